@@ -1,4 +1,61 @@
-from distutils.core import setup, Extension
+try:
+    from setuptools import setup, Extension, Command
+except ImportError:
+    from distutils.core import setup, Extension, Command
+
+import os
+
+
+class build_schemas(Command):
+    """Compile a schema file with xscompile.py and build the resulting
+    extension module (python setup.py build_schemas -s FILE)."""
+
+    description = "compile xstruct schemas into an extension module"
+    user_options = [
+        ("schemas=", "s", "schema file to compile"),
+        ("module=", "m", "name of the module (default: schema file name)"),
+        ("inplace", "i", "put the module next to the schema file"),
+    ]
+    boolean_options = ["inplace"]
+
+    def initialize_options(self):
+        self.schemas = None
+        self.module = None
+        self.inplace = 0
+
+    def finalize_options(self):
+        if self.schemas is None:
+            self.schemas = os.environ.get("XSTRUCT_SCHEMAS")
+        if self.schemas is None:
+            raise SystemExit("build_schemas: no schema file given (-s)")
+        if self.module is None:
+            self.module = os.path.splitext(os.path.basename(self.schemas))[0]
+
+    def run(self):
+        import xscompile
+
+        build_temp = self.get_finalized_command("build").build_temp
+        self.mkpath(build_temp)
+        source = xscompile.compile_file(self.schemas, self.module,
+            os.path.join(build_temp, self.module + ".c"))
+
+        # build_ext takes the extensions from the distribution when it is
+        # finalized, which is when setuptools prepares them. Object files
+        # go to build_temp under the path of their source, so with the
+        # current directory as build_temp the object lands next to the
+        # generated source.
+        self.distribution.ext_modules = [
+            Extension(self.module, sources=[os.path.relpath(source)])]
+        build_ext = self.reinitialize_command("build_ext")
+        build_ext.inplace = self.inplace
+        build_ext.build_temp = os.curdir
+        build_ext.ensure_finalized()
+        if self.inplace:
+            build_ext.build_lib = os.path.dirname(
+                os.path.abspath(self.schemas))
+            build_ext.inplace = 0
+        build_ext.run()
+
 
 setup(
     name = "xstruct",
@@ -7,11 +64,13 @@ setup(
     maintainer = "Kiran Bandla",
     maintainer_email = "kbandla@in2void.com",
     license = "unknown",
-    version = "0.2.0",
+    version = "0.3.0",
     description = "an extension of the standard Python 'struct' module",
     url = "http://www.github.com/kbandla/xstruct",
+    python_requires = ">=3.8",
     ext_modules = [Extension(
         "xstruct",
         sources = ["xstructmodule.c"]
         ) ],
+    cmdclass = {"build_schemas": build_schemas},
 )
@@ -0,0 +1,461 @@
+# xsbench.py - benchmark harness for the xstruct module
+#
+# Times the xstruct code paths against the standard 'struct' module and
+# ctypes.Structure and reports the cost of one operation in nanoseconds
+# (mean, standard deviation and minimum over a number of repeats).
+#
+# usage: python xsbench.py [options] [pattern ...]
+#
+#   pattern            only run scenarios whose name contains a pattern
+#   -r, --repeat N     number of timing repeats per scenario (default 7)
+#   -t, --time SEC     minimum duration of a single repeat (default 0.05)
+#   -j, --json FILE    write machine-readable results to FILE
+#   -c, --compare FILE compare with results previously written by --json
+#   --threshold PCT    regression threshold for --compare (default 10)
+#   -l, --list         list the scenario names and exit
+#   --check-jit        compare pack() and unpack() results with and without
+#                      native code instead of timing anything
+#
+# With --compare, the exit status is 1 if any xstruct scenario got slower
+# than the threshold allows, so the script can gate a build. With
+# --check-jit, it is 1 if native code changed any result.
+
+from __future__ import print_function
+
+import ctypes
+import json
+import math
+import platform
+import struct
+import sys
+import time
+import timeit
+
+import xstruct
+
+#-----------#
+# scenarios #
+#-----------#
+
+# the XSDP message from xsdp.py, as a format string and as a field list
+
+XSDP_FORMAT = "4s2BBBL16s"
+
+def xsdp_fields():
+  return [
+    ("magic",        (xstruct.string, 4),   b"XSDP",   xstruct.readonly),
+    ("version",      (xstruct.octet,  2),   (1, 0)),
+    ("byte_order",   (xstruct.octet,  1),    0,        xstruct.readonly),
+    ("message_type", (xstruct.octet,  1)),
+    ("correl_id",    (xstruct.unsigned_long, 1)),
+    ("data",         (xstruct.string, 16))
+  ]
+
+XSDP_VALUES = (b"XSDP", 1, 0, 0, 1, 0x01020304, b"Hello, World !")
+
+# formats exercised by the pack/unpack/calcsize scenarios
+
+FORMATS = [
+  ("int",    "i",         (12345,)),
+  ("mixed",  "hHlL",      (-2, 2, -100000, 100000)),
+  ("double", "4d",        (1.0, 2.5, -3.25, 1e10)),
+  ("xsdp",   XSDP_FORMAT, XSDP_VALUES),
+]
+
+BYTE_ORDERS = [("native", "@"), ("little", "<"), ("big", ">")]
+
+BULK_RECORDS = 10000
+
+# ctypes equivalents of the format codes (standard sizes, see struct__doc__)
+
+CTYPES_STANDARD = {
+  "b": ctypes.c_byte, "B": ctypes.c_ubyte, "c": ctypes.c_char,
+  "h": ctypes.c_int16, "H": ctypes.c_uint16,
+  "i": ctypes.c_int32, "I": ctypes.c_uint32,
+  "l": ctypes.c_int32, "L": ctypes.c_uint32,
+  "f": ctypes.c_float, "d": ctypes.c_double,
+}
+
+CTYPES_NATIVE = dict(CTYPES_STANDARD, l=ctypes.c_long, L=ctypes.c_ulong,
+  P=ctypes.c_void_p)
+
+CTYPES_BASE = {
+  "@": ctypes.Structure,
+  "<": ctypes.LittleEndianStructure,
+  ">": ctypes.BigEndianStructure,
+}
+
+def parse_format(fmt):
+  """Split a format string into (count, code) items."""
+  items = []
+  num = ""
+  for c in fmt:
+    if c.isdigit():
+      num += c
+    elif not c.isspace():
+      items.append((int(num or "1"), c))
+      num = ""
+  return items
+
+def ctypes_type(order, fmt):
+  """Build a ctypes.Structure subclass with the layout of fmt."""
+  table = order == "@" and CTYPES_NATIVE or CTYPES_STANDARD
+  fields = []
+  for count, code in parse_format(fmt):
+    if code == "s":
+      fields.append(("f%d" % len(fields), ctypes.c_char * count))
+    elif code == "x":
+      fields.append(("f%d" % len(fields), ctypes.c_char * count))
+    else:
+      for k in range(count):
+        fields.append(("f%d" % len(fields), table[code]))
+  attrs = {"_fields_": fields}
+  if order != "@":
+    attrs["_pack_"] = 1
+  return type("Bench", (CTYPES_BASE[order],), attrs)
+
+def raw(obj):
+  """Return the bytes of a ctypes object (bytes() is repr() on Python 2)."""
+  return ctypes.string_at(ctypes.addressof(obj), ctypes.sizeof(obj))
+
+class Scenario:
+  def __init__(self, name, subject, setup, ops=1):
+    self.name = name        # "<group>/<case>"
+    self.subject = subject  # "xstruct", "xs-jit", "struct" or "ctypes"
+    self.setup = setup      # returns the callable to time
+    self.ops = ops          # operations per call of that callable
+
+def jit_on(fmt, func):
+  """Switch native code on for fmt; measure() switches it off again."""
+  xstruct.enable_jit()
+  xstruct.jit(fmt)
+  return func
+
+def build_scenarios():
+  scenarios = []
+
+  def add(name, subject, setup, ops=1):
+    scenarios.append(Scenario(name, subject, setup, ops))
+
+  for fname, fmt, values in FORMATS:
+    for oname, order in BYTE_ORDERS:
+      full = order + fmt
+      case = "%s/%s" % (fname, oname)
+      packed = struct.pack(full, *values)
+
+      add("pack/" + case, "xstruct",
+        lambda full=full, values=values:
+          lambda: xstruct.pack(full, *values))
+      add("pack/" + case, "struct",
+        lambda full=full, values=values:
+          lambda: struct.pack(full, *values))
+      add("pack/" + case, "ctypes",
+        lambda order=order, fmt=fmt, values=values:
+          (lambda T: lambda: raw(T(*values)))(ctypes_type(order, fmt)))
+
+      add("unpack/" + case, "xstruct",
+        lambda full=full, packed=packed:
+          lambda: xstruct.unpack(full, packed))
+      add("unpack/" + case, "struct",
+        lambda full=full, packed=packed:
+          lambda: struct.unpack(full, packed))
+      add("unpack/" + case, "ctypes",
+        lambda order=order, fmt=fmt, packed=packed:
+          (lambda T: lambda: T.from_buffer_copy(packed))(
+            ctypes_type(order, fmt)))
+
+      # the same calls with native code compiled for the format
+
+      if hasattr(xstruct, "jit"):
+        add("pack/" + case, "xs-jit",
+          lambda full=full, values=values: jit_on(full,
+            lambda: xstruct.pack(full, *values)))
+        add("unpack/" + case, "xs-jit",
+          lambda full=full, packed=packed: jit_on(full,
+            lambda: xstruct.unpack(full, packed)))
+
+    add("calcsize/" + fname, "xstruct",
+      lambda fmt=fmt: lambda: xstruct.calcsize(fmt))
+    add("calcsize/" + fname, "struct",
+      lambda fmt=fmt: lambda: struct.calcsize(fmt))
+    add("calcsize/" + fname, "ctypes",
+      lambda fmt=fmt:
+        (lambda T: lambda: ctypes.sizeof(T))(ctypes_type("@", fmt)))
+
+  # definition construction
+
+  add("structdef/xsdp", "xstruct",
+    lambda: lambda: xstruct.structdef(xstruct.big_endian, xsdp_fields()))
+  add("structdef/xsdp", "struct",
+    lambda: lambda: struct.Struct(">" + XSDP_FORMAT))
+  add("structdef/xsdp", "ctypes",
+    lambda: lambda: ctypes_type(">", XSDP_FORMAT))
+
+  # field access; struct has no fields, so it unpacks one at its offset
+
+  def xsdp_object():
+    return xstruct.structdef(xstruct.big_endian, xsdp_fields())()
+
+  def xsdp_ctypes():
+    return ctypes_type(">", XSDP_FORMAT)(*XSDP_VALUES)
+
+  add("field/get/attr", "xstruct",
+    lambda: (lambda m: lambda: m.correl_id)(xsdp_object()))
+  add("field/get/attr", "ctypes",
+    lambda: (lambda m: lambda: m.f5)(xsdp_ctypes()))
+  add("field/get/subscript", "xstruct",
+    lambda: (lambda m: lambda: m["correl_id"])(xsdp_object()))
+  add("field/get/subscript", "struct",
+    lambda: (lambda s, b: lambda: s.unpack_from(b, 8))(
+      struct.Struct(">L"), struct.pack(">" + XSDP_FORMAT, *XSDP_VALUES)))
+
+  def set_attr(m):
+    def run():
+      m.correl_id = 7
+    return run
+
+  def set_subscript(m):
+    def run():
+      m["correl_id"] = 7
+    return run
+
+  def set_ctypes(m):
+    def run():
+      m.f5 = 7
+    return run
+
+  def set_struct(s, b):
+    return lambda: s.pack_into(b, 8, 7)
+
+  add("field/set/attr", "xstruct", lambda: set_attr(xsdp_object()))
+  add("field/set/attr", "ctypes", lambda: set_ctypes(xsdp_ctypes()))
+  add("field/set/subscript", "xstruct",
+    lambda: set_subscript(xsdp_object()))
+  add("field/set/subscript", "struct",
+    lambda: set_struct(struct.Struct(">L"), bytearray(28)))
+
+  # bulk decode of a buffer of records into per-record values
+
+  record = struct.pack(">" + XSDP_FORMAT, *XSDP_VALUES)
+  size = len(record)
+  buf = record * BULK_RECORDS
+
+  def bulk_structdef():
+    Message = xstruct.structdef(xstruct.big_endian, xsdp_fields())
+    offsets = range(0, len(buf), size)
+    return lambda: [Message(buf[i:i+size]).correl_id for i in offsets]
+
+  def bulk_unpack():
+    fmt = ">" + XSDP_FORMAT
+    offsets = range(0, len(buf), size)
+    return lambda: [xstruct.unpack(fmt, buf[i:i+size]) for i in offsets]
+
+  def bulk_struct():
+    s = struct.Struct(">" + XSDP_FORMAT)
+    offsets = range(0, len(buf), size)
+    return lambda: [s.unpack_from(buf, i) for i in offsets]
+
+  def bulk_ctypes():
+    T = ctypes_type(">", XSDP_FORMAT) * BULK_RECORDS
+    return lambda: [r.f5 for r in T.from_buffer_copy(buf)]
+
+  def bulk_columns():
+    Message = xstruct.structdef(xstruct.big_endian, xsdp_fields())
+    return lambda: xstruct.decode_columns(Message, buf)
+
+  add("bulk/decode/unpack", "xstruct", bulk_unpack, BULK_RECORDS)
+  add("bulk/decode/columns", "xstruct", bulk_columns, BULK_RECORDS)
+  add("bulk/decode/structdef", "xstruct", bulk_structdef, BULK_RECORDS)
+  add("bulk/decode/unpack", "struct", bulk_struct, BULK_RECORDS)
+  add("bulk/decode/unpack", "ctypes", bulk_ctypes, BULK_RECORDS)
+
+  return scenarios
+
+#-----------#
+# JIT check #
+#-----------#
+
+# floats the native code must convert exactly as the format tables do,
+# or leave to them: signed zeros, infinities, NaN and a denormal
+
+SPECIAL_FLOATS = [0.0, -0.0, float("inf"), -float("inf"), float("nan"),
+  1e-310, 1.5]
+
+def outcome(call):
+  """The result of call, or its error, as a comparable string (repr, as
+  NaN does not compare equal to itself)."""
+  try:
+    return repr(call())
+  except Exception as e:
+    return "%s: %s" % (type(e).__name__, e)
+
+def check_jit():
+  """Run pack() and unpack() with and without native code and print
+  the differences; return their number."""
+  cases = [(fmt, values) for fname, fmt, values in FORMATS]
+  for v in SPECIAL_FLOATS:
+    cases += [("d", (v,)), ("f", (v,)), ("Id", (7, v))]
+
+  mismatches = checked = 0
+  for order in "@<>":
+    for fmt, values in cases:
+      full = order + fmt
+      if not xstruct.jit(full):
+        continue
+      packed = struct.pack(full, *values)
+      calls = [("pack%r" % ((full,) + values,),
+          lambda: xstruct.pack(full, *values)),
+        ("unpack(%r, %r)" % (full, packed),
+          lambda: xstruct.unpack(full, packed))]
+      for name, call in calls:
+        xstruct.enable_jit(0)
+        expected = outcome(call)
+        xstruct.enable_jit(1)
+        got = outcome(call)
+        xstruct.enable_jit(0)
+        checked += 1
+        if got != expected:
+          mismatches += 1
+          print("%s: %s with native code, %s without" %
+            (name, got, expected))
+
+  if checked == 0:
+    print("xsbench: no native code could be compiled", file=sys.stderr)
+  else:
+    print("%d of %d calls differ with native code" % (mismatches, checked))
+  return mismatches
+
+#--------#
+# timing #
+#--------#
+
+def calibrate(timer, min_time):
+  """Find a loop count for which one repeat lasts at least min_time."""
+  number = 1
+  while True:
+    if timer.timeit(number) >= min_time:
+      return number
+    number *= 2
+
+def measure(scenario, repeat, min_time):
+  if hasattr(xstruct, "enable_jit"):
+    xstruct.enable_jit(0)
+  func = scenario.setup()
+  timer = timeit.Timer(func)
+  number = calibrate(timer, min_time)
+  samples = [1e9 * t / (number * scenario.ops)
+    for t in timer.repeat(repeat, number)]
+  mean = sum(samples) / len(samples)
+  var = sum((s - mean) ** 2 for s in samples) / max(len(samples) - 1, 1)
+  return {
+    "name": scenario.name,
+    "subject": scenario.subject,
+    "ns_per_op": mean,
+    "stdev": math.sqrt(var),
+    "min": min(samples),
+    "loops": number,
+    "samples": samples,
+  }
+
+#-----------#
+# reporting #
+#-----------#
+
+def key(result):
+  return "%s [%s]" % (result["name"], result["subject"])
+
+def report(results):
+  baseline = {}
+  for r in results:
+    if r["subject"] == "struct":
+      baseline[r["name"]] = r["ns_per_op"]
+  print("%-34s %-8s %12s %10s %8s" %
+    ("scenario", "subject", "ns/op", "stdev", "vs struct"))
+  for r in results:
+    ref = baseline.get(r["name"])
+    ratio = ref and "%7.2fx" % (r["ns_per_op"] / ref) or ""
+    print("%-34s %-8s %12.1f %9.1f%% %8s" % (r["name"], r["subject"],
+      r["ns_per_op"], 100.0 * r["stdev"] / r["ns_per_op"], ratio))
+
+def compare(results, path, threshold):
+  old = dict((key(r), r) for r in json.load(open(path))["results"])
+  regressions = 0
+  print()
+  print("%-45s %12s %12s %8s" % ("scenario", "before", "after", "change"))
+  for r in results:
+    o = old.get(key(r))
+    if o is None:
+      continue
+    change = 100.0 * (r["ns_per_op"] - o["ns_per_op"]) / o["ns_per_op"]
+    # only count changes that stand out of the noise of both runs
+    noise = 100.0 * (r["stdev"] + o["stdev"]) / o["ns_per_op"]
+    flag = ""
+    if r["subject"] in ("xstruct", "xs-jit") and \
+        change > max(threshold, noise):
+      flag = "  REGRESSION"
+      regressions += 1
+    print("%-45s %12.1f %12.1f %+7.1f%%%s" %
+      (key(r), o["ns_per_op"], r["ns_per_op"], change, flag))
+  return regressions
+
+def environment():
+  return {
+    "python": sys.version.split()[0],
+    "implementation": platform.python_implementation(),
+    "platform": platform.platform(),
+    "machine": platform.machine(),
+    "xstruct": getattr(xstruct, "__file__", "built-in"),
+    "time": time.strftime("%Y-%m-%dT%H:%M:%S"),
+  }
+
+def main(argv):
+  import getopt
+  try:
+    opts, patterns = getopt.getopt(argv, "r:t:j:c:l",
+      ["repeat=", "time=", "json=", "compare=", "threshold=", "list",
+       "check-jit"])
+  except getopt.GetoptError as e:
+    print("xsbench: %s" % e, file=sys.stderr)
+    return 2
+
+  repeat, min_time, json_path, compare_path = 7, 0.05, None, None
+  threshold, list_only = 10.0, False
+  for opt, val in opts:
+    if opt in ("-r", "--repeat"):
+      repeat = int(val)
+    elif opt in ("-t", "--time"):
+      min_time = float(val)
+    elif opt in ("-j", "--json"):
+      json_path = val
+    elif opt in ("-c", "--compare"):
+      compare_path = val
+    elif opt == "--threshold":
+      threshold = float(val)
+    elif opt in ("-l", "--list"):
+      list_only = True
+    elif opt == "--check-jit":
+      return check_jit() and 1 or 0
+
+  scenarios = [s for s in build_scenarios()
+    if not patterns or [p for p in patterns if p in s.name]]
+
+  if list_only:
+    for s in scenarios:
+      print("%s [%s]" % (s.name, s.subject))
+    return 0
+
+  results = [measure(s, repeat, min_time) for s in scenarios]
+  report(results)
+
+  if json_path:
+    f = open(json_path, "w")
+    json.dump({"environment": environment(), "repeat": repeat,
+      "results": results}, f, indent=1, sort_keys=True)
+    f.close()
+
+  if compare_path and compare(results, compare_path, threshold):
+    return 1
+  return 0
+
+if __name__ == "__main__":
+  sys.exit(main(sys.argv[1:]))
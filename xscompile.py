@@ -0,0 +1,1107 @@
+# xscompile.py - ahead-of-time compiler for xstruct schemas
+#
+# Reads a schema file and writes the C source of an extension module with
+# one type per schema. A schema file is ordinary Python code that defines
+# struct definitions with xstruct.structdef(), for instance:
+#
+#   import xstruct
+#
+#   XsdpMessage = xstruct.structdef(xstruct.big_endian, [
+#     ("magic",     (xstruct.string, 4), b"XSDP", xstruct.readonly),
+#     ("version",   (xstruct.octet,  2), (1, 0)),
+#     ("correl_id", (xstruct.unsigned_long, 1)),
+#   ])
+#
+# The file is run against a stand-in for the xstruct module, so the same
+# file also works with the real module at run time, and the xstruct
+# extension does not have to be built to compile it. Every struct
+# definition the file binds to a module-level name becomes a type of that
+# name. An instance behaves like a struct object (attribute and subscript
+# access to the fields, bytes(), the buffer protocol and a repr listing
+# the fields) and in addition has:
+#
+#   obj.as_tuple()          the values of all fields, in order
+#   Type.unpack(buffer)     the same, straight from a buffer
+#   Type.pack(v1, v2, ...)  bytes for the values of all fields
+#   Type.size               the size of the struct in bytes
+#
+# All offsets are constants in the generated code, so there is no format
+# parsing or table lookup at run time, and the module does not need
+# xstruct (or a C compiler) where it is used. Values are converted as by
+# xstruct, except that standard size floats are converted as IEEE 754
+# numbers by the C compiler, as the struct module does.
+#
+# usage: python xscompile.py [options] schemafile
+#
+#   -m, --module NAME  name of the extension module (default: the name of
+#                      the schema file)
+#   -o, --output FILE  write the C source to FILE (default: NAME.c)
+#
+# setup.py has a build_schemas command that compiles a schema file and
+# builds the module in one go.
+
+from __future__ import print_function
+
+import os
+import struct
+import sys
+import types
+
+#------------------#
+# xstruct stand-in #
+#------------------#
+
+# the constants of the xstruct module
+
+CONSTANTS = {
+  "native": "@", "standard": "=", "little_endian": "<",
+  "big_endian": ">", "network": "!",
+  "pad": "x", "char": "c", "signed_char": "b", "unsigned_char": "B",
+  "octet": "B", "short": "h", "unsigned_short": "H", "int": "i",
+  "unsigned_int": "I", "long": "l", "unsigned_long": "L", "float": "f",
+  "double": "d", "string": "s", "pascal_string": "p", "pointer": "P",
+  "varint": "V", "signed_varint": "v",
+  "crc32": "crc32", "crc32c": "crc32c", "adler32": "adler32",
+  "internet_checksum": "inet",
+  "union": "union",
+  "readonly": 1,
+  "raw": 2, # read as a view of the field's bytes, the layout is the same
+  "atomic": 4,
+}
+
+CHECKSUM_TYPES = ("crc32", "crc32c", "adler32", "inet")
+
+FLAG_READONLY = 1
+FLAG_RAW = 2
+FLAG_ATOMIC = 4
+
+class SchemaError(Exception):
+  pass
+
+class Field:
+  def __init__(self, name, code, count, offset, size, readonly, raw):
+    self.name = name          # None for unnamed fields
+    self.code = code          # format character
+    self.count = count        # repeat count, or string size for 's'/'p'
+    self.offset = offset
+    self.size = size          # of one element
+    self.readonly = readonly
+    self.raw = raw            # read as a memoryview of its bytes
+
+  def length(self):
+    """The number of bytes of the field."""
+    return self.is_string() and self.count or self.count * self.size
+
+  def is_string(self):
+    return self.code in "sp"
+
+class Schema:
+  """What xstruct.structdef() returns while a schema file is run."""
+
+  created = 0
+
+  def __init__(self, layout, definitions, key=None, pack=0, optimize=0):
+    if key is not None:
+      raise SchemaError("struct keys are not supported by xscompile")
+    if pack:
+      raise SchemaError("packed layouts are not supported by xscompile")
+    if optimize:
+      raise SchemaError("field reordering is not supported by xscompile")
+    Schema.created += 1
+    self.order = Schema.created
+    self.layout = layout
+    self.fields = []
+    self.initial = b""
+    self.compile(layout, definitions)
+
+  # layout of the fields, as struct_structdef() does it
+
+  def compile(self, layout, definitions):
+    if not isinstance(definitions, list):
+      raise SchemaError("field definitions must be a list")
+
+    order = layout[:1] if layout[:1] in ("@", "=", "<", ">", "!") else "@"
+    if order == "=":
+      order = sys.byteorder == "little" and "<" or ">"
+    elif order == "!":
+      order = ">"
+    self.order_char = order
+    codes = order == "@" and "xbBcsphHiIlLfdP" or "xbBcsphHiIlLfd"
+
+    offset = 0
+    struct_alignment = 1
+    values = []
+    names = set()
+    for definition in definitions:
+      name, (ftype, count) = definition[:2]
+      initial = definition[2] if len(definition) > 2 else None
+      flags = definition[3] if len(definition) > 3 else 0
+      if name is not None and not isinstance(name, str):
+        raise SchemaError("field name must be a string or None")
+      if count < 0:
+        raise SchemaError("invalid repeat count")
+      if ftype in CHECKSUM_TYPES:
+        raise SchemaError("checksum fields are not supported by xscompile")
+      options = definition[4] if len(definition) > 4 else None
+      if isinstance(options, dict) and ("offset" in options or
+          "align" in options):
+        raise SchemaError("explicit field layouts are not supported by "
+          "xscompile")
+      if options is not None:
+        raise SchemaError("constraints are not supported by xscompile")
+      if ftype == "union":
+        raise SchemaError("union fields are not supported by xscompile")
+      if ftype in ("v", "V"):
+        raise SchemaError("varint fields are not supported by xscompile")
+      if flags & FLAG_ATOMIC:
+        raise SchemaError("atomic fields are not supported by xscompile")
+      if ftype[:1] in ("@", "=", "<", ">", "!"):
+        raise SchemaError("per-field byte orders are not supported by "
+          "xscompile")
+      code = ftype[:1]
+      if code == "" or code not in codes:
+        raise SchemaError("bad char in struct format")
+
+      size = struct.calcsize(order + code)
+      if order == "@":
+        alignment = struct.calcsize("@c0" + code)
+        offset = (offset + alignment - 1) // alignment * alignment
+        struct_alignment = max(struct_alignment, alignment)
+
+      if code != "x" and (count != 0 or code == "s"):
+        if name is not None:
+          if name in names:
+            raise SchemaError("duplicate field name")
+          names.add(name)
+        self.fields.append(Field(name, code, count, offset, size,
+          bool(flags & FLAG_READONLY), bool(flags & FLAG_RAW)))
+        values.append(initial)
+      elif name is not None:
+        raise SchemaError("field name given to num/format combination "
+          "that does not count as a field")
+
+      offset += count * size
+
+    # trailing padding, as in C
+    offset = (offset + struct_alignment - 1) // struct_alignment * \
+      struct_alignment
+    if offset == 0:
+      raise SchemaError("zero struct size")
+    self.size = offset
+
+    data = bytearray(offset)
+    for field, value in zip(self.fields, values):
+      if value is not None:
+        packed = pack_field(order, field, value)
+        data[field.offset:field.offset + len(packed)] = packed
+    self.initial = bytes(data)
+
+def pack_field(order, field, value):
+  """The initial value of a field as bytes, packed by the struct module."""
+  fmt = "%s%d%s" % (order, field.count, field.code)
+  if field.is_string() or field.count == 1:
+    value = (value,)
+  elif len(value) != field.count:
+    raise SchemaError("field element count mismatch")
+  try:
+    return struct.pack(fmt, *value)
+  except struct.error as e:
+    raise SchemaError("initial value of field %s: %s" % (field.name, e))
+
+def stand_in():
+  module = types.ModuleType("xstruct")
+  module.__dict__.update(CONSTANTS)
+  module.structdef = Schema
+  module.error = SchemaError
+  return module
+
+def load_schemas(path):
+  """Run a schema file and return its (name, schema) pairs in order."""
+  saved = sys.modules.get("xstruct")
+  sys.modules["xstruct"] = stand_in()
+  try:
+    namespace = {"__name__": "__xscompile__", "__file__": path}
+    source = open(path).read()
+    exec(compile(source, path, "exec"), namespace)
+  finally:
+    if saved is None:
+      del sys.modules["xstruct"]
+    else:
+      sys.modules["xstruct"] = saved
+
+  seen = {}
+  for name, value in namespace.items():
+    if isinstance(value, Schema) and not name.startswith("_"):
+      if value.order not in seen:
+        seen[value.order] = (name, value)
+  return [seen[k] for k in sorted(seen)]
+
+#----------------#
+# code generator #
+#----------------#
+
+RUNTIME = r'''
+#define PY_SSIZE_T_CLEAN
+#include "Python.h"
+#include <float.h>
+#include <stddef.h>
+#include <string.h>
+
+static PyObject *Error;
+
+/* a schema may not use every helper */
+
+#if defined(__GNUC__)
+#define XS_HELPER static __attribute__((unused))
+#else
+#define XS_HELPER static
+#endif
+
+/* value conversion, as in xstruct */
+
+XS_HELPER int
+xs_get_long(PyObject *v, long *p)
+{
+	long x = PyLong_AsLong(v);
+	if (x == -1 && PyErr_Occurred()) {
+		if (PyErr_ExceptionMatches(PyExc_TypeError))
+			PyErr_SetString(Error,
+					"required argument is not an integer");
+		return -1;
+	}
+	*p = x;
+	return 0;
+}
+
+XS_HELPER int
+xs_get_ulong(PyObject *v, unsigned long *p)
+{
+	unsigned long x = PyLong_AsUnsignedLong(v);
+	if (x == (unsigned long)(-1) && PyErr_Occurred()) {
+		PyErr_Clear();
+		return xs_get_long(v, (long *)p);
+	}
+	*p = x;
+	return 0;
+}
+
+XS_HELPER int
+xs_get_double(PyObject *v, double *p)
+{
+	double x = PyFloat_AsDouble(v);
+	if (x == -1 && PyErr_Occurred()) {
+		PyErr_SetString(Error, "required argument is not a float");
+		return -1;
+	}
+	*p = x;
+	return 0;
+}
+
+XS_HELPER int
+xs_get_float(PyObject *v, double *p)
+{
+	if (xs_get_double(v, p) < 0)
+		return -1;
+	if ((*p > FLT_MAX || *p < -FLT_MAX) && *p - *p == 0) {
+		PyErr_SetString(PyExc_OverflowError,
+				"float too large to pack with f format");
+		return -1;
+	}
+	return 0;
+}
+
+XS_HELPER int
+xs_set_char(unsigned char *p, PyObject *v)
+{
+	if (!PyBytes_Check(v) || PyBytes_GET_SIZE(v) != 1) {
+		PyErr_SetString(Error, "char format require string of length 1");
+		return -1;
+	}
+	*p = *PyBytes_AS_STRING(v);
+	return 0;
+}
+
+XS_HELPER int
+xs_set_sstr(unsigned char *p, PyObject *v, int num)
+{
+	Py_ssize_t n;
+	if (!PyBytes_Check(v)) {
+		PyErr_SetString(Error, "required argument is not a bytes object");
+		return -1;
+	}
+	n = PyBytes_GET_SIZE(v);
+	if (n > num)
+		n = num;
+	memcpy(p, PyBytes_AS_STRING(v), n);
+	memset(p + n, 0, num - n);
+	return 0;
+}
+
+XS_HELPER int
+xs_set_pstr(unsigned char *p, PyObject *v, int num)
+{
+	Py_ssize_t n;
+	if (!PyBytes_Check(v)) {
+		PyErr_SetString(Error, "required argument is not a bytes object");
+		return -1;
+	}
+	n = PyBytes_GET_SIZE(v);
+	if (n > num - 1)
+		n = num - 1;
+	*p++ = (unsigned char) n;
+	memcpy(p, PyBytes_AS_STRING(v), n);
+	memset(p + n, 0, num - 1 - n);
+	return 0;
+}
+
+XS_HELPER PyObject *
+xs_get_pstr(const unsigned char *p, int num)
+{
+	int n = *p;
+	if (n >= num)
+		n = num - 1;
+	return PyBytes_FromStringAndSize((const char *) p + 1, n);
+}
+
+/* loads and stores; called with constant arguments, so that they
+   compile to single moves and byte swaps */
+
+#define XS_NATIVE(name, type) \
+static inline type xs_load_##name(const unsigned char *p) \
+{ type x; memcpy(&x, p, sizeof x); return x; } \
+static inline void xs_store_##name(unsigned char *p, type x) \
+{ memcpy(p, &x, sizeof x); }
+
+XS_NATIVE(b, signed char)
+XS_NATIVE(B, unsigned char)
+XS_NATIVE(h, short)
+XS_NATIVE(H, unsigned short)
+XS_NATIVE(i, int)
+XS_NATIVE(I, unsigned int)
+XS_NATIVE(l, long)
+XS_NATIVE(L, unsigned long)
+XS_NATIVE(f, float)
+XS_NATIVE(d, double)
+XS_NATIVE(P, void *)
+
+static inline unsigned long long
+xs_load(const unsigned char *p, int size, int big)
+{
+	unsigned long long x = 0;
+	int i;
+	for (i = 0; i < size; i++)
+		x |= (unsigned long long) p[i] << 8 * (big ? size - 1 - i : i);
+	return x;
+}
+
+static inline void
+xs_store(unsigned char *p, unsigned long long x, int size, int big)
+{
+	int i;
+	for (i = 0; i < size; i++)
+		p[i] = (unsigned char) (x >> 8 * (big ? size - 1 - i : i));
+}
+
+static inline double
+xs_load_float(const unsigned char *p, int big)
+{
+	unsigned int x = (unsigned int) xs_load(p, 4, big);
+	float f;
+	memcpy(&f, &x, 4);
+	return f;
+}
+
+static inline double
+xs_load_double(const unsigned char *p, int big)
+{
+	unsigned long long x = xs_load(p, 8, big);
+	double d;
+	memcpy(&d, &x, 8);
+	return d;
+}
+
+static inline void
+xs_store_float(unsigned char *p, double v, int big)
+{
+	float f = (float) v;
+	unsigned int x;
+	memcpy(&x, &f, 4);
+	xs_store(p, x, 4, big);
+}
+
+static inline void
+xs_store_double(unsigned char *p, double v, int big)
+{
+	unsigned long long x;
+	memcpy(&x, &v, 8);
+	xs_store(p, x, 8, big);
+}
+
+/* a struct of a schema */
+
+typedef struct {
+	PyObject_HEAD
+	unsigned char data[1]; /* the struct, as long as the schema says */
+} xs_object;
+
+static PyObject *
+xs_new(PyTypeObject *type, PyObject *const *args, Py_ssize_t nargs,
+       int keywords, const unsigned char *initial, Py_ssize_t size)
+{
+	PyObject *source = nargs == 1 ? args[0] : NULL;
+	xs_object *self;
+	Py_buffer view;
+
+	if (keywords) {
+		PyErr_Format(PyExc_TypeError, "%s() takes no keyword arguments",
+			     type->tp_name);
+		return NULL;
+	}
+	if (nargs > 1) {
+		PyErr_Format(PyExc_TypeError, "%s() takes at most 1 argument",
+			     type->tp_name);
+		return NULL;
+	}
+
+	self = (xs_object *) type->tp_alloc(type, 0);
+	if (self == NULL)
+		return NULL;
+
+	if (source == NULL) {
+		memcpy(self->data, initial, size);
+		return (PyObject *) self;
+	}
+
+	if (PyObject_GetBuffer(source, &view, PyBUF_SIMPLE) != 0) {
+		Py_DECREF(self);
+		return NULL;
+	}
+	if (view.len >= size)
+		memcpy(self->data, view.buf, size);
+	else {
+		memcpy(self->data, view.buf, view.len);
+		memset(self->data + view.len, 0, size - view.len);
+	}
+	PyBuffer_Release(&view);
+	return (PyObject *) self;
+}
+
+static int
+xs_getbuffer(PyObject *self, Py_buffer *view, int flags,
+	     Py_ssize_t size, const char *format)
+{
+	if (!(flags & PyBUF_FORMAT))
+		return PyBuffer_FillInfo(view, self, ((xs_object *) self)->data,
+					 size, 0, flags);
+	view->obj = self;
+	Py_INCREF(self);
+	view->buf = ((xs_object *) self)->data;
+	view->len = size;
+	view->readonly = 0;
+	view->itemsize = size;
+	view->format = (char *) format;
+	view->ndim = 0;
+	view->shape = NULL;
+	view->strides = NULL;
+	view->suboffsets = NULL;
+	view->internal = NULL;
+	return 0;
+}
+
+typedef PyObject *(*xs_decoder)(const unsigned char *);
+typedef int (*xs_encoder)(unsigned char *, PyObject *);
+
+typedef struct {
+	const char *name; /* NULL for unnamed fields */
+	xs_decoder decode;
+	xs_encoder encode;
+	int readonly;
+	int raw; /* read as a view of its bytes */
+	int offset;
+	int length; /* in bytes */
+} xs_field;
+
+/* the value of a field, or for a raw field a memoryview of its bytes in
+   the struct, as in xstruct */
+
+static PyObject *
+xs_get(xs_object *self, const xs_field *field)
+{
+	PyObject *whole, *bytes, *view;
+
+	if (!field->raw)
+		return field->decode(self->data);
+
+	whole = PyMemoryView_FromObject((PyObject *) self);
+	if (whole == NULL)
+		return NULL;
+	bytes = PyObject_CallMethod(whole, "cast", "s", "B");
+	Py_DECREF(whole);
+	if (bytes == NULL)
+		return NULL;
+	view = PySequence_GetSlice(bytes, field->offset,
+				   field->offset + field->length);
+	Py_DECREF(bytes);
+	if (view != NULL && field->readonly) {
+		PyObject *readonly = PyObject_CallMethod(view, "toreadonly", NULL);
+		Py_DECREF(view);
+		view = readonly;
+	}
+	return view;
+}
+
+static PyObject *
+xs_as_tuple(const unsigned char *data, const xs_field *fields, int count)
+{
+	PyObject *result = PyTuple_New(count);
+	int i;
+
+	if (result == NULL)
+		return NULL;
+	for (i = 0; i < count; i++) {
+		PyObject *v = fields[i].decode(data);
+		if (v == NULL) {
+			Py_DECREF(result);
+			return NULL;
+		}
+		PyTuple_SET_ITEM(result, i, v);
+	}
+	return result;
+}
+
+static PyObject *
+xs_unpack(PyObject *buffer, const xs_field *fields, int count,
+	  Py_ssize_t size)
+{
+	PyObject *result;
+	Py_buffer view;
+
+	if (PyObject_GetBuffer(buffer, &view, PyBUF_SIMPLE) != 0)
+		return NULL;
+	if (view.len != size) {
+		PyErr_SetString(Error, "unpack str size does not match format");
+		PyBuffer_Release(&view);
+		return NULL;
+	}
+	result = xs_as_tuple(view.buf, fields, count);
+	PyBuffer_Release(&view);
+	return result;
+}
+
+static PyObject *
+xs_pack(PyObject *const *args, Py_ssize_t nargs, const xs_field *fields,
+	int count, Py_ssize_t size)
+{
+	PyObject *result;
+	int i;
+
+	if (nargs != count) {
+		PyErr_SetString(Error, nargs < count ?
+				"insufficient arguments to pack" :
+				"too many arguments for pack format");
+		return NULL;
+	}
+	result = PyBytes_FromStringAndSize(NULL, size);
+	if (result == NULL)
+		return NULL;
+	memset(PyBytes_AS_STRING(result), 0, size);
+	for (i = 0; i < count; i++)
+		if (fields[i].encode((unsigned char *) PyBytes_AS_STRING(result),
+				     args[i]) < 0) {
+			Py_DECREF(result);
+			return NULL;
+		}
+	return result;
+}
+
+static int
+xs_set(xs_object *self, const xs_field *field, PyObject *v)
+{
+	if (v == NULL) {
+		PyErr_SetString(Error, "attribute can not be deleted");
+		return -1;
+	}
+	if (field->readonly) {
+		PyErr_SetString(Error, "field is not changeable");
+		return -1;
+	}
+	return field->encode(self->data, v);
+}
+
+static const xs_field *
+xs_lookup(PyObject *key, const xs_field *fields, int count)
+{
+	int i;
+	for (i = 0; i < count; i++)
+		if (fields[i].name != NULL &&
+		    PyUnicode_Check(key) &&
+		    PyUnicode_CompareWithASCIIString(key, fields[i].name) == 0)
+			return &fields[i];
+	PyErr_SetObject(PyExc_KeyError, key);
+	return NULL;
+}
+
+static Py_ssize_t
+xs_named(const xs_field *fields, int count)
+{
+	Py_ssize_t n = 0;
+	int i;
+	for (i = 0; i < count; i++)
+		n += (fields[i].name != NULL);
+	return n;
+}
+
+static PyObject *
+xs_repr(xs_object *self, const xs_field *fields, int count)
+{
+	PyObject *lines = PyList_New(0);
+	PyObject *separator, *result = NULL;
+	int i;
+
+	if (lines == NULL)
+		return NULL;
+	for (i = 0; i < count; i++) {
+		PyObject *v, *line;
+		if (fields[i].name == NULL)
+			continue;
+		v = fields[i].decode(self->data);
+		if (v == NULL)
+			goto done;
+		line = PyUnicode_FromFormat("%s: %S", fields[i].name, v);
+		Py_DECREF(v);
+		if (line == NULL || PyList_Append(lines, line) != 0) {
+			Py_XDECREF(line);
+			goto done;
+		}
+		Py_DECREF(line);
+	}
+	separator = PyUnicode_FromString("\n");
+	if (separator != NULL) {
+		result = PyUnicode_Join(separator, lines);
+		Py_DECREF(separator);
+	}
+ done:
+	Py_DECREF(lines);
+	return result;
+}
+'''
+
+def c_string(data):
+  """A C string literal for data (bytes or str)."""
+  if isinstance(data, str):
+    data = data.encode("ascii")
+  out = []
+  for b in bytearray(data):
+    c = chr(b)
+    if c in "\\\"":
+      out.append("\\" + c)
+    elif 32 <= b < 127:
+      out.append(c)
+    else:
+      out.append("\\%03o" % b)
+  return '"%s"' % "".join(out)
+
+def c_bytes(data):
+  """A C array initializer for data."""
+  items = ["%d" % b for b in bytearray(data)]
+  lines = [", ".join(items[i:i + 16]) for i in range(0, len(items), 16)]
+  return "{\n\t" + ",\n\t".join(lines) + "\n}"
+
+def buffer_format(schema):
+  """The PEP 3118 format string, as MakeBufferFormat() builds it."""
+  parts = [schema.order_char]
+  position = 0
+  for f in schema.fields + [None]:
+    offset = f is None and schema.size or f.offset
+    if offset > position:
+      parts.append("%dx" % (offset - position))
+    if f is None:
+      break
+    if f.is_string():
+      parts.append("%d%s" % (f.count, f.code))
+    elif f.count == 1:
+      parts.append(f.code)
+    else:
+      parts.append("(%d)%s" % (f.count, f.code))
+    if f.name is not None:
+      parts.append(":%s:" % f.name)
+    position = offset + (f.is_string() and f.count or f.count * f.size)
+  return "".join(parts)
+
+SIGNED_TYPES = {1: "signed char", 2: "short", 4: "int"}
+
+def decode_element(order, f, p):
+  """C expression for the Python value of the element at p."""
+  c = f.code
+  if c == "c":
+    return "PyBytes_FromStringAndSize((const char *) (%s), 1)" % p
+  if order == "@":
+    if c in "fd":
+      return "PyFloat_FromDouble(xs_load_%s(%s))" % (c, p)
+    if c == "P":
+      return "PyLong_FromVoidPtr(xs_load_P(%s))" % p
+    if c in "IL":
+      return "PyLong_FromUnsignedLong(xs_load_%s(%s))" % (c, p)
+    return "PyLong_FromLong((long) xs_load_%s(%s))" % (c, p)
+  big = order == ">" and 1 or 0
+  if c == "f":
+    return "PyFloat_FromDouble(xs_load_float(%s, %d))" % (p, big)
+  if c == "d":
+    return "PyFloat_FromDouble(xs_load_double(%s, %d))" % (p, big)
+  load = "xs_load(%s, %d, %d)" % (p, f.size, big)
+  if c.islower():
+    return "PyLong_FromLong((long) (%s) %s)" % (SIGNED_TYPES[f.size], load)
+  if f.size >= 4:
+    return "PyLong_FromUnsignedLong((unsigned long) %s)" % load
+  return "PyLong_FromLong((long) %s)" % load
+
+def encode_element(order, f, p, v):
+  """C statements that store the Python value v at p, or return -1."""
+  c = f.code
+  if c == "c":
+    return "if (xs_set_char(%s, %s) < 0) return -1;" % (p, v)
+  if c in "fd":
+    get = order != "@" and c == "f" and "xs_get_float" or "xs_get_double"
+    if order == "@":
+      store = "xs_store_%s(%s, (%s) x);" % (c, p,
+        c == "f" and "float" or "double")
+    else:
+      store = "xs_store_%s(%s, x, %d);" % (c == "f" and "float" or "double",
+        p, order == ">" and 1 or 0)
+    return "{ double x = 0; if (%s(%s, &x) < 0) return -1; %s }" % (
+      get, v, store)
+  if c == "P":
+    return ("{ void *x = PyLong_AsVoidPtr(%s); "
+      "if (x == NULL && PyErr_Occurred()) return -1; xs_store_P(%s, x); }"
+      % (v, p))
+  if order == "@":
+    unsigned = c in "IL"
+    store = "xs_store_%s(%s, x);" % (c, p)
+  else:
+    unsigned = c in "HIL"
+    store = "xs_store(%s, (unsigned long long) x, %d, %d);" % (
+      p, f.size, order == ">" and 1 or 0)
+  if unsigned:
+    return ("{ unsigned long x = 0; if (xs_get_ulong(%s, &x) < 0) return -1; "
+      "%s }" % (v, store))
+  return "{ long x = 0; if (xs_get_long(%s, &x) < 0) return -1; %s }" % (
+    v, store)
+
+def generate_schema(out, name, schema, module):
+  order = schema.order_char
+  prefix = "xs_%s" % name
+  count = len(schema.fields)
+
+  out.append("/* %s */\n" % name)
+  out.append("#define %s_SIZE %d\n" % (prefix, schema.size))
+  out.append("\nstatic const unsigned char %s_initial[%d] = %s;\n" % (
+    prefix, schema.size, c_bytes(schema.initial)))
+  out.append("\nstatic const char %s_format[] = %s;\n" % (
+    prefix, c_string(buffer_format(schema))))
+
+  for i, f in enumerate(schema.fields):
+    out.append("\n/* field %d: %s, %d%s at %d */\n" % (
+      i, f.name or "unnamed", f.count, f.code, f.offset))
+
+    # decoder
+
+    out.append("\nstatic PyObject *\n%s_decode_%d(const unsigned char *d)"
+      "\n{\n" % (prefix, i))
+    if f.code == "s":
+      out.append("\treturn PyBytes_FromStringAndSize((const char *) d + %d, "
+        "%d);\n" % (f.offset, f.count))
+    elif f.code == "p":
+      out.append("\treturn xs_get_pstr(d + %d, %d);\n" % (f.offset, f.count))
+    elif f.count == 1:
+      out.append("\treturn %s;\n" % decode_element(order, f,
+        "d + %d" % f.offset))
+    else:
+      out.append("\tPyObject *t = PyTuple_New(%d), *v;\n" % f.count)
+      out.append("\tif (t == NULL)\n\t\treturn NULL;\n")
+      for k in range(f.count):
+        out.append("\tif ((v = %s) == NULL)\n\t\tgoto fail;\n" %
+          decode_element(order, f, "d + %d" % (f.offset + k * f.size)))
+        out.append("\tPyTuple_SET_ITEM(t, %d, v);\n" % k)
+      out.append("\treturn t;\n fail:\n\tPy_DECREF(t);\n\treturn NULL;\n")
+    out.append("}\n")
+
+    # encoder
+
+    out.append("\nstatic int\n%s_encode_%d(unsigned char *d, PyObject *v)"
+      "\n{\n" % (prefix, i))
+    if f.code == "s":
+      out.append("\treturn xs_set_sstr(d + %d, v, %d);\n" % (
+        f.offset, f.count))
+    elif f.code == "p":
+      out.append("\treturn xs_set_pstr(d + %d, v, %d);\n" % (
+        f.offset, f.count))
+    elif f.count == 1:
+      out.append("\t%s\n\treturn 0;\n" % encode_element(order, f,
+        "d + %d" % f.offset, "v"))
+    else:
+      out.append("\tif (!PyTuple_Check(v)) {\n\t\tPyErr_SetString(Error, "
+        "\"value for field must be a tuple\");\n\t\treturn -1;\n\t}\n")
+      out.append("\tif (PyTuple_GET_SIZE(v) != %d) {\n\t\tPyErr_SetString("
+        "Error, \"field element count mismatch\");\n\t\treturn -1;\n\t}\n"
+        % f.count)
+      for k in range(f.count):
+        out.append("\t%s\n" % encode_element(order, f,
+          "d + %d" % (f.offset + k * f.size),
+          "PyTuple_GET_ITEM(v, %d)" % k))
+      out.append("\treturn 0;\n")
+    out.append("}\n")
+
+  out.append("\nstatic const xs_field %s_fields[%d] = {\n" % (
+    prefix, max(count, 1)))
+  if not schema.fields:
+    out.append("\t{NULL, NULL, NULL, 0, 0, 0, 0},\n")
+  for i, f in enumerate(schema.fields):
+    out.append("\t{%s, %s_decode_%d, %s_encode_%d, %d, %d, %d, %d},\n" % (
+      f.name is None and "NULL" or c_string(f.name), prefix, i, prefix, i,
+      f.readonly and 1 or 0, f.raw and 1 or 0, f.offset, f.length()))
+  out.append("};\n")
+
+  # getters and setters of the named fields
+
+  for i, f in enumerate(schema.fields):
+    if f.name is None:
+      continue
+    out.append("\nstatic PyObject *\n%s_get_%d(xs_object *self, void *c)\n"
+      "{\n\treturn xs_get(self, &%s_fields[%d]);\n}\n" % (prefix, i, prefix,
+      i))
+    out.append("\nstatic int\n%s_set_%d(xs_object *self, PyObject *v, "
+      "void *c)\n{\n\treturn xs_set(self, &%s_fields[%d], v);\n}\n" % (
+      prefix, i, prefix, i))
+
+  out.append("\nstatic PyGetSetDef %s_getset[] = {\n" % prefix)
+  for i, f in enumerate(schema.fields):
+    if f.name is not None:
+      out.append("\t{%s, (getter) %s_get_%d, (setter) %s_set_%d, NULL},\n"
+        % (c_string(f.name), prefix, i, prefix, i))
+  out.append("\t{NULL}\n};\n")
+
+  out.append('''
+static PyObject *
+%(p)s_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	return xs_new(type, &PyTuple_GET_ITEM(args, 0), PyTuple_GET_SIZE(args),
+		      kwds != NULL && PyDict_GET_SIZE(kwds) != 0,
+		      %(p)s_initial, %(p)s_SIZE);
+}
+
+#if PY_VERSION_HEX >= 0x03090000
+static PyObject *
+%(p)s_vectorcall(PyObject *type, PyObject *const *args, size_t nargsf,
+		 PyObject *kwnames)
+{
+	return xs_new((PyTypeObject *) type, args, PyVectorcall_NARGS(nargsf),
+		      kwnames != NULL && PyTuple_GET_SIZE(kwnames) != 0,
+		      %(p)s_initial, %(p)s_SIZE);
+}
+#endif
+
+static PyObject *
+%(p)s_repr(xs_object *self)
+{
+	return xs_repr(self, %(p)s_fields, %(n)d);
+}
+
+static PyObject *
+%(p)s_as_tuple(xs_object *self, PyObject *unused)
+{
+	return xs_as_tuple(self->data, %(p)s_fields, %(n)d);
+}
+
+static PyObject *
+%(p)s_bytes(xs_object *self, PyObject *unused)
+{
+	return PyBytes_FromStringAndSize((const char *) self->data, %(p)s_SIZE);
+}
+
+static PyObject *
+%(p)s_unpack(PyObject *cls, PyObject *buffer)
+{
+	return xs_unpack(buffer, %(p)s_fields, %(n)d, %(p)s_SIZE);
+}
+
+static PyObject *
+%(p)s_pack(PyObject *cls, PyObject *const *args, Py_ssize_t nargs)
+{
+	return xs_pack(args, nargs, %(p)s_fields, %(n)d, %(p)s_SIZE);
+}
+
+static PyMethodDef %(p)s_methods[] = {
+	{"as_tuple", (PyCFunction) %(p)s_as_tuple, METH_NOARGS,
+	 "as_tuple() -> tuple of the values of all fields"},
+	{"__bytes__", (PyCFunction) %(p)s_bytes, METH_NOARGS,
+	 "Return the raw struct data as bytes."},
+	{"unpack", (PyCFunction) %(p)s_unpack, METH_O | METH_CLASS,
+	 "unpack(buffer) -> tuple of the values of all fields"},
+	{"pack", (PyCFunction) (void (*)(void)) %(p)s_pack,
+	 METH_FASTCALL | METH_CLASS,
+	 "pack(v1, v2, ...) -> bytes with the values of all fields"},
+	{NULL, NULL}
+};
+
+static Py_ssize_t
+%(p)s_length(xs_object *self)
+{
+	return xs_named(%(p)s_fields, %(n)d);
+}
+
+static PyObject *
+%(p)s_subscript(xs_object *self, PyObject *key)
+{
+	const xs_field *field = xs_lookup(key, %(p)s_fields, %(n)d);
+	if (field == NULL)
+		return NULL;
+	return xs_get(self, field);
+}
+
+static int
+%(p)s_ass_subscript(xs_object *self, PyObject *key, PyObject *v)
+{
+	const xs_field *field = xs_lookup(key, %(p)s_fields, %(n)d);
+	if (field == NULL)
+		return -1;
+	return xs_set(self, field, v);
+}
+
+static PyMappingMethods %(p)s_as_mapping = {
+	(lenfunc) %(p)s_length,
+	(binaryfunc) %(p)s_subscript,
+	(objobjargproc) %(p)s_ass_subscript,
+};
+
+static int
+%(p)s_getbuffer(PyObject *self, Py_buffer *view, int flags)
+{
+	return xs_getbuffer(self, view, flags, %(p)s_SIZE, %(p)s_format);
+}
+
+static PyBufferProcs %(p)s_as_buffer = {
+	%(p)s_getbuffer,
+	NULL,
+};
+
+static PyTypeObject %(p)s_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "%(m)s.%(name)s",
+	.tp_basicsize = offsetof(xs_object, data) + %(p)s_SIZE,
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_doc = "%(name)s([buffer]) -> struct object",
+	.tp_new = %(p)s_new,
+	.tp_repr = (reprfunc) %(p)s_repr,
+	.tp_as_mapping = &%(p)s_as_mapping,
+	.tp_as_buffer = &%(p)s_as_buffer,
+	.tp_methods = %(p)s_methods,
+	.tp_getset = %(p)s_getset,
+#if PY_VERSION_HEX >= 0x03090000
+	.tp_vectorcall = %(p)s_vectorcall,
+#endif
+};
+
+''' % {"p": prefix, "n": count, "m": module, "name": name})
+
+def generate(schemas, module, source="schemas"):
+  """Return the C source of extension module 'module'."""
+  out = ["/* %s.c - generated by xscompile.py from %s, do not edit */\n"
+    % (module, source), RUNTIME, "\n"]
+
+  for name, schema in schemas:
+    generate_schema(out, name, schema, module)
+
+  out.append('''static struct PyModuleDef %(m)s_module = {
+	PyModuleDef_HEAD_INIT,
+	"%(m)s",
+	"structs compiled from %(source)s by xscompile.py",
+	-1,
+	NULL
+};
+
+PyMODINIT_FUNC
+PyInit_%(m)s(void)
+{
+	PyObject *m = PyModule_Create(&%(m)s_module);
+	PyObject *size;
+
+	if (m == NULL)
+		return NULL;
+
+	Error = PyErr_NewException("%(m)s.error", NULL, NULL);
+	if (Error == NULL || PyModule_AddObject(m, "error", Error) != 0)
+		goto fail;
+	Py_INCREF(Error);
+''' % {"m": module, "source": os.path.basename(source)})
+
+  for name, schema in schemas:
+    out.append('''
+	if (PyType_Ready(&xs_%(name)s_Type) < 0)
+		goto fail;
+	size = PyLong_FromLong(%(size)d);
+	if (size == NULL ||
+	    PyDict_SetItemString(xs_%(name)s_Type.tp_dict, "size", size) != 0) {
+		Py_XDECREF(size);
+		goto fail;
+	}
+	Py_DECREF(size);
+	PyType_Modified(&xs_%(name)s_Type);
+	Py_INCREF(&xs_%(name)s_Type);
+	if (PyModule_AddObject(m, "%(name)s",
+			       (PyObject *) &xs_%(name)s_Type) != 0)
+		goto fail;
+''' % {"name": name, "size": schema.size})
+
+  out.append('''
+	return m;
+
+ fail:
+	Py_DECREF(m);
+	return NULL;
+}
+''')
+  return "".join(out)
+
+def compile_file(path, module=None, output=None):
+  """Compile schema file path into C source; return the output path."""
+  if module is None:
+    module = os.path.splitext(os.path.basename(path))[0]
+  if output is None:
+    output = module + ".c"
+  schemas = load_schemas(path)
+  if not schemas:
+    raise SchemaError("%s defines no struct definitions" % path)
+  f = open(output, "w")
+  f.write(generate(schemas, module, path))
+  f.close()
+  return output
+
+def main(argv):
+  import getopt
+  try:
+    opts, args = getopt.getopt(argv, "m:o:", ["module=", "output="])
+  except getopt.GetoptError as e:
+    print("xscompile: %s" % e, file=sys.stderr)
+    return 2
+
+  module = output = None
+  for opt, val in opts:
+    if opt in ("-m", "--module"):
+      module = val
+    elif opt in ("-o", "--output"):
+      output = val
+
+  if len(args) != 1:
+    print("usage: python xscompile.py [-m module] [-o output] schemafile",
+      file=sys.stderr)
+    return 2
+
+  try:
+    print(compile_file(args[0], module, output))
+  except SchemaError as e:
+    print("xscompile: %s: %s" % (args[0], e), file=sys.stderr)
+    return 1
+  return 0
+
+if __name__ == "__main__":
+  sys.exit(main(sys.argv[1:]))
@@ -6,17 +6,17 @@
 import xstruct
 import sys
 
-print """>>> XsdpMessage = xstruct.structdef(xstruct.big_endian, [
-  ("magic",        (xstruct.string, 4),   "XSDP",   xstruct.readonly),
+print(""">>> XsdpMessage = xstruct.structdef(xstruct.big_endian, [
+  ("magic",        (xstruct.string, 4),   b"XSDP",  xstruct.readonly),
   ("version",      (xstruct.octet,  2),   (1, 0)), 
   ("byte_order",   (xstruct.octet,  1),    0,       xstruct.readonly), 
   ("message_type", (xstruct.octet,  1)), 
   ("correl_id",    (xstruct.unsigned_long, 1)),
   ("data",         (xstruct.string, 16))
-])""" 
+])""")
 
 XsdpMessage = xstruct.structdef(xstruct.big_endian, [
-  ("magic",        (xstruct.string, 4),   "XSDP",   xstruct.readonly),
+  ("magic",        (xstruct.string, 4),   b"XSDP",  xstruct.readonly),
   ("version",      (xstruct.octet,  2),   (1, 0)), 
   ("byte_order",   (xstruct.octet,  1),    0,       xstruct.readonly), 
   ("message_type", (xstruct.octet,  1)), 
@@ -24,78 +24,82 @@ XsdpMessage = xstruct.structdef(xstruct.big_endian, [
   ("data",         (xstruct.string, 16))
 ]) 
 
-print
+print()
 
-print ">>> XsdpMessage"
-print XsdpMessage
+print(">>> XsdpMessage")
+print(XsdpMessage)
 
-print
+print()
 
-print ">>> msg = XsdpMessage()"
+print(">>> msg = XsdpMessage()")
 
 msg = XsdpMessage()
 
-print ">>> print msg"
-print msg
+print(">>> msg")
+print(repr(msg))
 
-print
+print()
 
-print ">>> msg.correl_id = 0x01020304"
+print(">>> msg.correl_id = 0x01020304")
 msg.correl_id = 0x01020304
 
-print ">>> msg.correl_id"
-print msg.correl_id
+print(">>> msg.correl_id")
+print(msg.correl_id)
 
-print
+print()
 
-print ">>> msg['data'] = \"Hello, World !\""
-msg['data'] = "Hello, World !"
+print(">>> msg['data'] = b\"Hello, World !\"")
+msg['data'] = b"Hello, World !"
 
-print ">>> msg['data']"
-print msg['data']
+print(">>> msg['data']")
+print(msg['data'])
 
-print
+print()
 
-print ">>> msg.magic = \"XXXX\""
+print(">>> msg.magic = b\"XXXX\"")
 try:
-    msg.magic = "XXXX"
+    msg.magic = b"XXXX"
 except:
-    print "Traceback (innermost last):"
-    print "  File \"<stdin>\", line 1, in ?"
-    print "%s: %s" % (sys.exc_type, sys.exc_value)
+    print("Traceback (innermost last):")
+    print("  File \"<stdin>\", line 1, in ?")
+    print("%s: %s" % sys.exc_info()[:2])
 
-print
+print()
 
-print ">>> buf = str(msg)"
-buf = str(msg)
+print(">>> buf = bytes(msg)")
+buf = bytes(msg)
 
-print ">>> buf"
-print repr(buf)
+print(">>> buf")
+print(repr(buf))
 
-print
+print()
 
-print ">>> open(\"tmp\", \"w\").write(msg)"
-open("tmp", "w").write(msg)
+print(">>> memoryview(msg).format")
+print(memoryview(msg).format)
 
-print ">>> open(\"tmp\", \"r\").read()"
-print repr(open("tmp", "r").read())
+print()
 
-print
+print(">>> open(\"tmp\", \"wb\").write(msg)")
+open("tmp", "wb").write(msg)
 
-print ">>> msg2 = XsdpMessage(buf)"
+print(">>> open(\"tmp\", \"rb\").read()")
+print(repr(open("tmp", "rb").read()))
+
+print()
+
+print(">>> msg2 = XsdpMessage(buf)")
 msg2 = XsdpMessage(buf)
 
-print ">>> msg2"
-print msg2
+print(">>> msg2")
+print(repr(msg2))
 
-print
+print()
 
-print ">>> msg3 = XsdpMessage()"
+print(">>> msg3 = XsdpMessage()")
 msg3 = XsdpMessage()
 
-print ">>> open(\"tmp\", \"r\").readinto(msg3)"
-open("tmp", "r").readinto(msg3)
-
-print ">>> msg3"
-print msg3
+print(">>> open(\"tmp\", \"rb\").readinto(msg3)")
+open("tmp", "rb").readinto(msg3)
 
+print(">>> msg3")
+print(repr(msg3))
@@ -21,7 +21,7 @@ unpacking of 's' and 'p' type strings. These functions take the
 string packing and unpacking code out of the struct_pack() and
 struct_unpack() functions and make them available for general use.
 Note that because of this, the error message of the exception thrown by 
-p_sstr() and p_pstr() when the input object is not a PyStringObject 
+p_sstr() and p_pstr() when the input object is not a PyBytesObject 
 differs from the one originally thrown by struct_pack(), but is now
 consistent with the error messages from the np_*(), bp_*() and lp_*()
 functions.
@@ -37,6 +37,20 @@ the outer loop.
 (using the object count returned by calcsize()), instead of going through
 a temporary list.
 
+6. Renamed the bodies of struct_pack() and struct_unpack() to do_pack()
+and do_unpack(). struct_pack() and struct_unpack() now only check
+StatsMode and, when statistics are enabled, count the call against its
+format string (see the 'Statistics' section further down).
+
+7. Ported to the Python 3 C API: ints are PyLong, strings are bytes,
+and calcsize(), pack() and unpack() use METH_FASTCALL. unpack() accepts
+any object supporting the buffer protocol.
+
+8. Added the varint format codes 'v' (zigzag signed) and 'V' (unsigned).
+They take as many bytes as their value needs, so calcsize() counts them
+separately and rejects formats that have them; unpack() checks the
+buffer size as it goes for such formats.
+
 */
 
 /***********************************************************
@@ -77,8 +91,8 @@ PERFORMANCE OF THIS SOFTWARE.
 
 static char struct__doc__[] = "\
 Functions to convert between Python values and C structs.\n\
-Python strings are used to hold the data representing the C struct\n\
-and also as format strings to describe the layout of data in the C struct.\n\
+Python bytes objects are used to hold the data representing the C struct\n\
+and strings are used as format strings to describe its layout.\n\
 \n\
 The optional first format char indicates byte ordering and alignment:\n\
  @: native w/native alignment(default)\n\
@@ -96,15 +110,34 @@ Special cases (preceding decimal count indicates length):\n\
  s:string (array of char); p: pascal string (w. count byte).\n\
 Special case (only available in native format):\n\
  P:an integer type that is wide enough to hold a pointer.\n\
+Varints (LEB128, as many bytes as the value needs, so calcsize()\n\
+rejects them):\n\
+ v:signed (zigzag encoded); V:unsigned.\n\
 Whitespace between formats is ignored.\n\
 \n\
 The variable struct.error is an exception raised on errors.";
 
+#define PY_SSIZE_T_CLEAN
 #include "Python.h"
+#include "structmember.h"
 //#include "mymath.h"
 
+#include "pythread.h"
+
+#if PY_VERSION_HEX < 0x03080000
+#error "xstruct requires Python 3.8 or later"
+#endif
+
+#ifndef Py_TPFLAGS_HAVE_VECTORCALL
+#define Py_TPFLAGS_HAVE_VECTORCALL _Py_TPFLAGS_HAVE_VECTORCALL
+#endif
+
 #include <limits.h>
 #include <ctype.h>
+#include <time.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 
 /* Exception */
@@ -112,6 +145,38 @@ The variable struct.error is an exception raised on errors.";
 static PyObject *StructError;
 
 
+/* Statistics mode, a combination of STATS_COUNTERS and STATS_TIMING
+   (0 means off). The 'Statistics' section has the details. */
+
+#define STATS_COUNTERS 1
+#define STATS_TIMING 2
+
+#define STATS_PACK 0
+#define STATS_UNPACK 1
+#define STATS_NEW 2
+#define STATS_GET 3
+#define STATS_SET 4
+#define STATS_COPY 5
+#define STATS_OPCOUNT 6
+
+static int StatsMode = 0;
+
+typedef PyObject *(*formatfunc)(PyObject *const *, Py_ssize_t);
+
+static PyObject* CountFormatCall(int, formatfunc, PyObject *const *, 
+  Py_ssize_t);
+
+
+/* JIT threshold: the number of calls after which pack() and unpack() 
+   use native code for a format (0 means off). The 'JIT compilation' 
+   section has the details. */
+
+static int JitThreshold = 0;
+
+static PyObject* JitPack(PyObject *const *, Py_ssize_t);
+static PyObject* JitUnpack(PyObject *const *, Py_ssize_t);
+
+
 /* Define various structs to figure out the alignments of types */
 
 #ifdef __MWERKS__
@@ -130,6 +195,7 @@ typedef struct { char c; long x; } s_long;
 typedef struct { char c; float x; } s_float;
 typedef struct { char c; double x; } s_double;
 typedef struct { char c; void *x; } s_void_p;
+typedef struct { char c; PY_LONG_LONG x; } s_long_long;
 
 #define SHORT_ALIGN (sizeof(s_short) - sizeof(short))
 #define INT_ALIGN (sizeof(s_int) - sizeof(int))
@@ -137,6 +203,7 @@ typedef struct { char c; void *x; } s_void_p;
 #define FLOAT_ALIGN (sizeof(s_float) - sizeof(float))
 #define DOUBLE_ALIGN (sizeof(s_double) - sizeof(double))
 #define VOID_P_ALIGN (sizeof(s_void_p) - sizeof(void *))
+#define LONG_LONG_ALIGN (sizeof(s_long_long) - sizeof(PY_LONG_LONG))
 
 #ifdef __powerc
 #pragma options align=reset
@@ -146,11 +213,9 @@ typedef struct { char c; void *x; } s_void_p;
    if it isn't one */
 
 static int
-get_long(v, p)
-	PyObject *v;
-	long *p;
+get_long(PyObject *v, long *p)
 {
-	long x = PyInt_AsLong(v);
+	long x = PyLong_AsLong(v);
 	if (x == -1 && PyErr_Occurred()) {
 		if (PyErr_ExceptionMatches(PyExc_TypeError))
 			PyErr_SetString(StructError,
@@ -165,20 +230,17 @@ get_long(v, p)
 /* Same, but handling unsigned long */
 
 static int
-get_ulong(v, p)
-	PyObject *v;
-	unsigned long *p;
+get_ulong(PyObject *v, unsigned long *p)
 {
-	if (PyLong_Check(v)) {
-		unsigned long x = PyLong_AsUnsignedLong(v);
-		if (x == (unsigned long)(-1) && PyErr_Occurred())
-			return -1;
-		*p = x;
-		return 0;
-	}
-	else {
+	unsigned long x = PyLong_AsUnsignedLong(v);
+	if (x == (unsigned long)(-1) && PyErr_Occurred()) {
+		/* negative numbers are stored as their two's complement,
+		   which is what Python 2 did for plain ints */
+		PyErr_Clear();
 		return get_long(v, (long *)p);
 	}
+	*p = x;
+	return 0;
 }
 
 
@@ -191,10 +253,9 @@ get_ulong(v, p)
 /* XXX Inf/NaN are not handled quite right (but underflow is!) */
 
 static int
-pack_float(x, p, incr)
-	double x; /* The number to pack */
-	char *p;  /* Where to pack the high order byte */
-	int incr; /* 1 for big-endian; -1 for little-endian */
+pack_float(double x, /* The number to pack */
+           char *p,  /* Where to pack the high order byte */
+           int incr) /* 1 for big-endian; -1 for little-endian */
 {
 	int s;
 	int e;
@@ -263,10 +324,9 @@ pack_float(x, p, incr)
 }
 
 static int
-pack_double(x, p, incr)
-	double x; /* The number to pack */
-	char *p;  /* Where to pack the high order byte */
-	int incr; /* 1 for big-endian; -1 for little-endian */
+pack_double(double x, /* The number to pack */
+            char *p,  /* Where to pack the high order byte */
+            int incr) /* 1 for big-endian; -1 for little-endian */
 {
 	int s;
 	int e;
@@ -356,9 +416,8 @@ pack_double(x, p, incr)
 }
 
 static double
-unpack_float(p, incr)
-	char *p;  /* Where the high order byte is */
-	int incr; /* 1 for big-endian; -1 for little-endian */
+unpack_float(const char *p, /* Where the high order byte is */
+             int incr) /* 1 for big-endian; -1 for little-endian */
 {
 	int s;
 	int e;
@@ -400,9 +459,8 @@ unpack_float(p, incr)
 }
 
 static double
-unpack_double(p, incr)
-	char *p;  /* Where the high order byte is */
-	int incr; /* 1 for big-endian; -1 for little-endian */
+unpack_double(const char *p, /* Where the high order byte is */
+              int incr) /* 1 for big-endian; -1 for little-endian */
 {
 	int s;
 	int e;
@@ -468,90 +526,70 @@ typedef struct _formatdef {
 	char format;
 	int size;
 	int alignment;
-	PyObject* (*unpack) Py_PROTO((const char *,
-				      const struct _formatdef *));
-	int (*pack) Py_PROTO((char *,
-			      PyObject *,
-			      const struct _formatdef *));
+	PyObject* (*unpack)(const char *,
+			    const struct _formatdef *);
+	int (*pack)(char *,
+		    PyObject *,
+		    const struct _formatdef *);
 } formatdef;
 
 static PyObject *
-nu_char(p, f)
-	const char *p;
-	const formatdef *f;
+nu_char(const char *p, const formatdef *f)
 {
-	return PyString_FromStringAndSize(p, 1);
+	return PyBytes_FromStringAndSize(p, 1);
 }
 
 static PyObject *
-nu_byte(p, f)
-	const char *p;
-	const formatdef *f;
+nu_byte(const char *p, const formatdef *f)
 {
-	return PyInt_FromLong((long) *(signed char *)p);
+	return PyLong_FromLong((long) *(signed char *)p);
 }
 
 static PyObject *
-nu_ubyte(p, f)
-	const char *p;
-	const formatdef *f;
+nu_ubyte(const char *p, const formatdef *f)
 {
-	return PyInt_FromLong((long) *(unsigned char *)p);
+	return PyLong_FromLong((long) *(unsigned char *)p);
 }
 
 static PyObject *
-nu_short(p, f)
-	const char *p;
-	const formatdef *f;
+nu_short(const char *p, const formatdef *f)
 {
-	return PyInt_FromLong((long) *(short *)p);
+	return PyLong_FromLong((long) *(short *)p);
 }
 
 static PyObject *
-nu_ushort(p, f)
-	const char *p;
-	const formatdef *f;
+nu_ushort(const char *p, const formatdef *f)
 {
-	return PyInt_FromLong((long) *(unsigned short *)p);
+	return PyLong_FromLong((long) *(unsigned short *)p);
 }
 
 static PyObject *
-nu_int(p, f)
-	const char *p;
-	const formatdef *f;
+nu_int(const char *p, const formatdef *f)
 {
-	return PyInt_FromLong((long) *(int *)p);
+	return PyLong_FromLong((long) *(int *)p);
 }
 
 static PyObject *
-nu_uint(p, f)
-	const char *p;
-	const formatdef *f;
+nu_uint(const char *p, const formatdef *f)
 {
 	unsigned int x = *(unsigned int *)p;
 	return PyLong_FromUnsignedLong((unsigned long)x);
 }
 
 static PyObject *
-nu_long(p, f)
-	const char *p;
-	const formatdef *f;
+nu_long(const char *p, const formatdef *f)
 {
-	return PyInt_FromLong(*(long *)p);
+	return PyLong_FromLong(*(long *)p);
 }
 
 static PyObject *
-nu_ulong(p, f)
-	const char *p;
-	const formatdef *f;
+nu_ulong(const char *p, const formatdef *f)
 {
 	return PyLong_FromUnsignedLong(*(unsigned long *)p);
 }
 
 static PyObject *
-nu_float(p, f)
-	const char *p;
-	const formatdef *f;
+nu_float(const char *p, const formatdef *f)
 {
 	float x;
 	memcpy((char *)&x, p, sizeof(float));
@@ -559,9 +597,7 @@ nu_float(p, f)
 }
 
 static PyObject *
-nu_double(p, f)
-	const char *p;
-	const formatdef *f;
+nu_double(const char *p, const formatdef *f)
 {
 	double x;
 	memcpy((char *)&x, p, sizeof(double));
@@ -569,18 +605,13 @@ nu_double(p, f)
 }
 
 static PyObject *
-nu_void_p(p, f)
-	const char *p;
-	const formatdef *f;
+nu_void_p(const char *p, const formatdef *f)
 {
 	return PyLong_FromVoidPtr(*(void **)p);
 }
 
 static int
-np_byte(p, v, f)
-	char *p;
-	PyObject *v;
-	const formatdef *f;
+np_byte(char *p, PyObject *v, const formatdef *f)
 {
 	long x;
 	if (get_long(v, &x) < 0)
@@ -590,25 +621,19 @@ np_byte(p, v, f)
 }
 
 static int
-np_char(p, v, f)
-	char *p;
-	PyObject *v;
-	const formatdef *f;
+np_char(char *p, PyObject *v, const formatdef *f)
 {
-	if (!PyString_Check(v) || PyString_Size(v) != 1) {
+	if (!PyBytes_Check(v) || PyBytes_Size(v) != 1) {
 		PyErr_SetString(StructError,
 				"char format require string of length 1");
 		return -1;
 	}
-	*p = *PyString_AsString(v);
+	*p = *PyBytes_AsString(v);
 	return 0;
 }
 
 static int
-np_short(p, v, f)
-	char *p;
-	PyObject *v;
-	const formatdef *f;
+np_short(char *p, PyObject *v, const formatdef *f)
 {
 	long x;
 	if (get_long(v, &x) < 0)
@@ -618,10 +643,7 @@ np_short(p, v, f)
 }
 
 static int
-np_int(p, v, f)
-	char *p;
-	PyObject *v;
-	const formatdef *f;
+np_int(char *p, PyObject *v, const formatdef *f)
 {
 	long x;
 	if (get_long(v, &x) < 0)
@@ -631,10 +653,7 @@ np_int(p, v, f)
 }
 
 static int
-np_uint(p, v, f)
-	char *p;
-	PyObject *v;
-	const formatdef *f;
+np_uint(char *p, PyObject *v, const formatdef *f)
 {
 	unsigned long x;
 	if (get_ulong(v, &x) < 0)
@@ -644,10 +663,7 @@ np_uint(p, v, f)
 }
 
 static int
-np_long(p, v, f)
-	char *p;
-	PyObject *v;
-	const formatdef *f;
+np_long(char *p, PyObject *v, const formatdef *f)
 {
 	long x;
 	if (get_long(v, &x) < 0)
@@ -657,10 +673,7 @@ np_long(p, v, f)
 }
 
 static int
-np_ulong(p, v, f)
-	char *p;
-	PyObject *v;
-	const formatdef *f;
+np_ulong(char *p, PyObject *v, const formatdef *f)
 {
 	unsigned long x;
 	if (get_ulong(v, &x) < 0)
@@ -670,10 +683,7 @@ np_ulong(p, v, f)
 }
 
 static int
-np_float(p, v, f)
-	char *p;
-	PyObject *v;
-	const formatdef *f;
+np_float(char *p, PyObject *v, const formatdef *f)
 {
 	float x = (float)PyFloat_AsDouble(v);
 	if (x == -1 && PyErr_Occurred()) {
@@ -686,10 +696,7 @@ np_float(p, v, f)
 }
 
 static int
-np_double(p, v, f)
-	char *p;
-	PyObject *v;
-	const formatdef *f;
+np_double(char *p, PyObject *v, const formatdef *f)
 {
 	double x = PyFloat_AsDouble(v);
 	if (x == -1 && PyErr_Occurred()) {
@@ -702,10 +709,7 @@ np_double(p, v, f)
 }
 
 static int
-np_void_p(p, v, f)
-	char *p;
-	PyObject *v;
-	const formatdef *f;
+np_void_p(char *p, PyObject *v, const formatdef *f)
 {
 	void *x = PyLong_AsVoidPtr(v);
 	if (x == NULL && PyErr_Occurred()) {
@@ -719,6 +723,183 @@ np_void_p(p, v, f)
 	return 0;
 }
 
+/* Varints: 'V' unsigned and 'v' signed, LEB128 in pack() and unpack()
+   (7 bits per byte, low first, 0x80 set on all bytes but the last), the
+   signed ones zigzag encoded (0, -1, 1, -2 ... as 0, 1, 2, 3 ...). In
+   struct data they are held as 8-byte integers in the byte order of the
+   format table. */
+
+#define VARINT_MAX_SIZE 10
+
+/* Room pack() keeps for each varint: the largest size rounded up to the
+   largest alignment, so that native padding after a varint still fits */
+#define VARINT_PACK_ROOM 16
+
+#define ZIGZAG(x) (((x) << 1) ^ (0 - ((x) >> 63)))
+#define UNZIGZAG(x) (((x) >> 1) ^ (0 - ((x) & 1)))
+
+static int EncodeVarint(unsigned char* p, unsigned PY_LONG_LONG x)
+{
+  int n = 0;
+
+  while (x >= 0x80)
+  {
+    p[n++] = (unsigned char) (x | 0x80);
+    x >>= 7;
+  }
+  p[n++] = (unsigned char) x;
+
+  return n;
+}
+
+/* Decode the varint at p into *Value and return its size, 0 when it is
+   truncated and -1 when it is invalid: longer than VARINT_MAX_SIZE bytes
+   or beyond 64 bits, or not in its shortest form (a last byte of 0 after the first), which would give a
+   value more than one encoding. When 8 bytes are available, the end of
+   the varint is found and its 7-bit groups are joined without a loop. */
+
+static int DecodeVarint(const unsigned char* p, const unsigned char* End,
+  unsigned PY_LONG_LONG* Value)
+{
+  unsigned PY_LONG_LONG x = 0, Stops;
+  int n;
+
+  if (End - p >= 8)
+  {
+#if PY_BIG_ENDIAN
+    for (n = 7; n >= 0; n--)
+      x = (x << 8) | p[n];
+#else
+    memcpy(&x, p, 8);
+#endif
+    Stops = ~x & 0x8080808080808080ULL; /* bytes without continuation */
+
+    if (Stops != 0)
+    {
+      /* the number of the lowest stop byte, from its bit alone */
+      n = (int) ((((Stops & (0 - Stops)) >> 7) * 
+        0x0001020304050607ULL) >> 56);
+      if (n > 0 && p[n] == 0)
+        return -1;
+
+      x &= 0x7f7f7f7f7f7f7f7fULL >> (8 * (7 - n));
+      x = ((x & 0x7f007f007f007f00ULL) >> 1) | (x & 0x007f007f007f007fULL);
+      x = ((x & 0x3fff00003fff0000ULL) >> 2) | (x & 0x00003fff00003fffULL);
+      x = ((x & 0x0fffffff00000000ULL) >> 4) | (x & 0x000000000fffffffULL);
+
+      *Value = x;
+      return n + 1;
+    }
+
+    x = 0;
+  }
+
+  for (n = 0; n < VARINT_MAX_SIZE && p + n < End; n++)
+  {
+    x |= (unsigned PY_LONG_LONG) (p[n] & 0x7f) << (7 * n);
+
+    if ((p[n] & 0x80) == 0)
+    {
+      if ((n > 0 && p[n] == 0) || (n == VARINT_MAX_SIZE - 1 && p[n] > 1))
+        return -1;
+      *Value = x;
+      return n + 1;
+    }
+  }
+
+  return n == VARINT_MAX_SIZE ? -1 : 0;
+}
+
+static int
+get_varint(PyObject *v, const formatdef *f, unsigned PY_LONG_LONG *p)
+{
+	if (f->format == 'V')
+		*p = PyLong_AsUnsignedLongLong(v);
+	else
+		*p = (unsigned PY_LONG_LONG) PyLong_AsLongLong(v);
+	if (*p == (unsigned PY_LONG_LONG)(-1) && PyErr_Occurred()) {
+		if (PyErr_ExceptionMatches(PyExc_TypeError))
+			PyErr_SetString(StructError,
+					"required argument is not an integer");
+		else if (PyErr_ExceptionMatches(PyExc_OverflowError))
+			PyErr_SetString(StructError,
+					"varint argument out of range");
+		return -1;
+	}
+	return 0;
+}
+
+static PyObject *
+varint_value(unsigned PY_LONG_LONG x, const formatdef *f)
+{
+	if (f->format == 'V')
+		return PyLong_FromUnsignedLongLong(x);
+	return PyLong_FromLongLong((PY_LONG_LONG) x);
+}
+
+static PyObject *
+nu_varint(const char *p, const formatdef *f)
+{
+	unsigned PY_LONG_LONG x;
+	memcpy(&x, p, 8);
+	return varint_value(x, f);
+}
+
+static int
+np_varint(char *p, PyObject *v, const formatdef *f)
+{
+	unsigned PY_LONG_LONG x;
+	if (get_varint(v, f, &x) < 0)
+		return -1;
+	memcpy(p, &x, 8);
+	return 0;
+}
+
+static PyObject *
+lu_varint(const char *p, const formatdef *f)
+{
+	unsigned PY_LONG_LONG x = 0;
+	int i = 8;
+	do {
+		x = (x<<8) | (p[--i] & 0xFF);
+	} while (i > 0);
+	return varint_value(x, f);
+}
+
+static int
+lp_varint(char *p, PyObject *v, const formatdef *f)
+{
+	unsigned PY_LONG_LONG x;
+	int i;
+	if (get_varint(v, f, &x) < 0)
+		return -1;
+	for (i = 0; i < 8; i++, x >>= 8)
+		p[i] = (char)x;
+	return 0;
+}
+
+static PyObject *
+bu_varint(const char *p, const formatdef *f)
+{
+	unsigned PY_LONG_LONG x = 0;
+	int i;
+	for (i = 0; i < 8; i++)
+		x = (x<<8) | (p[i] & 0xFF);
+	return varint_value(x, f);
+}
+
+static int
+bp_varint(char *p, PyObject *v, const formatdef *f)
+{
+	unsigned PY_LONG_LONG x;
+	int i;
+	if (get_varint(v, f, &x) < 0)
+		return -1;
+	for (i = 7; i >= 0; i--, x >>= 8)
+		p[i] = (char)x;
+	return 0;
+}
+
 static formatdef native_table[] = {
 	{'x',	sizeof(char),	0,		NULL},
 	{'b',	sizeof(char),	0,		nu_byte,	np_byte},
@@ -735,13 +916,13 @@ static formatdef native_table[] = {
 	{'f',	sizeof(float),	FLOAT_ALIGN,	nu_float,	np_float},
 	{'d',	sizeof(double),	DOUBLE_ALIGN,	nu_double,	np_double},
 	{'P',	sizeof(void *),	VOID_P_ALIGN,	nu_void_p,	np_void_p},
+	{'v',	8,		LONG_LONG_ALIGN,	nu_varint,	np_varint},
+	{'V',	8,		LONG_LONG_ALIGN,	nu_varint,	np_varint},
 	{0}
 };
 
 static PyObject *
-bu_int(p, f)
-	const char *p;
-	const formatdef *f;
+bu_int(const char *p, const formatdef *f)
 {
 	long x = 0;
 	int i = f->size;
@@ -753,13 +934,11 @@ bu_int(p, f)
 		x <<= i;
 		x >>= i;
 	}
-	return PyInt_FromLong(x);
+	return PyLong_FromLong(x);
 }
 
 static PyObject *
-bu_uint(p, f)
-	const char *p;
-	const formatdef *f;
+bu_uint(const char *p, const formatdef *f)
 {
 	unsigned long x = 0;
 	int i = f->size;
@@ -769,30 +948,23 @@ bu_uint(p, f)
 	if (f->size >= 4)
 		return PyLong_FromUnsignedLong(x);
 	else
-		return PyInt_FromLong((long)x);
+		return PyLong_FromLong((long)x);
 }
 
 static PyObject *
-bu_float(p, f)
-	const char *p;
-	const formatdef *f;
+bu_float(const char *p, const formatdef *f)
 {
 	return PyFloat_FromDouble(unpack_float(p, 1));
 }
 
 static PyObject *
-bu_double(p, f)
-	const char *p;
-	const formatdef *f;
+bu_double(const char *p, const formatdef *f)
 {
 	return PyFloat_FromDouble(unpack_double(p, 1));
 }
 
 static int
-bp_int(p, v, f)
-	char *p;
-	PyObject *v;
-	const formatdef *f;
+bp_int(char *p, PyObject *v, const formatdef *f)
 {
 	long x;
 	int i;
@@ -807,10 +979,7 @@ bp_int(p, v, f)
 }
 
 static int
-bp_uint(p, v, f)
-	char *p;
-	PyObject *v;
-	const formatdef *f;
+bp_uint(char *p, PyObject *v, const formatdef *f)
 {
 	unsigned long x;
 	int i;
@@ -825,10 +994,7 @@ bp_uint(p, v, f)
 }
 
 static int
-bp_float(p, v, f)
-	char *p;
-	PyObject *v;
-	const formatdef *f;
+bp_float(char *p, PyObject *v, const formatdef *f)
 {
 	double x = PyFloat_AsDouble(v);
 	if (x == -1 && PyErr_Occurred()) {
@@ -840,10 +1006,7 @@ bp_float(p, v, f)
 }
 
 static int
-bp_double(p, v, f)
-	char *p;
-	PyObject *v;
-	const formatdef *f;
+bp_double(char *p, PyObject *v, const formatdef *f)
 {
 	double x = PyFloat_AsDouble(v);
 	if (x == -1 && PyErr_Occurred()) {
@@ -869,13 +1032,13 @@ static formatdef bigendian_table[] = {
 	{'L',	4,		0,		bu_uint,	bp_uint},
 	{'f',	4,		0,		bu_float,	bp_float},
 	{'d',	8,		0,		bu_double,	bp_double},
+	{'v',	8,		0,		bu_varint,	bp_varint},
+	{'V',	8,		0,		bu_varint,	bp_varint},
 	{0}
 };
 
 static PyObject *
-lu_int(p, f)
-	const char *p;
-	const formatdef *f;
+lu_int(const char *p, const formatdef *f)
 {
 	long x = 0;
 	int i = f->size;
@@ -887,13 +1050,11 @@ lu_int(p, f)
 		x <<= i;
 		x >>= i;
 	}
-	return PyInt_FromLong(x);
+	return PyLong_FromLong(x);
 }
 
 static PyObject *
-lu_uint(p, f)
-	const char *p;
-	const formatdef *f;
+lu_uint(const char *p, const formatdef *f)
 {
 	unsigned long x = 0;
 	int i = f->size;
@@ -903,30 +1064,23 @@ lu_uint(p, f)
 	if (f->size >= 4)
 		return PyLong_FromUnsignedLong(x);
 	else
-		return PyInt_FromLong((long)x);
+		return PyLong_FromLong((long)x);
 }
 
 static PyObject *
-lu_float(p, f)
-	const char *p;
-	const formatdef *f;
+lu_float(const char *p, const formatdef *f)
 {
 	return PyFloat_FromDouble(unpack_float(p+3, -1));
 }
 
 static PyObject *
-lu_double(p, f)
-	const char *p;
-	const formatdef *f;
+lu_double(const char *p, const formatdef *f)
 {
 	return PyFloat_FromDouble(unpack_double(p+7, -1));
 }
 
 static int
-lp_int(p, v, f)
-	char *p;
-	PyObject *v;
-	const formatdef *f;
+lp_int(char *p, PyObject *v, const formatdef *f)
 {
 	long x;
 	int i;
@@ -941,10 +1095,7 @@ lp_int(p, v, f)
 }
 
 static int
-lp_uint(p, v, f)
-	char *p;
-	PyObject *v;
-	const formatdef *f;
+lp_uint(char *p, PyObject *v, const formatdef *f)
 {
 	unsigned long x;
 	int i;
@@ -959,10 +1110,7 @@ lp_uint(p, v, f)
 }
 
 static int
-lp_float(p, v, f)
-	char *p;
-	PyObject *v;
-	const formatdef *f;
+lp_float(char *p, PyObject *v, const formatdef *f)
 {
 	double x = PyFloat_AsDouble(v);
 	if (x == -1 && PyErr_Occurred()) {
@@ -974,10 +1122,7 @@ lp_float(p, v, f)
 }
 
 static int
-lp_double(p, v, f)
-	char *p;
-	PyObject *v;
-	const formatdef *f;
+lp_double(char *p, PyObject *v, const formatdef *f)
 {
 	double x = PyFloat_AsDouble(v);
 	if (x == -1 && PyErr_Occurred()) {
@@ -1003,12 +1148,13 @@ static formatdef lilendian_table[] = {
 	{'L',	4,		0,		lu_uint,	lp_uint},
 	{'f',	4,		0,		lu_float,	lp_float},
 	{'d',	8,		0,		lu_double,	lp_double},
+	{'v',	8,		0,		lu_varint,	lp_varint},
+	{'V',	8,		0,		lu_varint,	lp_varint},
 	{0}
 };
 
 static const formatdef *
-whichtable(pfmt)
-	const char **pfmt;
+whichtable(const char **pfmt)
 {
 	const char *fmt = (*pfmt)++; /* May be backed out of later */
 	switch (*fmt) {
@@ -1035,20 +1181,20 @@ whichtable(pfmt)
 
 static int p_sstr(char* p, PyObject* v, int num)
 {
-  if (!PyString_Check(v)) 
+  if (!PyBytes_Check(v)) 
   {
-    PyErr_SetString(StructError, "required argument is not a string");
+    PyErr_SetString(StructError, "required argument is not a bytes object");
     return -1;
   }
   else
   {
-    int	n = PyString_Size(v);
+    Py_ssize_t n = PyBytes_GET_SIZE(v);
 		
     if (n > num)
 		  n = num;
 		
     if (n > 0)
-		  memcpy(p, PyString_AsString(v), n);
+		  memcpy(p, PyBytes_AsString(v), n);
 		
     if (n < num)
 		  memset(p + n, '\0', num - n);
@@ -1059,14 +1205,14 @@ static int p_sstr(char* p, PyObject* v, int num)
 
 static int p_pstr(char* p, PyObject* v, int num)
 {
-  if (!PyString_Check(v)) 
+  if (!PyBytes_Check(v)) 
   {
-    PyErr_SetString(StructError, "required argument is not a string");
+    PyErr_SetString(StructError, "required argument is not a bytes object");
     return -1;
   }
   else
   {
-	  int n = PyString_Size(v);
+	  Py_ssize_t n = PyBytes_GET_SIZE(v);
     
     num--; /* now num is max string size */
 
@@ -1076,7 +1222,7 @@ static int p_pstr(char* p, PyObject* v, int num)
     *p++ = n; /* store the length byte */
 
 	  if (n > 0)
-	    memcpy(p, PyString_AsString(v), n);
+	    memcpy(p, PyBytes_AsString(v), n);
 		
     if (n < num)
 	    memset(p + n, '\0', num - n);
@@ -1085,25 +1231,23 @@ static int p_pstr(char* p, PyObject* v, int num)
   }
 }
 
-static PyObject* u_sstr(char* p, int num)
+static PyObject* u_sstr(const char* p, int num)
 {
-  return PyString_FromStringAndSize(p, num);
+  return PyBytes_FromStringAndSize(p, num);
 }
 
-static PyObject* u_pstr(char* p, int num)
+static PyObject* u_pstr(const char* p, int num)
 {
-  int n = *(unsigned char*) p; /* first byte is string size */
+  int n = *(const unsigned char*) p; /* first byte is string size */
   if (n >= num)
     n = num-1;
-  return PyString_FromStringAndSize(p + 1, n);
+  return PyBytes_FromStringAndSize(p + 1, n);
 }
 
 /* Get the table entry for a format code */
 
 static const formatdef *
-getentry(c, f)
-	int c;
-	const formatdef *f;
+getentry(int c, const formatdef *f)
 {
 	for (; f->format != '\0'; f++) {
 		if (f->format == c) {
@@ -1118,10 +1262,7 @@ getentry(c, f)
 /* Align a size according to a format code */
 
 static int
-align(size, c, e)
-	int size;
-	int c;
-	const formatdef *e;
+align(int size, int c, const formatdef *e)
 {
 	if (e->format == c) {
 		if (e->alignment) {
@@ -1133,13 +1274,11 @@ align(size, c, e)
 	return size;
 }
 
-/* calculate the size of a format string */
+/* calculate the size of a format string; varints are not included and
+   only allowed when they can be counted in *varints */
 
 static int
-calcsize(fmt, f, objc)
-	const char *fmt;
-	const formatdef *f;
-  int* objc;
+calcsize(const char *fmt, const formatdef *f, int *objc, int *varints)
 {
 	const formatdef *e;
 	const char *s;
@@ -1151,6 +1290,8 @@ calcsize(fmt, f, objc)
 
   if (objc != NULL)
     *objc = 0;
+  if (varints != NULL)
+    *varints = 0;
 
 	while ((c = *s++) != '\0') {
 		if (isspace((int)c))
@@ -1177,6 +1318,22 @@ calcsize(fmt, f, objc)
 		if (e == NULL)
 			return -1;
 
+		if (c == 'v' || c == 'V') {
+			if (varints == NULL) {
+				PyErr_SetString(StructError,
+					"varint formats have no fixed size");
+				return -1;
+			}
+			*varints += num;
+			if (*varints < 0) {
+				PyErr_SetString(StructError, "too many varints");
+				return -1;
+			}
+			if (objc != NULL)
+				*objc += num;
+			continue;
+		}
+
 		itemsize = e->size;
 		size = align(size, c, e);
 		x = num * itemsize;
@@ -1222,63 +1379,82 @@ calcsize(fmt) -> int\n\
 Return size of C struct described by format string fmt.\n\
 See struct.__doc__ for more on format strings.";
 
+/* Get the format string from a str or bytes object */
+
+static const char *
+get_format(PyObject *format)
+{
+	if (PyUnicode_Check(format))
+		return PyUnicode_AsUTF8(format);
+	if (PyBytes_Check(format))
+		return PyBytes_AS_STRING(format);
+	PyErr_SetString(StructError, "format must be a string");
+	return NULL;
+}
+
 static PyObject *
-struct_calcsize(self, args)
-	PyObject *self; /* Not used */
-	PyObject *args;
+struct_calcsize(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
 {
-	char *fmt;
+	const char *fmt;
 	const formatdef *f;
 	int size;
 
-	if (!PyArg_ParseTuple(args, "s", &fmt))
+	if (nargs != 1) {
+		PyErr_SetString(PyExc_TypeError,
+				"calcsize() takes exactly one argument");
+		return NULL;
+	}
+	fmt = get_format(args[0]);
+	if (fmt == NULL)
 		return NULL;
 	f = whichtable(&fmt);
-	size = calcsize(fmt, f, NULL);
+	size = calcsize(fmt, f, NULL, NULL);
 	if (size < 0)
 		return NULL;
-	return PyInt_FromLong((long)size);
+	return PyLong_FromLong((long)size);
 }
 
 
 static char pack__doc__[] = "\
-pack(fmt, v1, v2, ...) -> string\n\
-Return string containing values v1, v2, ... packed according to fmt.\n\
+pack(fmt, v1, v2, ...) -> bytes\n\
+Return bytes containing values v1, v2, ... packed according to fmt.\n\
 See struct.__doc__ for more on format strings.";
 
 static PyObject *
-struct_pack(self, args)
-	PyObject *self; /* Not used */
-	PyObject *args;
+do_pack(PyObject *const *args, Py_ssize_t n)
 {
 	const formatdef *f, *e;
-	PyObject *format, *result, *v;
-	char *fmt;
-	int size, num;
-	int i, n;
-	char *s, *res, *restart, *nres;
+	PyObject *result, *v;
+	const char *fmt, *s;
+	int size, num, varints;
+	Py_ssize_t i;
+	char *res, *restart, *nres;
 	char c;
 
-	if (args == NULL || !PyTuple_Check(args) ||
-	    (n = PyTuple_Size(args)) < 1)
-        {
-		PyErr_BadArgument();
+	if (n < 1) {
+		PyErr_SetString(PyExc_TypeError,
+				"pack() requires a format argument");
 		return NULL;
 	}
-	format = PyTuple_GetItem(args, 0);
-	if (!PyArg_Parse(format, "s", &fmt))
+	fmt = get_format(args[0]);
+	if (fmt == NULL)
 		return NULL;
 	f = whichtable(&fmt);
-	size = calcsize(fmt, f, NULL);
+	size = calcsize(fmt, f, NULL, &varints);
 	if (size < 0)
 		return NULL;
-	result = PyString_FromStringAndSize((char *)NULL, size);
+	if (varints > (INT_MAX - size) / VARINT_PACK_ROOM) {
+		PyErr_SetString(StructError, "total struct size too long");
+		return NULL;
+	}
+	result = PyBytes_FromStringAndSize((char *)NULL,
+					   size + varints * VARINT_PACK_ROOM);
 	if (result == NULL)
 		return NULL;
 
 	s = fmt;
 	i = 1;
-	res = restart = PyString_AsString(result);
+	res = restart = PyBytes_AS_STRING(result);
 
 	while ((c = *s++) != '\0') {
 		if (isspace((int)c))
@@ -1296,7 +1472,9 @@ struct_pack(self, args)
 		e = getentry(c, f);
 		if (e == NULL)
 			goto fail;
-		nres = restart + align((int)(res-restart), c, e);
+		nres = res;
+		if (c != 'v' && c != 'V') /* varints are byte strings */
+			nres = restart + align((int)(res-restart), c, e);
 		/* Fill padd bytes with zeros */
 		while (res < nres)
 			*res++ = '\0';
@@ -1310,6 +1488,25 @@ struct_pack(self, args)
 			res += num;
       continue;
     }
+
+		if (c == 'v' || c == 'V') /* as many bytes as the value needs */
+    {
+			unsigned PY_LONG_LONG x;
+
+			for (; num > 0; num--) {
+				if (i >= n) {
+					PyErr_SetString(StructError,
+						"insufficient arguments to pack");
+					goto fail;
+				}
+				if (get_varint(args[i++], e, &x) < 0)
+					goto fail;
+				if (c == 'v')
+					x = ZIGZAG(x);
+				res += EncodeVarint((unsigned char *)res, x);
+			}
+			continue;
+    }
     
     if (i >= n) 
     {
@@ -1319,9 +1516,7 @@ struct_pack(self, args)
 
     if (c == 's' || c == 'p') /* num is string size, not repeat count */
     { 
-		  v = PyTuple_GetItem(args, i++);
-		  if (v == NULL)
-			  goto fail;
+		  v = args[i++];
 
 		  if (c == 's') 
       {
@@ -1340,9 +1535,12 @@ struct_pack(self, args)
 
 		while (num > 0)
     {	
-    	v = PyTuple_GetItem(args, i++);
-      if (v == NULL)
+      if (i >= n)
+      {
+        PyErr_SetString(StructError, "insufficient arguments to pack");
         goto fail;
+      }
+    	v = args[i++];
 			if (e->pack(res, v, e) < 0)
 				goto fail;
 			res += e->size;
@@ -1356,6 +1554,10 @@ struct_pack(self, args)
 		goto fail;
 	}
 
+	if (varints != 0 &&
+	    _PyBytes_Resize(&result, res - PyBytes_AS_STRING(result)) != 0)
+		return NULL;
+
 	return result;
 
  fail:
@@ -1363,39 +1565,64 @@ struct_pack(self, args)
 	return NULL;
 }
 
+static PyObject *
+struct_pack(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+	formatfunc pack = JitThreshold ? JitPack : do_pack;
+
+	if (StatsMode)
+		return CountFormatCall(STATS_PACK, pack, args, nargs);
+	return pack(args, nargs);
+}
+
 
 static char unpack__doc__[] = "\
-unpack(fmt, string) -> (v1, v2, ...)\n\
-Unpack the string, containing packed C structure data, according\n\
-to fmt.  Requires len(string)==calcsize(fmt).\n\
+unpack(fmt, buffer) -> (v1, v2, ...)\n\
+Unpack the buffer, containing packed C structure data, according\n\
+to fmt.  Requires len(buffer)==calcsize(fmt).\n\
 See struct.__doc__ for more on format strings.";
 
 static PyObject *
-struct_unpack(self, args)
-	PyObject *self; /* Not used */
-	PyObject *args;
+do_unpack(PyObject *const *args, Py_ssize_t nargs)
 {
 	const formatdef *f, *e;
-	char *str, *start, *fmt, *s;
+	const char *fmt, *s;
+	char *str, *start, *end;
 	char c;
-	int len, size, num, i, objc;
+	int size, num, i, objc, varints;
+	Py_buffer view;
 	PyObject *res, *v;
 
-	if (!PyArg_ParseTuple(args, "ss#", &fmt, &start, &len))
+	if (nargs != 2) {
+		PyErr_SetString(PyExc_TypeError,
+				"unpack() takes exactly two arguments");
+		return NULL;
+	}
+	fmt = get_format(args[0]);
+	if (fmt == NULL)
 		return NULL;
 	f = whichtable(&fmt);
-	size = calcsize(fmt, f, &objc);
+	size = calcsize(fmt, f, &objc, &varints);
 	if (size < 0)
 		return NULL;
-	if (size != len) {
+	if (PyObject_GetBuffer(args[1], &view, PyBUF_SIMPLE) != 0)
+		return NULL;
+	if (varints == 0 ? size != view.len : size + varints > view.len) {
 		PyErr_SetString(StructError,
 				"unpack str size does not match format");
+		PyBuffer_Release(&view);
 		return NULL;
 	}
 
   res = PyTuple_New(objc);
   if (res == NULL)
+  {
+    PyBuffer_Release(&view);
     return NULL;
+  }
+
+  start = view.buf;
+  end = start + view.len;
 
   i = 0;
 
@@ -1417,11 +1644,40 @@ struct_unpack(self, args)
 		e = getentry(c, f);
 		if (e == NULL)
 			goto fail;
-		str = start + align((int)(str-start), c, e);
+		if (c != 'v' && c != 'V') /* varints are byte strings */
+			str = start + align((int)(str-start), c, e);
 
 		if (num == 0 && c != 's') /* only '0s' creates an object */
 			continue;
 
+		if (c == 'v' || c == 'V') /* varints: the rest can move */
+    {
+			unsigned PY_LONG_LONG x;
+			int n;
+
+			for (; num > 0; num--) {
+				n = DecodeVarint((unsigned char *)str,
+						 (unsigned char *)end, &x);
+				if (n == 0)
+					goto mismatch;
+				if (n < 0) {
+					PyErr_SetString(StructError, 
+							"invalid varint");
+					goto fail;
+				}
+				str += n;
+				v = varint_value(c == 'v' ? UNZIGZAG(x) : x, e);
+				if (v == NULL)
+					goto fail;
+				PyTuple_SET_ITEM(res, i++, v);
+			}
+			continue;
+    }
+
+		if (end - str < (c == 'x' || c == 's' || c == 'p' ? 
+				 num : num * e->size))
+			goto mismatch;
+
 		if (c == 'x') /* doesn't create an object */
     {
 			str += num;
@@ -1455,756 +1711,10144 @@ struct_unpack(self, args)
 		}
 	}
 
+	if (str != end)
+		goto mismatch;
+
+	PyBuffer_Release(&view);
 	return res;
 
+ mismatch:
+	PyErr_SetString(StructError, "unpack str size does not match format");
  fail:
+	PyBuffer_Release(&view);
 	Py_DECREF(res);
 	return NULL;
 }
 
+static PyObject *
+struct_unpack(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+	formatfunc unpack = JitThreshold ? JitUnpack : do_unpack;
+
+	if (StatsMode)
+		return CountFormatCall(STATS_UNPACK, unpack, args, nargs);
+	return unpack(args, nargs);
+}
+
 /*===========*/
 /* new stuff */
 /*===========*/
 
 #define FLAG_READONLY 1
+#define FLAG_RAW 2 /* get a view of the bytes, see GetRawFieldView() */
+#define FLAG_ATOMIC 4 /* see 'Atomic fields' */
 
-/*---------------*/
-/* PyStructField */
-/*---------------*/
+/*------------*/
+/* Statistics */
+/*------------*/
 
-typedef struct {
-  PyObject_HEAD
-  PyObject* Name;
-  const formatdef* Format;
-  int Changeable;
-  int RepeatCount;
-  int Offset;
-} PyStructField;
+/*
+When StatsMode is not 0, pack() and unpack() are counted per format
+string and field access and object creation are counted per struct
+definition, as are the copies made on the first write to a default
+struct object and the default objects freed without ever being written
+(see 'PyStructObject' below). With STATS_TIMING, the time spent in each operation is
+measured with the processor's cycle counter as well. When StatsMode is 0,
+the only cost is the test of StatsMode on entry.
+*/
 
-static void PyStructField_dealloc(PyStructField* self)
-{
-  if (self->Name != NULL)
-    Py_DECREF(self->Name);
+typedef struct {
+  unsigned long Calls;
+  unsigned long Failures;
+  unsigned long Bytes;   /* encoded for pack/set, decoded otherwise */
+  unsigned long Objects; /* Python objects created */
+  PY_LONG_LONG Cycles;
+} OpStatistics;
 
-  PyMem_DEL(self);
-}
+typedef struct {
+  OpStatistics Op[STATS_OPCOUNT];
+  unsigned long Unwritten; /* default objects freed still sharing data */
+} StructStatistics;
 
-PyTypeObject PyStructField_Type = {
-	PyObject_HEAD_INIT(0) /* set in initxstruct() */
-	0,
-	"structfield",
-	sizeof(PyStructField),
-	0,
-	(destructor)PyStructField_dealloc, /*tp_dealloc*/
-	0,		/*tp_print*/
-	0,		/*tp_getattr*/
-	0,		/*tp_setattr*/
-	0,		/*tp_compare*/
-	0,		/*tp_repr*/
-	0,		/*tp_as_number*/
-	0,		/*tp_as_sequence*/
-	0,		/*tp_as_mapping*/
-	0,		/*tp_hash*/
-	0,		/*tp_call*/
-	0,		/*tp_str*/
-	0,		/*tp_getattro*/
-	0,		/*tp_setattro*/
-	0,		/*tp_as_buffer*/
-	Py_TPFLAGS_DEFAULT,	/*tp_flags*/
-	0,		/*tp_doc*/
+static char* StatsOpNames[STATS_OPCOUNT] = {
+  "pack", "unpack", "new", "get", "set", "copy"
 };
 
-PyStructField* NewPyStructField()
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+static PY_LONG_LONG ReadCycleCounter(void)
 {
-  PyStructField* StructField = 
-    PyObject_NEW(PyStructField, &PyStructField_Type);
-  if (StructField == NULL)
-    return NULL;
+  unsigned int Low, High;
+  __asm__ __volatile__ ("rdtsc" : "=a" (Low), "=d" (High));
+  return ((PY_LONG_LONG) High << 32) | Low;
+}
+#elif defined(_MSC_VER)
+#include <intrin.h>
+#define ReadCycleCounter() ((PY_LONG_LONG) __rdtsc())
+#else
+/* no cycle counter available, use processor clock ticks instead */
+#define ReadCycleCounter() ((PY_LONG_LONG) clock())
+#endif
 
-  StructField->Name = NULL;
+#define StatsStart() \
+  ((StatsMode & STATS_TIMING) ? ReadCycleCounter() : (PY_LONG_LONG) 0)
 
-  return StructField;
-}
- 
-static PyObject* GetFieldValue(PyStructField* Field, char* StructData)
+static void CountOp(StructStatistics* Stats, int Op, int Failed, 
+  long Bytes, long Objects, PY_LONG_LONG Start)
 {
-  char* FieldData = StructData + Field->Offset;
+  OpStatistics* OpStats = &Stats->Op[Op];
 
-  switch (Field->Format->format)
+  OpStats->Calls++;
+  if (Failed)
+    OpStats->Failures++;
+  else
   {
-    case 's': 
+    OpStats->Bytes += Bytes;
+    OpStats->Objects += Objects;
+  }
+
+  if (StatsMode & STATS_TIMING)
+    OpStats->Cycles += ReadCycleCounter() - Start;
+}
+
+static PyObject* StatisticsAsDict(StructStatistics* Stats)
+{
+  PyObject* Dict = PyDict_New();
+  int Op;
+
+  if (Dict == NULL)
+    return NULL;
+
+  for (Op = 0; Op < STATS_OPCOUNT; Op++)
+  {
+    OpStatistics* OpStats = &Stats->Op[Op];
+    PyObject* OpDict;
+
+    if (OpStats->Calls == 0)
+      continue;
+
+    OpDict = Py_BuildValue("{s:k,s:k,s:k,s:k,s:L}", 
+      "calls", OpStats->Calls, 
+      "failures", OpStats->Failures, 
+      "bytes", OpStats->Bytes, 
+      "objects", OpStats->Objects, 
+      "cycles", OpStats->Cycles);
+    if (OpDict == NULL)
+      goto fail;
+
+    if (PyDict_SetItemString(Dict, StatsOpNames[Op], OpDict) != 0)
+    {
+      Py_DECREF(OpDict);
+      goto fail;
+    }
+    Py_DECREF(OpDict);
+  }
+
+  if (Stats->Unwritten != 0)
+  {
+    PyObject* Unwritten = PyLong_FromUnsignedLong(Stats->Unwritten);
+    if (Unwritten == NULL)
+      goto fail;
+    if (PyDict_SetItemString(Dict, "unwritten", Unwritten) != 0)
+    {
+      Py_DECREF(Unwritten);
+      goto fail;
+    }
+    Py_DECREF(Unwritten);
+  }
+
+  return Dict;
+
+fail:
+
+  Py_DECREF(Dict);
+  return NULL;
+}
+
+/* The statistics of a format string are kept in a PyFormatStatistics
+   object in the FormatStatistics dictionary, keyed by the format string */
+
+typedef struct {
+  PyObject_HEAD
+  StructStatistics Stats;
+} PyFormatStatistics;
+
+static void PyFormatStatistics_dealloc(PyFormatStatistics* self)
+{
+  PyObject_DEL(self);
+}
+
+PyTypeObject PyFormatStatistics_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0) /* type set in PyInit_xstruct() */
+	"xstruct.formatstats",
+	sizeof(PyFormatStatistics),
+	0,
+	(destructor)PyFormatStatistics_dealloc, /*tp_dealloc*/
+	0,		/*tp_vectorcall_offset*/
+	0,		/*tp_getattr*/
+	0,		/*tp_setattr*/
+	0,		/*tp_as_async*/
+	0,		/*tp_repr*/
+	0,		/*tp_as_number*/
+	0,		/*tp_as_sequence*/
+	0,		/*tp_as_mapping*/
+	0,		/*tp_hash*/
+	0,		/*tp_call*/
+	0,		/*tp_str*/
+	0,		/*tp_getattro*/
+	0,		/*tp_setattro*/
+	0,		/*tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT,	/*tp_flags*/
+	0,		/*tp_doc*/
+};
+
+static PyObject* FormatStatistics = NULL;
+
+static StructStatistics* LookupFormatStatistics(PyObject* Format)
+{
+  PyFormatStatistics* Entry;
+
+  if (FormatStatistics == NULL)
+  {
+    FormatStatistics = PyDict_New();
+    if (FormatStatistics == NULL)
+      return NULL;
+  }
+
+  Entry = (PyFormatStatistics*) PyDict_GetItem(FormatStatistics, Format);
+    /* borrowed reference */
+  if (Entry != NULL)
+    return &Entry->Stats;
+
+  Entry = PyObject_NEW(PyFormatStatistics, &PyFormatStatistics_Type);
+  if (Entry == NULL)
+    return NULL;
+
+  memset(&Entry->Stats, 0, sizeof(StructStatistics));
+
+  if (PyDict_SetItem(FormatStatistics, Format, (PyObject*) Entry) != 0)
+  {
+    Py_DECREF(Entry);
+    return NULL;
+  }
+  Py_DECREF(Entry); /* now owned by FormatStatistics */
+
+  return &Entry->Stats;
+}
+
+/* Call do_pack() or do_unpack() and count the call against the format
+   string in its first argument */
+
+static PyObject* CountFormatCall(int Op, formatfunc Function, 
+  PyObject *const *args, Py_ssize_t nargs)
+{
+  StructStatistics* Stats;
+  PyObject* Result;
+  PY_LONG_LONG Start;
+  long Bytes = 0;
+  long Objects = 0;
+
+  if (nargs < 1 || !(PyUnicode_Check(args[0]) || PyBytes_Check(args[0])))
+    return Function(args, nargs); /* let it raise the error */
+
+  Stats = LookupFormatStatistics(args[0]);
+  if (Stats == NULL)
+    return NULL;
+
+  Start = StatsStart();
+
+  Result = Function(args, nargs);
+
+  if (Result != NULL)
+  {
+    if (Op == STATS_PACK)
+    {
+      Bytes = PyBytes_GET_SIZE(Result);
+      Objects = 1;
+    }
+    else
+    {
+      Py_buffer View;
+
+      /* the length of the data in bytes, not in items */
+      if (PyObject_GetBuffer(args[1], &View, PyBUF_SIMPLE) == 0)
+      {
+        Bytes = (long)View.len;
+        PyBuffer_Release(&View);
+      }
+      else
+        PyErr_Clear();
+      Objects = PyTuple_GET_SIZE(Result) + 1;
+    }
+  }
+
+  CountOp(Stats, Op, Result == NULL, Bytes, Objects, Start);
+
+  return Result;
+}
+
+
+/*-----------*/
+/* Checksums */
+/*-----------*/
+
+/*
+A checksum field is an unsigned integer field whose value is computed
+over a range of bytes of the struct: CRC-32 (as zlib), CRC-32C
+(Castagnoli), Adler-32 or the Internet checksum (RFC 1071). The field's
+own bytes count as zeros, so it may lie inside the range it covers.
+Checksums are computed in field order, which allows an outer checksum to
+cover an inner one that is declared before it.
+
+The CRCs are table driven, eight bytes at a time (slicing-by-8). CRC-32C
+uses the SSE 4.2 crc32 instruction when the processor has it. The
+Internet checksum is stored in network byte order whatever the layout,
+because that is what makes the ones' complement sum over the range
+(checksum included) come out as 0xffff on the wire.
+*/
+
+#define CHECKSUM_CRC32 1
+#define CHECKSUM_CRC32C 2
+#define CHECKSUM_ADLER32 3
+#define CHECKSUM_INET 4
+
+typedef struct {
+  const char* Name; /* field type specifier */
+  int Kind;
+  char Format; /* of the stored value */
+} ChecksumType;
+
+static ChecksumType ChecksumTypes[] = {
+  { "crc32", CHECKSUM_CRC32, 'I' },
+  { "crc32c", CHECKSUM_CRC32C, 'I' },
+  { "adler32", CHECKSUM_ADLER32, 'I' },
+  { "inet", CHECKSUM_INET, 'H' },
+  { NULL, 0, 0 }
+};
+
+typedef struct {
+  int Kind;
+  int Offset; /* of the checksum field */
+  int Size;
+  int BigEndian; /* byte order of the stored value */
+  int Start; /* covered range */
+  int Stop;
+} ChecksumSpec;
+
+static unsigned int Crc32Table[8][256];
+static unsigned int Crc32cTable[8][256];
+
+static void MakeCrcTable(unsigned int Table[8][256], unsigned int Polynomial)
+{
+  unsigned int i;
+  int k;
+
+  for (i = 0; i < 256; i++)
+  {
+    unsigned int Crc = i;
+    for (k = 0; k < 8; k++)
+      Crc = (Crc >> 1) ^ (Polynomial & (0 - (Crc & 1)));
+    Table[0][i] = Crc;
+  }
+
+  for (i = 0; i < 256; i++)
+    for (k = 1; k < 8; k++)
+      Table[k][i] = (Table[k - 1][i] >> 8) ^ Table[0][Table[k - 1][i] & 0xff];
+}
+
+#define LoadLittle32(p) \
+  ((unsigned int) (p)[0] | ((unsigned int) (p)[1] << 8) | \
+   ((unsigned int) (p)[2] << 16) | ((unsigned int) (p)[3] << 24))
+
+#define LoadBig32(p) \
+  (((unsigned int) (p)[0] << 24) | ((unsigned int) (p)[1] << 16) | \
+   ((unsigned int) (p)[2] << 8) | (unsigned int) (p)[3])
+
+/* Crc is the (inverted) CRC register */
+
+static unsigned int UpdateCrc(unsigned int Table[8][256], unsigned int Crc,
+  const unsigned char* p, size_t n)
+{
+  while (n >= 8)
+  {
+    unsigned int One = LoadLittle32(p) ^ Crc;
+    unsigned int Two = LoadLittle32(p + 4);
+
+    Crc = Table[7][One & 0xff] ^ Table[6][(One >> 8) & 0xff] ^
+      Table[5][(One >> 16) & 0xff] ^ Table[4][One >> 24] ^
+      Table[3][Two & 0xff] ^ Table[2][(Two >> 8) & 0xff] ^
+      Table[1][(Two >> 16) & 0xff] ^ Table[0][Two >> 24];
+
+    p += 8;
+    n -= 8;
+  }
+
+  while (n-- > 0)
+    Crc = Table[0][(Crc ^ *p++) & 0xff] ^ (Crc >> 8);
+
+  return Crc;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define WITH_CRC32C_INSTRUCTION
+#include <nmmintrin.h>
+
+static int HaveCrc32cInstruction = 0;
+
+__attribute__((target("sse4.2")))
+static unsigned int UpdateCrc32cInstruction(unsigned int Crc, 
+  const unsigned char* p, size_t n)
+{
+  unsigned PY_LONG_LONG Register = Crc;
+
+  while (n >= 8)
+  {
+    unsigned PY_LONG_LONG Word;
+    memcpy(&Word, p, 8);
+    Register = _mm_crc32_u64(Register, Word);
+    p += 8;
+    n -= 8;
+  }
+
+  Crc = (unsigned int) Register;
+  while (n-- > 0)
+    Crc = _mm_crc32_u8(Crc, *p++);
+
+  return Crc;
+}
+#endif
+
+static unsigned int UpdateAdler32(unsigned int Adler, 
+  const unsigned char* p, size_t n)
+{
+  unsigned int A = Adler & 0xffff;
+  unsigned int B = Adler >> 16;
+
+  while (n > 0)
+  {
+    size_t Block = n < 5552 ? n : 5552; /* no overflow before the modulo */
+    n -= Block;
+
+    while (Block >= 8)
+    {
+      A += p[0]; B += A;
+      A += p[1]; B += A;
+      A += p[2]; B += A;
+      A += p[3]; B += A;
+      A += p[4]; B += A;
+      A += p[5]; B += A;
+      A += p[6]; B += A;
+      A += p[7]; B += A;
+      p += 8;
+      Block -= 8;
+    }
+
+    while (Block-- > 0)
+    {
+      A += *p++;
+      B += A;
+    }
+
+    A %= 65521;
+    B %= 65521;
+  }
+
+  return (B << 16) | A;
+}
+
+/* The ones' complement sum of the big endian 16-bit words in p, with an
+   odd last byte padded with a zero */
+
+static unsigned int InetSum(const unsigned char* p, size_t n)
+{
+  unsigned PY_LONG_LONG Sum = 0;
+
+  while (n >= 8)
+  {
+    Sum += LoadBig32(p);
+    Sum += LoadBig32(p + 4);
+    p += 8;
+    n -= 8;
+  }
+
+  while (n >= 2)
+  {
+    Sum += ((unsigned int) p[0] << 8) | p[1];
+    p += 2;
+    n -= 2;
+  }
+
+  if (n > 0)
+    Sum += (unsigned int) p[0] << 8;
+
+  while (Sum >> 16)
+    Sum = (Sum & 0xffff) + (Sum >> 16);
+
+  return (unsigned int) Sum;
+}
+
+/* Feed the n bytes at p, which lie at Position in the covered range, to
+   the checksum State */
+
+static unsigned int UpdateChecksum(int Kind, unsigned int State, 
+  int Position, const unsigned char* p, size_t n)
+{
+  unsigned int Sum;
+
+  switch (Kind)
+  {
+    case CHECKSUM_CRC32:
+      return UpdateCrc(Crc32Table, State, p, n);
+    case CHECKSUM_CRC32C:
+#ifdef WITH_CRC32C_INSTRUCTION
+      if (HaveCrc32cInstruction)
+        return UpdateCrc32cInstruction(State, p, n);
+#endif
+      return UpdateCrc(Crc32cTable, State, p, n);
+    case CHECKSUM_ADLER32:
+      return UpdateAdler32(State, p, n);
+  }
+
+  /* an odd Position swaps the bytes of the words (RFC 1071, 2.B) */
+
+  Sum = InetSum(p, n);
+  if (Position & 1)
+    Sum = ((Sum & 0xff) << 8) | (Sum >> 8);
+
+  Sum += State;
+  return (Sum & 0xffff) + (Sum >> 16);
+}
+
+static unsigned int ComputeChecksum(const ChecksumSpec* Spec, 
+  const char* Data)
+{
+  static const unsigned char Zeros[8] = { 0 };
+  const unsigned char* p = (const unsigned char*) Data;
+  int Stop = Spec->Stop;
+  int ZeroStart = Spec->Offset;
+  int ZeroStop = Spec->Offset + Spec->Size;
+  unsigned int State;
+
+  switch (Spec->Kind)
+  {
+    case CHECKSUM_CRC32:
+    case CHECKSUM_CRC32C:
+      State = 0xffffffff;
+      break;
+    case CHECKSUM_ADLER32:
+      State = 1;
+      break;
+    default:
+      State = 0;
+  }
+
+  /* [Start, ZeroStart) data, [ZeroStart, ZeroStop) zeros, 
+     [ZeroStop, Stop) data */
+
+  if (ZeroStart < Spec->Start)
+    ZeroStart = Spec->Start;
+  if (ZeroStart > Stop)
+    ZeroStart = Stop;
+  if (ZeroStop < ZeroStart)
+    ZeroStop = ZeroStart;
+  if (ZeroStop > Stop)
+    ZeroStop = Stop;
+
+  State = UpdateChecksum(Spec->Kind, State, 0, p + Spec->Start, 
+    ZeroStart - Spec->Start);
+  State = UpdateChecksum(Spec->Kind, State, ZeroStart - Spec->Start, 
+    Zeros, ZeroStop - ZeroStart);
+  State = UpdateChecksum(Spec->Kind, State, ZeroStop - Spec->Start, 
+    p + ZeroStop, Stop - ZeroStop);
+
+  switch (Spec->Kind)
+  {
+    case CHECKSUM_CRC32:
+    case CHECKSUM_CRC32C:
+      return ~State;
+    case CHECKSUM_ADLER32:
+      return State;
+    default:
+      return ~State & 0xffff;
+  }
+}
+
+static unsigned int LoadChecksum(const ChecksumSpec* Spec, 
+  const char* Data)
+{
+  const unsigned char* p = (const unsigned char*) Data + Spec->Offset;
+  unsigned int Value = 0;
+  int k;
+
+  for (k = 0; k < Spec->Size; k++)
+    Value |= (unsigned int) p[k] << 
+      8 * (Spec->BigEndian ? Spec->Size - 1 - k : k);
+
+  return Value;
+}
+
+static void StoreChecksum(const ChecksumSpec* Spec, char* Data, 
+  unsigned int Value)
+{
+  unsigned char* p = (unsigned char*) Data + Spec->Offset;
+  int k;
+
+  for (k = 0; k < Spec->Size; k++)
+    p[k] = (unsigned char) 
+      (Value >> 8 * (Spec->BigEndian ? Spec->Size - 1 - k : k));
+}
+
+/* Compute and store all checksums of the struct at Data */
+
+static void SealChecksums(const ChecksumSpec* Specs, int Count, char* Data)
+{
+  int i;
+
+  for (i = 0; i < Count; i++)
+  {
+    StoreChecksum(&Specs[i], Data, ComputeChecksum(&Specs[i], Data));
+  }
+}
+
+/* Return the index of the first checksum of the struct at Data that 
+   does not match, -1 when they all do */
+
+static int VerifyChecksums(const ChecksumSpec* Specs, int Count, 
+  const char* Data)
+{
+  int i;
+
+  for (i = 0; i < Count; i++)
+    if (LoadChecksum(&Specs[i], Data) != ComputeChecksum(&Specs[i], Data))
+      return i;
+
+  return -1;
+}
+
+static void InitializeChecksums(void)
+{
+  MakeCrcTable(Crc32Table, 0xedb88320);
+  MakeCrcTable(Crc32cTable, 0x82f63b78);
+#ifdef WITH_CRC32C_INSTRUCTION
+  __builtin_cpu_init();
+  HaveCrc32cInstruction = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+/*---------------*/
+/* PyStructField */
+/*---------------*/
+
+typedef struct {
+  PyObject_HEAD
+  PyObject* Name;
+  const formatdef* Format;
+  const formatdef* Table; /* the one Format is in, for its byte order */
+  int Union; /* 1 + its index in the definition's unions, or 0 */
+  int Changeable;
+  int Raw; /* read as a view of its bytes */
+  int Atomic; /* updated atomically in record buffers */
+  int RepeatCount;
+  int Offset;
+} PyStructField;
+
+static void PyStructField_dealloc(PyStructField* self)
+{
+  if (self->Name != NULL)
+    Py_DECREF(self->Name);
+
+  PyObject_DEL(self);
+}
+
+PyTypeObject PyStructField_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0) /* type set in PyInit_xstruct() */
+	"xstruct.structfield",
+	sizeof(PyStructField),
+	0,
+	(destructor)PyStructField_dealloc, /*tp_dealloc*/
+	0,		/*tp_vectorcall_offset*/
+	0,		/*tp_getattr*/
+	0,		/*tp_setattr*/
+	0,		/*tp_as_async*/
+	0,		/*tp_repr*/
+	0,		/*tp_as_number*/
+	0,		/*tp_as_sequence*/
+	0,		/*tp_as_mapping*/
+	0,		/*tp_hash*/
+	0,		/*tp_call*/
+	0,		/*tp_str*/
+	0,		/*tp_getattro*/
+	0,		/*tp_setattro*/
+	0,		/*tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT,	/*tp_flags*/
+	0,		/*tp_doc*/
+};
+
+PyStructField* NewPyStructField()
+{
+  PyStructField* StructField = 
+    PyObject_NEW(PyStructField, &PyStructField_Type);
+  if (StructField == NULL)
+    return NULL;
+
+  StructField->Name = NULL;
+  StructField->Union = 0;
+  StructField->Raw = 0;
+  StructField->Atomic = 0;
+
+  return StructField;
+}
+ 
+static int FieldSize(PyStructField* Field)
+{
+  return Field->RepeatCount * Field->Format->size;
+}
+
+static PyObject* GetFieldValue(PyStructField* Field, char* StructData)
+{
+  char* FieldData = StructData + Field->Offset;
+
+  switch (Field->Format->format)
+  {
+    case 's': 
+    {
+      return u_sstr(FieldData, Field->RepeatCount);
+    }
+    case 'p':
+	  {
+	    return u_pstr(FieldData, Field->RepeatCount);
+	  }
+	  default:
+	  {
+	    if (Field->RepeatCount == 1)
+	    {
+	      return Field->Format->unpack(FieldData, Field->Format);
+	    }
+	    else
+	    {
+	      PyObject* ResultTuple;
+		    int i;
+		
+		    ResultTuple = PyTuple_New(Field->RepeatCount);
+	      if (ResultTuple == NULL)
+		      return NULL;
+	    
+	      i = 0;
+	  
+	      while (i < Field->RepeatCount)
+		    {
+		      PyObject* Element = Field->Format->unpack(FieldData, 
+            Field->Format);
+		      if (Element == NULL)
+		      {
+		        Py_DECREF(ResultTuple);
+			      return NULL;
+		      };
+
+		      PyTuple_SET_ITEM(ResultTuple, i, Element); 
+            /* steals the reference */
+		  
+		      FieldData += Field->Format->size;
+
+		      i++;
+		    }
+
+		    return ResultTuple;
+	    }
+	  }
+  }
+}
+
+/* Pack Value into the field data at FieldData */
+
+static int PackFieldValue(PyStructField* Field, char* FieldData, 
+  PyObject* Value)
+{
+  switch (Field->Format->format)
+  {
+	  case 's': 
+	  {
+	    return p_sstr(FieldData, Value, Field->RepeatCount);
+	  }
+	  case 'p': 
+	  {
+	    return p_pstr(FieldData, Value, Field->RepeatCount);
+	  }
+	  default:
+	  {
+	    if (Field->RepeatCount == 1)
+	    {
+	      return Field->Format->pack(FieldData, Value, Field->Format);
+	    }
+	    else
+	    {
+	      int i;
+
+	      if (!PyTuple_Check(Value)) 
+	      {
+		      PyErr_SetString(StructError, "value for field must be a tuple");
+		      return -1;
+		    }
+
+		    if (PyTuple_Size(Value) != Field->RepeatCount)
+		    {
+		      PyErr_SetString(StructError, "field element count mismatch");
+		      return -1;
+		    }
+
+		    i = 0;
+
+		    while (i < Field->RepeatCount)
+		    {
+		      PyObject* Element = PyTuple_GET_ITEM(Value, i);
+		        /* borrowed reference ! */
+
+		      if (Field->Format->pack(FieldData, Element, Field->Format) < 0)
+		        return -1;
+		  
+		      FieldData += Field->Format->size;
+
+		      i++;
+		    }
+
+		    return 0;
+	    }
+	  }
+  }
+}
+
+static int SetFieldValue(PyStructField* Field, char* StructData, 
+  PyObject* Value)
+{
+  return PackFieldValue(Field, StructData + Field->Offset, Value);
+}
+
+/*-------------*/
+/* Constraints */
+/*-------------*/
+
+/*
+A field can be given constraints in a dictionary following its flags:
+'value' (the field must hold exactly this value), 'min' and 'max' (for
+numeric fields, each element must lie within them), 'choices' (each
+element must be one of these) and 'nonzero' (the field must not be all
+zero bytes). They are compiled into an array of checks on the raw
+struct data, which is run when a struct object is created from a buffer
+and by structdef.validate() over a buffer of records. No Python objects
+are created while checking.
+*/
+
+#define CHECK_VALUE 1 /* the field is exactly Values */
+#define CHECK_CHOICES 2 /* each element is one of Values */
+#define CHECK_NONZERO 3 /* the field is not all zero bytes */
+#define CHECK_RANGE 4 /* each element lies within [Min, Max] */
+
+typedef union {
+  PY_LONG_LONG i;
+  unsigned PY_LONG_LONG u;
+  double f;
+} CheckBound;
+
+typedef struct {
+  int Kind;
+  PyStructField* Field; /* owned by the struct definition */
+  int Offset;
+  int Size; /* of one element */
+  int Count; /* of elements */
+  char Type; /* 'i', 'u', 'f' or 'b' (bytes) */
+  int Native; /* elements in native format */
+  int BigEndian;
+  CheckBound Min;
+  CheckBound Max;
+  char* Values; /* packed elements, sorted for CHECK_CHOICES */
+  int ValueCount;
+} FieldCheck;
+
+static char* CheckFailures[] = {
+  NULL, "unexpected value", "value not allowed", "value is zero",
+  "value out of range"
+};
+
+static void FreeFieldChecks(FieldCheck* Checks, int Count)
+{
+  int i;
+
+  for (i = 0; i < Count; i++)
+    if (Checks[i].Values != NULL)
+      free(Checks[i].Values);
+
+  free(Checks);
+}
+
+static char CheckType(const formatdef* Format)
+{
+  switch (Format->format)
+  {
+    case 'x':
+    case 'c':
+    case 's':
+    case 'p':
+      return 'b';
+    case 'f':
+    case 'd':
+      return 'f';
+  }
+
+  return islower(Format->format) ? 'i' : 'u';
+}
+
+static int PackElement(PyStructField* Field, char* Data, PyObject* Value)
+{
+  switch (Field->Format->format)
+  {
+    case 's':
+      return p_sstr(Data, Value, Field->RepeatCount);
+    case 'p':
+      return p_pstr(Data, Value, Field->RepeatCount);
+  }
+
+  return Field->Format->pack(Data, Value, Field->Format);
+}
+
+static int ElementSize;
+
+static int CompareElementsOfSize(const void* a, const void* b)
+{
+  return memcmp(a, b, ElementSize);
+}
+
+static int ParseBound(FieldCheck* Check, PyObject* Value, 
+  CheckBound* Bound)
+{
+  switch (Check->Type)
+  {
+    case 'i':
+      Bound->i = PyLong_AsLongLong(Value);
+      break;
+    case 'u':
+      Bound->u = PyLong_AsUnsignedLongLong(Value);
+      break;
+    default:
+      Bound->f = PyFloat_AsDouble(Value);
+  }
+
+  return PyErr_Occurred() ? -1 : 0;
+}
+
+/* Set up Check for the elements of Field */
+
+static void InitFieldCheck(FieldCheck* Check, int Kind, 
+  PyStructField* Field, const formatdef* Table)
+{
+  memset(Check, 0, sizeof(FieldCheck));
+  Check->Kind = Kind;
+  Check->Field = Field;
+  Check->Offset = Field->Offset;
+  Check->Type = CheckType(Field->Format);
+  Check->Native = (Table == native_table);
+  Check->BigEndian = Check->Native ? PY_BIG_ENDIAN : 
+    (Table == bigendian_table);
+
+  if (Field->Format->format == 's' || Field->Format->format == 'p')
+  {
+    Check->Size = Field->RepeatCount;
+    Check->Count = 1;
+  }
+  else
+  {
+    Check->Size = Field->Format->size;
+    Check->Count = Field->RepeatCount;
+  }
+}
+
+/* Append a check to Checks, set up for the elements of Field */
+
+static FieldCheck* AppendFieldCheck(FieldCheck** Checks, int* CheckCount,
+  int Kind, PyStructField* Field, const formatdef* Table)
+{
+  FieldCheck* NewChecks;
+
+  NewChecks = realloc(*Checks, (*CheckCount + 1) * sizeof(FieldCheck));
+  if (NewChecks == NULL)
+  {
+    PyErr_NoMemory();
+    return NULL;
+  }
+  *Checks = NewChecks;
+
+  InitFieldCheck(&NewChecks[*CheckCount], Kind, Field, Table);
+  return &NewChecks[(*CheckCount)++];
+}
+
+/* Compile the Constraints dictionary of Field into checks */
+
+static int CompileConstraints(FieldCheck** Checks, int* CheckCount,
+  PyStructField* Field, const formatdef* Table, PyObject* Constraints)
+{
+  PyObject* Key;
+  PyObject* Value;
+  PyObject* Min = NULL;
+  PyObject* Max = NULL;
+  Py_ssize_t Position = 0;
+  FieldCheck* Check;
+
+  if (!PyDict_Check(Constraints))
+  {
+    PyErr_SetString(StructError, "constraints must be a dictionary");
+    return -1;
+  }
+
+  while (PyDict_Next(Constraints, &Position, &Key, &Value))
+  {
+    const char* Name = PyUnicode_Check(Key) ? PyUnicode_AsUTF8(Key) : "";
+    if (Name == NULL)
+      return -1;
+
+    if (strcmp(Name, "min") == 0)
+      Min = Value;
+    else if (strcmp(Name, "max") == 0)
+      Max = Value;
+    else if (strcmp(Name, "value") == 0)
+    {
+      Check = AppendFieldCheck(Checks, CheckCount, CHECK_VALUE, Field, 
+        Table);
+      if (Check == NULL)
+        return -1;
+
+      Check->Size = FieldSize(Field);
+      Check->Count = 1;
+      Check->Values = malloc(Check->Size);
+      if (Check->Values == NULL)
+      {
+        PyErr_NoMemory();
+        return -1;
+      }
+      memset(Check->Values, 0, Check->Size);
+      Check->ValueCount = 1;
+
+      if (PackFieldValue(Field, Check->Values, Value) != 0)
+        return -1;
+    }
+    else if (strcmp(Name, "choices") == 0)
+    {
+      PyObject* Choices = PySequence_Fast(Value, 
+        "choices must be a sequence");
+      Py_ssize_t i;
+
+      if (Choices == NULL)
+        return -1;
+
+      Check = AppendFieldCheck(Checks, CheckCount, CHECK_CHOICES, Field, 
+        Table);
+      if (Check == NULL || PySequence_Fast_GET_SIZE(Choices) == 0 ||
+          PySequence_Fast_GET_SIZE(Choices) > INT_MAX / (Check->Size + 1))
+      {
+        if (Check != NULL)
+          PyErr_SetString(StructError, "invalid number of choices");
+        Py_DECREF(Choices);
+        return -1;
+      }
+
+      Check->ValueCount = (int) PySequence_Fast_GET_SIZE(Choices);
+      Check->Values = malloc(Check->ValueCount * Check->Size);
+      if (Check->Values == NULL)
+      {
+        PyErr_NoMemory();
+        Py_DECREF(Choices);
+        return -1;
+      }
+      memset(Check->Values, 0, Check->ValueCount * Check->Size);
+
+      for (i = 0; i < Check->ValueCount; i++)
+      {
+        if (PackElement(Field, Check->Values + i * Check->Size, 
+            PySequence_Fast_GET_ITEM(Choices, i)) != 0)
+        {
+          Py_DECREF(Choices);
+          return -1;
+        }
+      }
+      Py_DECREF(Choices);
+
+      ElementSize = Check->Size; /* under the interpreter lock */
+      qsort(Check->Values, Check->ValueCount, Check->Size, 
+        CompareElementsOfSize);
+    }
+    else if (strcmp(Name, "offset") == 0 || strcmp(Name, "align") == 0 ||
+        strcmp(Name, "discriminator") == 0 || strcmp(Name, "cases") == 0)
+      continue; /* layout and union options, see struct_structdef() */
+    else if (strcmp(Name, "nonzero") == 0)
+    {
+      int Nonzero = PyObject_IsTrue(Value);
+      if (Nonzero < 0)
+        return -1;
+
+      if (Nonzero)
+      {
+        Check = AppendFieldCheck(Checks, CheckCount, CHECK_NONZERO, Field,
+          Table);
+        if (Check == NULL)
+          return -1;
+
+        Check->Size = FieldSize(Field);
+        Check->Count = 1;
+      }
+    }
+    else
+    {
+      PyErr_Format(StructError, "unknown constraint %R", Key);
+      return -1;
+    }
+  }
+
+  if (Min == NULL && Max == NULL)
+    return 0;
+
+  Check = AppendFieldCheck(Checks, CheckCount, CHECK_RANGE, Field, Table);
+  if (Check == NULL)
+    return -1;
+
+  switch (Check->Type)
+  {
+    case 'i':
+      Check->Min.i = LLONG_MIN;
+      Check->Max.i = LLONG_MAX;
+      break;
+    case 'u':
+      Check->Min.u = 0;
+      Check->Max.u = ULLONG_MAX;
+      break;
+    case 'f':
+      Check->Min.f = -HUGE_VAL;
+      Check->Max.f = HUGE_VAL;
+      break;
+    default:
+      PyErr_SetString(StructError, 
+        "min and max only apply to numeric fields");
+      return -1;
+  }
+
+  if ((Min != NULL && ParseBound(Check, Min, &Check->Min) != 0) ||
+      (Max != NULL && ParseBound(Check, Max, &Check->Max) != 0))
+    return -1;
+
+  return 0;
+}
+
+/* Store the low Check->Size bytes of x as an element of Check */
+
+static void StoreElement(const FieldCheck* Check, char* p, 
+  unsigned PY_LONG_LONG x)
+{
+  int k;
+
+#if !PY_BIG_ENDIAN
+  if (!Check->BigEndian)
+  {
+    memcpy(p, &x, Check->Size);
+    return;
+  }
+#endif
+
+  for (k = 0; k < Check->Size; k++)
+    p[Check->BigEndian ? Check->Size - 1 - k : k] = 
+      (char) (x >> (8 * k));
+}
+
+/* Decode the numeric element at p */
+
+static CheckBound LoadElement(const FieldCheck* Check, const char* p)
+{
+  CheckBound Value;
+  unsigned PY_LONG_LONG Raw = 0;
+  int k;
+
+  if (Check->Type == 'f')
+  {
+    if (Check->Native && Check->Size == sizeof(float))
+    {
+      float f;
+      memcpy(&f, p, sizeof(float));
+      Value.f = f;
+    }
+    else if (Check->Native)
+      memcpy(&Value.f, p, sizeof(double));
+    else if (Check->Size == 4)
+      Value.f = Check->BigEndian ? unpack_float(p, 1) : 
+        unpack_float(p + 3, -1);
+    else
+      Value.f = Check->BigEndian ? unpack_double(p, 1) : 
+        unpack_double(p + 7, -1);
+
+    return Value;
+  }
+
+  if (Check->BigEndian == PY_BIG_ENDIAN)
+  {
+    /* the host byte order, load the element in one go */
+
+    switch (Check->Size)
+    {
+      case 1:
+        Raw = (unsigned char) *p;
+        break;
+      case 2:
+      {
+        unsigned short x;
+        memcpy(&x, p, 2);
+        Raw = x;
+        break;
+      }
+      case 4:
+      {
+        unsigned int x;
+        memcpy(&x, p, 4);
+        Raw = x;
+        break;
+      }
+      default:
+        memcpy(&Raw, p, 8);
+    }
+  }
+  else
+    for (k = 0; k < Check->Size; k++)
+      Raw |= (unsigned PY_LONG_LONG) (unsigned char) p[k] << 
+        8 * (Check->BigEndian ? Check->Size - 1 - k : k);
+
+  if (Check->Type == 'i' && Check->Size < 8 && 
+      (Raw >> (8 * Check->Size - 1)) & 1)
+    Raw |= ~(unsigned PY_LONG_LONG) 0 << (8 * Check->Size); /* sign */
+
+  Value.u = Raw;
+  return Value;
+}
+
+static int ElementInRange(const FieldCheck* Check, const char* p)
+{
+  CheckBound x = LoadElement(Check, p);
+
+  switch (Check->Type)
+  {
+    case 'f':
+      return x.f >= Check->Min.f && x.f <= Check->Max.f;
+    case 'u':
+      return x.u >= Check->Min.u && x.u <= Check->Max.u;
+  }
+
+  return x.i >= Check->Min.i && x.i <= Check->Max.i;
+}
+
+static int ElementIsChoice(const FieldCheck* Check, const char* p)
+{
+  int Low = 0;
+  int High = Check->ValueCount;
+
+  while (Low < High)
+  {
+    int Middle = (Low + High) / 2;
+    int Order = memcmp(p, Check->Values + Middle * Check->Size, 
+      Check->Size);
+
+    if (Order == 0)
+      return 1;
+    if (Order < 0)
+      High = Middle;
+    else
+      Low = Middle + 1;
+  }
+
+  return 0;
+}
+
+static int RunFieldCheck(const FieldCheck* Check, const char* Data)
+{
+  const char* p = Data + Check->Offset;
+  int i;
+
+  switch (Check->Kind)
+  {
+    case CHECK_VALUE:
+      return memcmp(p, Check->Values, Check->Size) == 0;
+    case CHECK_NONZERO:
+      for (i = 0; i < Check->Size; i++)
+        if (p[i] != 0)
+          return 1;
+      return 0;
+  }
+
+  for (i = 0; i < Check->Count; i++, p += Check->Size)
+  {
+    if (Check->Kind == CHECK_RANGE ? !ElementInRange(Check, p) : 
+        !ElementIsChoice(Check, p))
+      return 0;
+  }
+
+  return 1;
+}
+
+/* Return the index of the first check that fails for the struct at 
+   Data, -1 when they all pass */
+
+static int RunFieldChecks(const FieldCheck* Checks, int Count, 
+  const char* Data)
+{
+  int i;
+
+  for (i = 0; i < Count; i++)
+    if (!RunFieldCheck(&Checks[i], Data))
+      return i;
+
+  return -1;
+}
+
+/*--------------------*/
+/* PyStructDefinition */
+/*--------------------*/
+
+typedef struct _JitKernel JitKernel; /* see 'JIT compilation' */
+typedef struct _UnionSpec UnionSpec; /* see 'Unions' */
+
+typedef struct {
+  int Offset;
+  int Size;
+} KeyRange;
+
+static void FreeJitKernel(JitKernel*);
+static void FreeUnionSpecs(UnionSpec*, int);
+
+typedef struct _PyStructDefinition {
+  PyObject_HEAD
+  vectorcallfunc Vectorcall;
+  const formatdef* FormatTable;
+  PyObject* FieldList;
+  PyObject* FieldMap;
+  int StructSize;
+  char* InitialStructData;
+  PyObject* BufferFormat; /* bytes, PEP 3118 format of the struct */
+  PyObject* ArrayDescr; /* list, array interface description */
+  ChecksumSpec* Checksums; /* checksum fields, in field order */
+  int ChecksumCount;
+  FieldCheck* Checks; /* constraints */
+  int CheckCount;
+  KeyRange* KeyRanges; /* bytes hashed and compared */
+  int KeyRangeCount;
+  UnionSpec* Unions; /* union fields, in field order */
+  int UnionCount;
+  JitKernel* Jit; /* native code, if any */
+  int JitCalls; /* calls before the kernel is built, -1 when it is */
+  StructStatistics Stats;
+  PyObject* Spec; /* what it was built from, see 'Pickling' below */
+  PyObject* SpecKey; /* Spec frozen, its key in SpecDefinitions */
+  PyObject* WeakRefs;
+  struct _PyStructDefinition* Next; /* list of all definitions */
+  struct _PyStructDefinition* Prev;
+} PyStructDefinition;
+
+static PyStructDefinition* StructDefinitions = NULL;
+
+/* forward declaration */
+
+static void ForgetDefinitionSpec(PyStructDefinition* StructDefinition);
+
+static void PyStructDefinition_dealloc(PyStructDefinition* self)
+{
+  if (self->Prev != NULL)
+    self->Prev->Next = self->Next;
+  else
+    StructDefinitions = self->Next;
+
+  if (self->Next != NULL)
+    self->Next->Prev = self->Prev;
+
+  if (self->WeakRefs != NULL)
+    PyObject_ClearWeakRefs((PyObject*) self);
+
+  if (self->SpecKey != NULL)
+    ForgetDefinitionSpec(self);
+  Py_XDECREF(self->Spec);
+
+  if (self->InitialStructData != NULL)
+    free(self->InitialStructData);
+
+  if (self->FieldMap != NULL)
+    Py_DECREF(self->FieldMap);
+    
+  if (self->FieldList != NULL)
+    Py_DECREF(self->FieldList);
+
+  Py_XDECREF(self->BufferFormat);
+  Py_XDECREF(self->ArrayDescr);
+
+  if (self->Checksums != NULL)
+    free(self->Checksums);
+
+  if (self->Checks != NULL)
+    FreeFieldChecks(self->Checks, self->CheckCount);
+
+  if (self->KeyRanges != NULL)
+    free(self->KeyRanges);
+
+  if (self->Unions != NULL)
+    FreeUnionSpecs(self->Unions, self->UnionCount);
+
+  if (self->Jit != NULL)
+    FreeJitKernel(self->Jit);
+
+  PyObject_DEL(self);
+}
+
+/* forward declarations */
+
+static PyObject* NewStructObject(PyStructDefinition* StructDefinition, 
+  char* data, Py_ssize_t len);
+static PyObject* NewDefaultStructObject(
+  PyStructDefinition* StructDefinition);
+static char* StructObjectData(PyObject* StructObject);
+
+/* Raise StructError if a checksum or constraint of the struct at Data
+   does not hold. Record is its index in a buffer of records, or -1. */
+
+static int CheckStructData(PyStructDefinition* StructDefinition, 
+  const char* Data, Py_ssize_t Record)
+{
+  PyObject* Where;
+  int i;
+
+  i = VerifyChecksums(StructDefinition->Checksums, 
+    StructDefinition->ChecksumCount, Data);
+  if (i >= 0)
+  {
+    ChecksumSpec* Spec = &StructDefinition->Checksums[i];
+    ChecksumType* Type = ChecksumTypes;
+
+    while (Type->Kind != Spec->Kind)
+      Type++;
+
+    Where = PyUnicode_FromFormat("%s checksum at offset %d does not match",
+      Type->Name, Spec->Offset);
+  }
+  else
+  {
+    FieldCheck* Check;
+
+    i = RunFieldChecks(StructDefinition->Checks, 
+      StructDefinition->CheckCount, Data);
+    if (i < 0)
+      return 0;
+
+    Check = &StructDefinition->Checks[i];
+    if (Check->Field->Name != NULL)
+      Where = PyUnicode_FromFormat("field '%U': %s", Check->Field->Name,
+        CheckFailures[Check->Kind]);
+    else
+      Where = PyUnicode_FromFormat("field at offset %d: %s", 
+        Check->Field->Offset, CheckFailures[Check->Kind]);
+  }
+
+  if (Where == NULL)
+    return -1;
+
+  if (Record >= 0)
+    PyErr_Format(StructError, "record %zd: %U", Record, Where);
+  else
+    PyErr_SetObject(StructError, Where);
+
+  Py_DECREF(Where);
+  return -1;
+}
+
+/* Calling a struct definition creates a struct object, initialized from
+   the optional bytes-like argument or from the initial field values. In
+   the latter case, the object shares the initial data until its first
+   write. */
+
+static PyObject* PyStructDefinition_vectorcall(PyObject* callable,
+  PyObject* const* args, size_t nargsf, PyObject* kwnames)
+{
+  PyStructDefinition* self = (PyStructDefinition*) callable;
+  Py_ssize_t nargs = PyVectorcall_NARGS(nargsf);
+  Py_buffer View;
+  PyObject* Result;
+
+  if (kwnames != NULL && PyTuple_GET_SIZE(kwnames) != 0)
+  {
+    PyErr_SetString(PyExc_TypeError, 
+      "structdef objects take no keyword arguments");
+    return NULL;
+  }
+
+  if (nargs == 0)
+    return NewDefaultStructObject(self);
+
+  if (nargs > 1)
+  {
+    PyErr_SetString(PyExc_TypeError, 
+      "structdef objects take at most one argument");
+    return NULL;
+  }
+
+  if (PyObject_GetBuffer(args[0], &View, PyBUF_SIMPLE) != 0)
+    return NULL;
+
+  Result = NewStructObject(self, View.buf, View.len);
+
+  PyBuffer_Release(&View);
+
+  if (Result != NULL && (self->ChecksumCount != 0 || self->CheckCount != 0)
+      && CheckStructData(self, StructObjectData(Result), -1) != 0)
+    Py_CLEAR(Result);
+
+  return Result;
+}
+
+/* forward declaration */
+
+static PyObject* NewRecordBuffer(PyStructDefinition* StructDefinition,
+  PyObject* Buffer);
+
+static PyObject* PyStructDefinition_records(PyStructDefinition* self, 
+  PyObject* Buffer)
+{
+  return NewRecordBuffer(self, Buffer);
+}
+
+/* forward declaration */
+
+static PyObject* NewRecordIndex(PyStructDefinition* StructDefinition,
+  PyObject* Buffer, PyObject* Key);
+
+static PyObject* PyStructDefinition_index(PyStructDefinition* self, 
+  PyObject* args)
+{
+  PyObject* Buffer;
+  PyObject* Key;
+
+  if (!PyArg_ParseTuple(args, "OO", &Buffer, &Key))
+    return NULL;
+
+  return NewRecordIndex(self, Buffer, Key);
+}
+
+/* forward declaration */
+
+static PyObject* NewRecordFilter(PyStructDefinition* StructDefinition,
+  PyObject* Expression);
+
+static PyObject* PyStructDefinition_filter(PyStructDefinition* self, 
+  PyObject* Expression)
+{
+  return NewRecordFilter(self, Expression);
+}
+
+/* forward declaration */
+
+static PyObject* AggregateBuffer(PyStructDefinition* StructDefinition, 
+  PyObject* Buffer, PyObject* FieldName, PyObject* KeyName, 
+  Py_ssize_t Groups);
+
+static PyObject* PyStructDefinition_aggregate(PyStructDefinition* self, 
+  PyObject* args)
+{
+  PyObject* Buffer;
+  PyObject* Field;
+  PyObject* By = Py_None;
+  Py_ssize_t Groups = 256;
+
+  if (!PyArg_ParseTuple(args, "OO|On", &Buffer, &Field, &By, &Groups))
+    return NULL;
+
+  return AggregateBuffer(self, Buffer, Field, By, Groups);
+}
+
+/* forward declarations */
+
+static PyObject* EncodeStream(PyStructDefinition* StructDefinition,
+  PyObject* Buffer, Py_ssize_t BlockRecords);
+static PyObject* DecodeStream(PyStructDefinition* StructDefinition,
+  PyObject* Stream, Py_ssize_t Offset);
+static PyObject* DecodeStruct(PyStructDefinition* StructDefinition,
+  PyObject* Buffer, Py_ssize_t Offset);
+
+static PyObject* PyStructDefinition_encode_stream(PyStructDefinition* self,
+  PyObject* args)
+{
+  PyObject* Buffer;
+  Py_ssize_t BlockRecords = 1024;
+
+  if (!PyArg_ParseTuple(args, "O|n", &Buffer, &BlockRecords))
+    return NULL;
+
+  return EncodeStream(self, Buffer, BlockRecords);
+}
+
+static PyObject* PyStructDefinition_decode_stream(PyStructDefinition* self,
+  PyObject* args)
+{
+  PyObject* Stream;
+  Py_ssize_t Offset = 0;
+
+  if (!PyArg_ParseTuple(args, "O|n", &Stream, &Offset))
+    return NULL;
+
+  return DecodeStream(self, Stream, Offset);
+}
+
+static PyObject* PyStructDefinition_decode(PyStructDefinition* self,
+  PyObject* args)
+{
+  PyObject* Buffer;
+  Py_ssize_t Offset = 0;
+
+  if (!PyArg_ParseTuple(args, "O|n", &Buffer, &Offset))
+    return NULL;
+
+  return DecodeStruct(self, Buffer, Offset);
+}
+
+/* Verifying a buffer does not create a struct object, for receive paths
+   that drop what does not check out */
+
+static PyObject* PyStructDefinition_verify(PyStructDefinition* self, 
+  PyObject* Buffer)
+{
+  Py_buffer View;
+  int Valid;
+
+  if (PyObject_GetBuffer(Buffer, &View, PyBUF_SIMPLE) != 0)
+    return NULL;
+
+  Valid = View.len >= self->StructSize &&
+    VerifyChecksums(self->Checksums, self->ChecksumCount, View.buf) < 0;
+
+  PyBuffer_Release(&View);
+  return PyBool_FromLong(Valid);
+}
+
+static PyObject* PyStructDefinition_validate(PyStructDefinition* self, 
+  PyObject* Buffer)
+{
+  Py_buffer View;
+  Py_ssize_t Record;
+  int Result = 0;
+
+  if (PyObject_GetBuffer(Buffer, &View, PyBUF_SIMPLE) != 0)
+    return NULL;
+
+  if (View.len % self->StructSize != 0)
+  {
+    PyErr_SetString(StructError, 
+      "buffer size is not a multiple of the struct size");
+    Result = -1;
+  }
+
+  for (Record = 0; Result == 0 && Record < View.len / self->StructSize; 
+       Record++)
+    Result = CheckStructData(self, 
+      (char*) View.buf + Record * self->StructSize, Record);
+
+  PyBuffer_Release(&View);
+
+  if (Result != 0)
+    return NULL;
+
+  Py_RETURN_NONE;
+}
+
+/* Diffs and deltas */
+
+/* Set Changed[i] for the fields whose bytes differ between the structs
+   at Old and New and return how many do. The structs are compared a
+   word at a time; only the fields overlapping a differing word are 
+   compared byte-wise. */
+
+static int DiffStructData(PyStructDefinition* StructDefinition, 
+  const char* Old, const char* New, char* Changed)
+{
+  PyObject* Fields = StructDefinition->FieldList;
+  int FieldCount = (int) PyList_GET_SIZE(Fields);
+  int Size = StructDefinition->StructSize;
+  int Count = 0;
+  int Offset, i = 0;
+
+  memset(Changed, 0, FieldCount);
+
+  for (Offset = 0; Offset < Size && i < FieldCount; Offset += 8)
+  {
+    int Width = Size - Offset < 8 ? Size - Offset : 8;
+    int j;
+
+    if (Width == 8)
+    {
+      unsigned PY_LONG_LONG a, b;
+      memcpy(&a, Old + Offset, 8);
+      memcpy(&b, New + Offset, 8);
+      if (a == b)
+        continue;
+    }
+    else if (memcmp(Old + Offset, New + Offset, Width) == 0)
+      continue;
+
+    /* skip the fields that end before this word */
+
+    while (i < FieldCount)
+    {
+      PyStructField* Field = (PyStructField*) PyList_GET_ITEM(Fields, i);
+      if (Field->Offset + FieldSize(Field) > Offset)
+        break;
+      i++;
+    }
+
+    for (j = i; j < FieldCount; j++)
+    {
+      PyStructField* Field = (PyStructField*) PyList_GET_ITEM(Fields, j);
+      if (Field->Offset >= Offset + Width)
+        break;
+
+      if (!Changed[j] && memcmp(Old + Field->Offset, New + Field->Offset, 
+          FieldSize(Field)) != 0)
+      {
+        Changed[j] = 1;
+        Count++;
+      }
+    }
+  }
+
+  return Count;
+}
+
+static PyObject* ChangedFields(const char* Changed, int FieldCount, 
+  int Count)
+{
+  PyObject* Result = PyTuple_New(Count);
+  int i, k = 0;
+
+  if (Result == NULL)
+    return NULL;
+
+  for (i = 0; i < FieldCount; i++)
+  {
+    if (Changed[i])
+    {
+      PyObject* Index = PyLong_FromLong(i);
+      if (Index == NULL)
+      {
+        Py_DECREF(Result);
+        return NULL;
+      }
+      PyTuple_SET_ITEM(Result, k++, Index);
+    }
+  }
+
+  return Result;
+}
+
+/* The changed fields of one struct are returned as a tuple of field 
+   indices. For buffers of several records, a list of (record, fields)
+   pairs is returned for the records that changed. Results holds one 
+   tuple (or NULL) per record. */
+
+static PyObject* ChangedRecords(PyObject** Results, Py_ssize_t Records)
+{
+  PyObject* List;
+  Py_ssize_t r;
+
+  if (Records == 1)
+  {
+    Py_INCREF(Results[0]);
+    return Results[0];
+  }
+
+  List = PyList_New(0);
+  if (List == NULL)
+    return NULL;
+
+  for (r = 0; r < Records; r++)
+  {
+    PyObject* Pair;
+
+    if (PyTuple_GET_SIZE(Results[r]) == 0)
+      continue;
+
+    Pair = Py_BuildValue("nO", r, Results[r]);
+    if (Pair == NULL || PyList_Append(List, Pair) != 0)
+    {
+      Py_XDECREF(Pair);
+      Py_DECREF(List);
+      return NULL;
+    }
+    Py_DECREF(Pair);
+  }
+
+  return List;
+}
+
+static int GetRecordsView(PyStructDefinition* StructDefinition, 
+  PyObject* Buffer, Py_buffer* View, int Flags)
+{
+  if (PyObject_GetBuffer(Buffer, View, Flags) != 0)
+    return -1;
+
+  if (View->len == 0 || View->len % StructDefinition->StructSize != 0)
+  {
+    PyErr_SetString(StructError, 
+      "buffer size is not a multiple of the struct size");
+    PyBuffer_Release(View);
+    return -1;
+  }
+
+  return 0;
+}
+
+static PyObject* PyStructDefinition_diff(PyStructDefinition* self, 
+  PyObject *const *args, Py_ssize_t nargs)
+{
+  Py_buffer Old, New;
+  PyObject** Results = NULL;
+  PyObject* Result = NULL;
+  char* Changed = NULL;
+  int FieldCount = (int) PyList_GET_SIZE(self->FieldList);
+  Py_ssize_t Records = 0, r;
+
+  if (nargs != 2)
+  {
+    PyErr_SetString(PyExc_TypeError, 
+      "diff() takes exactly two arguments");
+    return NULL;
+  }
+
+  if (GetRecordsView(self, args[0], &Old, PyBUF_SIMPLE) != 0)
+    return NULL;
+  if (GetRecordsView(self, args[1], &New, PyBUF_SIMPLE) != 0)
+  {
+    PyBuffer_Release(&Old);
+    return NULL;
+  }
+
+  if (Old.len != New.len)
+  {
+    PyErr_SetString(StructError, "buffers differ in size");
+    goto fail;
+  }
+
+  Records = Old.len / self->StructSize;
+  Changed = malloc(FieldCount + 1);
+  Results = calloc(Records, sizeof(PyObject*));
+  if (Changed == NULL || Results == NULL)
+  {
+    PyErr_NoMemory();
+    goto fail;
+  }
+
+  for (r = 0; r < Records; r++)
+  {
+    int Count = DiffStructData(self, 
+      (char*) Old.buf + r * self->StructSize,
+      (char*) New.buf + r * self->StructSize, Changed);
+
+    Results[r] = ChangedFields(Changed, FieldCount, Count);
+    if (Results[r] == NULL)
+      goto fail;
+  }
+
+  Result = ChangedRecords(Results, Records);
+
+fail:
+
+  if (Results != NULL)
+  {
+    for (r = 0; r < Records; r++)
+      Py_XDECREF(Results[r]);
+    free(Results);
+  }
+  if (Changed != NULL)
+    free(Changed);
+  PyBuffer_Release(&Old);
+  PyBuffer_Release(&New);
+  return Result;
+}
+
+/* A delta holds, for each record, a bitmap of the changed fields (bit 
+   i % 8 of byte i / 8 for field i) followed by the bytes of the changed
+   fields in field order */
+
+static PyObject* PyStructDefinition_delta(PyStructDefinition* self, 
+  PyObject *const *args, Py_ssize_t nargs)
+{
+  Py_buffer Old, New;
+  PyObject* Result = NULL;
+  char* Changed = NULL;
+  int FieldCount = (int) PyList_GET_SIZE(self->FieldList);
+  int BitmapSize = (FieldCount + 7) / 8;
+  Py_ssize_t Records, r;
+  char* Out;
+
+  if (nargs != 2)
+  {
+    PyErr_SetString(PyExc_TypeError, 
+      "delta() takes exactly two arguments");
+    return NULL;
+  }
+
+  if (GetRecordsView(self, args[0], &Old, PyBUF_SIMPLE) != 0)
+    return NULL;
+  if (GetRecordsView(self, args[1], &New, PyBUF_SIMPLE) != 0)
+  {
+    PyBuffer_Release(&Old);
+    return NULL;
+  }
+
+  if (Old.len != New.len)
+  {
+    PyErr_SetString(StructError, "buffers differ in size");
+    goto fail;
+  }
+
+  Records = Old.len / self->StructSize;
+  if (Records > PY_SSIZE_T_MAX / (BitmapSize + self->StructSize))
+  {
+    PyErr_NoMemory();
+    goto fail;
+  }
+
+  Changed = malloc(FieldCount + 1);
+  if (Changed == NULL)
+  {
+    PyErr_NoMemory();
+    goto fail;
+  }
+
+  /* room for the worst case, trimmed at the end */
+
+  Result = PyBytes_FromStringAndSize(NULL, 
+    Records * (BitmapSize + self->StructSize));
+  if (Result == NULL)
+    goto fail;
+  Out = PyBytes_AS_STRING(Result);
+
+  for (r = 0; r < Records; r++)
+  {
+    const char* NewData = (char*) New.buf + r * self->StructSize;
+    char* Bitmap = Out;
+    int i;
+
+    DiffStructData(self, (char*) Old.buf + r * self->StructSize, NewData,
+      Changed);
+
+    memset(Bitmap, 0, BitmapSize);
+    Out += BitmapSize;
+
+    for (i = 0; i < FieldCount; i++)
+    {
+      if (Changed[i])
+      {
+        PyStructField* Field = (PyStructField*) 
+          PyList_GET_ITEM(self->FieldList, i);
+
+        Bitmap[i / 8] |= 1 << (i % 8);
+        memcpy(Out, NewData + Field->Offset, FieldSize(Field));
+        Out += FieldSize(Field);
+      }
+    }
+  }
+
+  _PyBytes_Resize(&Result, Out - PyBytes_AS_STRING(Result));
+
+fail:
+
+  if (Changed != NULL)
+    free(Changed);
+  PyBuffer_Release(&Old);
+  PyBuffer_Release(&New);
+  return Result;
+}
+
+static PyObject* PyStructDefinition_apply_delta(PyStructDefinition* self, 
+  PyObject *const *args, Py_ssize_t nargs)
+{
+  Py_buffer Target, Delta;
+  PyObject** Results = NULL;
+  PyObject* Result = NULL;
+  char* Changed = NULL;
+  int FieldCount = (int) PyList_GET_SIZE(self->FieldList);
+  int BitmapSize = (FieldCount + 7) / 8;
+  Py_ssize_t Records = 0, r;
+  const char* In;
+  const char* End;
+
+  if (nargs != 2)
+  {
+    PyErr_SetString(PyExc_TypeError, 
+      "apply_delta() takes exactly two arguments");
+    return NULL;
+  }
+
+  if (GetRecordsView(self, args[0], &Target, PyBUF_WRITABLE) != 0)
+    return NULL;
+  if (PyObject_GetBuffer(args[1], &Delta, PyBUF_SIMPLE) != 0)
+  {
+    PyBuffer_Release(&Target);
+    return NULL;
+  }
+
+  Records = Target.len / self->StructSize;
+  Changed = malloc(FieldCount + 1);
+  Results = calloc(Records, sizeof(PyObject*));
+  if (Changed == NULL || Results == NULL)
+  {
+    PyErr_NoMemory();
+    goto fail;
+  }
+
+  In = Delta.buf;
+  End = In + Delta.len;
+
+  for (r = 0; r < Records; r++)
+  {
+    char* Data = (char*) Target.buf + r * self->StructSize;
+    const char* Bitmap = In;
+    int Count = 0;
+    int i;
+
+    if (End - In < BitmapSize)
+      goto bad_delta;
+    In += BitmapSize;
+
+    for (i = 0; i < BitmapSize * 8; i++)
+    {
+      PyStructField* Field;
+
+      if (!(Bitmap[i / 8] & (1 << (i % 8))))
+      {
+        if (i < FieldCount)
+          Changed[i] = 0;
+        continue;
+      }
+
+      if (i >= FieldCount)
+        goto bad_delta;
+
+      Field = (PyStructField*) PyList_GET_ITEM(self->FieldList, i);
+      if (End - In < FieldSize(Field))
+        goto bad_delta;
+
+      memcpy(Data + Field->Offset, In, FieldSize(Field));
+      In += FieldSize(Field);
+      Changed[i] = 1;
+      Count++;
+    }
+
+    Results[r] = ChangedFields(Changed, FieldCount, Count);
+    if (Results[r] == NULL)
+      goto fail;
+  }
+
+  if (In != End)
+    goto bad_delta;
+
+  Result = ChangedRecords(Results, Records);
+  goto fail;
+
+bad_delta:
+
+  PyErr_SetString(StructError, "delta does not match the buffer");
+
+fail:
+
+  if (Results != NULL)
+  {
+    for (r = 0; r < Records; r++)
+      Py_XDECREF(Results[r]);
+    free(Results);
+  }
+  if (Changed != NULL)
+    free(Changed);
+  PyBuffer_Release(&Target);
+  PyBuffer_Release(&Delta);
+  return Result;
+}
+
+/* forward declarations */
+
+static PyObject* PyStructDefinition_reduce(PyStructDefinition* self, 
+  PyObject* Unused);
+static PyObject* PyStructDefinition_ring(PyStructDefinition* self, 
+  PyObject* args);
+
+static PyMethodDef PyStructDefinition_methods[] = {
+  {"__reduce__", (PyCFunction)PyStructDefinition_reduce, METH_NOARGS,
+   "Pickle the definition by its spec (see structdef_from_spec())."},
+  {"records", (PyCFunction)PyStructDefinition_records, METH_O,
+   "records(buffer) -> records\n"
+   "Wrap a buffer of consecutive structs without copying it."},
+  {"index", (PyCFunction)PyStructDefinition_index, METH_VARARGS,
+   "index(buffer, key) -> index\n"
+   "Index the records in buffer by key, a field name or a sequence of\n"
+   "them."},
+  {"filter", (PyCFunction)PyStructDefinition_filter, METH_O,
+   "filter(expr) -> filter\n"
+   "Compile a predicate over the fields, such as ('and', ('id', '>', 10),\n"
+   "('name', '==', b'x')), to run over buffers of records."},
+  {"aggregate", (PyCFunction)PyStructDefinition_aggregate, METH_VARARGS,
+   "aggregate(buffer, field[, by[, groups]]) -> dict\n"
+   "Return the count, sum, min, max and mean of a numeric field over a\n"
+   "buffer of records. With by, the name of an integer field, return them\n"
+   "per key value below groups (256)."},
+  {"encode_stream", (PyCFunction)PyStructDefinition_encode_stream, 
+   METH_VARARGS,
+   "encode_stream(buffer[, block_records]) -> bytes\n"
+   "Compress a buffer of records into blocks of block_records (1024)\n"
+   "records, each field stored as the difference to the previous record."},
+  {"decode_stream", (PyCFunction)PyStructDefinition_decode_stream, 
+   METH_VARARGS,
+   "decode_stream(data[, offset]) -> bytes\n"
+   "Rebuild the records of an encoded stream, from the block at offset."},
+  {"decode", (PyCFunction)PyStructDefinition_decode, METH_VARARGS,
+   "decode(buffer[, offset]) -> (struct, end)\n"
+   "Decode a struct in the wire form of encode(), with its varint fields\n"
+   "as LEB128, from offset in buffer. Returns it and where it ends."},
+  {"verify", (PyCFunction)PyStructDefinition_verify, METH_O,
+   "verify(buffer) -> bool\n"
+   "Check the checksum fields of the struct at the start of buffer."},
+  {"validate", (PyCFunction)PyStructDefinition_validate, METH_O,
+   "validate(buffer)\n"
+   "Check the checksums and constraints of every struct in a buffer of\n"
+   "records. Raises error naming the first record and field that fail."},
+  {"diff", (PyCFunction)(void(*)(void)) PyStructDefinition_diff, 
+   METH_FASTCALL,
+   "diff(old, new) -> fields\n"
+   "Return the indices of the fields that differ between two structs. For\n"
+   "buffers of several records, return (record, fields) pairs for the\n"
+   "records that differ."},
+  {"delta", (PyCFunction)(void(*)(void)) PyStructDefinition_delta, 
+   METH_FASTCALL,
+   "delta(old, new) -> bytes\n"
+   "Encode the fields of new that differ from old: per record, a bitmap\n"
+   "of the changed fields followed by their bytes."},
+  {"apply_delta", (PyCFunction)(void(*)(void)) 
+   PyStructDefinition_apply_delta, METH_FASTCALL,
+   "apply_delta(target, delta) -> fields\n"
+   "Apply a delta to a writable struct or buffer of records in place and\n"
+   "return the changed fields, as diff() does."},
+  {"ring", (PyCFunction)PyStructDefinition_ring, METH_VARARGS,
+   "ring(buffer[, multi_producer]) -> ring\n"
+   "Use a writable buffer shared between processes (an mmap, zero-filled\n"
+   "at first) as a ring of records from one or, with multi_producer,\n"
+   "several producer processes to one consumer process."},
+  {NULL, NULL}
+};
+
+static PyObject* PyStructDefinition_get_descr(PyStructDefinition* self, 
+  void* Unused)
+{
+  return PyList_GetSlice(self->ArrayDescr, 0, PY_SSIZE_T_MAX);
+}
+
+static PyObject* PyStructDefinition_get_spec(PyStructDefinition* self, 
+  void* Unused)
+{
+  Py_INCREF(self->Spec);
+  return self->Spec;
+}
+
+static PyObject* PyStructDefinition_get_fields(PyStructDefinition* self, 
+  void* Unused)
+{
+  Py_ssize_t FieldCount = PyList_GET_SIZE(self->FieldList);
+  PyObject* Names = PyTuple_New(FieldCount);
+  Py_ssize_t i;
+
+  if (Names == NULL)
+    return NULL;
+
+  for (i = 0; i < FieldCount; i++)
+  {
+    PyStructField* Field = (PyStructField*) 
+      PyList_GET_ITEM(self->FieldList, i);
+    PyObject* Name = Field->Name != NULL ? Field->Name : Py_None;
+
+    Py_INCREF(Name);
+    PyTuple_SET_ITEM(Names, i, Name);
+  }
+
+  return Names;
+}
+
+static PyGetSetDef PyStructDefinition_getset[] = {
+  {"descr", (getter)PyStructDefinition_get_descr, NULL,
+   "array interface description of the struct, for numpy.dtype()"},
+  {"fields", (getter)PyStructDefinition_get_fields, NULL,
+   "names of the fields (None for unnamed ones), by field index"},
+  {"spec", (getter)PyStructDefinition_get_spec, NULL,
+   "what the struct was defined by, for structdef_from_spec(): the format\n"
+   "string, or (layout, fields, key, pack, optimize)"},
+  {NULL}
+};
+
+static PyMemberDef PyStructDefinition_members[] = {
+  {"size", T_INT, offsetof(PyStructDefinition, StructSize), READONLY,
+   "size of the struct in bytes"},
+  {NULL}
+};
+
+PyTypeObject PyStructDefinition_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0) /* type set in PyInit_xstruct() */
+	"xstruct.structdef",
+	sizeof(PyStructDefinition),
+	0,
+	(destructor)PyStructDefinition_dealloc, /*tp_dealloc*/
+	offsetof(PyStructDefinition, Vectorcall), /*tp_vectorcall_offset*/
+	0,		/*tp_getattr*/
+	0,		/*tp_setattr*/
+	0,		/*tp_as_async*/
+	0,		/*tp_repr*/
+	0,		/*tp_as_number*/
+	0,		/*tp_as_sequence*/
+	0,		/*tp_as_mapping*/
+	0,		/*tp_hash*/
+	PyVectorcall_Call, /*tp_call*/
+	0,		/*tp_str*/
+	PyObject_GenericGetAttr, /*tp_getattro*/
+	0,		/*tp_setattro*/
+	0,		/*tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_VECTORCALL,	/*tp_flags*/
+	0,		/*tp_doc*/
+	0,		/*tp_traverse*/
+	0,		/*tp_clear*/
+	0,		/*tp_richcompare*/
+	offsetof(PyStructDefinition, WeakRefs), /*tp_weaklistoffset*/
+	0,		/*tp_iter*/
+	0,		/*tp_iternext*/
+	PyStructDefinition_methods, /*tp_methods*/
+	PyStructDefinition_members, /*tp_members*/
+	PyStructDefinition_getset, /*tp_getset*/
+};
+
+PyStructDefinition* NewPyStructDefinition()
+{
+  PyStructDefinition* StructDefinition = 
+    PyObject_NEW(PyStructDefinition, &PyStructDefinition_Type);
+  if (StructDefinition == NULL)
+    return NULL;
+
+  StructDefinition->Vectorcall = PyStructDefinition_vectorcall;
+  StructDefinition->FieldList = NULL;
+  StructDefinition->FieldMap = NULL;
+  StructDefinition->InitialStructData = NULL;
+  StructDefinition->BufferFormat = NULL;
+  StructDefinition->ArrayDescr = NULL;
+  StructDefinition->Checksums = NULL;
+  StructDefinition->ChecksumCount = 0;
+  StructDefinition->Checks = NULL;
+  StructDefinition->CheckCount = 0;
+  StructDefinition->KeyRanges = NULL;
+  StructDefinition->KeyRangeCount = 0;
+  StructDefinition->Unions = NULL;
+  StructDefinition->UnionCount = 0;
+  StructDefinition->Jit = NULL;
+  StructDefinition->JitCalls = 0;
+  StructDefinition->Spec = NULL;
+  StructDefinition->SpecKey = NULL;
+  StructDefinition->WeakRefs = NULL;
+
+  memset(&StructDefinition->Stats, 0, sizeof(StructStatistics));
+
+  StructDefinition->Prev = NULL;
+  StructDefinition->Next = StructDefinitions;
+  if (StructDefinitions != NULL)
+    StructDefinitions->Prev = StructDefinition;
+  StructDefinitions = StructDefinition;
+
+  return StructDefinition;
+}
+
+static PyStructField* LookupFieldByName(PyStructDefinition* 
+  StructDefinition, PyObject* Name)
+{
+  PyStructField* Field = (PyStructField*) 
+    PyDict_GetItemWithError(StructDefinition->FieldMap, Name);
+      /* borrowed reference */
+  if (Field == NULL && !PyErr_Occurred())
+    PyErr_SetObject(PyExc_KeyError, Name);
+
+  return Field;
+}
+
+static PyObject* CountGetFieldValue(PyStructDefinition* StructDefinition,
+  PyStructField* Field, char* StructData)
+{
+  PY_LONG_LONG Start = StatsStart();
+  PyObject* Value = GetFieldValue(Field, StructData);
+  int Objects = 1;
+
+  if (Value != NULL && PyTuple_Check(Value))
+    Objects += PyTuple_GET_SIZE(Value);
+
+  CountOp(&StructDefinition->Stats, STATS_GET, Value == NULL, 
+    FieldSize(Field), Objects, Start);
+
+  return Value;
+}
+
+static int CountSetFieldValue(PyStructDefinition* StructDefinition,
+  PyStructField* Field, char* StructData, PyObject* Value)
+{
+  PY_LONG_LONG Start = StatsStart();
+  int Result = SetFieldValue(Field, StructData, Value);
+
+  CountOp(&StructDefinition->Stats, STATS_SET, Result != 0, 
+    FieldSize(Field), 0, Start);
+
+  return Result;
+}
+
+static PyObject* GetNamedFieldValue(PyStructDefinition* StructDefinition,
+  char* StructData, PyStructField* Field)
+{
+  if (StatsMode)
+    return CountGetFieldValue(StructDefinition, Field, StructData);
+
+  return GetFieldValue(Field, StructData);
+}
+
+static int SetChangeableFieldValue(PyStructDefinition* StructDefinition,
+  char* StructData, PyStructField* Field, PyObject* Value)
+{
+  if (Field->Changeable)
+  {
+    if (StatsMode)
+      return CountSetFieldValue(StructDefinition, Field, StructData, Value);
+
+    return SetFieldValue(Field, StructData, Value);
+  }
+  else
+  {
+    PyErr_SetString(StructError, "field is not changeable");
+    return -1;
+  }
+}
+
+static int SetChangeableFieldValueByName(PyStructDefinition* 
+  StructDefinition, char* StructData, PyObject* Name, PyObject* Value)
+{
+  PyStructField* Field = LookupFieldByName(StructDefinition, Name);
+  if (Field == NULL)
+    return -1;
+
+  return SetChangeableFieldValue(StructDefinition, StructData, Field, 
+    Value);
+}
+
+/* Return the named fields and their values as "name: value" lines */
+
+static PyObject* FormatFields(PyStructDefinition* StructDefinition, 
+  char* StructData)
+{
+  PyObject* Lines;
+  PyObject* Separator;
+  PyObject* Result;
+  int i = 0;
+
+  Lines = PyList_New(0);
+  if (Lines == NULL)
+    return NULL;
+
+  while (i < PyList_Size(StructDefinition->FieldList))
+  {
+	  PyStructField* Field = (PyStructField*)
+      PyList_GET_ITEM(StructDefinition->FieldList, i); /* borrowed ref */
+	  PyObject* Value;
+    PyObject* Line;
+
+    i++;
+
+    if (Field->Name == NULL)
+      continue;
+
+	  Value = GetFieldValue(Field, StructData);
+	  if (Value == NULL)
+	    goto fail;
+
+    Line = PyUnicode_FromFormat("%U: %S", Field->Name, Value);
+	  Py_DECREF(Value);
+    if (Line == NULL)
+      goto fail;
+
+    if (PyList_Append(Lines, Line) != 0)
+    {
+      Py_DECREF(Line);
+      goto fail;
+    }
+    Py_DECREF(Line);
+  }
+
+  Separator = PyUnicode_FromString("\n");
+  if (Separator == NULL)
+    goto fail;
+
+  Result = PyUnicode_Join(Separator, Lines);
+  Py_DECREF(Separator);
+  Py_DECREF(Lines);
+  return Result;
+
+fail:
+
+  Py_DECREF(Lines);
+  return NULL;
+}
+
+/* Build the PEP 3118 format string that describes the layout of the
+   struct to buffer consumers such as memoryview and NumPy. Gaps between
+   fields are given as explicit pad bytes. Consumers align '@' items, so
+   if a native field is off its natural alignment (in a packed layout),
+   all native fields are given in standard sizes under '=' instead. */
+
+static char ByteOrderChar(const formatdef* Table)
+{
+  if (Table == native_table)
+    return '@';
+  return Table == lilendian_table ? '<' : '>';
+}
+
+/* The format character of a standard size element with the size and 
+   kind of the native element Format */
+
+static char StandardSizeChar(const formatdef* Format)
+{
+  int Signed = islower(Format->format);
+
+  switch (Format->format)
+  {
+    case 'c':
+    case 's':
+    case 'p':
+      return Format->format;
+    case 'f':
+    case 'd':
+      return Format->size == 4 ? 'f' : 'd';
+  }
+
+  switch (Format->size)
+  {
+    case 1:
+      return Signed ? 'b' : 'B';
+    case 2:
+      return Signed ? 'h' : 'H';
+    case 4:
+      return Signed ? 'i' : 'I';
+    default:
+      return Signed ? 'q' : 'Q';
+  }
+}
+
+static int MakeBufferFormat(PyStructDefinition* StructDefinition)
+{
+  PyObject* FieldList = StructDefinition->FieldList;
+  char Native = '@';
+  char Order;
+  PyObject* Format;
+  int Position = 0;
+  int i;
+
+  for (i = 0; i < PyList_Size(FieldList); i++)
+  {
+    PyStructField* Field = (PyStructField*) PyList_GET_ITEM(FieldList, i);
+
+    if (Field->Table == native_table && Field->Format->alignment > 1 &&
+        Field->Offset % Field->Format->alignment != 0)
+      Native = '=';
+  }
+
+  Order = ByteOrderChar(StructDefinition->FormatTable);
+  if (Order == '@')
+    Order = Native;
+
+  Format = PyBytes_FromFormat("%c", Order);
+
+  for (i = 0; Format != NULL && i <= PyList_Size(StructDefinition->FieldList);
+       i++)
+  {
+    PyStructField* Field = NULL;
+    int Offset = StructDefinition->StructSize;
+    PyObject* Item;
+    char FieldByteOrder;
+
+    if (i < PyList_Size(StructDefinition->FieldList))
+    {
+      Field = (PyStructField*) PyList_GET_ITEM(StructDefinition->FieldList, 
+        i);
+      Offset = Field->Offset;
+    }
+
+    if (Offset > Position)
+    {
+      PyBytes_ConcatAndDel(&Format, 
+        PyBytes_FromFormat("%dx", Offset - Position));
+      if (Format == NULL)
+        return -1;
+    }
+
+    if (Field == NULL)
+      break;
+
+    FieldByteOrder = ByteOrderChar(Field->Table);
+    if (FieldByteOrder == '@')
+      FieldByteOrder = Native;
+
+    if (FieldByteOrder != Order)
+    {
+      Order = FieldByteOrder;
+      PyBytes_ConcatAndDel(&Format, PyBytes_FromFormat("%c", Order));
+      if (Format == NULL)
+        return -1;
+    }
+
+    switch (Field->Format->format)
+    {
+      case 's':
+      case 'p':
+        Item = PyBytes_FromFormat("%d%c", Field->RepeatCount, 
+          Field->Format->format);
+        break;
+      default:
+      {
+        char c = Field->Format->format;
+
+        if (Order == '=')
+          c = StandardSizeChar(Field->Format);
+        else if (c == 'v' || c == 'V') /* held as 8-byte integers */
+          c = c == 'v' ? 'q' : 'Q';
+
+        if (Field->RepeatCount == 1)
+          Item = PyBytes_FromFormat("%c", c);
+        else
+          Item = PyBytes_FromFormat("(%d)%c", Field->RepeatCount, c);
+      }
+    }
+    PyBytes_ConcatAndDel(&Format, Item);
+
+    if (Format != NULL && Field->Name != NULL)
+      PyBytes_ConcatAndDel(&Format, 
+        PyBytes_FromFormat(":%s:", PyUnicode_AsUTF8(Field->Name)));
+
+    Position = Offset + FieldSize(Field);
+  }
+
+  if (Format == NULL)
+    return -1;
+
+  StructDefinition->BufferFormat = Format;
+  return 0;
+}
+
+/* The array interface type string (as used by NumPy) of a single
+   element of Field */
+
+static PyObject* ArrayTypeString(const formatdef* Table, PyStructField* Field)
+{
+  int n = 1;
+  char ByteOrder;
+  char Kind;
+
+  switch (Field->Format->format)
+  {
+    case 'c':
+      return PyUnicode_FromString("|S1");
+    case 's':
+      return PyUnicode_FromFormat("|S%d", Field->RepeatCount);
+    case 'p':
+      return PyUnicode_FromFormat("|V%d", Field->RepeatCount);
+    case 'f':
+    case 'd':
+      Kind = 'f';
+      break;
+    default:
+      Kind = islower(Field->Format->format) ? 'i' : 'u';
+  }
+
+  if (Field->Format->size == 1)
+    ByteOrder = '|';
+  else if (Table == lilendian_table)
+    ByteOrder = '<';
+  else if (Table == bigendian_table)
+    ByteOrder = '>';
+  else
+    ByteOrder = (*(char *) &n == 1) ? '<' : '>';
+
+  return PyUnicode_FromFormat("%c%c%d", ByteOrder, Kind, 
+    Field->Format->size);
+}
+
+/* Build the array interface description of the struct: a list of 
+   (name, typestr[, shape]) tuples in the form of the 'descr' key of
+   NumPy's __array_interface__, so that numpy.dtype(descr) is the 
+   equivalent structured dtype. Like in NumPy's own descriptions, gaps
+   between fields are unnamed void entries. */
+
+static int MakeArrayDescr(PyStructDefinition* StructDefinition)
+{
+  PyObject* Descr = PyList_New(0);
+  int Position = 0;
+  int i;
+
+  if (Descr == NULL)
+    return -1;
+
+  for (i = 0; i <= PyList_Size(StructDefinition->FieldList); i++)
+  {
+    PyStructField* Field = NULL;
+    int Offset = StructDefinition->StructSize;
+    const char* Name = "";
+    PyObject* TypeString;
+    PyObject* Item;
+
+    if (i < PyList_Size(StructDefinition->FieldList))
+    {
+      Field = (PyStructField*) PyList_GET_ITEM(StructDefinition->FieldList, 
+        i);
+      Offset = Field->Offset;
+    }
+
+    if (Offset > Position)
+    {
+      Item = Py_BuildValue("(sN)", "", 
+        PyUnicode_FromFormat("|V%d", Offset - Position));
+      if (Item == NULL || PyList_Append(Descr, Item) != 0)
+      {
+        Py_XDECREF(Item);
+        goto fail;
+      }
+      Py_DECREF(Item);
+    }
+
+    if (Field == NULL)
+      break;
+
+    Position = Offset + FieldSize(Field);
+    if (FieldSize(Field) == 0)
+      continue;
+
+    if (Field->Name != NULL)
+    {
+      Name = PyUnicode_AsUTF8(Field->Name);
+      if (Name == NULL)
+        goto fail;
+    }
+
+    TypeString = ArrayTypeString(Field->Table, Field);
+    if (TypeString == NULL)
+      goto fail;
+
+    if (Field->RepeatCount == 1 || Field->Format->format == 's' || 
+        Field->Format->format == 'p')
+      Item = Py_BuildValue("(sN)", Name, TypeString);
+    else
+      Item = Py_BuildValue("(sN(i))", Name, TypeString, Field->RepeatCount);
+    if (Item == NULL || PyList_Append(Descr, Item) != 0)
+    {
+      Py_XDECREF(Item);
+      goto fail;
+    }
+    Py_DECREF(Item);
+  }
+
+  StructDefinition->ArrayDescr = Descr;
+  return 0;
+
+fail:
+
+  Py_DECREF(Descr);
+  return -1;
+}
+
+/* Build the __array_interface__ dictionary for Count consecutive structs
+   at Data, or for a single (zero-dimensional) struct if Count < 0 */
+
+static PyObject* MakeArrayInterface(PyStructDefinition* StructDefinition,
+  char* Data, Py_ssize_t Count, int ReadOnly)
+{
+  PyObject* Shape;
+  PyObject* Descr;
+
+  if (Count < 0)
+    Shape = PyTuple_New(0);
+  else
+    Shape = Py_BuildValue("(n)", Count);
+
+  Descr = PyList_GetSlice(StructDefinition->ArrayDescr, 0, 
+    PY_SSIZE_T_MAX); /* a copy, the caller may change it */
+
+  return Py_BuildValue("{s:i,s:N,s:N,s:N,s:(NO)}",
+    "version", 3,
+    "shape", Shape,
+    "typestr", PyUnicode_FromFormat("|V%d", StructDefinition->StructSize),
+    "descr", Descr,
+    "data", PyLong_FromVoidPtr(Data), ReadOnly ? Py_True : Py_False);
+}
+
+/* Create a field at the current end of the struct and append it to the
+   field list. The returned field is owned by StructDefinition. */
+
+static PyStructField* AppendField(PyStructDefinition* StructDefinition,
+  const formatdef* Table, const formatdef* Format, int RepeatCount)
+{
+  PyStructField* Field = NewPyStructField();
+  if (Field == NULL)
+    return NULL;
+
+  if (PyList_Append(StructDefinition->FieldList, (PyObject*) Field) != 0)
+  {
+    Py_DECREF(Field);
+    return NULL;
+  }
+
+  /* from now on, Field is owned by StructDefinition */
+
+  Py_DECREF(Field); 
+
+  Field->Changeable = 1;
+  Field->RepeatCount = RepeatCount;
+  Field->Format = Format;
+  Field->Table = Table;
+  Field->Offset = StructDefinition->StructSize;
+
+  return Field;
+}
+
+static ChecksumType* LookupChecksumType(const char* Name)
+{
+  ChecksumType* Type = ChecksumTypes;
+
+  while (Type->Name != NULL && strcmp(Type->Name, Name) != 0)
+    Type++;
+
+  return Type->Name != NULL ? Type : NULL;
+}
+
+/* Add a checksum of the given Kind, stored in Field, to the struct
+   definition. Its range is resolved later by ResolveChecksumRange(). */
+
+static int AddChecksum(PyStructDefinition* StructDefinition, int Kind,
+  PyStructField* Field)
+{
+  ChecksumSpec* Specs;
+  ChecksumSpec* Spec;
+
+  Specs = realloc(StructDefinition->Checksums, 
+    (StructDefinition->ChecksumCount + 1) * sizeof(ChecksumSpec));
+  if (Specs == NULL)
+  {
+    PyErr_NoMemory();
+    return -1;
+  }
+  StructDefinition->Checksums = Specs;
+
+  Spec = &Specs[StructDefinition->ChecksumCount++];
+  Spec->Kind = Kind;
+  Spec->Offset = Field->Offset;
+  Spec->Size = Field->Format->size;
+  if (Kind == CHECKSUM_INET)
+    Spec->BigEndian = 1;
+  else if (Field->Table == native_table)
+    Spec->BigEndian = PY_BIG_ENDIAN;
+  else
+    Spec->BigEndian = (Field->Table == bigendian_table);
+  Spec->Start = 0;
+  Spec->Stop = 0;
+
+  return 0;
+}
+
+/* One end of a checksum range is None (the start or end of the struct),
+   a byte offset (negative ones count from the end of the struct) or the
+   name of a field (the start or end of that field) */
+
+static int ResolveChecksumBound(PyStructDefinition* StructDefinition,
+  PyObject* Bound, int IsStop, int* Result)
+{
+  int Size = StructDefinition->StructSize;
+
+  if (Bound == Py_None)
+    *Result = IsStop ? Size : 0;
+  else if (PyUnicode_Check(Bound))
+  {
+    PyStructField* Field = (PyStructField*) 
+      PyDict_GetItemWithError(StructDefinition->FieldMap, Bound);
+        /* borrowed reference */
+    if (Field == NULL)
+    {
+      if (!PyErr_Occurred())
+        PyErr_Format(StructError, "unknown field '%U' in checksum range",
+          Bound);
+      return -1;
+    }
+
+    *Result = Field->Offset + (IsStop ? FieldSize(Field) : 0);
+  }
+  else
+  {
+    long Offset = PyLong_AsLong(Bound);
+    if (Offset == -1 && PyErr_Occurred())
+      return -1;
+
+    if (Offset < 0)
+      Offset += Size;
+
+    if (Offset < 0 || Offset > Size)
+    {
+      PyErr_SetString(StructError, "checksum range out of struct");
+      return -1;
+    }
+
+    *Result = (int) Offset;
+  }
+
+  return 0;
+}
+
+static int ResolveChecksumRange(PyStructDefinition* StructDefinition,
+  ChecksumSpec* Spec, PyObject* Range)
+{
+  if (Range == Py_None)
+  {
+    Spec->Start = 0;
+    Spec->Stop = StructDefinition->StructSize;
+    return 0;
+  }
+
+  if (!PyTuple_Check(Range) || PyTuple_GET_SIZE(Range) != 2)
+  {
+    PyErr_SetString(StructError, 
+      "checksum range must be a (start, stop) tuple");
+    return -1;
+  }
+
+  if (ResolveChecksumBound(StructDefinition, PyTuple_GET_ITEM(Range, 0), 
+        0, &Spec->Start) != 0 ||
+      ResolveChecksumBound(StructDefinition, PyTuple_GET_ITEM(Range, 1), 
+        1, &Spec->Stop) != 0)
+    return -1;
+
+  if (Spec->Stop < Spec->Start)
+  {
+    PyErr_SetString(StructError, "empty checksum range");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* The key of a struct definition is a sequence of field names. Adjacent
+   key fields are merged into one range. */
+
+static int MakeKeyRanges(PyStructDefinition* StructDefinition, 
+  PyObject* Key)
+{
+  PyObject* Names = PySequence_Fast(Key, "key must be a sequence");
+  Py_ssize_t i;
+
+  if (Names == NULL)
+    return -1;
+
+  StructDefinition->KeyRanges = 
+    malloc((PySequence_Fast_GET_SIZE(Names) + 1) * sizeof(KeyRange));
+  if (StructDefinition->KeyRanges == NULL)
+  {
+    PyErr_NoMemory();
+    goto fail;
+  }
+
+  for (i = 0; i < PySequence_Fast_GET_SIZE(Names); i++)
+  {
+    PyObject* Name = PySequence_Fast_GET_ITEM(Names, i);
+    KeyRange* Last = &StructDefinition->KeyRanges[
+      StructDefinition->KeyRangeCount - 1];
+    PyStructField* Field = NULL;
+
+    if (PyUnicode_Check(Name))
+    {
+      Field = (PyStructField*) 
+        PyDict_GetItemWithError(StructDefinition->FieldMap, Name);
+          /* borrowed reference */
+      if (Field == NULL && PyErr_Occurred())
+        goto fail;
+    }
+
+    if (Field == NULL)
+    {
+      PyErr_Format(StructError, "unknown key field %R", Name);
+      goto fail;
+    }
+
+    if (StructDefinition->KeyRangeCount > 0 && 
+        Last->Offset + Last->Size == Field->Offset)
+      Last->Size += FieldSize(Field);
+    else
+    {
+      Last++;
+      Last->Offset = Field->Offset;
+      Last->Size = FieldSize(Field);
+      StructDefinition->KeyRangeCount++;
+    }
+  }
+
+  Py_DECREF(Names);
+  return 0;
+
+fail:
+
+  Py_DECREF(Names);
+  return -1;
+}
+
+/* forward declarations */
+
+static int UnionCaseSize(PyObject* Options);
+static int CompileUnion(PyStructDefinition* StructDefinition, 
+  PyStructField* Field, PyObject* Options);
+
+/* Field layout. A field type is an optional byte order character (which
+   overrides the one of the struct for the field, as in "<" + 
+   unsigned_int) followed by a format code or a checksum type name. */
+
+static const formatdef* LookupFieldType(const formatdef* StructTable, 
+  const char* FieldType, const formatdef** Table, ChecksumType** Checksum)
+{
+  *Table = StructTable;
+  if (FieldType[0] != '\0' && strchr("@=<>!", FieldType[0]) != NULL)
+    *Table = whichtable(&FieldType);
+
+  *Checksum = LookupChecksumType(FieldType);
+
+  return getentry(*Checksum != NULL ? (*Checksum)->Format : FieldType[0],
+    *Table);
+}
+
+/* The alignment of a Format field (from Table) in a struct laid out by
+   StructTable. In native layouts, a field with a byte order of its own 
+   is aligned like the native type of its code, but not beyond its 
+   (standard) element size. At most Pack when that is not 0. */
+
+static int FieldAlignment(const formatdef* StructTable, 
+  const formatdef* Table, const formatdef* Format, int Pack)
+{
+  int Alignment = 1;
+
+  if (StructTable == native_table)
+  {
+    const formatdef* Native = Format;
+
+    if (Table != native_table)
+    {
+      for (Native = native_table; Native->format != 0 && 
+           Native->format != Format->format; Native++)
+        ;
+    }
+
+    if (Native->alignment > 1)
+      Alignment = Native->alignment;
+    if (Table != native_table && Alignment > Format->size)
+      Alignment = Format->size > 1 ? Format->size : 1;
+  }
+
+  if (Pack != 0 && Alignment > Pack)
+    Alignment = Pack;
+
+  return Alignment;
+}
+
+/* Read the layout option Name ("offset" or "align") of a field from its
+   options dictionary into *Value, if it is there */
+
+static int GetLayoutOption(PyObject* Options, const char* Name, int* Value)
+{
+  PyObject* Item;
+  long x;
+
+  if (Options == NULL || !PyDict_Check(Options))
+    return 0;
+
+  Item = PyDict_GetItemString(Options, Name); /* borrowed reference */
+  if (Item == NULL)
+    return 0;
+
+  x = PyLong_AsLong(Item);
+  if (x == -1 && PyErr_Occurred())
+    return -1;
+  if (x < 0 || x > INT_MAX || 
+      (strcmp(Name, "align") == 0 && (x == 0 || (x & (x - 1)) != 0)))
+  {
+    PyErr_Format(StructError, "invalid field %s %ld", Name, x);
+    return -1;
+  }
+
+  *Value = (int) x;
+  return 0;
+}
+
+typedef struct {
+  int Alignment;
+  Py_ssize_t Index;
+} FieldOrder;
+
+static int CompareFieldOrders(const void* a, const void* b)
+{
+  const FieldOrder* x = a;
+  const FieldOrder* y = b;
+
+  if (x->Alignment != y->Alignment)
+    return x->Alignment > y->Alignment ? -1 : 1;
+  return x->Index < y->Index ? -1 : x->Index > y->Index;
+}
+
+/* Return the field definitions in the order with the least padding: the
+   most aligned first, and otherwise as given (all alignments are powers
+   of two and divide the sizes, so no padding is left between fields).
+   Definitions that do not parse are left to struct_structdef() to
+   report. */
+
+static PyObject* OptimizeFieldOrder(PyObject* FieldDefinitions, 
+  const formatdef* StructTable, int Pack)
+{
+  Py_ssize_t i, Count = PyList_GET_SIZE(FieldDefinitions);
+  FieldOrder* Orders;
+  PyObject* Result = NULL;
+
+  Orders = malloc((Count + 1) * sizeof(FieldOrder));
+  if (Orders == NULL)
+    return PyErr_NoMemory();
+
+  for (i = 0; i < Count; i++)
+  {
+    char* FieldName;
+    char* FieldType;
+    int RepeatCount;
+    PyObject* InitialValue = NULL;
+    int Flags = 0;
+    PyObject* Options = NULL;
+    const formatdef* Table;
+    const formatdef* Format = NULL;
+    ChecksumType* Checksum;
+    int Alignment = 0, Offset = -1;
+
+    if (PyArg_ParseTuple(PyList_GET_ITEM(FieldDefinitions, i), 
+        "z(si)|OiO", &FieldName, &FieldType, &RepeatCount, &InitialValue,
+        &Flags, &Options))
+      Format = LookupFieldType(StructTable, FieldType, &Table, &Checksum);
+    if (Format == NULL)
+      PyErr_Clear();
+
+    if (GetLayoutOption(Options, "offset", &Offset) != 0 ||
+        GetLayoutOption(Options, "align", &Alignment) != 0)
+      PyErr_Clear();
+
+    if (Offset >= 0)
+    {
+      PyErr_SetString(StructError, 
+        "explicit offsets can not be combined with optimize");
+      goto fail;
+    }
+
+    Orders[i].Index = i;
+    Orders[i].Alignment = Format == NULL ? 1 : 
+      FieldAlignment(StructTable, Table, Format, Pack);
+    if (Orders[i].Alignment < Alignment)
+      Orders[i].Alignment = Alignment;
+  }
+
+  qsort(Orders, Count, sizeof(FieldOrder), CompareFieldOrders);
+
+  Result = PyList_New(Count);
+  for (i = 0; Result != NULL && i < Count; i++)
+  {
+    PyObject* FieldDefinition = 
+      PyList_GET_ITEM(FieldDefinitions, Orders[i].Index);
+
+    Py_INCREF(FieldDefinition);
+    PyList_SET_ITEM(Result, i, FieldDefinition);
+  }
+
+fail:
+
+  free(Orders);
+  return Result;
+}
+
+/* forward declarations */
+
+static int SetDefinitionSpec(PyStructDefinition* StructDefinition,
+  PyObject* Spec);
+static int CheckAtomicField(PyStructDefinition* StructDefinition, 
+  PyStructField* Field);
+
+/* structdef(layout, fields[, key[, pack[, optimize]]]): pack caps the
+   alignment of fields as #pragma pack(n) does (1 is packed), optimize 
+   reorders the fields for the least padding, so that positional access
+   (and structdef.fields) follows the new order. As in C, the struct is
+   aligned like its most aligned field (counting "align" options), and 
+   its size is padded to a multiple of that, so that native layouts get
+   the size of their C struct and records of them stay aligned. */
+
+static PyObject* struct_structdef(PyObject* self, PyObject* args, 
+  PyObject* kwds)
+{
+  static char* Keywords[] = { "layout", "fields", "key", "pack", 
+    "optimize", NULL };
+  const char* LayoutSpecifier;
+  PyObject* FieldDefinitions;
+  PyObject* Key = NULL;
+  int Pack = 0;
+  int Optimize = 0;
+  int StructAlignment = 1;
+  PyObject* InitialValues;
+  PyObject* ChecksumRanges;
+  PyObject* Unions = NULL; /* (field, options) of the union fields */
+  PyObject* Spec = NULL;
+
+  PyStructDefinition* StructDefinition;
+  int i;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "sO!|Oip", Keywords, 
+      &LayoutSpecifier, &PyList_Type, &FieldDefinitions, &Key, &Pack, 
+      &Optimize))
+    return NULL;
+
+  if (Pack < 0 || (Pack & (Pack - 1)) != 0)
+  {
+    PyErr_SetString(StructError, "pack must be 0 or a power of two");
+    return NULL;
+  }
+
+  InitialValues = PyList_New(0);
+  if (InitialValues == NULL)
+    return NULL;
+
+  ChecksumRanges = PyList_New(0);
+  if (ChecksumRanges == NULL)
+  {
+    Py_DECREF(InitialValues);
+    return NULL;
+  }
+
+  StructDefinition = NewPyStructDefinition();
+  if (StructDefinition == NULL)
+  {
+    Py_DECREF(InitialValues);
+    Py_DECREF(ChecksumRanges);
+    return NULL;
+  }
+
+  Py_INCREF(FieldDefinitions); /* replaced when optimizing */
+
+  Spec = Py_BuildValue("(sNOiO)", LayoutSpecifier, 
+    PyList_AsTuple(FieldDefinitions), Key != NULL ? Key : Py_None, Pack,
+    Optimize ? Py_True : Py_False);
+  if (Spec == NULL)
+    goto fail;
+
+  Unions = PyList_New(0);
+  if (Unions == NULL)
+    goto fail;
+
+  StructDefinition->FormatTable =	whichtable(&LayoutSpecifier);
+  if (StructDefinition->FormatTable == NULL)
+    goto fail;
+
+  if (Optimize)
+  {
+    PyObject* Optimized = OptimizeFieldOrder(FieldDefinitions, 
+      StructDefinition->FormatTable, Pack);
+    if (Optimized == NULL)
+      goto fail;
+    Py_DECREF(FieldDefinitions);
+    FieldDefinitions = Optimized;
+  }
+
+  StructDefinition->FieldList = PyList_New(0);
+  if (StructDefinition->FieldList == NULL)
+    goto fail;
+
+  StructDefinition->FieldMap = PyDict_New();
+  if (StructDefinition->FieldMap == NULL)
+    goto fail;
+
+  StructDefinition->StructSize = 0;
+
+  i = 0;
+  while (i < PyList_Size(FieldDefinitions))
+  {
+    char* FieldName;
+    char* FieldType;
+    int RepeatCount = 1;
+    PyObject* InitialValue = NULL;
+    int Flags = 0;
+    PyObject* Options = NULL; /* checksum range or constraints */
+    PyObject* ChecksumRange = NULL;
+    PyObject* Constraints = NULL;
+    ChecksumType* Checksum;
+
+    char ch;
+    const formatdef* Table;
+    formatdef* Format;
+    int Offset = -1;
+    int Alignment = 0;
+    int IsUnion;
+
+    int x;
+
+    PyObject* FieldDefinition = PyList_GET_ITEM(FieldDefinitions, i);
+      /* borrowed reference */
+
+    if (!PyArg_ParseTuple(FieldDefinition, "z(si)|OiO", &FieldName,
+        &FieldType, &RepeatCount, &InitialValue, &Flags, &Options))
+      goto fail;
+
+    if (Options != NULL && PyTuple_Check(Options))
+      ChecksumRange = Options;
+    else if (Options != NULL && Options != Py_None)
+      Constraints = Options;
+
+    if (RepeatCount < 0)
+    {
+      PyErr_SetString(StructError, "invalid repeat count");
+      goto fail;
+    }
+
+    /* a union is a string field as far as the layout goes, of the size 
+       of its largest case unless given */
+
+    IsUnion = (strcmp(FieldType, "union") == 0);
+    if (IsUnion)
+    {
+      int Size = UnionCaseSize(Constraints);
+
+      if (Size < 0)
+        goto fail;
+      if (FieldName == NULL)
+      {
+        PyErr_SetString(StructError, "union field must have a name");
+        goto fail;
+      }
+      if (RepeatCount == 0)
+        RepeatCount = Size;
+      else if (RepeatCount < Size)
+      {
+        PyErr_SetString(StructError, 
+          "union field is smaller than its largest case");
+        goto fail;
+      }
+      FieldType = "s";
+    }
+
+    Format = (formatdef*) LookupFieldType(StructDefinition->FormatTable, 
+      FieldType, &Table, &Checksum);
+    if (Format == NULL)
+      goto fail;
+    ch = Format->format;
+
+    if (Checksum != NULL && RepeatCount != 1)
+    {
+      PyErr_SetString(StructError, 
+        "checksum field must have a repeat count of 1");
+      goto fail;
+    }
+    if (Checksum == NULL && ChecksumRange != NULL)
+    {
+      PyErr_SetString(StructError, 
+        "checksum range given to a field that is not a checksum");
+      goto fail;
+    }
+    if (Checksum != NULL && (Flags & FLAG_ATOMIC))
+    {
+      PyErr_SetString(StructError, "checksum field can not be atomic");
+      goto fail;
+    }
+
+    /* an explicit offset places the field at or after the end of the 
+       previous one, else it is aligned: naturally in native layouts (at 
+       most to pack), and at least to its "align" option */
+
+    if (GetLayoutOption(Constraints, "offset", &Offset) != 0 ||
+        GetLayoutOption(Constraints, "align", &Alignment) != 0)
+      goto fail;
+
+    if (Alignment < FieldAlignment(StructDefinition->FormatTable, Table,
+        Format, Pack))
+      Alignment = FieldAlignment(StructDefinition->FormatTable, Table, 
+        Format, Pack);
+    if (StructAlignment < Alignment)
+      StructAlignment = Alignment;
+
+    if (Offset >= 0)
+    {
+      if (Offset < StructDefinition->StructSize)
+      {
+        PyErr_Format(StructError, 
+          "field offset %d overlaps the previous field", Offset);
+        goto fail;
+      }
+      StructDefinition->StructSize = Offset;
+    }
+    else
+    {
+      if (StructDefinition->StructSize > INT_MAX - Alignment)
+      {
+        PyErr_SetString(StructError, "struct size overflow");
+        goto fail;
+      }
+      StructDefinition->StructSize = (StructDefinition->StructSize + 
+        Alignment - 1) / Alignment * Alignment;
+    }
+
+    if ((ch != 'x') && ((RepeatCount != 0) || (ch == 's'))) 
+    {
+      PyStructField* Field = AppendField(StructDefinition, Table, Format, 
+        RepeatCount);
+      if (Field == NULL)
+        goto fail;
+
+      if (FieldName != NULL) 
+      {
+        PyObject* CurrentField = PyDict_GetItemString(
+          StructDefinition->FieldMap, FieldName); /* borrowed ref */
+        if (PyErr_Occurred())
+          goto fail;
+
+        if (CurrentField != NULL)
+        {
+          PyErr_SetString(StructError, "duplicate field name");
+          goto fail;
+        }
+
+        Field->Name = PyUnicode_InternFromString(FieldName);
+        if (Field->Name == NULL)
+          goto fail;
+
+        if (PyDict_SetItem(StructDefinition->FieldMap, Field->Name, 
+            (PyObject*) Field) != 0)
+          goto fail;
+      }
+
+      Field->Changeable = !(Flags & FLAG_READONLY);
+      Field->Raw = (Flags & FLAG_RAW) != 0;
+      Field->Atomic = (Flags & FLAG_ATOMIC) != 0;
+
+      if (IsUnion)
+      {
+        PyObject* Union = Py_BuildValue("(OO)", Field, Constraints);
+
+        if (Union == NULL || PyList_Append(Unions, Union) != 0)
+        {
+          Py_XDECREF(Union);
+          goto fail;
+        }
+        Py_DECREF(Union);
+      }
+
+      if (Checksum != NULL)
+      {
+        if (AddChecksum(StructDefinition, Checksum->Kind, Field) != 0 ||
+            PyList_Append(ChecksumRanges, 
+              ChecksumRange != NULL ? ChecksumRange : Py_None) != 0)
+          goto fail;
+      }
+
+      if (Constraints != NULL)
+      {
+        if (CompileConstraints(&StructDefinition->Checks, 
+            &StructDefinition->CheckCount, Field, Field->Table, 
+            Constraints) != 0)
+          goto fail;
+
+        /* a fixed value is also the initial one, unless given */
+
+        if (InitialValue == NULL || InitialValue == Py_None)
+          InitialValue = PyDict_GetItemString(Constraints, "value");
+      }
+
+      if (InitialValue == NULL)
+        InitialValue = Py_None;
+
+      if (PyList_Append(InitialValues, InitialValue) != 0)
+        goto fail;
+    }
+    else /* other combinations do not count as fields */
+    {
+      if (Constraints != NULL)
+      {
+        PyErr_SetString(StructError, "constraints given to num/format "
+          "combination that does not count as a field");
+        goto fail;
+      }
+
+      if (FieldName != NULL)
+      {
+        PyErr_SetString(StructError, "field name given to num/format "
+          "combination that does not count as a field");
+        goto fail;
+      }
+    }
+
+    x = RepeatCount * Format->size;
+	  if (x/Format->size != RepeatCount)
+    {
+	    PyErr_SetString(StructError, "field size overflow");
+		  goto fail;
+	  }
+
+    StructDefinition->StructSize += x;
+    if (StructDefinition->StructSize < 0)
+    {
+	    PyErr_SetString(StructError, "struct size overflow");
+		  goto fail;
+	  }
+
+    i++;
+  }
+
+  /* trailing padding up to the alignment of the struct */
+
+  if (StructDefinition->StructSize > INT_MAX - StructAlignment)
+  {
+    PyErr_SetString(StructError, "struct size overflow");
+    goto fail;
+  }
+  StructDefinition->StructSize = (StructDefinition->StructSize + 
+    StructAlignment - 1) / StructAlignment * StructAlignment;
+
+  if (StructDefinition->StructSize == 0)
+  {
+    PyErr_SetString(StructError, "zero struct size");
+	  goto fail;
+  }
+
+  StructDefinition->InitialStructData = malloc(StructDefinition->StructSize);
+  if (StructDefinition->InitialStructData == NULL)
+  {
+    PyErr_NoMemory();
+    goto fail;
+  }
+
+  memset(StructDefinition->InitialStructData, '\0', StructDefinition->StructSize);
+
+  i = 0;
+  while (i < PyList_Size(InitialValues))
+  {
+    PyObject* InitialValue = PyList_GetItem(InitialValues, i);
+      /* borrowed reference */
+    if (InitialValue == NULL)
+      goto fail;
+
+    if (InitialValue != Py_None)
+    {
+      PyStructField* Field = 
+        (PyStructField*) PyList_GetItem(StructDefinition->FieldList, i);
+          /* borrowed reference */
+
+      if (Field == NULL)
+        goto fail;
+
+      if (SetFieldValue(Field, StructDefinition->InitialStructData, 
+          InitialValue) != 0)
+        goto fail;
+    }
+
+    i++;
+  }
+
+  i = 0;
+  while (i < StructDefinition->ChecksumCount)
+  {
+    if (ResolveChecksumRange(StructDefinition, 
+        &StructDefinition->Checksums[i], 
+        PyList_GET_ITEM(ChecksumRanges, i)) != 0)
+      goto fail;
+
+    i++;
+  }
+
+  SealChecksums(StructDefinition->Checksums, 
+    StructDefinition->ChecksumCount, StructDefinition->InitialStructData);
+
+  for (i = 0; i < PyList_GET_SIZE(Unions); i++)
+  {
+    PyObject* Union = PyList_GET_ITEM(Unions, i);
+
+    if (CompileUnion(StructDefinition, (PyStructField*) 
+        PyTuple_GET_ITEM(Union, 0), PyTuple_GET_ITEM(Union, 1)) != 0)
+      goto fail;
+  }
+
+  for (i = 0; i < PyList_GET_SIZE(StructDefinition->FieldList); i++)
+  {
+    PyStructField* Field = (PyStructField*) 
+      PyList_GET_ITEM(StructDefinition->FieldList, i);
+
+    if (Field->Atomic && CheckAtomicField(StructDefinition, Field) != 0)
+      goto fail;
+  }
+
+  if (Key != NULL && Key != Py_None && 
+      MakeKeyRanges(StructDefinition, Key) != 0)
+    goto fail;
+
+  if (MakeBufferFormat(StructDefinition) != 0 ||
+      MakeArrayDescr(StructDefinition) != 0)
+    goto fail;
+
+  if (SetDefinitionSpec(StructDefinition, Spec) != 0)
+    goto fail;
+
+  Py_DECREF(FieldDefinitions);
+  Py_DECREF(InitialValues);
+  Py_DECREF(ChecksumRanges);
+  Py_DECREF(Unions);
+  Py_DECREF(Spec);
+  return (PyObject*) StructDefinition;
+
+fail:
+
+  Py_DECREF(StructDefinition);
+  Py_DECREF(FieldDefinitions);
+  Py_DECREF(InitialValues);
+  Py_DECREF(ChecksumRanges);
+  Py_XDECREF(Unions);
+  Py_XDECREF(Spec);
+  return NULL;
+}
+
+/*------------------*/
+/* Compiled formats */
+/*------------------*/
+
+/*
+A format string can be compiled into an (anonymous) struct definition,
+so that code written against struct definitions also works for format
+strings. Like unpack(), it has one field per value: 's' and 'p' items
+are a single field, all other items are 'num' fields of one element.
+Compiled formats are cached by format string.
+*/
+
+#define MAXFORMATCACHE 100
+
+static PyObject* FormatCache = NULL;
+
+static PyStructDefinition* CompileFormat(const char* fmt)
+{
+  PyStructDefinition* StructDefinition;
+  const formatdef* Format;
+  const char* s;
+  char c;
+  int num, x;
+
+  StructDefinition = NewPyStructDefinition();
+  if (StructDefinition == NULL)
+    return NULL;
+
+  StructDefinition->FormatTable = whichtable(&fmt);
+
+  StructDefinition->FieldList = PyList_New(0);
+  if (StructDefinition->FieldList == NULL)
+    goto fail;
+
+  StructDefinition->FieldMap = PyDict_New();
+  if (StructDefinition->FieldMap == NULL)
+    goto fail;
+
+  StructDefinition->StructSize = calcsize(fmt, 
+    StructDefinition->FormatTable, NULL, NULL); /* validates the format */
+  if (StructDefinition->StructSize < 0)
+    goto fail;
+
+  if (StructDefinition->StructSize == 0)
+  {
+    PyErr_SetString(StructError, "zero struct size");
+    goto fail;
+  }
+
+  StructDefinition->StructSize = 0;
+
+  s = fmt;
+  while ((c = *s++) != '\0') 
+  {
+    if (isspace((int)c))
+      continue;
+    if ('0' <= c && c <= '9') 
+    {
+      num = c - '0';
+      while ('0' <= (c = *s++) && c <= '9')
+        num = num*10 + (c - '0');
+      if (c == '\0')
+        break;
+    }
+    else
+      num = 1;
+
+    Format = getentry(c, StructDefinition->FormatTable);
+    StructDefinition->StructSize = align(StructDefinition->StructSize, c, 
+      Format);
+
+    if (c == 's' || (c == 'p' && num != 0))
+    {
+      if (AppendField(StructDefinition, StructDefinition->FormatTable, 
+          Format, num) == NULL)
+        goto fail;
+      StructDefinition->StructSize += num;
+    }
+    else if (c == 'x' || c == 'p')
+      StructDefinition->StructSize += num;
+    else
+    {
+      for (x = 0; x < num; x++)
+      {
+        if (AppendField(StructDefinition, StructDefinition->FormatTable, 
+            Format, 1) == NULL)
+          goto fail;
+        StructDefinition->StructSize += Format->size;
+      }
+    }
+  }
+
+  StructDefinition->InitialStructData = malloc(StructDefinition->StructSize);
+  if (StructDefinition->InitialStructData == NULL)
+  {
+    PyErr_NoMemory();
+    goto fail;
+  }
+
+  memset(StructDefinition->InitialStructData, '\0', 
+    StructDefinition->StructSize);
+
+  if (MakeBufferFormat(StructDefinition) != 0 ||
+      MakeArrayDescr(StructDefinition) != 0)
+    goto fail;
+
+  return StructDefinition;
+
+fail:
+
+  Py_DECREF(StructDefinition);
+  return NULL;
+}
+
+/* Return a new reference to the compiled form of format string Format */
+
+static PyStructDefinition* GetCompiledFormat(PyObject* Format)
+{
+  PyStructDefinition* StructDefinition;
+  const char* fmt = get_format(Format);
+
+  if (fmt == NULL)
+    return NULL;
+
+  if (FormatCache == NULL)
+  {
+    FormatCache = PyDict_New();
+    if (FormatCache == NULL)
+      return NULL;
+  }
+
+  StructDefinition = (PyStructDefinition*) 
+    PyDict_GetItem(FormatCache, Format); /* borrowed reference */
+  if (StructDefinition != NULL)
+  {
+    Py_INCREF(StructDefinition);
+    return StructDefinition;
+  }
+
+  StructDefinition = CompileFormat(fmt);
+  if (StructDefinition == NULL)
+    return NULL;
+
+  StructDefinition->Spec = Format; /* interned by the cache */
+  Py_INCREF(Format);
+
+  if (PyDict_Size(FormatCache) >= MAXFORMATCACHE)
+    PyDict_Clear(FormatCache);
+
+  if (PyDict_SetItem(FormatCache, Format, (PyObject*) StructDefinition) != 0)
+  {
+    Py_DECREF(StructDefinition);
+    return NULL;
+  }
+
+  return StructDefinition;
+}
+
+/*-----------------*/
+/* JIT compilation */
+/*-----------------*/
+
+/*
+When JitThreshold is not 0, pack() and unpack() count the calls per
+(compiled) format. After JitThreshold calls, straight-line C code is
+generated for the format, with constant offsets and inlined byte swaps,
+and compiled with the system C compiler into a shared object. The
+shared object is cached on disk under the hash of its source, so a
+layout is only compiled once per machine. From then on, the values are
+converted between the record and an array of JitValues by the compiled
+kernel; the interpreter only creates or reads the Python objects.
+
+Values the kernel does not handle ('c', 's', 'p' and 'P', and 'f' 
+packing in the standard formats, which rounds differently from the C
+compiler) go through the table driven code, as do non-finite standard
+floats, whose handling must not change. If the kernel can't be built,
+for instance because there is no compiler, the format stays on the 
+interpreter. So do calls that fail: they are redone by do_pack() or
+do_unpack(), which raise the usual error.
+*/
+
+#if defined(HAVE_DLOPEN) && defined(HAVE_DLFCN_H)
+#define WITH_JIT
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifndef O_NOFOLLOW
+#define O_NOFOLLOW 0
+#endif
+#endif
+
+#define JIT_STACK_VALUES 32 /* values converted without a malloc */
+
+typedef union {
+  PY_LONG_LONG i;
+  unsigned PY_LONG_LONG u;
+  double d;
+} JitValue;
+
+typedef void (*JitDecodeFunction)(const char*, JitValue*);
+typedef void (*JitEncodeFunction)(char*, const JitValue*);
+
+struct _JitKernel {
+  void* Library;
+  JitDecodeFunction Decode;
+  JitEncodeFunction Encode;
+  int ValueCount;
+  char* DecodeKinds; /* per value, see JitKind() */
+  char* EncodeKinds;
+};
+
+static void FreeJitKernel(JitKernel* Kernel)
+{
+#ifdef WITH_JIT
+  if (Kernel->Library != NULL)
+    dlclose(Kernel->Library);
+#endif
+  free(Kernel->DecodeKinds);
+  free(Kernel->EncodeKinds);
+  free(Kernel);
+}
+
+/* How the value of Field is converted by the kernel: 'i' (signed), 'u'
+   (unsigned), 'd' (double), 'D' (double, if finite and, when packing,
+   not -0.0, which the standard formats pack as 0.0) or 'g' (not, it
+   goes through the format table). Integer packing follows the format 
+   tables in using get_long() or get_ulong(). */
+
+static char JitKind(const formatdef* Table, PyStructField* Field, 
+  int Encode)
+{
+  char c = Field->Format->format;
+
+  if (Field->RepeatCount != 1 || strchr("cspPvV", c) != NULL)
+    return 'g';
+
+  if (c == 'f' || c == 'd')
+  {
+    if (Table == native_table)
+      return 'd';
+    return (Encode && c == 'f') ? 'g' : 'D';
+  }
+
+  if (!Encode)
+    return islower(c) ? 'i' : 'u';
+
+  if (Table == native_table)
+    return (c == 'I' || c == 'L') ? 'u' : 'i';
+  return (c == 'H' || c == 'I' || c == 'L') ? 'u' : 'i';
+}
+
+static const char* JitNativeType(char c)
+{
+  switch (c)
+  {
+    case 'b': return "signed char";
+    case 'B': return "unsigned char";
+    case 'h': return "short";
+    case 'H': return "unsigned short";
+    case 'i': return "int";
+    case 'I': return "unsigned int";
+    case 'l': return "long";
+    case 'L': return "unsigned long";
+    case 'f': return "float";
+    default: return "double";
+  }
+}
+
+/* The C expression that assembles the Size bytes at Offset of a 
+   standard format record into an unsigned integer */
+
+static PyObject* JitLoadBytes(int Offset, int Size, int BigEndian)
+{
+  PyObject* Expression = PyBytes_FromString("(");
+  int k;
+
+  for (k = 0; Expression != NULL && k < Size; k++)
+    PyBytes_ConcatAndDel(&Expression, PyBytes_FromFormat(
+      "%s(unsigned long long) p[%d] << %d", k == 0 ? "" : " | ", 
+      Offset + k, 8 * (BigEndian ? Size - 1 - k : k)));
+
+  if (Expression != NULL)
+    PyBytes_ConcatAndDel(&Expression, PyBytes_FromString(")"));
+  return Expression;
+}
+
+/* The C statements that store the unsigned integer x into the Size 
+   bytes at Offset of a standard format record */
+
+static PyObject* JitStoreBytes(int Offset, int Size, int BigEndian)
+{
+  PyObject* Statements = PyBytes_FromString("");
+  int k;
+
+  for (k = 0; Statements != NULL && k < Size; k++)
+    PyBytes_ConcatAndDel(&Statements, PyBytes_FromFormat(
+      " p[%d] = (unsigned char) (x >> %d);", Offset + k, 
+      8 * (BigEndian ? Size - 1 - k : k)));
+
+  return Statements;
+}
+
+/* Generate the C source of the kernel for StructDefinition */
+
+static PyObject* JitSource(PyStructDefinition* StructDefinition,
+  JitKernel* Kernel)
+{
+  const formatdef* Table = StructDefinition->FormatTable;
+  int BigEndian = (Table == bigendian_table);
+  PyObject* Decode;
+  PyObject* Encode;
+  int i;
+
+  Decode = PyBytes_FromString(
+    "/* generated by xstruct, do not edit */\n"
+    "#include <string.h>\n"
+    "typedef union { long long i; unsigned long long u; double d; } "
+      "xs_value;\n"
+    "void xs_decode(const unsigned char* p, xs_value* v)\n{\n");
+  Encode = PyBytes_FromString(
+    "}\n"
+    "void xs_encode(unsigned char* p, const xs_value* v)\n{\n");
+
+  for (i = 0; i < Kernel->ValueCount && Decode != NULL && Encode != NULL; 
+       i++)
+  {
+    PyStructField* Field = (PyStructField*) 
+      PyList_GET_ITEM(StructDefinition->FieldList, i);
+    char c = Field->Format->format;
+    int Offset = Field->Offset;
+    int Size = Field->Format->size;
+    char DecodeKind = Kernel->DecodeKinds[i];
+    char EncodeKind = Kernel->EncodeKinds[i];
+    const char* Member = DecodeKind == 'i' ? "i" : 
+      DecodeKind == 'u' ? "u" : "d";
+
+    if (Table == native_table)
+    {
+      const char* Type = JitNativeType(c);
+
+      if (DecodeKind != 'g')
+        PyBytes_ConcatAndDel(&Decode, PyBytes_FromFormat(
+          "  { %s x; memcpy(&x, p + %d, sizeof x); v[%d].%s = x; }\n",
+          Type, Offset, i, Member));
+      if (EncodeKind != 'g')
+        PyBytes_ConcatAndDel(&Encode, PyBytes_FromFormat(
+          "  { %s x = (%s) v[%d].%s; memcpy(p + %d, &x, sizeof x); }\n",
+          Type, Type, i, EncodeKind == 'i' ? "i" : 
+          EncodeKind == 'u' ? "u" : "d", Offset));
+      continue;
+    }
+
+    if (DecodeKind != 'g')
+    {
+      PyObject* Load = JitLoadBytes(Offset, Size, BigEndian);
+      if (Load == NULL)
+        goto fail;
+
+      if (c == 'f')
+        PyBytes_ConcatAndDel(&Decode, PyBytes_FromFormat(
+          "  { unsigned int x = %s; float f; memcpy(&f, &x, 4); "
+          "v[%d].d = f; }\n", PyBytes_AS_STRING(Load), i));
+      else if (c == 'd')
+        PyBytes_ConcatAndDel(&Decode, PyBytes_FromFormat(
+          "  { unsigned long long x = %s; memcpy(&v[%d].d, &x, 8); }\n",
+          PyBytes_AS_STRING(Load), i));
+      else if (DecodeKind == 'i')
+        PyBytes_ConcatAndDel(&Decode, PyBytes_FromFormat(
+          "  v[%d].i = (%s) %s;\n", i, 
+          Size == 1 ? "signed char" : Size == 2 ? "short" : "int",
+          PyBytes_AS_STRING(Load)));
+      else
+        PyBytes_ConcatAndDel(&Decode, PyBytes_FromFormat(
+          "  v[%d].u = %s;\n", i, PyBytes_AS_STRING(Load)));
+      Py_DECREF(Load);
+    }
+
+    if (EncodeKind != 'g')
+    {
+      PyObject* Store = JitStoreBytes(Offset, Size, BigEndian);
+      if (Store == NULL)
+        goto fail;
+
+      if (c == 'd')
+        PyBytes_ConcatAndDel(&Encode, PyBytes_FromFormat(
+          "  { unsigned long long x; memcpy(&x, &v[%d].d, 8);%s }\n",
+          i, PyBytes_AS_STRING(Store)));
+      else
+        PyBytes_ConcatAndDel(&Encode, PyBytes_FromFormat(
+          "  { unsigned long long x = v[%d].u;%s }\n",
+          i, PyBytes_AS_STRING(Store)));
+      Py_DECREF(Store);
+    }
+  }
+
+  if (Decode == NULL || Encode == NULL)
+    goto fail;
+
+  PyBytes_ConcatAndDel(&Decode, Encode);
+  Encode = NULL;
+  if (Decode != NULL)
+    PyBytes_ConcatAndDel(&Decode, PyBytes_FromString("}\n"));
+  return Decode;
+
+fail:
+
+  Py_XDECREF(Decode);
+  Py_XDECREF(Encode);
+  return NULL;
+}
+
+#ifdef WITH_JIT
+
+/* Whether Name is a Type (S_IFDIR or S_IFREG) entry of ours with none
+   of the permission bits in Denied. Symbolic links are not followed. */
+
+static int IsPrivateEntry(const char* Name, mode_t Type, mode_t Denied)
+{
+  struct stat Status;
+
+  return lstat(Name, &Status) == 0 && (Status.st_mode & S_IFMT) == Type &&
+    Status.st_uid == getuid() && (Status.st_mode & Denied) == 0;
+}
+
+/* The directory compiled kernels are cached in, or NULL if it is not
+   private to the user: a shared object someone else could put there
+   would be loaded into the process. */
+
+static const char* JitDirectory(void)
+{
+  static char Directory[1024];
+  static int Checked = 0;
+  const char* Base;
+
+  if (Checked)
+    return Directory[0] != '\0' ? Directory : NULL;
+  Checked = 1;
+
+  Base = getenv("XSTRUCT_JIT_DIR");
+  if (Base != NULL && Base[0] != '\0')
+    snprintf(Directory, sizeof(Directory), "%s", Base);
+  else
+  {
+    Base = getenv("TMPDIR");
+    snprintf(Directory, sizeof(Directory), "%s/xstruct-jit-%ld", 
+      (Base != NULL && Base[0] != '\0') ? Base : "/tmp", (long) getuid());
+  }
+
+  mkdir(Directory, 0700);
+
+  if (strchr(Directory, '\'') != NULL || 
+      !IsPrivateEntry(Directory, S_IFDIR, S_IRWXG | S_IRWXO))
+  {
+    Directory[0] = '\0';
+    return NULL;
+  }
+
+  return Directory;
+}
+
+/* Create Name for writing, failing if it is there already or is a 
+   symbolic link */
+
+static FILE* CreateJitFile(const char* Name)
+{
+  int Handle = open(Name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+  FILE* File;
+
+  if (Handle < 0)
+    return NULL;
+  File = fdopen(Handle, "w");
+  if (File == NULL)
+    close(Handle);
+  return File;
+}
+
+/* Compile Source into the shared object Library, unless it exists */
+
+static int JitCompile(const char* Source, const char* Library)
+{
+  const char* Compiler;
+  char SourceName[1200];
+  char TempName[1200];
+  char Command[4096];
+  FILE* File;
+  int Status;
+
+  if (IsPrivateEntry(Library, S_IFREG, S_IWGRP | S_IWOTH))
+    return 0;
+
+  Compiler = getenv("XSTRUCT_JIT_CC");
+  if (Compiler == NULL || Compiler[0] == '\0')
+    Compiler = getenv("CC");
+  if (Compiler == NULL || Compiler[0] == '\0')
+    Compiler = "cc";
+
+  /* build under temporary names, so that other processes never see a 
+     partial file */
+
+  snprintf(SourceName, sizeof(SourceName), "%s.%ld.c", Library, 
+    (long) getpid());
+  snprintf(TempName, sizeof(TempName), "%s.%ld.tmp", Library, 
+    (long) getpid());
+  if (snprintf(Command, sizeof(Command), 
+      "%s -O2 -shared -fPIC -o '%s' '%s' >/dev/null 2>&1", Compiler, 
+      TempName, SourceName) >= (int) sizeof(Command))
+    return -1;
+
+  /* leftovers of a process that had our pid are removed, but nothing 
+     is written through a name someone else could have created */
+
+  remove(SourceName);
+  remove(TempName);
+  File = CreateJitFile(SourceName);
+  if (File == NULL)
+    return -1;
+  Status = (fputs(Source, File) < 0);
+  Status |= (fclose(File) != 0);
+
+  if (Status == 0)
+  {
+    Py_BEGIN_ALLOW_THREADS
+    Status = system(Command);
+    Py_END_ALLOW_THREADS
+  }
+
+  remove(SourceName);
+
+  if (Status == 0 && rename(TempName, Library) == 0)
+    return 0;
+
+  remove(TempName);
+  return -1;
+}
+
+#endif /* WITH_JIT */
+
+/* Build the kernel for StructDefinition. Returns NULL, without an 
+   exception, if there is none. */
+
+static JitKernel* NewJitKernel(PyStructDefinition* StructDefinition)
+{
+#ifdef WITH_JIT
+  JitKernel* Kernel;
+  PyObject* Source = NULL;
+  unsigned PY_LONG_LONG Hash = 14695981039346656037ULL; /* FNV-1a */
+  const char* Directory = JitDirectory();
+  char Library[1100];
+  const unsigned char* s;
+  int Useful = 0;
+  int i;
+
+  if (Directory == NULL)
+    return NULL;
+
+  Kernel = calloc(1, sizeof(JitKernel));
+  if (Kernel == NULL)
+    return NULL;
+
+  Kernel->ValueCount = (int) PyList_GET_SIZE(StructDefinition->FieldList);
+  Kernel->DecodeKinds = malloc(Kernel->ValueCount + 1);
+  Kernel->EncodeKinds = malloc(Kernel->ValueCount + 1);
+  if (Kernel->DecodeKinds == NULL || Kernel->EncodeKinds == NULL)
+    goto fail;
+
+  for (i = 0; i < Kernel->ValueCount; i++)
+  {
+    PyStructField* Field = (PyStructField*) 
+      PyList_GET_ITEM(StructDefinition->FieldList, i);
+    Kernel->DecodeKinds[i] = JitKind(StructDefinition->FormatTable, 
+      Field, 0);
+    Kernel->EncodeKinds[i] = JitKind(StructDefinition->FormatTable, 
+      Field, 1);
+    Useful |= (Kernel->DecodeKinds[i] != 'g');
+  }
+
+  if (!Useful)
+    goto fail;
+
+  Source = JitSource(StructDefinition, Kernel);
+  if (Source == NULL)
+    goto fail;
+
+  for (s = (const unsigned char*) PyBytes_AS_STRING(Source); *s; s++)
+    Hash = (Hash ^ *s) * 1099511628211ULL;
+
+  snprintf(Library, sizeof(Library), "%s/xs%016llx.so", Directory, Hash);
+
+  if (JitCompile(PyBytes_AS_STRING(Source), Library) != 0)
+    goto fail;
+
+  Kernel->Library = dlopen(Library, RTLD_NOW | RTLD_LOCAL);
+  if (Kernel->Library == NULL)
+    goto fail;
+
+  Kernel->Decode = (JitDecodeFunction) dlsym(Kernel->Library, "xs_decode");
+  Kernel->Encode = (JitEncodeFunction) dlsym(Kernel->Library, "xs_encode");
+  if (Kernel->Decode == NULL || Kernel->Encode == NULL)
+    goto fail;
+
+  Py_DECREF(Source);
+  return Kernel;
+
+fail:
+
+  PyErr_Clear();
+  Py_XDECREF(Source);
+  FreeJitKernel(Kernel);
+#endif
+  return NULL;
+}
+
+/* Return the kernel of StructDefinition once it is hot, or NULL */
+
+static JitKernel* GetJitKernel(PyStructDefinition* StructDefinition)
+{
+  if (StructDefinition->Jit != NULL)
+    return StructDefinition->Jit;
+
+  if (StructDefinition->JitCalls < 0) /* no kernel, or being built */
+    return NULL;
+
+  if (++StructDefinition->JitCalls < JitThreshold)
+    return NULL;
+
+  StructDefinition->JitCalls = -1;
+  StructDefinition->Jit = NewJitKernel(StructDefinition);
+  return StructDefinition->Jit;
+}
+
+static PyObject* JitUnpack(PyObject *const *args, Py_ssize_t nargs)
+{
+  PyStructDefinition* StructDefinition;
+  JitKernel* Kernel;
+  JitValue Stack[JIT_STACK_VALUES];
+  JitValue* Values = Stack;
+  PyObject* Result = NULL;
+  Py_buffer View;
+  int i;
+
+  if (nargs != 2)
+    return do_unpack(args, nargs);
+
+  StructDefinition = GetCompiledFormat(args[0]);
+  if (StructDefinition == NULL)
+  {
+    PyErr_Clear();
+    return do_unpack(args, nargs);
+  }
+
+  Kernel = GetJitKernel(StructDefinition);
+  if (Kernel == NULL)
+  {
+    Py_DECREF(StructDefinition);
+    return do_unpack(args, nargs);
+  }
+
+  if (PyObject_GetBuffer(args[1], &View, PyBUF_SIMPLE) != 0)
+  {
+    Py_DECREF(StructDefinition);
+    return NULL;
+  }
+
+  if (View.len != StructDefinition->StructSize)
+    goto fallback;
+
+  if (Kernel->ValueCount > JIT_STACK_VALUES)
+  {
+    Values = malloc(Kernel->ValueCount * sizeof(JitValue));
+    if (Values == NULL)
+    {
+      PyErr_NoMemory();
+      goto done;
+    }
+  }
+
+  Kernel->Decode(View.buf, Values);
+
+  Result = PyTuple_New(Kernel->ValueCount);
+  if (Result == NULL)
+    goto done;
+
+  for (i = 0; i < Kernel->ValueCount; i++)
+  {
+    PyObject* Value;
+
+    switch (Kernel->DecodeKinds[i])
+    {
+      case 'i':
+        Value = PyLong_FromLongLong(Values[i].i);
+        break;
+      case 'u':
+        Value = PyLong_FromUnsignedLongLong(Values[i].u);
+        break;
+      case 'D':
+        if (!Py_IS_FINITE(Values[i].d))
+          goto fallback;
+        /* fall through */
+      case 'd':
+        Value = PyFloat_FromDouble(Values[i].d);
+        break;
+      default:
+        Value = GetFieldValue((PyStructField*) 
+          PyList_GET_ITEM(StructDefinition->FieldList, i), View.buf);
+    }
+
+    if (Value == NULL)
+      goto fallback;
+    PyTuple_SET_ITEM(Result, i, Value); /* steals the reference */
+  }
+
+done:
+
+  if (Values != Stack)
+    free(Values);
+  PyBuffer_Release(&View);
+  Py_DECREF(StructDefinition);
+  return Result;
+
+fallback:
+
+  PyErr_Clear();
+  Py_CLEAR(Result);
+  if (Values != Stack)
+    free(Values);
+  PyBuffer_Release(&View);
+  Py_DECREF(StructDefinition);
+  return do_unpack(args, nargs);
+}
+
+static PyObject* JitPack(PyObject *const *args, Py_ssize_t nargs)
+{
+  PyStructDefinition* StructDefinition;
+  JitKernel* Kernel;
+  JitValue Stack[JIT_STACK_VALUES];
+  JitValue* Values = Stack;
+  PyObject* Result = NULL;
+  char* Data;
+  int i;
+
+  if (nargs < 1)
+    return do_pack(args, nargs);
+
+  StructDefinition = GetCompiledFormat(args[0]);
+  if (StructDefinition == NULL)
+  {
+    PyErr_Clear();
+    return do_pack(args, nargs);
+  }
+
+  Kernel = GetJitKernel(StructDefinition);
+  if (Kernel == NULL || nargs - 1 != Kernel->ValueCount)
+    goto fallback;
+
+  if (Kernel->ValueCount > JIT_STACK_VALUES)
+  {
+    Values = malloc(Kernel->ValueCount * sizeof(JitValue));
+    if (Values == NULL)
+      goto fallback;
+  }
+
+  Result = PyBytes_FromStringAndSize(StructDefinition->InitialStructData,
+    StructDefinition->StructSize); /* zeroes the pad bytes */
+  if (Result == NULL)
+    goto fallback;
+  Data = PyBytes_AS_STRING(Result);
+
+  for (i = 0; i < Kernel->ValueCount; i++)
+  {
+    PyObject* v = args[i + 1];
+
+    switch (Kernel->EncodeKinds[i])
+    {
+      case 'i':
+      {
+        long x;
+        if (get_long(v, &x) < 0)
+          goto fallback;
+        Values[i].i = x;
+        break;
+      }
+      case 'u':
+      {
+        unsigned long x;
+        if (get_ulong(v, &x) < 0)
+          goto fallback;
+        Values[i].u = x;
+        break;
+      }
+      case 'D':
+      case 'd':
+        Values[i].d = PyFloat_AsDouble(v);
+        if ((Values[i].d == -1 && PyErr_Occurred()) ||
+            (Kernel->EncodeKinds[i] == 'D' && (!Py_IS_FINITE(Values[i].d) ||
+             (Values[i].d == 0 && copysign(1, Values[i].d) < 0))))
+          goto fallback;
+        break;
+      default:
+        if (SetFieldValue((PyStructField*) 
+            PyList_GET_ITEM(StructDefinition->FieldList, i), Data, v) != 0)
+          goto fallback;
+    }
+  }
+
+  Kernel->Encode(Data, Values);
+
+  if (Values != Stack)
+    free(Values);
+  Py_DECREF(StructDefinition);
+  return Result;
+
+fallback:
+
+  PyErr_Clear();
+  Py_XDECREF(Result);
+  if (Values != Stack)
+    free(Values);
+  Py_DECREF(StructDefinition);
+  return do_pack(args, nargs);
+}
+
+/* JIT functions */
+
+static char enable_jit__doc__[] = "\
+enable_jit([threshold]) -> int\n\
+Switch on native code for pack() and unpack() and return the previous\n\
+threshold. A format gets native code after it has been used threshold\n\
+times (default: 1000). 0 switches it off, which is the default. Code\n\
+is compiled with $XSTRUCT_JIT_CC or $CC (default: cc) and cached in\n\
+$XSTRUCT_JIT_DIR (default: a per-user directory in $TMPDIR), which\n\
+must be owned by the user and not accessible to others. Formats for\n\
+which no code can be compiled keep using the interpreter.";
+
+static PyObject* struct_enable_jit(PyObject* self, PyObject* args)
+{
+  int Threshold = 1000;
+  int PreviousThreshold = JitThreshold;
+
+  if (!PyArg_ParseTuple(args, "|i", &Threshold))
+    return NULL;
+
+  if (Threshold < 0)
+  {
+    PyErr_SetString(StructError, "invalid JIT threshold");
+    return NULL;
+  }
+
+  JitThreshold = Threshold;
+
+  return PyLong_FromLong(PreviousThreshold);
+}
+
+static char jit__doc__[] = "\
+jit(fmt) -> bool\n\
+Compile native code for format string fmt now, instead of when it is\n\
+hot, and return whether it has native code. The code is only used\n\
+while enable_jit() is on.";
+
+static PyObject* struct_jit(PyObject* self, PyObject* args)
+{
+  PyObject* Format;
+  PyStructDefinition* StructDefinition;
+  int Compiled;
+
+  if (!PyArg_ParseTuple(args, "O", &Format))
+    return NULL;
+
+  StructDefinition = GetCompiledFormat(Format);
+  if (StructDefinition == NULL)
+    return NULL;
+
+  if (StructDefinition->Jit == NULL && StructDefinition->JitCalls >= 0)
+  {
+    StructDefinition->JitCalls = -1;
+    StructDefinition->Jit = NewJitKernel(StructDefinition);
+  }
+
+  Compiled = (StructDefinition->Jit != NULL);
+  Py_DECREF(StructDefinition);
+  return PyBool_FromLong(Compiled);
+}
+
+/*----------------*/
+/* PyStructObject */
+/*----------------*/
+
+/* A struct object created from the initial field values (the default
+   object) shares the InitialStructData of its definition until the first
+   write to it, whether through a field, a buffer view or sealing, copies
+   it. Senders that create many default objects and set a few fields
+   before packing them save the copy of the rest; objects that are never
+   written never copy at all.
+
+   A struct view (see records.view()) is a struct object whose data is a
+   record in a record buffer, which it keeps alive as its Base: it is
+   read and written in place, and read-only if the records are. */
+
+typedef struct {
+  PyObject_HEAD
+  PyStructDefinition* StructDefinition;
+  char* StructData; /* the definition's InitialStructData while shared */
+  Py_hash_t Hash; /* -1 when not computed (or not cacheable) */
+  Py_ssize_t Exports; /* buffer views (and array interfaces) exported */
+  PyObject* Base; /* the records of a struct view, NULL otherwise */
+  int ReadOnly; /* a view of read-only records */
+} PyStructObject;
+
+#define IsSharedStructData(self) \
+  ((self)->StructData == (self)->StructDefinition->InitialStructData)
+
+/* Give a default struct object a copy of its own before it is written */
+
+static int UnshareStructData(PyStructObject* self)
+{
+  PyStructDefinition* StructDefinition = self->StructDefinition;
+  PY_LONG_LONG Start;
+  char* StructData;
+
+  if (!IsSharedStructData(self))
+    return 0;
+
+  Start = StatsStart();
+
+  StructData = malloc(StructDefinition->StructSize);
+  if (StructData == NULL)
+  {
+    if (StatsMode)
+      CountOp(&StructDefinition->Stats, STATS_COPY, 1, 0, 0, Start);
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  memcpy(StructData, self->StructData, StructDefinition->StructSize);
+  self->StructData = StructData;
+
+  if (StatsMode)
+    CountOp(&StructDefinition->Stats, STATS_COPY, 0, 
+      StructDefinition->StructSize, 0, Start);
+
+  return 0;
+}
+
+/* Make sure the struct data can be written */
+
+static int WritableStructData(PyStructObject* self)
+{
+  if (self->ReadOnly)
+  {
+    PyErr_SetString(StructError, "struct view is read-only");
+    return -1;
+  }
+
+  return UnshareStructData(self);
+}
+
+static void PyStructObject_dealloc(PyStructObject* self)
+{
+  if (self->Base != NULL)
+    Py_DECREF(self->Base);
+  else if (self->StructData != NULL && IsSharedStructData(self))
+  {
+    if (StatsMode)
+      self->StructDefinition->Stats.Unwritten++;
+  }
+  else if (self->StructData != NULL)
+    free(self->StructData);
+
+  if (self->StructDefinition != NULL)
+    Py_DECREF(self->StructDefinition);
+
+  PyObject_DEL(self);
+}
+
+static PyObject* PyStructObject_repr(PyStructObject* self)
+{
+  return FormatFields(self->StructDefinition, self->StructData);
+}
+
+/* A raw field is read as a memoryview of its bytes in the struct data
+   instead of as a copy: forwarding a large payload then copies nothing.
+   The memoryview is over a field buffer, which holds a buffer of the
+   struct object narrowed to the field, so it keeps the struct alive (and
+   its data exported). It is read-only unless the field is changeable. */
+
+typedef struct {
+  PyObject_HEAD
+  Py_buffer View;
+} PyFieldBuffer;
+
+static void PyFieldBuffer_dealloc(PyFieldBuffer* self)
+{
+  PyBuffer_Release(&self->View);
+
+  PyObject_DEL(self);
+}
+
+static int PyFieldBuffer_getbuffer(PyFieldBuffer* self, Py_buffer* view,
+  int flags)
+{
+  return PyBuffer_FillInfo(view, (PyObject*) self, self->View.buf, 
+    self->View.len, self->View.readonly, flags);
+}
+
+static PyBufferProcs PyFieldBuffer_as_buffer = {
+  (getbufferproc)PyFieldBuffer_getbuffer, /*bf_getbuffer*/
+  0, /*bf_releasebuffer*/
+};
+
+PyTypeObject PyFieldBuffer_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0) /* type set in PyInit_xstruct() */
+	"xstruct.fieldbuffer",
+	sizeof(PyFieldBuffer),
+	0,
+	(destructor)PyFieldBuffer_dealloc,  /*tp_dealloc*/
+	0,		/*tp_vectorcall_offset*/
+	0,		/*tp_getattr*/
+	0,		/*tp_setattr*/
+	0,		/*tp_as_async*/
+	0,		/*tp_repr*/
+	0,		/*tp_as_number*/
+	0,		/*tp_as_sequence*/
+	0,		/*tp_as_mapping*/
+	0,		/*tp_hash*/
+	0,		/*tp_call*/
+	0,		/*tp_str*/
+	0,		/*tp_getattro*/
+	0,		/*tp_setattro*/
+	&PyFieldBuffer_as_buffer,		/*tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT,	/*tp_flags*/
+};
+
+static PyObject* GetRawFieldView(PyStructObject* self, 
+  PyStructField* Field)
+{
+  PyObject* Result;
+  PyFieldBuffer* FieldBuffer = 
+    PyObject_NEW(PyFieldBuffer, &PyFieldBuffer_Type);
+  if (FieldBuffer == NULL)
+    return NULL;
+
+  if (PyObject_GetBuffer((PyObject*) self, &FieldBuffer->View, 
+      PyBUF_SIMPLE) != 0)
+  {
+    PyObject_DEL(FieldBuffer);
+    return NULL;
+  }
+
+  FieldBuffer->View.buf = (char*) FieldBuffer->View.buf + Field->Offset;
+  FieldBuffer->View.len = FieldSize(Field);
+  FieldBuffer->View.readonly = !Field->Changeable || self->ReadOnly;
+
+  Result = PyMemoryView_FromObject((PyObject*) FieldBuffer);
+  Py_DECREF(FieldBuffer);
+  return Result;
+}
+
+/* forward declaration */
+
+static PyObject* GetUnionView(PyObject* Owner, 
+  PyStructDefinition* StructDefinition, const char* StructData, 
+  PyStructField* Field);
+
+/* Fields are looked up by the attribute name object itself, whose hash
+   is cached; other attributes (methods) are found the generic way. Union
+   fields give a view of their active case. */
+
+static PyObject* PyStructObject_getattro(PyStructObject* self, 
+  PyObject* name)
+{
+  PyStructField* Field = (PyStructField*) 
+    PyDict_GetItemWithError(self->StructDefinition->FieldMap, name);
+      /* borrowed reference */
+  if (Field != NULL && Field->Union)
+    return GetUnionView((PyObject*) self, self->StructDefinition, 
+      self->StructData, Field);
+  if (Field != NULL && Field->Raw)
+    return GetRawFieldView(self, Field);
+  if (Field != NULL)
+    return GetNamedFieldValue(self->StructDefinition, self->StructData, 
+      Field);
+  if (PyErr_Occurred())
+    return NULL;
+
+  return PyObject_GenericGetAttr((PyObject*) self, name);
+}
+
+static int PyStructObject_setattro(PyStructObject* self, PyObject* name, 
+  PyObject* value)
+{
+  PyStructField* Field;
+
+  if (value == NULL)
+  {
+    PyErr_SetString(StructError, "attribute can not be deleted");
+	  return -1;
+  }
+
+  self->Hash = -1;
+
+  Field = (PyStructField*) 
+    PyDict_GetItemWithError(self->StructDefinition->FieldMap, name);
+      /* borrowed reference */
+  if (Field == NULL)
+  {
+    if (!PyErr_Occurred())
+      PyErr_SetObject(PyExc_AttributeError, name);
+    return -1;
+  }
+
+  if (Field->Changeable && WritableStructData(self) != 0)
+    return -1;
+
+  return SetChangeableFieldValue(self->StructDefinition, self->StructData,
+    Field, value);
+}
+
+static char* StructObjectData(PyObject* StructObject)
+{
+  return ((PyStructObject*) StructObject)->StructData;
+}
+
+static PyObject* PyStructObject_seal(PyStructObject* self, 
+  PyObject* Unused)
+{
+  self->Hash = -1;
+  if (self->ReadOnly)
+  {
+    PyErr_SetString(StructError, "struct view is read-only");
+    return NULL;
+  }
+  if (!IsSharedStructData(self)) /* the initial data is sealed */
+    SealChecksums(self->StructDefinition->Checksums, 
+      self->StructDefinition->ChecksumCount, self->StructData);
+  Py_RETURN_NONE;
+}
+
+static PyObject* PyStructObject_verify(PyStructObject* self, 
+  PyObject* Unused)
+{
+  return PyBool_FromLong(VerifyChecksums(self->StructDefinition->Checksums,
+    self->StructDefinition->ChecksumCount, self->StructData) < 0);
+}
+
+static PyObject* PyStructObject_bytes(PyStructObject* self, 
+  PyObject* Unused)
+{
+  self->Hash = -1;
+  if (!IsSharedStructData(self) && !self->ReadOnly) /* see seal() */
+    SealChecksums(self->StructDefinition->Checksums, 
+      self->StructDefinition->ChecksumCount, self->StructData);
+
+  return PyBytes_FromStringAndSize(self->StructData, 
+    self->StructDefinition->StructSize);
+}
+
+/* forward declaration */
+
+static PyObject* EncodeWire(PyStructDefinition* StructDefinition, 
+  const char* Data);
+
+static PyObject* PyStructObject_encode(PyStructObject* self, 
+  PyObject* Unused)
+{
+  self->Hash = -1;
+  if (!IsSharedStructData(self) && !self->ReadOnly) /* see seal() */
+    SealChecksums(self->StructDefinition->Checksums, 
+      self->StructDefinition->ChecksumCount, self->StructData);
+
+  return EncodeWire(self->StructDefinition, self->StructData);
+}
+
+/* Struct objects pickle as a call of their definition with their bytes
+   and copy with a single memcpy (or none, for a default object) */
+
+static PyObject* PyStructObject_reduce(PyStructObject* self, 
+  PyObject* Unused)
+{
+  return Py_BuildValue("O(N)", self->StructDefinition, 
+    PyStructObject_bytes(self, NULL));
+}
+
+static PyObject* PyStructObject_copy(PyStructObject* self, 
+  PyObject* Unused)
+{
+  PyStructObject* Copy;
+
+  if (IsSharedStructData(self))
+    return NewDefaultStructObject(self->StructDefinition);
+
+  Copy = (PyStructObject*) NewStructObject(self->StructDefinition, 
+    self->StructData, self->StructDefinition->StructSize);
+  if (Copy != NULL)
+    Copy->Hash = self->Hash;
+
+  return (PyObject*) Copy;
+}
+
+static PyObject* PyStructObject_raw(PyStructObject* self, PyObject* Name)
+{
+  PyStructField* Field = LookupFieldByName(self->StructDefinition, Name);
+  if (Field == NULL)
+    return NULL;
+
+  return GetRawFieldView(self, Field);
+}
+
+static PyMethodDef PyStructObject_methods[] = {
+  {"__bytes__", (PyCFunction)PyStructObject_bytes, METH_NOARGS,
+   "Return the raw struct data as bytes, checksums computed."},
+  {"__reduce__", (PyCFunction)PyStructObject_reduce, METH_NOARGS,
+   "Pickle the struct as its definition and its bytes."},
+  {"__copy__", (PyCFunction)PyStructObject_copy, METH_NOARGS,
+   "Return a copy of the struct."},
+  {"__deepcopy__", (PyCFunction)PyStructObject_copy, METH_O,
+   "Return a copy of the struct (it holds no Python objects)."},
+  {"encode", (PyCFunction)PyStructObject_encode, METH_NOARGS,
+   "Return the struct in wire form: its bytes, checksums computed, with\n"
+   "the varint fields as LEB128 (see structdef.decode())."},
+  {"raw", (PyCFunction)PyStructObject_raw, METH_O,
+   "raw(name) -> memoryview\n"
+   "Return a view of the bytes of a field, sharing the struct's memory;\n"
+   "writable if the field is changeable. Fields defined with the raw\n"
+   "flag are always read this way."},
+  {"seal", (PyCFunction)PyStructObject_seal, METH_NOARGS,
+   "Compute the checksum fields."},
+  {"verify", (PyCFunction)PyStructObject_verify, METH_NOARGS,
+   "Return whether the checksum fields match the struct data."},
+  {NULL, NULL}
+};
+
+static PyObject* PyStructObject_get_array_interface(PyStructObject* self, 
+  void* Unused)
+{
+  /* the address goes out without a release, so the data can change 
+     behind our back from now on: count an export that never ends */
+
+  self->Hash = -1;
+  if (UnshareStructData(self) != 0)
+    return NULL;
+  self->Exports++;
+
+  return MakeArrayInterface(self->StructDefinition, self->StructData, -1, 
+    self->ReadOnly);
+}
+
+static PyGetSetDef PyStructObject_getset[] = {
+  {"__array_interface__", (getter)PyStructObject_get_array_interface, NULL,
+   "NumPy array interface of the struct data"},
+  {NULL}
+};
+
+/* Mapping methods */
+
+static Py_ssize_t PyStructObject_length(PyStructObject* self)
+{
+  return PyDict_Size(self->StructDefinition->FieldMap);
+}
+
+static PyObject* PyStructObject_subscript(PyStructObject* self, 
+  PyObject* key)
+{
+  PyStructField* Field = LookupFieldByName(self->StructDefinition, key);
+  if (Field == NULL)
+    return NULL;
+
+  if (Field->Union)
+    return GetUnionView((PyObject*) self, self->StructDefinition, 
+      self->StructData, Field);
+
+  if (Field->Raw)
+    return GetRawFieldView(self, Field);
+
+  return GetNamedFieldValue(self->StructDefinition, self->StructData, 
+    Field);
+}
+
+static int PyStructObject_ass_sub(PyStructObject* self, PyObject* key, 
+  PyObject* value)
+{
+  if (value == NULL)
+  {
+    PyErr_SetString(StructError, "key can not be deleted");
+	  return -1;
+  }
+  else
+  {
+    self->Hash = -1;
+    if (WritableStructData(self) != 0)
+      return -1;
+    return SetChangeableFieldValueByName(self->StructDefinition,
+      self->StructData, key, value);
+  }
+}
+
+static PyMappingMethods PyStructObject_as_mapping = {
+	(lenfunc)PyStructObject_length, /*mp_length*/
+	(binaryfunc)PyStructObject_subscript, /*mp_subscript*/
+	(objobjargproc)PyStructObject_ass_sub, /*mp_ass_subscript*/
+};
+
+/* Buffer methods */
+
+/* The struct data is exported as a single (zero-dimensional) item whose
+   format is the layout of the struct, so that consumers that ask for
+   the format see the fields. Consumers that don't, see plain bytes. */
+
+static int PyStructObject_getbuffer(PyStructObject* self, Py_buffer* view,
+  int flags)
+{
+  PyStructDefinition* StructDefinition = self->StructDefinition;
+
+  /* the data can change through the view behind our back */
+
+  self->Hash = -1;
+  if (UnshareStructData(self) != 0)
+    return -1;
+
+  if (!(flags & PyBUF_FORMAT))
+  {
+    if (PyBuffer_FillInfo(view, (PyObject*) self, self->StructData,
+        StructDefinition->StructSize, self->ReadOnly, flags) != 0)
+      return -1;
+    self->Exports++;
+    return 0;
+  }
+
+  if ((flags & PyBUF_WRITABLE) && self->ReadOnly)
+  {
+    PyErr_SetString(PyExc_BufferError, "struct view is read-only");
+    return -1;
+  }
+
+  self->Exports++;
+  view->obj = (PyObject*) self;
+  Py_INCREF(self);
+  view->buf = self->StructData;
+  view->len = StructDefinition->StructSize;
+  view->readonly = self->ReadOnly;
+  view->itemsize = StructDefinition->StructSize;
+  view->format = PyBytes_AS_STRING(StructDefinition->BufferFormat);
+  view->ndim = 0;
+  view->shape = NULL;
+  view->strides = NULL;
+  view->suboffsets = NULL;
+  view->internal = NULL;
+  return 0;
+}
+
+static void PyStructObject_releasebuffer(PyStructObject* self, 
+  Py_buffer* view)
+{
+  self->Exports--;
+}
+
+static PyBufferProcs PyStructObject_as_buffer = {
+  (getbufferproc)PyStructObject_getbuffer, /*bf_getbuffer*/
+  (releasebufferproc)PyStructObject_releasebuffer, /*bf_releasebuffer*/
+};
+
+/* Hashing and comparison */
+
+/* Struct objects of the same definition compare (and hash) by the raw
+   bytes of their key fields, or of the whole struct when the definition
+   has no key. Ordering is that of memcmp(), not of the field values. 
+   The hash is cached until the struct is written to; while buffer views 
+   are exported it is recomputed every time. */
+
+/* forward declaration */
+
+extern PyTypeObject PyStructObject_Type;
+
+static int CompareStructData(PyStructDefinition* StructDefinition,
+  const char* a, const char* b)
+{
+  int i;
+
+  if (StructDefinition->KeyRanges == NULL)
+    return memcmp(a, b, StructDefinition->StructSize);
+
+  for (i = 0; i < StructDefinition->KeyRangeCount; i++)
+  {
+    KeyRange* Range = &StructDefinition->KeyRanges[i];
+    int Order = memcmp(a + Range->Offset, b + Range->Offset, Range->Size);
+    if (Order != 0)
+      return Order;
+  }
+
+  return 0;
+}
+
+#define HASH_MULTIPLIER 0x9e3779b97f4a7c15ULL
+
+static unsigned PY_LONG_LONG HashBytes(unsigned PY_LONG_LONG Hash,
+  const char* p, int n)
+{
+  unsigned PY_LONG_LONG Word;
+
+  while (n >= 8)
+  {
+    memcpy(&Word, p, 8);
+    Hash = (Hash ^ Word) * HASH_MULTIPLIER;
+    Hash ^= Hash >> 32;
+    p += 8;
+    n -= 8;
+  }
+
+  if (n > 0)
+  {
+    Word = (unsigned PY_LONG_LONG) n << 56;
+    memcpy(&Word, p, n);
+    Hash = (Hash ^ Word) * HASH_MULTIPLIER;
+    Hash ^= Hash >> 32;
+  }
+
+  return Hash;
+}
+
+static Py_hash_t HashStructData(PyStructDefinition* StructDefinition,
+  const char* Data)
+{
+  unsigned PY_LONG_LONG Hash = StructDefinition->StructSize;
+  int i;
+
+  if (StructDefinition->KeyRanges == NULL)
+    Hash = HashBytes(Hash, Data, StructDefinition->StructSize);
+
+  for (i = 0; i < StructDefinition->KeyRangeCount; i++)
+    Hash = HashBytes(Hash, Data + StructDefinition->KeyRanges[i].Offset,
+      StructDefinition->KeyRanges[i].Size);
+
+  /* final mix (MurmurHash3's fmix64) */
+
+  Hash ^= Hash >> 33;
+  Hash *= 0xff51afd7ed558ccdULL;
+  Hash ^= Hash >> 33;
+  Hash *= 0xc4ceb9fe1a85ec53ULL;
+  Hash ^= Hash >> 33;
+
+  return (Py_hash_t) Hash == -1 ? -2 : (Py_hash_t) Hash;
+}
+
+static Py_hash_t PyStructObject_hash(PyStructObject* self)
+{
+  Py_hash_t Hash;
+
+  if (self->Hash != -1)
+    return self->Hash;
+
+  Hash = HashStructData(self->StructDefinition, self->StructData);
+  if (self->Exports == 0 && self->Base == NULL)
+    self->Hash = Hash;
+
+  return Hash;
+}
+
+static PyObject* PyStructObject_richcompare(PyObject* a, PyObject* b, 
+  int op)
+{
+  PyStructObject* x = (PyStructObject*) a;
+  PyStructObject* y = (PyStructObject*) b;
+
+  if (Py_TYPE(a) != &PyStructObject_Type || 
+      Py_TYPE(b) != &PyStructObject_Type)
+    Py_RETURN_NOTIMPLEMENTED;
+
+  if (x->StructDefinition != y->StructDefinition)
+  {
+    if (op == Py_EQ)
+      Py_RETURN_FALSE;
+    if (op == Py_NE)
+      Py_RETURN_TRUE;
+    Py_RETURN_NOTIMPLEMENTED;
+  }
+
+  if ((op == Py_EQ || op == Py_NE) && x->Hash != -1 && y->Hash != -1 &&
+      x->Hash != y->Hash)
+    return PyBool_FromLong(op == Py_NE);
+
+  Py_RETURN_RICHCOMPARE(CompareStructData(x->StructDefinition, 
+    x->StructData, y->StructData), 0, op);
+}
+
+PyTypeObject PyStructObject_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0) /* type set in PyInit_xstruct() */
+	"xstruct.structobject",
+	sizeof(PyStructObject),
+	0,
+	(destructor)PyStructObject_dealloc,  /*tp_dealloc*/
+	0,		/*tp_vectorcall_offset*/
+	0,		/*tp_getattr*/
+	0,		/*tp_setattr*/
+	0,		/*tp_as_async*/
+	(reprfunc)PyStructObject_repr,		/*tp_repr*/
+	0,		/*tp_as_number*/
+	0,		/*tp_as_sequence*/
+	&PyStructObject_as_mapping,		/*tp_as_mapping*/
+	(hashfunc)PyStructObject_hash,		/*tp_hash*/
+	0,		/*tp_call*/
+	0,		/*tp_str*/
+	(getattrofunc)PyStructObject_getattro, /*tp_getattro*/
+	(setattrofunc)PyStructObject_setattro, /*tp_setattro*/
+	&PyStructObject_as_buffer,		/*tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT,	/*tp_flags*/
+	0,		/*tp_doc*/
+	0,		/*tp_traverse*/
+	0,		/*tp_clear*/
+	PyStructObject_richcompare,		/*tp_richcompare*/
+	0,		/*tp_weaklistoffset*/
+	0,		/*tp_iter*/
+	0,		/*tp_iternext*/
+	PyStructObject_methods, /*tp_methods*/
+	0,		/*tp_members*/
+	PyStructObject_getset, /*tp_getset*/
+};
+
+/* With data NULL, the struct object shares the initial data */
+
+static PyObject* DoNewStructObject(PyStructDefinition* StructDefinition, 
+  char* data, Py_ssize_t len)
+{
+  Py_ssize_t gap;
+
+  PyStructObject* StructObject = 
+    PyObject_NEW(PyStructObject, &PyStructObject_Type);
+  if (StructObject == NULL)
+    return NULL;
+
+  StructObject->StructDefinition = StructDefinition;
+  Py_INCREF(StructDefinition);
+  StructObject->Hash = -1;
+  StructObject->Exports = 0;
+  StructObject->Base = NULL;
+  StructObject->ReadOnly = 0;
+
+  if (data == NULL)
+  {
+    StructObject->StructData = StructDefinition->InitialStructData;
+    return (PyObject*) StructObject;
+  }
+
+  StructObject->StructData = malloc(StructDefinition->StructSize);
+  if (StructObject->StructData == NULL)
+  {
+    PyErr_NoMemory();
+	  goto fail;
+  }
+
+  gap = StructDefinition->StructSize - len;
+  if (gap <= 0)
+    memcpy(StructObject->StructData, data, StructDefinition->StructSize);
+  else
+  {
+    memcpy(StructObject->StructData, data, len);
+    memset(StructObject->StructData + len, 0, gap);
+  }  
+
+  return (PyObject*) StructObject;
+
+fail:
+
+  Py_DECREF(StructObject);
+  return NULL;
+}
+
+static PyObject* NewStructObject(PyStructDefinition* StructDefinition, 
+  char* data, Py_ssize_t len)
+{
+  PY_LONG_LONG Start;
+  PyObject* StructObject;
+
+  if (!StatsMode)
+    return DoNewStructObject(StructDefinition, data, len);
+
+  Start = StatsStart();
+  StructObject = DoNewStructObject(StructDefinition, data, len);
+  CountOp(&StructDefinition->Stats, STATS_NEW, StructObject == NULL,
+    data != NULL ? StructDefinition->StructSize : 0, 1, Start);
+
+  return StructObject;
+}
+
+static PyObject* NewDefaultStructObject(
+  PyStructDefinition* StructDefinition)
+{
+  return NewStructObject(StructDefinition, NULL, 0);
+}
+
+/* A struct view of the struct at StructData in the records Base */
+
+static PyObject* NewStructView(PyStructDefinition* StructDefinition, 
+  PyObject* Base, char* StructData, int ReadOnly)
+{
+  PyStructObject* StructObject = 
+    PyObject_NEW(PyStructObject, &PyStructObject_Type);
+  if (StructObject == NULL)
+    return NULL;
+
+  StructObject->StructDefinition = StructDefinition;
+  Py_INCREF(StructDefinition);
+  StructObject->StructData = StructData;
+  StructObject->Hash = -1;
+  StructObject->Exports = 0;
+  StructObject->Base = Base;
+  Py_INCREF(Base);
+  StructObject->ReadOnly = ReadOnly;
+
+  return (PyObject*) StructObject;
+}
+
+/* Statistics functions */
+
+static char enable_stats__doc__[] = "\
+enable_stats([mode]) -> int\n\
+Set the statistics mode and return the previous one. The mode is 0\n\
+(off, the default), stats_counters or stats_counters | stats_timing.\n\
+Without an argument, counters are switched on.";
+
+static PyObject* struct_enable_stats(PyObject* self, PyObject* args)
+{
+  int Mode = STATS_COUNTERS;
+  int PreviousMode = StatsMode;
+
+  if (!PyArg_ParseTuple(args, "|i", &Mode))
+    return NULL;
+
+  if (Mode & ~(STATS_COUNTERS | STATS_TIMING))
+  {
+    PyErr_SetString(StructError, "invalid statistics mode");
+    return NULL;
+  }
+
+  if (Mode & STATS_TIMING)
+    Mode |= STATS_COUNTERS;
+
+  StatsMode = Mode;
+
+  return PyLong_FromLong(PreviousMode);
+}
+
+static char stats__doc__[] = "\
+stats() -> dict\n\
+Return the statistics collected while enable_stats() was on, as a\n\
+dictionary with a 'formats' dictionary keyed by format string and a\n\
+'structdefs' dictionary keyed by struct definition. Each entry maps an\n\
+operation ('pack', 'unpack', 'new', 'get', 'set', 'copy') to its\n\
+counters: calls, failures, bytes, objects and cycles. 'copy' counts the\n\
+default struct objects copied from the initial data on their first\n\
+write; 'unwritten' the default struct objects freed without one.";
+
+static PyObject* struct_stats(PyObject* self, PyObject* args)
+{
+  PyObject* Formats = NULL;
+  PyObject* Definitions = NULL;
+  PyObject* Result;
+  PyStructDefinition* StructDefinition;
+  PyObject* Format;
+  PyObject* Entry;
+  Py_ssize_t Position = 0;
+
+  if (!PyArg_ParseTuple(args, ""))
+    return NULL;
+
+  Formats = PyDict_New();
+  if (Formats == NULL)
+    goto fail;
+
+  while (FormatStatistics != NULL && 
+    PyDict_Next(FormatStatistics, &Position, &Format, &Entry))
+  {
+    PyObject* Dict = StatisticsAsDict(&((PyFormatStatistics*) Entry)->Stats);
+    if (Dict == NULL)
+      goto fail;
+    if (PyDict_SetItem(Formats, Format, Dict) != 0)
+    {
+      Py_DECREF(Dict);
+      goto fail;
+    }
+    Py_DECREF(Dict);
+  }
+
+  Definitions = PyDict_New();
+  if (Definitions == NULL)
+    goto fail;
+
+  for (StructDefinition = StructDefinitions; StructDefinition != NULL;
+       StructDefinition = StructDefinition->Next)
+  {
+    PyObject* Dict = StatisticsAsDict(&StructDefinition->Stats);
+    if (Dict == NULL)
+      goto fail;
+    if (PyDict_Size(Dict) != 0 &&
+        PyDict_SetItem(Definitions, (PyObject*) StructDefinition, Dict) != 0)
+    {
+      Py_DECREF(Dict);
+      goto fail;
+    }
+    Py_DECREF(Dict);
+  }
+
+  Result = Py_BuildValue("{s:O,s:O}", "formats", Formats, 
+    "structdefs", Definitions);
+
+  Py_DECREF(Formats);
+  Py_DECREF(Definitions);
+  return Result;
+
+fail:
+
+  Py_XDECREF(Formats);
+  Py_XDECREF(Definitions);
+  return NULL;
+}
+
+static char reset_stats__doc__[] = "\
+reset_stats() -> None\n\
+Discard all statistics collected so far.";
+
+static PyObject* struct_reset_stats(PyObject* self, PyObject* args)
+{
+  PyStructDefinition* StructDefinition;
+
+  if (!PyArg_ParseTuple(args, ""))
+    return NULL;
+
+  if (FormatStatistics != NULL)
+    PyDict_Clear(FormatStatistics);
+
+  for (StructDefinition = StructDefinitions; StructDefinition != NULL;
+       StructDefinition = StructDefinition->Next)
+    memset(&StructDefinition->Stats, 0, sizeof(StructStatistics));
+
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+/*-----------------*/
+/* Array interface */
+/*-----------------*/
+
+/*
+A record buffer wraps a buffer of consecutive structs (for instance, a
+file read into a bytearray or an mmap) without copying it. It exports
+the records through the buffer protocol, with the struct layout as item
+format, and through NumPy's __array_interface__, so that the records
+can be used as a structured NumPy array sharing the same memory.
+Indexing it returns a struct object holding a copy of the record, view()
+one that reads and writes the record in place.
+*/
+
+typedef struct {
+  PyObject_HEAD
+  PyStructDefinition* StructDefinition;
+  Py_buffer View;
+  Py_ssize_t Count;
+  Py_ssize_t Stride; /* exported as strides */
+} PyRecordBuffer;
+
+static void PyRecordBuffer_dealloc(PyRecordBuffer* self)
+{
+  PyBuffer_Release(&self->View);
+  Py_DECREF(self->StructDefinition);
+
+  PyObject_DEL(self);
+}
+
+static Py_ssize_t PyRecordBuffer_length(PyRecordBuffer* self)
+{
+  return self->Count;
+}
+
+static PyObject* PyRecordBuffer_item(PyRecordBuffer* self, Py_ssize_t i)
+{
+  if (i < 0 || i >= self->Count)
+  {
+    PyErr_SetString(PyExc_IndexError, "record index out of range");
+    return NULL;
+  }
+
+  return NewStructObject(self->StructDefinition, 
+    (char*) self->View.buf + i * self->Stride, self->Stride);
+}
+
+/* forward declaration */
+
+static PyObject* NewStructView(PyStructDefinition* StructDefinition, 
+  PyObject* Base, char* StructData, int ReadOnly);
+
+static PyObject* PyRecordBuffer_view(PyRecordBuffer* self, PyObject* Index)
+{
+  Py_ssize_t i = PyNumber_AsSsize_t(Index, PyExc_IndexError);
+  if (i == -1 && PyErr_Occurred())
+    return NULL;
+
+  if (i < 0)
+    i += self->Count;
+  if (i < 0 || i >= self->Count)
+  {
+    PyErr_SetString(PyExc_IndexError, "record index out of range");
+    return NULL;
+  }
+
+  return NewStructView(self->StructDefinition, (PyObject*) self,
+    (char*) self->View.buf + i * self->Stride, self->View.readonly);
+}
+
+static PySequenceMethods PyRecordBuffer_as_sequence = {
+  (lenfunc)PyRecordBuffer_length, /*sq_length*/
+  0, /*sq_concat*/
+  0, /*sq_repeat*/
+  (ssizeargfunc)PyRecordBuffer_item, /*sq_item*/
+};
+
+/* Like struct objects, records are exported as structs to consumers 
+   that ask for the format and as plain bytes to consumers that don't */
+
+static int PyRecordBuffer_getbuffer(PyRecordBuffer* self, Py_buffer* view,
+  int flags)
+{
+  if (!(flags & PyBUF_FORMAT))
+    return PyBuffer_FillInfo(view, (PyObject*) self, self->View.buf,
+      self->View.len, self->View.readonly, flags);
+
+  if ((flags & PyBUF_WRITABLE) && self->View.readonly)
+  {
+    PyErr_SetString(PyExc_BufferError, "records are read-only");
+    return -1;
+  }
+
+  view->obj = (PyObject*) self;
+  Py_INCREF(self);
+  view->buf = self->View.buf;
+  view->len = self->View.len;
+  view->readonly = self->View.readonly;
+  view->itemsize = self->Stride;
+  view->format = PyBytes_AS_STRING(self->StructDefinition->BufferFormat);
+  view->ndim = 1;
+  view->shape = &self->Count;
+  view->strides = &self->Stride;
+  view->suboffsets = NULL;
+  view->internal = NULL;
+  return 0;
+}
+
+static PyBufferProcs PyRecordBuffer_as_buffer = {
+  (getbufferproc)PyRecordBuffer_getbuffer, /*bf_getbuffer*/
+  0, /*bf_releasebuffer*/
+};
+
+static PyObject* PyRecordBuffer_get_array_interface(PyRecordBuffer* self,
+  void* Unused)
+{
+  return MakeArrayInterface(self->StructDefinition, self->View.buf, 
+    self->Count, self->View.readonly);
+}
+
+static PyGetSetDef PyRecordBuffer_getset[] = {
+  {"__array_interface__", (getter)PyRecordBuffer_get_array_interface, NULL,
+   "NumPy array interface of the records"},
+  {NULL}
+};
+
+/* forward declarations */
+
+static PyObject* PyRecordBuffer_atomic_load(PyRecordBuffer* self, 
+  PyObject* args);
+static PyObject* PyRecordBuffer_atomic_store(PyRecordBuffer* self, 
+  PyObject* args);
+static PyObject* PyRecordBuffer_fetch_add(PyRecordBuffer* self, 
+  PyObject* args);
+static PyObject* PyRecordBuffer_exchange(PyRecordBuffer* self, 
+  PyObject* args);
+static PyObject* PyRecordBuffer_compare_exchange(PyRecordBuffer* self, 
+  PyObject* args);
+
+static PyMethodDef PyRecordBuffer_methods[] = {
+  {"view", (PyCFunction)PyRecordBuffer_view, METH_O,
+   "view(record) -> struct\n"
+   "Return a struct object that reads and writes a record in place."},
+  {"atomic_load", (PyCFunction)PyRecordBuffer_atomic_load, METH_VARARGS,
+   "atomic_load(record, field) -> int\n"
+   "Read an atomic field of a record, with acquire ordering."},
+  {"atomic_store", (PyCFunction)PyRecordBuffer_atomic_store, METH_VARARGS,
+   "atomic_store(record, field, value)\n"
+   "Write an atomic field of a record, with release ordering."},
+  {"fetch_add", (PyCFunction)PyRecordBuffer_fetch_add, METH_VARARGS,
+   "fetch_add(record, field, delta) -> int\n"
+   "Atomically add delta (wrapping around) to a field of a record and\n"
+   "return its previous value."},
+  {"exchange", (PyCFunction)PyRecordBuffer_exchange, METH_VARARGS,
+   "exchange(record, field, value) -> int\n"
+   "Atomically replace a field of a record and return its previous value."},
+  {"compare_exchange", (PyCFunction)PyRecordBuffer_compare_exchange, 
+   METH_VARARGS,
+   "compare_exchange(record, field, expected, desired) -> int\n"
+   "Atomically set a field of a record to desired if it holds expected.\n"
+   "Return the value it held: the swap took place if it is expected."},
+  {NULL, NULL}
+};
+
+static PyMemberDef PyRecordBuffer_members[] = {
+  {"layout", T_OBJECT, offsetof(PyRecordBuffer, StructDefinition), 
+   READONLY, "struct definition of the records"},
+  {"obj", T_OBJECT, offsetof(PyRecordBuffer, View.obj), READONLY,
+   "the wrapped buffer object"},
+  {NULL}
+};
+
+PyTypeObject PyRecordBuffer_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0) /* type set in PyInit_xstruct() */
+	"xstruct.records",
+	sizeof(PyRecordBuffer),
+	0,
+	(destructor)PyRecordBuffer_dealloc,  /*tp_dealloc*/
+	0,		/*tp_vectorcall_offset*/
+	0,		/*tp_getattr*/
+	0,		/*tp_setattr*/
+	0,		/*tp_as_async*/
+	0,		/*tp_repr*/
+	0,		/*tp_as_number*/
+	&PyRecordBuffer_as_sequence,		/*tp_as_sequence*/
+	0,		/*tp_as_mapping*/
+	0,		/*tp_hash*/
+	0,		/*tp_call*/
+	0,		/*tp_str*/
+	PyObject_GenericGetAttr, /*tp_getattro*/
+	0,		/*tp_setattro*/
+	&PyRecordBuffer_as_buffer,		/*tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT,	/*tp_flags*/
+	0,		/*tp_doc*/
+	0,		/*tp_traverse*/
+	0,		/*tp_clear*/
+	0,		/*tp_richcompare*/
+	0,		/*tp_weaklistoffset*/
+	0,		/*tp_iter*/
+	0,		/*tp_iternext*/
+	PyRecordBuffer_methods, /*tp_methods*/
+	PyRecordBuffer_members, /*tp_members*/
+	PyRecordBuffer_getset, /*tp_getset*/
+};
+
+static PyObject* NewRecordBuffer(PyStructDefinition* StructDefinition,
+  PyObject* Buffer)
+{
+  PyRecordBuffer* RecordBuffer = 
+    PyObject_NEW(PyRecordBuffer, &PyRecordBuffer_Type);
+  if (RecordBuffer == NULL)
+    return NULL;
+
+  /* wrap the buffer writable if it can be, read-only otherwise */
+
+  if (PyObject_GetBuffer(Buffer, &RecordBuffer->View, PyBUF_WRITABLE) != 0)
+  {
+    PyErr_Clear();
+    if (PyObject_GetBuffer(Buffer, &RecordBuffer->View, PyBUF_SIMPLE) != 0)
+    {
+      PyObject_DEL(RecordBuffer);
+      return NULL;
+    }
+  }
+
+  RecordBuffer->StructDefinition = StructDefinition;
+  Py_INCREF(StructDefinition);
+  RecordBuffer->Stride = StructDefinition->StructSize;
+  RecordBuffer->Count = RecordBuffer->View.len / RecordBuffer->Stride;
+
+  if (RecordBuffer->View.len % RecordBuffer->Stride != 0)
+  {
+    PyErr_SetString(StructError, 
+      "buffer size is not a multiple of the struct size");
+    Py_DECREF(RecordBuffer);
+    return NULL;
+  }
+
+  return (PyObject*) RecordBuffer;
+}
+
+/* A record buffer of Count records at Offset in Buffer, sharing its 
+   memory */
+
+static PyObject* NewRecordSlice(PyStructDefinition* StructDefinition,
+  PyObject* Buffer, Py_ssize_t Offset, Py_ssize_t Count)
+{
+  Py_ssize_t Size = StructDefinition->StructSize;
+  PyRecordBuffer* RecordBuffer = 
+    PyObject_NEW(PyRecordBuffer, &PyRecordBuffer_Type);
+  if (RecordBuffer == NULL)
+    return NULL;
+
+  if (PyObject_GetBuffer(Buffer, &RecordBuffer->View, PyBUF_WRITABLE) 
+      != 0)
+  {
+    PyErr_Clear();
+    if (PyObject_GetBuffer(Buffer, &RecordBuffer->View, PyBUF_SIMPLE) 
+        != 0)
+    {
+      PyObject_DEL(RecordBuffer);
+      return NULL;
+    }
+  }
+
+  RecordBuffer->StructDefinition = StructDefinition;
+  Py_INCREF(StructDefinition);
+
+  if (Offset < 0 || Count > (RecordBuffer->View.len - Offset) / Size)
+  {
+    PyErr_SetString(StructError, "records out of range of the buffer");
+    Py_DECREF(RecordBuffer);
+    return NULL;
+  }
+
+  RecordBuffer->View.buf = (char*) RecordBuffer->View.buf + Offset;
+  RecordBuffer->View.len = Count * Size;
+  RecordBuffer->Count = Count;
+  RecordBuffer->Stride = Size;
+
+  return (PyObject*) RecordBuffer;
+}
+
+/* The format character for an array interface type string, with the
+   number of them it takes. Returns 0 for types without one. */
+
+static char DescrFormat(const char* TypeString, int* Count)
+{
+  char Kind = TypeString[1];
+  int Size;
+
+  if (strchr("<>|=", TypeString[0]) == NULL || Kind == '\0' ||
+      sscanf(TypeString + 2, "%d", &Size) != 1 || Size < 0)
+    return 0;
+
+  switch (Kind)
+  {
+    case 'S':
+    case 'a':
+    case 'V':
+      *Count *= Size;
+      return 's';
+    case 'b':
+      return Size == 1 ? 'B' : 0;
+    case 'i':
+      return Size == 1 ? 'b' : Size == 2 ? 'h' : Size == 4 ? 'i' : 0;
+    case 'u':
+      return Size == 1 ? 'B' : Size == 2 ? 'H' : Size == 4 ? 'I' : 0;
+    case 'f':
+      return Size == 4 ? 'f' : Size == 8 ? 'd' : 0;
+  }
+
+  return 0;
+}
+
+static char structdef_from_descr__doc__[] = "\
+structdef_from_descr(descr) -> structdef\n\
+Create a struct definition from an array interface description, a list\n\
+of (name, typestr[, shape]) tuples as given by numpy.dtype.descr. Fields\n\
+get the standard size and no alignment, and can differ in byte order.\n\
+Unnamed void entries are pad bytes. Strings and other void entries\n\
+become string fields.";
+
+static PyObject* struct_structdef_from_descr(PyObject* self, 
+  PyObject* args)
+{
+  PyObject* Descr;
+  PyObject* FieldDefinitions;
+  PyObject* Result = NULL;
+  char ByteOrder = '\0';
+  int n = 1;
+  int i;
+
+  if (!PyArg_ParseTuple(args, "O!", &PyList_Type, &Descr))
+    return NULL;
+
+  FieldDefinitions = PyList_New(0);
+  if (FieldDefinitions == NULL)
+    return NULL;
+
+  for (i = 0; i < PyList_GET_SIZE(Descr); i++)
+  {
+    const char* Name;
+    const char* TypeString;
+    PyObject* Shape = NULL;
+    PyObject* FieldDefinition;
+    char FieldType[3] = { 0 };
+    int Count = 1;
+    char Format;
+    int j;
+
+    if (!PyArg_ParseTuple(PyList_GET_ITEM(Descr, i), "ss|O!", &Name, 
+        &TypeString, &PyTuple_Type, &Shape))
+      goto fail;
+
+    for (j = 0; Shape != NULL && j < PyTuple_GET_SIZE(Shape); j++)
+    {
+      long Dimension = PyLong_AsLong(PyTuple_GET_ITEM(Shape, j));
+      if (Dimension == -1 && PyErr_Occurred())
+        goto fail;
+      if (Dimension < 0 || (Dimension > 0 && Count > INT_MAX / Dimension))
+      {
+        PyErr_SetString(StructError, "invalid shape in descr");
+        goto fail;
+      }
+      Count *= (int) Dimension;
+    }
+
+    Format = DescrFormat(TypeString, &Count);
+    if (Format == 0)
+    {
+      PyErr_Format(StructError, "unsupported type in descr: %s", 
+        TypeString);
+      goto fail;
+    }
+
+    if (TypeString[0] == '<' || TypeString[0] == '>' || 
+        TypeString[0] == '=')
+    {
+      char Order = TypeString[0];
+      if (Order == '=')
+        Order = (*(char *) &n == 1) ? '<' : '>';
+      if (ByteOrder == '\0')
+        ByteOrder = Order;
+      else if (Order != ByteOrder) /* overridden for this field */
+        FieldType[strlen(FieldType)] = Order;
+    }
+
+    if (Name[0] == '\0' && TypeString[1] == 'V')
+      Format = 'x';
+    FieldType[strlen(FieldType)] = Format;
+
+    FieldDefinition = Py_BuildValue("(z(si))", Name[0] != '\0' ? Name : NULL,
+      FieldType, Count);
+    if (FieldDefinition == NULL)
+      goto fail;
+    if (PyList_Append(FieldDefinitions, FieldDefinition) != 0)
+    {
+      Py_DECREF(FieldDefinition);
+      goto fail;
+    }
+    Py_DECREF(FieldDefinition);
+  }
+
+  args = Py_BuildValue("(sO)", ByteOrder == '>' ? ">" : "<", 
+    FieldDefinitions);
+  if (args != NULL)
+  {
+    Result = struct_structdef(self, args, NULL);
+    Py_DECREF(args);
+  }
+
+fail:
+
+  Py_DECREF(FieldDefinitions);
+  return Result;
+}
+
+/*----------------*/
+/* Record indexes */
+/*----------------*/
+
+/*
+A record index maps the key fields of the records in a buffer to record
+numbers, in an open addressing (linear probing) table of 8-byte slots:
+the low 32 bits of the key hash and the record number plus one (0 marks
+an empty slot). Keys are not copied; they are compared in the buffer
+itself. The buffer is acquired for each call only, so a bytearray can
+grow between calls; update() then indexes the records appended since.
+When several records have the same key, the last one wins.
+
+Looking up a key packs it into a scratch struct, hashes its key fields
+and probes the table. Found records are returned as one-record record
+buffers that share the memory of the indexed buffer.
+*/
+
+typedef struct {
+  unsigned int Hash;
+  unsigned int Record; /* plus one, 0 for an empty slot */
+} IndexSlot;
+
+typedef struct {
+  PyObject_HEAD
+  PyStructDefinition* StructDefinition;
+  PyObject* Buffer;
+  PyStructField** KeyFields; /* owned by StructDefinition */
+  int KeyFieldCount;
+  IndexSlot* Slots;
+  Py_ssize_t SlotCount; /* a power of two */
+  Py_ssize_t Used; /* distinct keys */
+  Py_ssize_t Count; /* records indexed */
+  char* Scratch; /* a struct to pack lookup keys in */
+} PyRecordIndex;
+
+static void PyRecordIndex_dealloc(PyRecordIndex* self)
+{
+  Py_XDECREF(self->StructDefinition);
+  Py_XDECREF(self->Buffer);
+
+  if (self->KeyFields != NULL)
+    free(self->KeyFields);
+  if (self->Slots != NULL)
+    free(self->Slots);
+  if (self->Scratch != NULL)
+    free(self->Scratch);
+
+  PyObject_DEL(self);
+}
+
+static unsigned PY_LONG_LONG HashKey(PyRecordIndex* self, const char* Data)
+{
+  unsigned PY_LONG_LONG Hash = 0;
+  int i;
+
+  for (i = 0; i < self->KeyFieldCount; i++)
+    Hash = HashBytes(Hash, Data + self->KeyFields[i]->Offset, 
+      FieldSize(self->KeyFields[i]));
+
+  Hash ^= Hash >> 29;
+  Hash *= 0xbf58476d1ce4e5b9ULL;
+  Hash ^= Hash >> 32;
+
+  return Hash;
+}
+
+static int SameKey(PyRecordIndex* self, const char* a, const char* b)
+{
+  int i;
+
+  for (i = 0; i < self->KeyFieldCount; i++)
+  {
+    PyStructField* Field = self->KeyFields[i];
+    if (memcmp(a + Field->Offset, b + Field->Offset, FieldSize(Field)) != 0)
+      return 0;
+  }
+
+  return 1;
+}
+
+/* Return the slot holding the key of the struct at Key, or the empty 
+   slot where it belongs */
+
+static IndexSlot* FindSlot(PyRecordIndex* self, const char* Records, 
+  const char* Key, unsigned int Hash)
+{
+  Py_ssize_t Mask = self->SlotCount - 1;
+  Py_ssize_t i = Hash & Mask;
+
+  while (self->Slots[i].Record != 0)
+  {
+    IndexSlot* Slot = &self->Slots[i];
+
+    if (Slot->Hash == Hash && SameKey(self, Key, 
+        Records + (Py_ssize_t) (Slot->Record - 1) * 
+          self->StructDefinition->StructSize))
+      return Slot;
+
+    i = (i + 1) & Mask;
+  }
+
+  return &self->Slots[i];
+}
+
+static int GrowIndex(PyRecordIndex* self, Py_ssize_t Needed)
+{
+  IndexSlot* OldSlots = self->Slots;
+  Py_ssize_t OldCount = self->SlotCount;
+  Py_ssize_t SlotCount = OldCount > 0 ? OldCount : 16;
+  Py_ssize_t i;
+
+  /* keep the table at most half full */
+
+  while (SlotCount / 2 < Needed)
+  {
+    if (SlotCount > PY_SSIZE_T_MAX / 2 / (Py_ssize_t) sizeof(IndexSlot))
+    {
+      PyErr_NoMemory();
+      return -1;
+    }
+    SlotCount *= 2;
+  }
+
+  if (SlotCount == OldCount)
+    return 0;
+
+  self->Slots = calloc(SlotCount, sizeof(IndexSlot));
+  if (self->Slots == NULL)
+  {
+    self->Slots = OldSlots;
+    PyErr_NoMemory();
+    return -1;
+  }
+  self->SlotCount = SlotCount;
+
+  for (i = 0; i < OldCount; i++)
+  {
+    if (OldSlots[i].Record != 0)
+    {
+      Py_ssize_t j = OldSlots[i].Hash & (SlotCount - 1);
+
+      while (self->Slots[j].Record != 0)
+        j = (j + 1) & (SlotCount - 1);
+      self->Slots[j] = OldSlots[i];
+    }
+  }
+
+  if (OldSlots != NULL)
+    free(OldSlots);
+
+  return 0;
+}
+
+/* Get the indexed buffer, which must still hold the indexed records */
+
+static int GetIndexView(PyRecordIndex* self, Py_buffer* View)
+{
+  if (PyObject_GetBuffer(self->Buffer, View, PyBUF_SIMPLE) != 0)
+    return -1;
+
+  if (View->len / self->StructDefinition->StructSize < self->Count)
+  {
+    PyErr_SetString(StructError, "buffer shrank below the indexed records");
+    PyBuffer_Release(View);
+    return -1;
+  }
+
+  return 0;
+}
+
+static PyObject* PyRecordIndex_update(PyRecordIndex* self, 
+  PyObject* Unused)
+{
+  Py_buffer View;
+  Py_ssize_t Size = self->StructDefinition->StructSize;
+  Py_ssize_t Records, Added;
+
+  if (GetIndexView(self, &View) != 0)
+    return NULL;
+
+  Records = View.len / Size;
+  Added = Records - self->Count;
+
+  if (Records > UINT_MAX - 1)
+  {
+    PyErr_SetString(StructError, "too many records to index");
+    goto fail;
+  }
+
+  if (GrowIndex(self, self->Used + Added) != 0)
+    goto fail;
+
+  for (; self->Count < Records; self->Count++)
+  {
+    const char* Record = (char*) View.buf + self->Count * Size;
+    unsigned int Hash = (unsigned int) HashKey(self, Record);
+    IndexSlot* Slot = FindSlot(self, View.buf, Record, Hash);
+
+    if (Slot->Record == 0)
+      self->Used++;
+
+    Slot->Hash = Hash;
+    Slot->Record = (unsigned int) self->Count + 1;
+  }
+
+  PyBuffer_Release(&View);
+  return PyLong_FromSsize_t(Added);
+
+fail:
+
+  PyBuffer_Release(&View);
+  return NULL;
+}
+
+/* Pack a key (a value, or a tuple of values for several key fields) into
+   the scratch struct */
+
+static int PackKey(PyRecordIndex* self, PyObject* Key)
+{
+  int i;
+
+  if (self->KeyFieldCount == 1)
+    return PackFieldValue(self->KeyFields[0], 
+      self->Scratch + self->KeyFields[0]->Offset, Key);
+
+  if (!PyTuple_Check(Key) || PyTuple_GET_SIZE(Key) != self->KeyFieldCount)
+  {
+    PyErr_SetString(StructError, "key must be a tuple of key field values");
+    return -1;
+  }
+
+  for (i = 0; i < self->KeyFieldCount; i++)
+  {
+    if (PackFieldValue(self->KeyFields[i], 
+        self->Scratch + self->KeyFields[i]->Offset, 
+        PyTuple_GET_ITEM(Key, i)) != 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+/* Return the number of the record with Key, -1 if there is none and -2
+   on errors */
+
+static Py_ssize_t LookupRecord(PyRecordIndex* self, PyObject* Key, 
+  Py_buffer* View)
+{
+  IndexSlot* Slot;
+
+  if (PackKey(self, Key) != 0)
+    return -2;
+
+  if (self->Used == 0)
+    return -1;
+
+  Slot = FindSlot(self, View->buf, self->Scratch, 
+    (unsigned int) HashKey(self, self->Scratch));
+
+  return (Py_ssize_t) Slot->Record - 1;
+}
+
+/* A record buffer of one record, sharing the memory of the buffer */
+
+static PyObject* NewRecordView(PyRecordIndex* self, Py_ssize_t Record)
+{
+  return NewRecordSlice(self->StructDefinition, self->Buffer, 
+    Record * self->StructDefinition->StructSize, 1);
+}
+
+static PyObject* PyRecordIndex_find(PyRecordIndex* self, PyObject* Key)
+{
+  Py_buffer View;
+  Py_ssize_t Record;
+
+  if (GetIndexView(self, &View) != 0)
+    return NULL;
+
+  Record = LookupRecord(self, Key, &View);
+  PyBuffer_Release(&View);
+
+  if (Record == -2)
+    return NULL;
+
+  return PyLong_FromSsize_t(Record);
+}
+
+static PyObject* PyRecordIndex_get(PyRecordIndex* self, PyObject* args)
+{
+  PyObject* Key;
+  PyObject* Default = Py_None;
+  Py_buffer View;
+  Py_ssize_t Record;
+
+  if (!PyArg_ParseTuple(args, "O|O", &Key, &Default))
+    return NULL;
+
+  if (GetIndexView(self, &View) != 0)
+    return NULL;
+
+  Record = LookupRecord(self, Key, &View);
+  PyBuffer_Release(&View);
+
+  if (Record == -2)
+    return NULL;
+
+  if (Record == -1)
+  {
+    Py_INCREF(Default);
+    return Default;
+  }
+
+  return NewRecordView(self, Record);
+}
+
+static PyObject* PyRecordIndex_get_many(PyRecordIndex* self, 
+  PyObject* Keys)
+{
+  PyObject* Iterator;
+  PyObject* Key;
+  PyObject* Result;
+  Py_buffer View;
+
+  Iterator = PyObject_GetIter(Keys);
+  if (Iterator == NULL)
+    return NULL;
+
+  Result = PyList_New(0);
+  if (Result == NULL || GetIndexView(self, &View) != 0)
+  {
+    Py_XDECREF(Result);
+    Py_DECREF(Iterator);
+    return NULL;
+  }
+
+  while ((Key = PyIter_Next(Iterator)) != NULL)
+  {
+    Py_ssize_t Record = LookupRecord(self, Key, &View);
+    PyObject* Item;
+
+    Py_DECREF(Key);
+    if (Record == -2)
+      goto fail;
+
+    if (Record == -1)
+    {
+      Item = Py_None;
+      Py_INCREF(Item);
+    }
+    else
+    {
+      Item = NewRecordView(self, Record);
+      if (Item == NULL)
+        goto fail;
+    }
+
+    if (PyList_Append(Result, Item) != 0)
+    {
+      Py_DECREF(Item);
+      goto fail;
+    }
+    Py_DECREF(Item);
+  }
+
+  if (PyErr_Occurred())
+    goto fail;
+
+  PyBuffer_Release(&View);
+  Py_DECREF(Iterator);
+  return Result;
+
+fail:
+
+  PyBuffer_Release(&View);
+  Py_DECREF(Iterator);
+  Py_DECREF(Result);
+  return NULL;
+}
+
+static PyMethodDef PyRecordIndex_methods[] = {
+  {"get", (PyCFunction)PyRecordIndex_get, METH_VARARGS,
+   "get(key[, default]) -> record\n"
+   "Return the record with key as a one-record record buffer sharing the\n"
+   "indexed buffer, or default (None) when there is none."},
+  {"find", (PyCFunction)PyRecordIndex_find, METH_O,
+   "find(key) -> int\n"
+   "Return the number of the record with key, -1 when there is none."},
+  {"get_many", (PyCFunction)PyRecordIndex_get_many, METH_O,
+   "get_many(keys) -> list\n"
+   "Look up each of keys as get() does."},
+  {"update", (PyCFunction)PyRecordIndex_update, METH_NOARGS,
+   "update() -> int\n"
+   "Index the records appended to the buffer since the last call and\n"
+   "return their number."},
+  {NULL, NULL}
+};
+
+static Py_ssize_t PyRecordIndex_length(PyRecordIndex* self)
+{
+  return self->Used;
+}
+
+static int PyRecordIndex_contains(PyRecordIndex* self, PyObject* Key)
+{
+  Py_buffer View;
+  Py_ssize_t Record;
+
+  if (GetIndexView(self, &View) != 0)
+    return -1;
+
+  Record = LookupRecord(self, Key, &View);
+  PyBuffer_Release(&View);
+
+  return Record == -2 ? -1 : Record >= 0;
+}
+
+static PySequenceMethods PyRecordIndex_as_sequence = {
+  (lenfunc)PyRecordIndex_length, /*sq_length*/
+  0, /*sq_concat*/
+  0, /*sq_repeat*/
+  0, /*sq_item*/
+  0, /*was_sq_slice*/
+  0, /*sq_ass_item*/
+  0, /*was_sq_ass_slice*/
+  (objobjproc)PyRecordIndex_contains, /*sq_contains*/
+};
+
+static PyMemberDef PyRecordIndex_members[] = {
+  {"layout", T_OBJECT, offsetof(PyRecordIndex, StructDefinition), 
+   READONLY, "struct definition of the records"},
+  {"obj", T_OBJECT, offsetof(PyRecordIndex, Buffer), READONLY,
+   "the indexed buffer object"},
+  {"records", T_PYSSIZET, offsetof(PyRecordIndex, Count), READONLY,
+   "number of records indexed"},
+  {NULL}
+};
+
+PyTypeObject PyRecordIndex_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0) /* type set in PyInit_xstruct() */
+	"xstruct.index",
+	sizeof(PyRecordIndex),
+	0,
+	(destructor)PyRecordIndex_dealloc, /*tp_dealloc*/
+	0,		/*tp_vectorcall_offset*/
+	0,		/*tp_getattr*/
+	0,		/*tp_setattr*/
+	0,		/*tp_as_async*/
+	0,		/*tp_repr*/
+	0,		/*tp_as_number*/
+	&PyRecordIndex_as_sequence,		/*tp_as_sequence*/
+	0,		/*tp_as_mapping*/
+	0,		/*tp_hash*/
+	0,		/*tp_call*/
+	0,		/*tp_str*/
+	PyObject_GenericGetAttr, /*tp_getattro*/
+	0,		/*tp_setattro*/
+	0,		/*tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT,	/*tp_flags*/
+	0,		/*tp_doc*/
+	0,		/*tp_traverse*/
+	0,		/*tp_clear*/
+	0,		/*tp_richcompare*/
+	0,		/*tp_weaklistoffset*/
+	0,		/*tp_iter*/
+	0,		/*tp_iternext*/
+	PyRecordIndex_methods, /*tp_methods*/
+	PyRecordIndex_members, /*tp_members*/
+	0,		/*tp_getset*/
+};
+
+/* Key is a field name or a sequence of them */
+
+static PyObject* NewRecordIndex(PyStructDefinition* StructDefinition,
+  PyObject* Buffer, PyObject* Key)
+{
+  PyRecordIndex* Index;
+  PyObject* Names;
+  PyObject* Result;
+  Py_ssize_t i;
+
+  Index = PyObject_NEW(PyRecordIndex, &PyRecordIndex_Type);
+  if (Index == NULL)
+    return NULL;
+
+  Index->StructDefinition = StructDefinition;
+  Py_INCREF(StructDefinition);
+  Index->Buffer = Buffer;
+  Py_INCREF(Buffer);
+  Index->KeyFields = NULL;
+  Index->KeyFieldCount = 0;
+  Index->Slots = NULL;
+  Index->SlotCount = 0;
+  Index->Used = 0;
+  Index->Count = 0;
+  Index->Scratch = calloc(1, StructDefinition->StructSize);
+  if (Index->Scratch == NULL)
+  {
+    PyErr_NoMemory();
+    goto fail;
+  }
+
+  if (PyUnicode_Check(Key))
+    Names = PyTuple_Pack(1, Key);
+  else
+    Names = PySequence_Tuple(Key);
+  if (Names == NULL)
+    goto fail;
+
+  Index->KeyFields = malloc((PyTuple_GET_SIZE(Names) + 1) * 
+    sizeof(PyStructField*));
+  if (Index->KeyFields == NULL || PyTuple_GET_SIZE(Names) == 0)
+  {
+    if (Index->KeyFields == NULL)
+      PyErr_NoMemory();
+    else
+      PyErr_SetString(StructError, "no key fields given");
+    Py_DECREF(Names);
+    goto fail;
+  }
+
+  for (i = 0; i < PyTuple_GET_SIZE(Names); i++)
+  {
+    PyObject* Name = PyTuple_GET_ITEM(Names, i);
+    PyStructField* Field = NULL;
+
+    if (PyUnicode_Check(Name))
+      Field = (PyStructField*) 
+        PyDict_GetItemWithError(StructDefinition->FieldMap, Name);
+          /* borrowed reference */
+
+    if (Field == NULL)
+    {
+      if (!PyErr_Occurred())
+        PyErr_Format(StructError, "unknown key field %R", Name);
+      Py_DECREF(Names);
+      goto fail;
+    }
+
+    Index->KeyFields[Index->KeyFieldCount++] = Field;
+  }
+  Py_DECREF(Names);
+
+  Result = PyRecordIndex_update(Index, NULL);
+  if (Result == NULL)
+    goto fail;
+  Py_DECREF(Result);
+
+  return (PyObject*) Index;
+
+fail:
+
+  Py_DECREF(Index);
+  return NULL;
+}
+
+/*-----------------*/
+/* Bulk conversion */
+/*-----------------*/
+
+/*
+decode_columns() and encode_columns() convert between a buffer of
+records and one column per field. A column holds the field values of all
+records back to back in native byte order, so the conversion is a plain
+copy (with a byte swap for the standard layouts where needed) and does
+not create Python objects. This allows it to run with the interpreter
+lock released, on several threads, each converting its own range of
+records.
+*/
+
+typedef struct {
+  int Offset;      /* of the field within a record */
+  int ElementSize;
+  int Count;       /* elements per record */
+  int Swap;        /* byte order of elements differs from native */
+  char* Data;      /* the column */
+} ColumnSpec;
+
+typedef struct {
+  char* Records;
+  int StructSize;
+  char* InitialStructData;
+  ColumnSpec* Columns;
+  int ColumnCount;
+  ChecksumSpec* Checksums; /* computed by EncodeRange() */
+  int ChecksumCount;
+} BulkJob;
+
+static int NeedsByteSwap(const formatdef* Table)
+{
+  int n = 1;
+  int LittleEndianHost = (*(char *) &n == 1);
+
+  if (Table == lilendian_table)
+    return !LittleEndianHost;
+  if (Table == bigendian_table)
+    return LittleEndianHost;
+  return 0;
+}
+
+/* The 'array' module type code for a column of Format elements */
+
+static char ColumnTypeCode(const formatdef* Format)
+{
+  int Signed;
+
+  switch (Format->format)
+  {
+    case 'c':
+    case 's':
+    case 'p':
+      return 'B';
+    case 'f':
+      return Format->size == sizeof(float) ? 'f' : '\0';
+    case 'd':
+      return Format->size == sizeof(double) ? 'd' : '\0';
+  }
+
+  Signed = islower(Format->format);
+
+  if (Format->size == 1)
+    return Signed ? 'b' : 'B';
+  if (Format->size == sizeof(short))
+    return Signed ? 'h' : 'H';
+  if (Format->size == sizeof(int))
+    return Signed ? 'i' : 'I';
+  if (Format->size == sizeof(long))
+    return Signed ? 'l' : 'L';
+  if (Format->size == sizeof(PY_LONG_LONG))
+    return Signed ? 'q' : 'Q';
+  return '\0';
+}
+
+static void CopyElements(char* Dest, const char* Source, int Count, 
+  int Size, int Swap)
+{
+  int i, k;
+
+  if (!Swap)
+  {
+    memcpy(Dest, Source, Count * Size);
+    return;
+  }
+
+  for (i = 0; i < Count; i++)
+  {
+    for (k = 0; k < Size; k++)
+      Dest[k] = Source[Size - 1 - k];
+    Dest += Size;
+    Source += Size;
+  }
+}
+
+static void DecodeRange(BulkJob* Job, int First, int Last)
+{
+  int r, c;
+
+  for (r = First; r < Last; r++)
+  {
+    char* Record = Job->Records + (size_t) r * Job->StructSize;
+
+    for (c = 0; c < Job->ColumnCount; c++)
+    {
+      ColumnSpec* Column = &Job->Columns[c];
+      int Width = Column->Count * Column->ElementSize;
+
+      CopyElements(Column->Data + (size_t) r * Width, 
+        Record + Column->Offset, Column->Count, Column->ElementSize,
+        Column->Swap);
+    }
+  }
+}
+
+static void EncodeRange(BulkJob* Job, int First, int Last)
+{
+  int r, c;
+
+  for (r = First; r < Last; r++)
+  {
+    char* Record = Job->Records + (size_t) r * Job->StructSize;
+
+    memcpy(Record, Job->InitialStructData, Job->StructSize);
+
+    for (c = 0; c < Job->ColumnCount; c++)
+    {
+      ColumnSpec* Column = &Job->Columns[c];
+      int Width = Column->Count * Column->ElementSize;
+
+      CopyElements(Record + Column->Offset, 
+        Column->Data + (size_t) r * Width, Column->Count, 
+        Column->ElementSize, Column->Swap);
+    }
+
+    SealChecksums(Job->Checksums, Job->ChecksumCount, Record);
+  }
+}
+
+/* Worker pool */
+
+typedef void (*RangeFunction)(BulkJob*, int, int);
+
+#define MAX_WORKERS 64
+#define MIN_BYTES_PER_WORKER 65536
+
+typedef struct {
+  PyThread_type_lock Start; /* released to hand the worker a range */
+  PyThread_type_lock Done;  /* released by the worker when finished */
+  RangeFunction Function;
+  BulkJob* Job;
+  int First;
+  int Last;
+} Worker;
+
+static Worker Workers[MAX_WORKERS];
+static int WorkerCount = 0;
+static PyThread_type_lock PoolLock = NULL; /* one bulk call at a time */
+
+#if defined(HAVE_FORK) && defined(HAVE_PTHREAD_H)
+#include <pthread.h>
+#define HAVE_POOL_ATFORK
+#endif
+
+#ifdef HAVE_POOL_ATFORK
+
+/* A forked child has none of the worker threads, and the pool lock may
+   be held by a thread that is gone too: start over with an empty pool.
+   The old locks are leaked, as they may still be held. */
+
+static void ResetWorkersAfterFork(void)
+{
+  WorkerCount = 0;
+  PoolLock = PyThread_allocate_lock();
+}
+
+#endif
+
+static void WorkerMain(void* Arg)
+{
+  Worker* Self = (Worker*) Arg;
+
+  for (;;)
+  {
+    PyThread_acquire_lock(Self->Start, WAIT_LOCK);
+    Self->Function(Self->Job, Self->First, Self->Last);
+    PyThread_release_lock(Self->Done);
+  }
+}
+
+/* Make sure there are Count workers, return how many there are */
+
+static int StartWorkers(int Count)
+{
+  Worker* New;
+
+  while (WorkerCount < Count)
+  {
+    New = &Workers[WorkerCount];
+
+    New->Start = PyThread_allocate_lock();
+    New->Done = PyThread_allocate_lock();
+    if (New->Start == NULL || New->Done == NULL)
+      goto fail;
+
+    /* both locks are held until there is work, resp. it is done */
+
+    PyThread_acquire_lock(New->Start, WAIT_LOCK);
+    PyThread_acquire_lock(New->Done, WAIT_LOCK);
+
+    if (PyThread_start_new_thread(WorkerMain, New) == 
+        PYTHREAD_INVALID_THREAD_ID)
+    {
+      PyThread_release_lock(New->Start);
+      PyThread_release_lock(New->Done);
+      goto fail;
+    }
+
+    WorkerCount++;
+  }
+
+  return Count;
+
+fail:
+
+  if (New->Start != NULL)
+    PyThread_free_lock(New->Start);
+  if (New->Done != NULL)
+    PyThread_free_lock(New->Done);
+
+  return WorkerCount;
+}
+
+static int DefaultThreadCount(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+  long Count = sysconf(_SC_NPROCESSORS_ONLN);
+  if (Count > 0)
+    return Count < MAX_WORKERS ? (int) Count : MAX_WORKERS;
+#endif
+  return 1;
+}
+
+/* Run Function over records [0, Total) on up to Threads threads, with
+   the interpreter lock released */
+
+static void RunBulkJob(RangeFunction Function, BulkJob* Job, int Total, 
+  int Threads)
+{
+  int MinRecords = MIN_BYTES_PER_WORKER / Job->StructSize + 1;
+  int Parts, k;
+
+  if (Threads <= 0)
+    Threads = DefaultThreadCount();
+  if (Threads > MAX_WORKERS)
+    Threads = MAX_WORKERS;
+
+  Parts = Total / MinRecords;
+  if (Parts > Threads)
+    Parts = Threads;
+
+  Py_BEGIN_ALLOW_THREADS
+
+  if (Parts <= 1)
+    Function(Job, 0, Total);
+  else
+  {
+    PyThread_acquire_lock(PoolLock, WAIT_LOCK);
+
+    Parts = StartWorkers(Parts - 1) + 1;
+
+    for (k = 1; k < Parts; k++)
+    {
+      Worker* Helper = &Workers[k - 1];
+      Helper->Function = Function;
+      Helper->Job = Job;
+      Helper->First = (int) ((PY_LONG_LONG) Total * k / Parts);
+      Helper->Last = (int) ((PY_LONG_LONG) Total * (k + 1) / Parts);
+      PyThread_release_lock(Helper->Start);
+    }
+
+    Function(Job, 0, (int) ((PY_LONG_LONG) Total / Parts));
+
+    for (k = 1; k < Parts; k++)
+      PyThread_acquire_lock(Workers[k - 1].Done, WAIT_LOCK);
+
+    PyThread_release_lock(PoolLock);
+  }
+
+  Py_END_ALLOW_THREADS
+}
+
+/* Layouts: a struct definition or a format string */
+
+static PyStructDefinition* GetLayout(PyObject* Layout)
+{
+  if (Py_TYPE(Layout) == &PyStructDefinition_Type)
+  {
+    Py_INCREF(Layout);
+    return (PyStructDefinition*) Layout;
+  }
+  return GetCompiledFormat(Layout);
+}
+
+static int InitColumnSpec(ColumnSpec* Column, PyStructDefinition* 
+  StructDefinition, PyStructField* Field)
+{
+  const formatdef* Format = Field->Format;
+
+  if (ColumnTypeCode(Format) == '\0')
+  {
+    PyErr_SetString(StructError, "field type not supported in columns");
+    return -1;
+  }
+
+  Column->Offset = Field->Offset;
+  Column->ElementSize = Format->size;
+  Column->Count = Field->RepeatCount;
+  Column->Swap = NeedsByteSwap(Field->Table) && 
+    Format->size > 1 && ColumnTypeCode(Format) != 'B';
+  Column->Data = NULL;
+
+  return 0;
+}
+
+static PyObject* ArrayType = NULL; /* array.array */
+
+static int ImportArrayType(void)
+{
+  PyObject* ArrayModule = PyImport_ImportModule("array");
+  if (ArrayModule == NULL)
+    return -1;
+  ArrayType = PyObject_GetAttrString(ArrayModule, "array");
+  Py_DECREF(ArrayModule);
+
+  return ArrayType != NULL ? 0 : -1;
+}
+
+/* A zeroed array.array of Count elements for Field's column, which the
+   records are decoded into in place */
+
+static PyObject* NewColumnArray(PyStructField* Field, Py_ssize_t Count)
+{
+  char TypeCode[2];
+  PyObject* Single;
+  PyObject* Result;
+
+  if (ArrayType == NULL && ImportArrayType() != 0)
+    return NULL;
+
+  TypeCode[0] = ColumnTypeCode(Field->Format);
+  TypeCode[1] = '\0';
+
+  Single = PyObject_CallFunction(ArrayType, "s(i)", TypeCode, 0);
+  if (Single == NULL)
+    return NULL;
+  Result = PySequence_Repeat(Single, Count);
+  Py_DECREF(Single);
+
+  return Result;
+}
+
+static char decode_columns__doc__[] = "\
+decode_columns(layout, buffer[, threads]) -> columns\n\
+Convert a buffer of records into one array.array per field. layout is\n\
+a struct definition or a format string. For a struct definition, the\n\
+result is a dictionary keyed by field name, for a format string it is a\n\
+tuple with a column per value. Repeated fields are flattened and string\n\
+fields give 'B' arrays of their raw bytes. The conversion runs with the\n\
+interpreter lock released, on threads threads (default: one per CPU).";
+
+static PyObject* struct_decode_columns(PyObject* self, PyObject* args)
+{
+  PyObject* Layout;
+  Py_buffer Buffer;
+  int Threads = 0;
+
+  PyStructDefinition* StructDefinition;
+  PyObject* Fields = NULL;
+  PyObject* Result = NULL;
+  Py_buffer* Views = NULL;
+  int ViewCount = 0;
+  BulkJob Job;
+  int Records, FieldCount, i;
+
+  Job.Columns = NULL;
+
+  if (!PyArg_ParseTuple(args, "Oy*|i", &Layout, &Buffer, &Threads))
+    return NULL;
+
+  StructDefinition = GetLayout(Layout);
+  if (StructDefinition == NULL)
+  {
+    PyBuffer_Release(&Buffer);
+    return NULL;
+  }
+
+  if (Buffer.len % StructDefinition->StructSize != 0 ||
+      Buffer.len / StructDefinition->StructSize > INT_MAX)
+  {
+    PyErr_SetString(StructError, 
+      "buffer size is not a multiple of the struct size");
+    goto fail;
+  }
+
+  Records = (int) (Buffer.len / StructDefinition->StructSize);
+  Fields = StructDefinition->FieldList;
+  FieldCount = PyList_Size(Fields);
+
+  Job.Records = Buffer.buf;
+  Job.StructSize = StructDefinition->StructSize;
+  Job.ColumnCount = 0;
+  Job.Columns = malloc((FieldCount + 1) * sizeof(ColumnSpec));
+  Views = malloc((FieldCount + 1) * sizeof(Py_buffer));
+  if (Job.Columns == NULL || Views == NULL)
+  {
+    PyErr_NoMemory();
+    goto fail;
+  }
+
+  if (Layout == (PyObject*) StructDefinition)
+    Result = PyDict_New();
+  else
+    Result = PyTuple_New(FieldCount);
+  if (Result == NULL)
+    goto fail;
+
+  /* the columns are decoded straight into the arrays returned */
+
+  for (i = 0; i < FieldCount; i++)
+  {
+    PyStructField* Field = (PyStructField*) PyList_GET_ITEM(Fields, i);
+    ColumnSpec* Column = &Job.Columns[Job.ColumnCount];
+    PyObject* Array;
+
+    if (PyDict_Check(Result) && Field->Name == NULL)
+      continue;
+
+    if (InitColumnSpec(Column, StructDefinition, Field) != 0)
+      goto fail;
+
+    Array = NewColumnArray(Field, (Py_ssize_t) Records * Column->Count);
+    if (Array == NULL)
+      goto fail;
+
+    if (PyTuple_Check(Result))
+      PyTuple_SET_ITEM(Result, i, Array); /* steals the reference */
+    else
+    {
+      if (PyDict_SetItem(Result, Field->Name, Array) != 0)
+      {
+        Py_DECREF(Array);
+        goto fail;
+      }
+      Py_DECREF(Array);
+    }
+
+    if (PyObject_GetBuffer(Array, &Views[ViewCount], PyBUF_WRITABLE) != 0)
+      goto fail;
+    ViewCount++;
+
+    Column->Data = Views[ViewCount - 1].buf;
+    Job.ColumnCount++;
+  }
+
+  RunBulkJob(DecodeRange, &Job, Records, Threads);
+
+  for (i = 0; i < ViewCount; i++)
+    PyBuffer_Release(&Views[i]);
+  free(Views);
+  free(Job.Columns);
+  Py_DECREF(StructDefinition);
+  PyBuffer_Release(&Buffer);
+  return Result;
+
+fail:
+
+  for (i = 0; i < ViewCount; i++)
+    PyBuffer_Release(&Views[i]);
+  if (Views != NULL)
+    free(Views);
+  if (Job.Columns != NULL)
+    free(Job.Columns);
+  Py_XDECREF(Result);
+  Py_DECREF(StructDefinition);
+  PyBuffer_Release(&Buffer);
+  return NULL;
+}
+
+static char encode_columns__doc__[] = "\
+encode_columns(layout, columns[, threads]) -> bytes\n\
+The reverse of decode_columns(): build a buffer of records from columns,\n\
+which is a dictionary keyed by field name for a struct definition and a\n\
+sequence with a column per value for a format string. A column is any\n\
+bytes-like object, like an array.array. Fields without a column\n\
+keep their initial value.";
+
+static PyObject* struct_encode_columns(PyObject* self, PyObject* args)
+{
+  PyObject* Layout;
+  PyObject* ColumnObjects;
+  int Threads = 0;
+
+  PyStructDefinition* StructDefinition;
+  PyObject* Fields;
+  PyObject* Result = NULL;
+  Py_buffer* Views = NULL;
+  int ViewCount = 0;
+  BulkJob Job;
+  Py_ssize_t Records = -1;
+  int FieldCount, i;
+
+  Job.Columns = NULL;
+
+  if (!PyArg_ParseTuple(args, "OO|i", &Layout, &ColumnObjects, &Threads))
+    return NULL;
+
+  StructDefinition = GetLayout(Layout);
+  if (StructDefinition == NULL)
+    return NULL;
+
+  Fields = StructDefinition->FieldList;
+  FieldCount = PyList_Size(Fields);
+
+  if (Layout == (PyObject*) StructDefinition)
+  {
+    if (!PyDict_Check(ColumnObjects))
+    {
+      PyErr_SetString(StructError, "columns must be a dictionary");
+      goto fail;
+    }
+  }
+  else if (PySequence_Size(ColumnObjects) != FieldCount)
+  {
+    if (!PyErr_Occurred())
+      PyErr_SetString(StructError, "column count does not match format");
+    goto fail;
+  }
+
+  Job.StructSize = StructDefinition->StructSize;
+  Job.InitialStructData = StructDefinition->InitialStructData;
+  Job.Checksums = StructDefinition->Checksums;
+  Job.ChecksumCount = StructDefinition->ChecksumCount;
+  Job.ColumnCount = 0;
+  Job.Columns = malloc((FieldCount + 1) * sizeof(ColumnSpec));
+  Views = malloc((FieldCount + 1) * sizeof(Py_buffer));
+  if (Job.Columns == NULL || Views == NULL)
+  {
+    PyErr_NoMemory();
+    goto fail;
+  }
+
+  for (i = 0; i < FieldCount; i++)
+  {
+    PyStructField* Field = (PyStructField*) PyList_GET_ITEM(Fields, i);
+    ColumnSpec* Column = &Job.Columns[Job.ColumnCount];
+    Py_buffer* View = &Views[ViewCount];
+    PyObject* ColumnObject;
+    int Width;
+
+    if (PyDict_Check(ColumnObjects))
+    {
+      if (Field->Name == NULL)
+        continue;
+      ColumnObject = PyDict_GetItem(ColumnObjects, Field->Name);
+      if (ColumnObject == NULL)
+        continue;
+      Py_INCREF(ColumnObject);
+    }
+    else
+    {
+      ColumnObject = PySequence_GetItem(ColumnObjects, i);
+      if (ColumnObject == NULL)
+        goto fail;
+    }
+
+    if (PyObject_GetBuffer(ColumnObject, View, PyBUF_SIMPLE) != 0)
+    {
+      Py_DECREF(ColumnObject);
+      goto fail;
+    }
+    Py_DECREF(ColumnObject); /* the view keeps the column alive */
+    ViewCount++;
+
+    if (InitColumnSpec(Column, StructDefinition, Field) != 0)
+      goto fail;
+
+    Width = Column->Count * Column->ElementSize;
+    if (Width == 0)
+      continue;
+
+    if (View->len % Width != 0 || 
+        (Records >= 0 && View->len / Width != Records))
+    {
+      PyErr_SetString(StructError, "column sizes do not match");
+      goto fail;
+    }
+
+    Records = View->len / Width;
+    Column->Data = View->buf;
+    Job.ColumnCount++;
+  }
+
+  if (Records < 0)
+  {
+    PyErr_SetString(StructError, "no columns given");
+    goto fail;
+  }
+
+  if (Records > INT_MAX)
+  {
+    PyErr_SetString(StructError, "too many records");
+    goto fail;
+  }
+
+  Result = PyBytes_FromStringAndSize(NULL, Records * Job.StructSize);
+  if (Result == NULL)
+    goto fail;
+
+  Job.Records = PyBytes_AS_STRING(Result);
+
+  RunBulkJob(EncodeRange, &Job, (int) Records, Threads);
+
+fail:
+
+  while (ViewCount > 0)
+    PyBuffer_Release(&Views[--ViewCount]);
+  if (Views != NULL)
+    free(Views);
+  if (Job.Columns != NULL)
+    free(Job.Columns);
+  Py_DECREF(StructDefinition);
+  return Result;
+}
+
+/* Batch packing */
+
+/* Pack one record, a sequence with a value per field or a struct object
+   of the layout, into the struct at Data */
+
+static int PackRecord(PyStructDefinition* StructDefinition, 
+  PyObject* Record, char* Data)
+{
+  PyObject* Values;
+  Py_ssize_t FieldCount = PyList_GET_SIZE(StructDefinition->FieldList);
+  Py_ssize_t i;
+
+  if (Py_TYPE(Record) == &PyStructObject_Type &&
+      ((PyStructObject*) Record)->StructDefinition == StructDefinition)
+  {
+    memcpy(Data, ((PyStructObject*) Record)->StructData, 
+      StructDefinition->StructSize);
+    goto seal;
+  }
+
+  Values = PySequence_Fast(Record, "record must be a sequence");
+  if (Values == NULL)
+    return -1;
+
+  if (PySequence_Fast_GET_SIZE(Values) != FieldCount)
+  {
+    PyErr_SetString(StructError, "record size does not match format");
+    Py_DECREF(Values);
+    return -1;
+  }
+
+  memcpy(Data, StructDefinition->InitialStructData, 
+    StructDefinition->StructSize);
+
+  for (i = 0; i < FieldCount; i++)
+  {
+    if (SetFieldValue(
+        (PyStructField*) PyList_GET_ITEM(StructDefinition->FieldList, i),
+        Data, PySequence_Fast_GET_ITEM(Values, i)) != 0)
+    {
+      Py_DECREF(Values);
+      return -1;
+    }
+  }
+
+  Py_DECREF(Values);
+
+seal:
+
+  SealChecksums(StructDefinition->Checksums, 
+    StructDefinition->ChecksumCount, Data);
+  return 0;
+}
+
+static char pack_many__doc__[] = "\
+pack_many(layout, records[, buffer[, offset]]) -> bytes or int\n\
+Pack an iterable of records back to back, as pack() would pack each of\n\
+them. layout is a format string or a structdef; a record is a sequence\n\
+with a value per field (or, for a structdef, one of its struct objects).\n\
+Without buffer, return the packed records as bytes. With a writable\n\
+buffer, pack them into it starting at offset (default: 0) and return\n\
+the number of records packed.";
+
+static PyObject* struct_pack_many(PyObject* self, PyObject* args)
+{
+  PyObject* Layout;
+  PyObject* Records;
+  PyObject* Buffer = NULL;
+  Py_ssize_t Offset = 0;
+
+  PyStructDefinition* StructDefinition;
+  PyObject* Iterator = NULL;
+  PyObject* Record;
+  PyObject* Result = NULL;
+  Py_buffer View;
+  char* Data;
+  Py_ssize_t Size, Capacity, Count = 0;
+
+  View.obj = NULL;
+
+  if (!PyArg_ParseTuple(args, "OO|On", &Layout, &Records, &Buffer, 
+      &Offset))
+    return NULL;
+
+  StructDefinition = GetLayout(Layout);
+  if (StructDefinition == NULL)
+    return NULL;
+
+  Size = StructDefinition->StructSize;
+
+  if (Buffer != NULL)
+  {
+    if (PyObject_GetBuffer(Buffer, &View, PyBUF_WRITABLE) != 0)
+      goto fail;
+
+    if (Offset < 0 || Offset > View.len)
+    {
+      PyErr_SetString(StructError, "offset out of buffer");
+      goto fail;
+    }
+
+    Data = (char*) View.buf + Offset;
+    Capacity = (View.len - Offset) / Size;
+  }
+  else
+  {
+    /* start with room for the expected number of records and grow the
+       result geometrically when there are more */
+
+    Capacity = PyObject_LengthHint(Records, 16);
+    if (Capacity < 0)
+      goto fail;
+    if (Capacity == 0)
+      Capacity = 1;
+    if (Capacity > PY_SSIZE_T_MAX / Size)
+    {
+      PyErr_NoMemory();
+      goto fail;
+    }
+
+    Result = PyBytes_FromStringAndSize(NULL, Capacity * Size);
+    if (Result == NULL)
+      goto fail;
+    Data = PyBytes_AS_STRING(Result);
+  }
+
+  Iterator = PyObject_GetIter(Records);
+  if (Iterator == NULL)
+    goto fail;
+
+  while ((Record = PyIter_Next(Iterator)) != NULL)
+  {
+    if (Count == Capacity)
+    {
+      if (Buffer != NULL)
+      {
+        Py_DECREF(Record);
+        PyErr_SetString(StructError, "buffer too small for the records");
+        goto fail;
+      }
+
+      if (Capacity > PY_SSIZE_T_MAX / 2 / Size)
+      {
+        Py_DECREF(Record);
+        PyErr_NoMemory();
+        goto fail;
+      }
+
+      Capacity *= 2;
+      if (_PyBytes_Resize(&Result, Capacity * Size) != 0)
+      {
+        Py_DECREF(Record);
+        goto fail;
+      }
+      Data = PyBytes_AS_STRING(Result);
+    }
+
+    if (PackRecord(StructDefinition, Record, Data + Count * Size) != 0)
+    {
+      Py_DECREF(Record);
+      goto fail;
+    }
+
+    Py_DECREF(Record);
+    Count++;
+  }
+
+  if (PyErr_Occurred())
+    goto fail;
+
+  Py_DECREF(Iterator);
+  Py_DECREF(StructDefinition);
+
+  if (Buffer != NULL)
+  {
+    PyBuffer_Release(&View);
+    return PyLong_FromSsize_t(Count);
+  }
+
+  if (Count < Capacity)
+    _PyBytes_Resize(&Result, Count * Size);
+
+  return Result;
+
+fail:
+
+  Py_XDECREF(Iterator);
+  Py_XDECREF(Result);
+  if (View.obj != NULL)
+    PyBuffer_Release(&View);
+  Py_DECREF(StructDefinition);
+  return NULL;
+}
+
+/*----------------*/
+/* Record filters */
+/*----------------*/
+
+/*
+A record filter is a predicate over the fields of a struct, compiled
+from nested tuples:
+
+  (name, op, value)       op is '==', '!=', '<', '<=', '>', '>=' or 'in'
+  ('and', expr, ...)
+  ('or', expr, ...)
+  ('not', expr)
+
+Each comparison is bound to the offset and coding of its field. The
+value is converted once: packed into the field format for string and
+char fields, which are then compared with memcmp, or held as a C
+integer or double for numeric ones. An integer value outside the range
+of the field folds the comparison to a constant. 'in' becomes an 'or'
+of equalities. The nodes are stored in prefix order in one array, each
+with the length of its subtree, so and/or can skip the operands they
+do not need.
+
+Filters run over a buffer of records without the interpreter lock and
+without creating Python objects, and return the numbers of the records
+that match, their count, or a buffer of just those records.
+*/
+
+#define FILTER_FALSE 0
+#define FILTER_TRUE 1
+#define FILTER_AND 2
+#define FILTER_OR 3
+#define FILTER_NOT 4
+#define FILTER_COMPARE 5
+
+typedef struct {
+  int Kind;
+  int Length; /* nodes in the subtree, this one included */
+  int Compare; /* Py_LT ... Py_GE */
+  char Domain; /* compared as 'i', 'u', 'f' or 'b' (memcmp) */
+  FieldCheck Check; /* the field; Min or Values holds the operand */
+} FilterNode;
+
+typedef struct {
+  PyObject_HEAD
+  PyStructDefinition* StructDefinition;
+  PyObject* Expression;
+  FilterNode* Nodes;
+  int NodeCount;
+} PyRecordFilter;
+
+static void PyRecordFilter_dealloc(PyRecordFilter* self)
+{
+  int i;
+
+  Py_XDECREF(self->StructDefinition);
+  Py_XDECREF(self->Expression);
+
+  if (self->Nodes != NULL)
+  {
+    for (i = 0; i < self->NodeCount; i++)
+      if (self->Nodes[i].Check.Values != NULL)
+        free(self->Nodes[i].Check.Values);
+    free(self->Nodes);
+  }
+
+  PyObject_DEL(self);
+}
+
+static int OrderMatches(int Compare, int Order)
+{
+  switch (Compare)
+  {
+    case Py_LT: return Order < 0;
+    case Py_LE: return Order <= 0;
+    case Py_EQ: return Order == 0;
+    case Py_NE: return Order != 0;
+    case Py_GT: return Order > 0;
+  }
+
+  return Order >= 0;
+}
+
+static int CompareElement(const FilterNode* Node, const char* p)
+{
+  const FieldCheck* Check = &Node->Check;
+  CheckBound x;
+  int Order;
+
+  if (Node->Domain == 'b')
+    return OrderMatches(Node->Compare, memcmp(p, Check->Values, 
+      Check->Size));
+
+  x = LoadElement(Check, p);
+
+  switch (Node->Domain)
+  {
+    case 'i':
+      Order = (x.i > Check->Min.i) - (x.i < Check->Min.i);
+      break;
+    case 'u':
+      Order = (x.u > Check->Min.u) - (x.u < Check->Min.u);
+      break;
+    default:
+      if (Check->Type == 'i')
+        x.f = (double) x.i;
+      else if (Check->Type == 'u')
+        x.f = (double) x.u;
+
+      if (x.f != x.f || Check->Min.f != Check->Min.f)
+        return Node->Compare == Py_NE; /* NaN */
+      Order = (x.f > Check->Min.f) - (x.f < Check->Min.f);
+  }
+
+  return OrderMatches(Node->Compare, Order);
+}
+
+static int RunFilterNode(const FilterNode* Node, const char* Data)
+{
+  const FilterNode* Operand;
+  const FilterNode* End;
+  int Stop;
+
+  switch (Node->Kind)
+  {
+    case FILTER_COMPARE:
+      return CompareElement(Node, Data + Node->Check.Offset);
+    case FILTER_NOT:
+      return !RunFilterNode(Node + 1, Data);
+    case FILTER_AND:
+    case FILTER_OR:
+      Stop = (Node->Kind == FILTER_OR);
+      End = Node + Node->Length;
+      for (Operand = Node + 1; Operand < End; Operand += Operand->Length)
+        if (RunFilterNode(Operand, Data) == Stop)
+          return Stop;
+      return !Stop;
+  }
+
+  return Node->Kind; /* FILTER_FALSE or FILTER_TRUE */
+}
+
+/* Compiling */
+
+static int AppendFilterNode(PyRecordFilter* self, int Kind)
+{
+  FilterNode* Nodes;
+
+  Nodes = realloc(self->Nodes, (self->NodeCount + 1) * sizeof(FilterNode));
+  if (Nodes == NULL)
+  {
+    PyErr_NoMemory();
+    return -1;
+  }
+  self->Nodes = Nodes;
+
+  memset(&Nodes[self->NodeCount], 0, sizeof(FilterNode));
+  Nodes[self->NodeCount].Kind = Kind;
+  Nodes[self->NodeCount].Length = 1;
+  return self->NodeCount++;
+}
+
+static char* FilterOperators[] = {
+  "<", "<=", "==", "!=", ">", ">=", "in", NULL /* Py_LT ... Py_GE */
+};
+
+#define FILTER_IN 6
+
+static int LookupFilterOperator(PyObject* Operator)
+{
+  const char* Name;
+  int i;
+
+  if (!PyUnicode_Check(Operator))
+    return -1;
+
+  Name = PyUnicode_AsUTF8(Operator);
+  if (Name == NULL)
+  {
+    PyErr_Clear();
+    return -1;
+  }
+
+  for (i = 0; FilterOperators[i] != NULL; i++)
+    if (strcmp(Name, FilterOperators[i]) == 0)
+      return i;
+
+  return -1;
+}
+
+/* Set the operand of a comparison on an integer field. Return the side
+   of the field's range the value lies beyond, if it does: -1 below, 1
+   above, 0 when within. */
+
+static int ParseIntegerOperand(FilterNode* Node, PyObject* Value, 
+  int* Side)
+{
+  FieldCheck* Check = &Node->Check;
+  PY_LONG_LONG x;
+  int Overflow;
+
+  Value = PyNumber_Index(Value);
+  if (Value == NULL)
+    return -1;
+
+  *Side = 0;
+  x = PyLong_AsLongLongAndOverflow(Value, &Overflow);
+  if (x == -1 && PyErr_Occurred())
+    goto fail;
+
+  if (Check->Type == 'u' && Check->Size == 8)
+  {
+    /* the one case the field can exceed a long long */
+
+    if (Overflow < 0 || (Overflow == 0 && x < 0))
+      *Side = -1;
+    else
+    {
+      Node->Domain = 'u';
+      Check->Min.u = PyLong_AsUnsignedLongLong(Value);
+      if (Check->Min.u == (unsigned PY_LONG_LONG) -1 && PyErr_Occurred())
+      {
+        if (!PyErr_ExceptionMatches(PyExc_OverflowError))
+          goto fail;
+        PyErr_Clear();
+        *Side = 1;
+      }
+    }
+  }
+  else if (Overflow != 0)
+    *Side = Overflow;
+  else
+  {
+    Node->Domain = 'i'; /* unsigned fields narrower than 8 bytes fit */
+    Check->Min.i = x;
+  }
+
+  Py_DECREF(Value);
+  return 0;
+
+fail:
+
+  Py_DECREF(Value);
+  return -1;
+}
+
+static int CompileComparison(PyRecordFilter* self, PyStructField* Field,
+  int Compare, PyObject* Value)
+{
+  FilterNode* Node;
+  int i, Side = 0;
+
+  i = AppendFilterNode(self, FILTER_COMPARE);
+  if (i < 0)
+    return -1;
+  Node = &self->Nodes[i];
+  Node->Compare = Compare;
+  InitFieldCheck(&Node->Check, 0, Field, Field->Table);
+
+  if (Node->Check.Count != 1)
+  {
+    PyErr_Format(StructError, 
+      "field '%U': only single-element fields can be compared", 
+      Field->Name);
+    return -1;
+  }
+
+  switch (Node->Check.Type)
+  {
+    case 'b':
+      if (Field->Format->format == 'p' && Compare != Py_EQ && 
+          Compare != Py_NE)
+      {
+        PyErr_Format(StructError, 
+          "field '%U': pascal strings compare for equality only", 
+          Field->Name);
+        return -1;
+      }
+
+      Node->Domain = 'b';
+      Node->Check.Values = calloc(1, Node->Check.Size);
+      if (Node->Check.Values == NULL)
+      {
+        PyErr_NoMemory();
+        return -1;
+      }
+      return PackElement(Field, Node->Check.Values, Value);
+    case 'i':
+    case 'u':
+      if (!PyFloat_Check(Value))
+      {
+        if (ParseIntegerOperand(Node, Value, &Side) != 0)
+          return -1;
+        break;
+      }
+      /* fall through, compared as doubles */
+    default:
+      Node->Domain = 'f';
+      Node->Check.Min.f = PyFloat_AsDouble(Value);
+      if (Node->Check.Min.f == -1.0 && PyErr_Occurred())
+        return -1;
+  }
+
+  if (Side != 0) /* the field is on the other side of Value */
+    Node->Kind = OrderMatches(Compare, -Side) ? FILTER_TRUE : FILTER_FALSE;
+
+  return 0;
+}
+
+static int CompileFilterNode(PyRecordFilter* self, PyObject* Expression)
+{
+  Py_ssize_t Size, i;
+  PyObject* Head;
+  const char* Name;
+  int Operator, Node, Kind, Result = -1;
+
+  if (!PyTuple_Check(Expression) || PyTuple_GET_SIZE(Expression) < 2)
+  {
+    PyErr_Format(StructError, "invalid filter expression %R", Expression);
+    return -1;
+  }
+
+  if (Py_EnterRecursiveCall(" while compiling a filter"))
+    return -1;
+
+  Size = PyTuple_GET_SIZE(Expression);
+  Head = PyTuple_GET_ITEM(Expression, 0);
+  Operator = Size == 3 ? 
+    LookupFilterOperator(PyTuple_GET_ITEM(Expression, 1)) : -1;
+
+  if (Operator >= 0)
+  {
+    PyObject* Value = PyTuple_GET_ITEM(Expression, 2);
+    PyStructField* Field = NULL;
+
+    if (PyUnicode_Check(Head))
+      Field = (PyStructField*) 
+        PyDict_GetItemWithError(self->StructDefinition->FieldMap, Head);
+          /* borrowed reference */
+
+    if (Field == NULL)
+    {
+      if (!PyErr_Occurred())
+        PyErr_Format(StructError, "unknown field %R in filter", Head);
+      goto fail;
+    }
+
+    if (Operator != FILTER_IN)
+    {
+      Result = CompileComparison(self, Field, Operator, Value);
+      goto fail;
+    }
+
+    /* 'in' is an 'or' of equalities */
+
+    Value = PySequence_Fast(Value, "'in' needs a sequence of values");
+    if (Value == NULL)
+      goto fail;
+
+    Node = AppendFilterNode(self, FILTER_OR);
+    for (i = 0; Node >= 0 && i < PySequence_Fast_GET_SIZE(Value); i++)
+      if (CompileComparison(self, Field, Py_EQ, 
+          PySequence_Fast_GET_ITEM(Value, i)) != 0)
+        Node = -1;
+    Py_DECREF(Value);
+  }
+  else
+  {
+    Name = PyUnicode_Check(Head) ? PyUnicode_AsUTF8(Head) : NULL;
+    if (Name == NULL)
+      PyErr_Clear();
+
+    if (Name != NULL && strcmp(Name, "and") == 0)
+      Kind = FILTER_AND;
+    else if (Name != NULL && strcmp(Name, "or") == 0)
+      Kind = FILTER_OR;
+    else if (Name != NULL && strcmp(Name, "not") == 0 && Size == 2)
+      Kind = FILTER_NOT;
+    else
+    {
+      PyErr_Format(StructError, "invalid filter expression %R", 
+        Expression);
+      goto fail;
+    }
+
+    Node = AppendFilterNode(self, Kind);
+    for (i = 1; Node >= 0 && i < Size; i++)
+      if (CompileFilterNode(self, PyTuple_GET_ITEM(Expression, i)) != 0)
+        Node = -1;
+  }
+
+  if (Node >= 0)
+  {
+    self->Nodes[Node].Length = self->NodeCount - Node;
+    Result = 0;
+  }
+
+fail:
+
+  Py_LeaveRecursiveCall();
+  return Result;
+}
+
+/* Running */
+
+static int GetFilterView(PyRecordFilter* self, PyObject* Buffer, 
+  Py_buffer* View)
+{
+  if (PyObject_GetBuffer(Buffer, View, PyBUF_SIMPLE) != 0)
+    return -1;
+
+  if (View->len % self->StructDefinition->StructSize != 0)
+  {
+    PyErr_SetString(StructError, 
+      "buffer size is not a multiple of the struct size");
+    PyBuffer_Release(View);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Run the filter over the records of View. Store the numbers of the
+   matching records in Matches and copy them to Output, if not NULL, and
+   return their count. */
+
+static Py_ssize_t ScanRecords(PyRecordFilter* self, Py_buffer* View, 
+  PY_LONG_LONG* Matches, char* Output)
+{
+  const FilterNode* Root = self->Nodes;
+  Py_ssize_t Size = self->StructDefinition->StructSize;
+  Py_ssize_t Records = View->len / Size;
+  Py_ssize_t Count = 0, Start = -1, r;
+  const char* Data = View->buf;
+
+  Py_BEGIN_ALLOW_THREADS
+
+  for (r = 0; r <= Records; r++)
+  {
+    if (r < Records && RunFilterNode(Root, Data + r * Size))
+    {
+      if (Matches != NULL)
+        Matches[Count] = r;
+      if (Start < 0)
+        Start = r;
+      Count++;
+    }
+    else if (Start >= 0)
+    {
+      /* copy each run of matching records at once */
+
+      if (Output != NULL)
+        memcpy(Output + (Count - (r - Start)) * Size, Data + Start * Size,
+          (r - Start) * Size);
+      Start = -1;
+    }
+  }
+
+  Py_END_ALLOW_THREADS
+
+  return Count;
+}
+
+static PyObject* PyRecordFilter_count(PyRecordFilter* self, 
+  PyObject* Buffer)
+{
+  Py_buffer View;
+  Py_ssize_t Count;
+
+  if (GetFilterView(self, Buffer, &View) != 0)
+    return NULL;
+
+  Count = ScanRecords(self, &View, NULL, NULL);
+  PyBuffer_Release(&View);
+
+  return PyLong_FromSsize_t(Count);
+}
+
+static PyObject* PyRecordFilter_indices(PyRecordFilter* self, 
+  PyObject* Buffer)
+{
+  PyObject* Indices;
+  PyObject* Result;
+  Py_buffer View;
+  Py_ssize_t Records;
+
+  if (GetFilterView(self, Buffer, &View) != 0)
+    return NULL;
+
+  Records = View.len / self->StructDefinition->StructSize;
+  if (Records > PY_SSIZE_T_MAX / (Py_ssize_t) sizeof(PY_LONG_LONG))
+  {
+    PyBuffer_Release(&View);
+    return PyErr_NoMemory();
+  }
+
+  Indices = PyBytes_FromStringAndSize(NULL, 
+    Records * sizeof(PY_LONG_LONG));
+  if (Indices == NULL)
+  {
+    PyBuffer_Release(&View);
+    return NULL;
+  }
+
+  Records = ScanRecords(self, &View, 
+    (PY_LONG_LONG*) PyBytes_AS_STRING(Indices), NULL);
+  PyBuffer_Release(&View);
+
+  if (_PyBytes_Resize(&Indices, Records * sizeof(PY_LONG_LONG)) != 0)
+    return NULL;
+
+  if (ArrayType == NULL && ImportArrayType() != 0)
+  {
+    Py_DECREF(Indices);
+    return NULL;
+  }
+
+  Result = PyObject_CallFunction(ArrayType, "sO", "q", Indices);
+  Py_DECREF(Indices);
+  return Result;
+}
+
+static PyObject* PyRecordFilter_select(PyRecordFilter* self, 
+  PyObject* Buffer)
+{
+  PyObject* Result;
+  Py_buffer View;
+  Py_ssize_t Size, Records;
+
+  if (GetFilterView(self, Buffer, &View) != 0)
+    return NULL;
+
+  Size = View.len;
+  Result = PyBytes_FromStringAndSize(NULL, Size);
+  if (Result == NULL)
+  {
+    PyBuffer_Release(&View);
+    return NULL;
+  }
+
+  Records = ScanRecords(self, &View, NULL, PyBytes_AS_STRING(Result));
+  PyBuffer_Release(&View);
+
+  if (Records * self->StructDefinition->StructSize < Size)
+    _PyBytes_Resize(&Result, Records * self->StructDefinition->StructSize);
+
+  return Result;
+}
+
+static PyObject* PyRecordFilter_call(PyRecordFilter* self, 
+  PyObject* args, PyObject* kwds)
+{
+  PyObject* Buffer;
+  Py_buffer View;
+  int Match;
+
+  if (!PyArg_UnpackTuple(args, "filter", 1, 1, &Buffer))
+    return NULL;
+
+  if (PyObject_GetBuffer(Buffer, &View, PyBUF_SIMPLE) != 0)
+    return NULL;
+
+  if (View.len != self->StructDefinition->StructSize)
+  {
+    PyErr_SetString(StructError, "buffer size is not the struct size");
+    PyBuffer_Release(&View);
+    return NULL;
+  }
+
+  Match = RunFilterNode(self->Nodes, View.buf);
+  PyBuffer_Release(&View);
+
+  return PyBool_FromLong(Match);
+}
+
+static PyMethodDef PyRecordFilter_methods[] = {
+  {"indices", (PyCFunction)PyRecordFilter_indices, METH_O,
+   "indices(buffer) -> array\n"
+   "Return the numbers of the records in buffer that match, as an\n"
+   "array.array of type 'q'."},
+  {"count", (PyCFunction)PyRecordFilter_count, METH_O,
+   "count(buffer) -> int\n"
+   "Return the number of records in buffer that match."},
+  {"select", (PyCFunction)PyRecordFilter_select, METH_O,
+   "select(buffer) -> bytes\n"
+   "Return the records in buffer that match, packed one after another."},
+  {NULL, NULL}
+};
+
+static PyMemberDef PyRecordFilter_members[] = {
+  {"layout", T_OBJECT, offsetof(PyRecordFilter, StructDefinition), 
+   READONLY, "struct definition of the records"},
+  {"expr", T_OBJECT, offsetof(PyRecordFilter, Expression), READONLY,
+   "the filter expression"},
+  {NULL}
+};
+
+PyTypeObject PyRecordFilter_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0) /* type set in PyInit_xstruct() */
+	"xstruct.filter",
+	sizeof(PyRecordFilter),
+	0,
+	(destructor)PyRecordFilter_dealloc, /*tp_dealloc*/
+	0,		/*tp_vectorcall_offset*/
+	0,		/*tp_getattr*/
+	0,		/*tp_setattr*/
+	0,		/*tp_as_async*/
+	0,		/*tp_repr*/
+	0,		/*tp_as_number*/
+	0,		/*tp_as_sequence*/
+	0,		/*tp_as_mapping*/
+	0,		/*tp_hash*/
+	(ternaryfunc)PyRecordFilter_call, /*tp_call*/
+	0,		/*tp_str*/
+	PyObject_GenericGetAttr, /*tp_getattro*/
+	0,		/*tp_setattro*/
+	0,		/*tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT,	/*tp_flags*/
+	0,		/*tp_doc*/
+	0,		/*tp_traverse*/
+	0,		/*tp_clear*/
+	0,		/*tp_richcompare*/
+	0,		/*tp_weaklistoffset*/
+	0,		/*tp_iter*/
+	0,		/*tp_iternext*/
+	PyRecordFilter_methods, /*tp_methods*/
+	PyRecordFilter_members, /*tp_members*/
+	0,		/*tp_getset*/
+};
+
+static PyObject* NewRecordFilter(PyStructDefinition* StructDefinition,
+  PyObject* Expression)
+{
+  PyRecordFilter* Filter;
+
+  Filter = PyObject_NEW(PyRecordFilter, &PyRecordFilter_Type);
+  if (Filter == NULL)
+    return NULL;
+
+  Filter->StructDefinition = StructDefinition;
+  Py_INCREF(StructDefinition);
+  Filter->Expression = Expression;
+  Py_INCREF(Expression);
+  Filter->Nodes = NULL;
+  Filter->NodeCount = 0;
+
+  if (CompileFilterNode(Filter, Expression) != 0)
+  {
+    Py_DECREF(Filter);
+    return NULL;
+  }
+
+  return (PyObject*) Filter;
+}
+
+/*-------------*/
+/* Aggregation */
+/*-------------*/
+
+/*
+structdef.aggregate() reduces one numeric field over a buffer of records
+to its count, sum, minimum, maximum and mean, optionally grouped by a
+small integer key field. The records are processed in blocks: the field
+(and key) of each record in a block is gathered at the struct stride
+into a contiguous array, decoding the byte order of the format table,
+and the array is then reduced by loops without branches or calls that
+the compiler turns into SIMD code. Grouping adds each value to a fixed
+array of accumulators indexed by the key.
+
+Integer sums are exact: the low and high 32 bits of the values are
+summed separately in 64-bit accumulators, which cannot overflow within
+a chunk of 2**31 records, and each chunk is folded into a Python int.
+Float sums and extremes are computed in double precision; a NaN makes
+all of them NaN.
+*/
+
+#define AGGREGATE_BLOCK 256 /* records gathered at once */
+#define AGGREGATE_CHUNK ((Py_ssize_t) 1 << 31) /* records between folds */
+
+typedef struct {
+  Py_ssize_t Count;
+  unsigned PY_LONG_LONG Low; /* integer sums of the low and */
+  PY_LONG_LONG High; /* high 32 bits of the values */
+  double Sum; /* float sum */
+  CheckBound Min;
+  CheckBound Max;
+  int NaN;
+  PyObject* Total; /* integer sum of the chunks so far */
+} Aggregate;
+
+static void InitAggregate(Aggregate* a, char Type)
+{
+  memset(a, 0, sizeof(Aggregate));
+
+  switch (Type)
+  {
+    case 'i':
+      a->Min.i = LLONG_MAX;
+      a->Max.i = LLONG_MIN;
+      break;
+    case 'u':
+      a->Min.u = ULLONG_MAX;
+      a->Max.u = 0;
+      break;
+    default:
+      a->Min.f = HUGE_VAL;
+      a->Max.f = -HUGE_VAL;
+  }
+}
+
+/* Decode the element of n structs, Stride bytes apart, into Values */
+
+static void GatherElements(const FieldCheck* Check, const char* p, 
+  Py_ssize_t Stride, int n, CheckBound* Values)
+{
+  int i;
+
+#define GATHER(Type, Member) \
+  { \
+    for (i = 0; i < n; i++, p += Stride) \
+    { \
+      Type x; \
+      memcpy(&x, p, sizeof(Type)); \
+      Values[i].Member = x; \
+    } \
+    return; \
+  }
+
+  if (Check->BigEndian == PY_BIG_ENDIAN)
+  {
+    /* host byte order; standard floats share the IEEE 754 encoding of
+       C floats and doubles on the platforms Python supports */
+
+    if (Check->Type == 'f')
+    {
+      if (Check->Size == sizeof(float))
+        GATHER(float, f)
+      GATHER(double, f)
+    }
+
+    switch (Check->Size * (Check->Type == 'i' ? -1 : 1))
+    {
+      case -1: GATHER(signed char, i)
+      case 1: GATHER(unsigned char, u)
+      case -2: GATHER(short, i)
+      case 2: GATHER(unsigned short, u)
+      case -4: GATHER(int, i)
+      case 4: GATHER(unsigned int, u)
+      case -8:
+      case 8: GATHER(unsigned PY_LONG_LONG, u)
+    }
+  }
+
+#undef GATHER
+
+  for (i = 0; i < n; i++, p += Stride)
+    Values[i] = LoadElement(Check, p);
+}
+
+/* Reduce n values into a */
+
+static void ReduceSigned(Aggregate* a, const CheckBound* Values, int n)
+{
+  unsigned PY_LONG_LONG Low = 0;
+  PY_LONG_LONG High = 0, Min = a->Min.i, Max = a->Max.i;
+  int i;
+
+  for (i = 0; i < n; i++)
+  {
+    PY_LONG_LONG x = Values[i].i;
+    Low += (unsigned int) x;
+    High += Py_ARITHMETIC_RIGHT_SHIFT(PY_LONG_LONG, x, 32);
+    Min = x < Min ? x : Min;
+    Max = x > Max ? x : Max;
+  }
+
+  a->Count += n;
+  a->Low += Low;
+  a->High += High;
+  a->Min.i = Min;
+  a->Max.i = Max;
+}
+
+static void ReduceUnsigned(Aggregate* a, const CheckBound* Values, int n)
+{
+  unsigned PY_LONG_LONG Low = 0, High = 0, Min = a->Min.u, Max = a->Max.u;
+  int i;
+
+  for (i = 0; i < n; i++)
+  {
+    unsigned PY_LONG_LONG x = Values[i].u;
+    Low += (unsigned int) x;
+    High += x >> 32;
+    Min = x < Min ? x : Min;
+    Max = x > Max ? x : Max;
+  }
+
+  a->Count += n;
+  a->Low += Low;
+  a->High += (PY_LONG_LONG) High;
+  a->Min.u = Min;
+  a->Max.u = Max;
+}
+
+static void ReduceFloats(Aggregate* a, const CheckBound* Values, int n)
+{
+  double Sum[4] = {0.0, 0.0, 0.0, 0.0}; /* independent lanes */
+  double Min = a->Min.f, Max = a->Max.f;
+  int i, NaN = 0;
+
+  for (i = 0; i + 4 <= n; i += 4)
+  {
+    Sum[0] += Values[i].f;
+    Sum[1] += Values[i + 1].f;
+    Sum[2] += Values[i + 2].f;
+    Sum[3] += Values[i + 3].f;
+  }
+  for (; i < n; i++)
+    Sum[0] += Values[i].f;
+
+  for (i = 0; i < n; i++)
+  {
+    double x = Values[i].f;
+    Min = x < Min ? x : Min;
+    Max = x > Max ? x : Max;
+    NaN |= x != x;
+  }
+
+  a->Count += n;
+  a->Sum += (Sum[0] + Sum[1]) + (Sum[2] + Sum[3]);
+  a->Min.f = Min;
+  a->Max.f = Max;
+  a->NaN |= NaN;
+}
+
+static void AddToAggregate(Aggregate* a, char Type, CheckBound x)
+{
+  a->Count++;
+
+  switch (Type)
+  {
+    case 'i':
+      a->Low += (unsigned int) x.i;
+      a->High += Py_ARITHMETIC_RIGHT_SHIFT(PY_LONG_LONG, x.i, 32);
+      a->Min.i = x.i < a->Min.i ? x.i : a->Min.i;
+      a->Max.i = x.i > a->Max.i ? x.i : a->Max.i;
+      break;
+    case 'u':
+      a->Low += (unsigned int) x.u;
+      a->High += (PY_LONG_LONG) (x.u >> 32);
+      a->Min.u = x.u < a->Min.u ? x.u : a->Min.u;
+      a->Max.u = x.u > a->Max.u ? x.u : a->Max.u;
+      break;
+    default:
+      a->Sum += x.f;
+      a->Min.f = x.f < a->Min.f ? x.f : a->Min.f;
+      a->Max.f = x.f > a->Max.f ? x.f : a->Max.f;
+      a->NaN |= x.f != x.f;
+  }
+}
+
+/* Aggregate n records into Aggregates, grouped when Key is not NULL.
+   Return the number of the first record whose key is not below Groups,
+   -1 when there is none. */
+
+static Py_ssize_t AggregateRecords(const FieldCheck* Value, 
+  const FieldCheck* Key, const char* Data, Py_ssize_t Stride, 
+  Py_ssize_t n, Aggregate* Aggregates, Py_ssize_t Groups)
+{
+  CheckBound Values[AGGREGATE_BLOCK];
+  CheckBound Keys[AGGREGATE_BLOCK];
+  Py_ssize_t Block;
+  int i, m;
+
+  for (Block = 0; Block < n; Block += AGGREGATE_BLOCK)
+  {
+    const char* p = Data + Block * Stride;
+
+    m = (int) (n - Block < AGGREGATE_BLOCK ? n - Block : AGGREGATE_BLOCK);
+    GatherElements(Value, p + Value->Offset, Stride, m, Values);
+
+    if (Key == NULL)
+    {
+      switch (Value->Type)
+      {
+        case 'i':
+          ReduceSigned(Aggregates, Values, m);
+          break;
+        case 'u':
+          ReduceUnsigned(Aggregates, Values, m);
+          break;
+        default:
+          ReduceFloats(Aggregates, Values, m);
+      }
+      continue;
+    }
+
+    GatherElements(Key, p + Key->Offset, Stride, m, Keys);
+
+    for (i = 0; i < m; i++)
+    {
+      if (Keys[i].u >= (unsigned PY_LONG_LONG) Groups) /* or negative */
+        return Block + i;
+      AddToAggregate(&Aggregates[Keys[i].u], Value->Type, Values[i]);
+    }
+  }
+
+  return -1;
+}
+
+/* Fold the 32-bit halves of the integer sum into Total */
+
+static int FoldAggregate(Aggregate* a)
+{
+  PyObject* Low = NULL;
+  PyObject* High = NULL;
+  PyObject* Sum = NULL;
+  PyObject* Shift;
+  int Result = -1;
+
+  if (a->Total == NULL)
+  {
+    a->Total = PyLong_FromLong(0);
+    if (a->Total == NULL)
+      return -1;
+  }
+
+  if (a->Low == 0 && a->High == 0)
+    return 0;
+
+  Shift = PyLong_FromLong(32);
+  if (Shift == NULL)
+    return -1;
+
+  Low = PyLong_FromUnsignedLongLong(a->Low);
+  High = PyLong_FromLongLong(a->High);
+  if (Low == NULL || High == NULL)
+    goto fail;
+
+  Sum = PyNumber_Lshift(High, Shift);
+  Py_SETREF(High, Sum);
+  if (High == NULL)
+    goto fail;
+
+  Sum = PyNumber_Add(High, Low);
+  if (Sum == NULL)
+    goto fail;
+  Py_SETREF(Low, Sum);
+
+  Sum = PyNumber_Add(a->Total, Low);
+  if (Sum == NULL)
+    goto fail;
+  Py_SETREF(a->Total, Sum);
+
+  a->Low = 0;
+  a->High = 0;
+  Result = 0;
+
+fail:
+
+  Py_DECREF(Shift);
+  Py_XDECREF(Low);
+  Py_XDECREF(High);
+  return Result;
+}
+
+static PyObject* AggregateValue(char Type, CheckBound x)
+{
+  switch (Type)
+  {
+    case 'i':
+      return PyLong_FromLongLong(x.i);
+    case 'u':
+      return PyLong_FromUnsignedLongLong(x.u);
+  }
+
+  return PyFloat_FromDouble(x.f);
+}
+
+/* Return the result dictionary of a */
+
+static PyObject* AggregateResult(Aggregate* a, char Type)
+{
+  PyObject* Sum;
+  PyObject* Min;
+  PyObject* Max;
+  PyObject* Mean;
+  PyObject* Result;
+
+  if (Type == 'f')
+  {
+    if (a->NaN)
+      a->Sum = a->Min.f = a->Max.f = Py_NAN;
+    Sum = PyFloat_FromDouble(a->Sum);
+  }
+  else
+  {
+    Sum = a->Total;
+    Py_XINCREF(Sum);
+  }
+
+  if (a->Count == 0)
+  {
+    Min = Max = Mean = Py_None;
+    Py_INCREF(Py_None);
+    Py_INCREF(Py_None);
+    Py_INCREF(Py_None);
+  }
+  else
+  {
+    Min = AggregateValue(Type, a->Min);
+    Max = AggregateValue(Type, a->Max);
+
+    if (Type == 'f')
+      Mean = PyFloat_FromDouble(a->Sum / a->Count);
+    else
+    {
+      PyObject* Count = PyLong_FromSsize_t(a->Count);
+      Mean = Count != NULL && Sum != NULL ? 
+        PyNumber_TrueDivide(Sum, Count) : NULL;
+      Py_XDECREF(Count);
+    }
+  }
+
+  if (Sum == NULL || Min == NULL || Max == NULL || Mean == NULL)
+    Result = NULL;
+  else
+    Result = Py_BuildValue("{s:n,s:O,s:O,s:O,s:O}", "count", a->Count, 
+      "sum", Sum, "min", Min, "max", Max, "mean", Mean);
+
+  Py_XDECREF(Sum);
+  Py_XDECREF(Min);
+  Py_XDECREF(Max);
+  Py_XDECREF(Mean);
+  return Result;
+}
+
+/* Set up Check for the numeric field Name of StructDefinition */
+
+static int AggregateField(PyStructDefinition* StructDefinition, 
+  PyObject* Name, FieldCheck* Check)
+{
+  PyStructField* Field = NULL;
+
+  if (PyUnicode_Check(Name))
+    Field = (PyStructField*) 
+      PyDict_GetItemWithError(StructDefinition->FieldMap, Name);
+        /* borrowed reference */
+
+  if (Field == NULL)
+  {
+    if (!PyErr_Occurred())
+      PyErr_Format(StructError, "unknown field %R", Name);
+    return -1;
+  }
+
+  InitFieldCheck(Check, 0, Field, Field->Table);
+
+  if (Check->Type == 'b' || Check->Count != 1)
+  {
+    PyErr_Format(StructError, 
+      "field '%U': only single-element numeric fields can be aggregated",
+      Name);
+    return -1;
+  }
+
+  return 0;
+}
+
+static PyObject* AggregateBuffer(PyStructDefinition* StructDefinition, 
+  PyObject* Buffer, PyObject* FieldName, PyObject* KeyName, 
+  Py_ssize_t Groups)
+{
+  FieldCheck Value, Key;
+  Aggregate* Aggregates = NULL;
+  PyObject* Result = NULL;
+  Py_buffer View;
+  Py_ssize_t Size = StructDefinition->StructSize;
+  Py_ssize_t Records, Start, Bad, g;
+
+  if (AggregateField(StructDefinition, FieldName, &Value) != 0)
+    return NULL;
+
+  if (KeyName == Py_None)
+    Groups = 1;
+  else if (AggregateField(StructDefinition, KeyName, &Key) != 0)
+    return NULL;
+  else if (Key.Type == 'f' || Groups <= 0)
+  {
+    PyErr_SetString(StructError, Key.Type == 'f' ? 
+      "the group key must be an integer field" : 
+      "the number of groups must be positive");
+    return NULL;
+  }
+
+  if (PyObject_GetBuffer(Buffer, &View, PyBUF_SIMPLE) != 0)
+    return NULL;
+
+  if (View.len % Size != 0)
+  {
+    PyErr_SetString(StructError, 
+      "buffer size is not a multiple of the struct size");
+    goto fail;
+  }
+  Records = View.len / Size;
+
+  if (Groups <= PY_SSIZE_T_MAX / (Py_ssize_t) sizeof(Aggregate))
+    Aggregates = malloc(Groups * sizeof(Aggregate));
+  if (Aggregates == NULL)
+  {
+    PyErr_NoMemory();
+    goto fail;
+  }
+  for (g = 0; g < Groups; g++)
+    InitAggregate(&Aggregates[g], Value.Type);
+
+  for (Start = 0; Start == 0 || Start < Records; Start += AGGREGATE_CHUNK)
+  {
+    Py_ssize_t n = Records - Start;
+    if (n > AGGREGATE_CHUNK)
+      n = AGGREGATE_CHUNK;
+
+    Py_BEGIN_ALLOW_THREADS
+    Bad = AggregateRecords(&Value, KeyName == Py_None ? NULL : &Key, 
+      (char*) View.buf + Start * Size, Size, n, Aggregates, Groups);
+    Py_END_ALLOW_THREADS
+
+    if (Bad >= 0)
+    {
+      PyErr_Format(StructError, "record %zd: group key out of range", 
+        Start + Bad);
+      goto fail;
+    }
+
+    if (Value.Type != 'f')
+      for (g = 0; g < Groups; g++)
+        if (FoldAggregate(&Aggregates[g]) != 0)
+          goto fail;
+  }
+
+  if (KeyName == Py_None)
+  {
+    Result = AggregateResult(&Aggregates[0], Value.Type);
+    goto fail;
+  }
+
+  Result = PyDict_New();
+  if (Result == NULL)
+    goto fail;
+
+  for (g = 0; g < Groups; g++)
+  {
+    PyObject* GroupKey;
+    PyObject* GroupResult;
+    int Status;
+
+    if (Aggregates[g].Count == 0)
+      continue;
+
+    GroupKey = PyLong_FromSsize_t(g);
+    GroupResult = AggregateResult(&Aggregates[g], Value.Type);
+    Status = GroupKey != NULL && GroupResult != NULL ?
+      PyDict_SetItem(Result, GroupKey, GroupResult) : -1;
+    Py_XDECREF(GroupKey);
+    Py_XDECREF(GroupResult);
+    if (Status != 0)
+    {
+      Py_CLEAR(Result);
+      goto fail;
+    }
+  }
+
+fail:
+
+  if (Aggregates != NULL)
+  {
+    for (g = 0; g < Groups; g++)
+      Py_XDECREF(Aggregates[g].Total);
+    free(Aggregates);
+  }
+  PyBuffer_Release(&View);
+  return Result;
+}
+
+/*----------------*/
+/* Record streams */
+/*----------------*/
+
+/*
+structdef.encode_stream() compresses a buffer of records into a stream
+of blocks, and structdef.decode_stream() rebuilds the packed records.
+Each block starts with a 20-byte header, all little-endian:
+
+  magic 'XSR1', struct size, record count, payload size, and the
+  CRC-32C of the payload
+
+followed by the records, each encoded against the one before it (the
+first record of a block against an all-zero struct, so that decoding
+can start at any block):
+
+  a bitmap of the fields that changed, one bit per field as in deltas,
+  then for each changed field in order
+    integer fields: the difference to the previous value of each
+      element, zigzag encoded as a varint (7 bits per byte, low first)
+    other fields: their bytes
+
+Streams can be concatenated. Decoding runs without the interpreter
+lock: the previous record is copied forward and the changed fields are
+patched into it.
+*/
+
+#define STREAM_MAGIC "XSR1"
+#define STREAM_HEADER_SIZE 20
+
+typedef struct {
+  FieldCheck* Fields; /* Type 'i' or 'u' for delta coded fields */
+  int FieldCount;
+  int BitmapSize;
+  Py_ssize_t StructSize;
+  Py_ssize_t MaxRecordSize; /* encoded, at worst */
+} StreamCodec;
+
+static void PutUint32(unsigned char* p, unsigned int x)
+{
+  p[0] = (unsigned char) x;
+  p[1] = (unsigned char) (x >> 8);
+  p[2] = (unsigned char) (x >> 16);
+  p[3] = (unsigned char) (x >> 24);
+}
+
+static unsigned int GetUint32(const unsigned char* p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+}
+
+static unsigned int StreamCrc(const unsigned char* p, size_t n)
+{
+  return ~UpdateChecksum(CHECKSUM_CRC32C, 0xffffffff, 0, p, n);
+}
+
+/* Add Delta to the element of Check at p, wrapping around */
+
+static void AddToElement(const FieldCheck* Check, char* p, 
+  unsigned PY_LONG_LONG Delta)
+{
+  if (Check->BigEndian == PY_BIG_ENDIAN)
+  {
+    switch (Check->Size)
+    {
+      case 1:
+        *p = (char) ((unsigned char) *p + Delta);
+        return;
+      case 2:
+      {
+        unsigned short x;
+        memcpy(&x, p, 2);
+        x = (unsigned short) (x + Delta);
+        memcpy(p, &x, 2);
+        return;
+      }
+      case 4:
+      {
+        unsigned int x;
+        memcpy(&x, p, 4);
+        x = (unsigned int) (x + Delta);
+        memcpy(p, &x, 4);
+        return;
+      }
+      case 8:
+      {
+        unsigned PY_LONG_LONG x;
+        memcpy(&x, p, 8);
+        x += Delta;
+        memcpy(p, &x, 8);
+        return;
+      }
+    }
+  }
+
+  StoreElement(Check, p, LoadElement(Check, p).u + Delta);
+}
+
+static int InitStreamCodec(StreamCodec* Codec, 
+  PyStructDefinition* StructDefinition)
+{
+  Py_ssize_t i, FieldCount = PyList_GET_SIZE(StructDefinition->FieldList);
+
+  if (FieldCount == 0)
+  {
+    PyErr_SetString(StructError, "struct definition has no fields");
+    return -1;
+  }
+
+  Codec->Fields = malloc((FieldCount + 1) * sizeof(FieldCheck));
+  if (Codec->Fields == NULL)
+  {
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  Codec->FieldCount = (int) FieldCount;
+  Codec->BitmapSize = (int) (FieldCount + 7) / 8;
+  Codec->StructSize = StructDefinition->StructSize;
+  Codec->MaxRecordSize = Codec->BitmapSize;
+
+  for (i = 0; i < FieldCount; i++)
+  {
+    FieldCheck* Check = &Codec->Fields[i];
+    PyStructField* Field = (PyStructField*) 
+      PyList_GET_ITEM(StructDefinition->FieldList, i);
+
+    InitFieldCheck(Check, 0, Field, Field->Table);
+
+    if (Check->Type == 'i' || Check->Type == 'u')
+      Codec->MaxRecordSize += Check->Count * VARINT_MAX_SIZE;
+    else
+      Codec->MaxRecordSize += Check->Count * Check->Size;
+  }
+
+  return 0;
+}
+
+/* Encode Records structs at Data, each against the one before it and 
+   the first against Previous, at Out. Return the end of the output. */
+
+static unsigned char* EncodeRecords(const StreamCodec* Codec, 
+  const char* Previous, const char* Data, Py_ssize_t Records, 
+  unsigned char* Out)
+{
+  Py_ssize_t r;
+  int f, e;
+
+  for (r = 0; r < Records; r++)
+  {
+    const char* Record = Data + r * Codec->StructSize;
+    unsigned char* Bitmap = Out;
+
+    memset(Bitmap, 0, Codec->BitmapSize);
+    Out += Codec->BitmapSize;
+
+    for (f = 0; f < Codec->FieldCount; f++)
+    {
+      const FieldCheck* Check = &Codec->Fields[f];
+      const char* New = Record + Check->Offset;
+      const char* Old = Previous + Check->Offset;
+      int Bytes = Check->Size * Check->Count;
+
+      if (memcmp(New, Old, Bytes) == 0)
+        continue;
+
+      Bitmap[f >> 3] |= 1 << (f & 7);
+
+      if (Check->Type != 'i' && Check->Type != 'u')
+      {
+        memcpy(Out, New, Bytes);
+        Out += Bytes;
+        continue;
+      }
+
+      for (e = 0; e < Bytes; e += Check->Size)
+      {
+        unsigned PY_LONG_LONG Delta = LoadElement(Check, New + e).u - 
+          LoadElement(Check, Old + e).u;
+
+        Out += EncodeVarint(Out, ZIGZAG(Delta));
+      }
+    }
+
+    Previous = Record;
+  }
+
+  return Out;
+}
+
+/* Decode a block payload of Records structs into Out, which ends up 
+   Records structs long. Return -1 when the payload does not hold them 
+   exactly. */
+
+static int DecodeRecords(const StreamCodec* Codec, const unsigned char* p,
+  const unsigned char* End, Py_ssize_t Records, char* Out)
+{
+  Py_ssize_t Size = Codec->StructSize;
+  Py_ssize_t r;
+  int f, e;
+
+  memset(Out, 0, Size); /* the first record's previous */
+
+  for (r = 0; r < Records; r++)
+  {
+    char* Record = Out + r * Size;
+    const unsigned char* Bitmap = p;
+
+    if (r > 0)
+      memcpy(Record, Record - Size, Size);
+
+    if (End - p < Codec->BitmapSize)
+      return -1;
+    p += Codec->BitmapSize;
+
+    for (f = 0; f < Codec->FieldCount; f++)
+    {
+      const FieldCheck* Check;
+      char* Field;
+      int Bytes;
+
+      if ((Bitmap[f >> 3] & (1 << (f & 7))) == 0)
+        continue;
+
+      Check = &Codec->Fields[f];
+      Field = Record + Check->Offset;
+      Bytes = Check->Size * Check->Count;
+
+      if (Check->Type != 'i' && Check->Type != 'u')
+      {
+        if (End - p < Bytes)
+          return -1;
+        memcpy(Field, p, Bytes);
+        p += Bytes;
+        continue;
+      }
+
+      for (e = 0; e < Bytes; e += Check->Size)
+      {
+        unsigned PY_LONG_LONG Delta;
+
+        if (p < End && *p < 0x80)
+          Delta = *p++; /* most deltas are small */
+        else
+        {
+          int n = DecodeVarint(p, End, &Delta);
+
+          if (n <= 0)
+            return -1;
+          p += n;
+        }
+
+        AddToElement(Check, Field + e, UNZIGZAG(Delta));
+      }
+    }
+  }
+
+  return p == End ? 0 : -1;
+}
+
+static PyObject* EncodeStream(PyStructDefinition* StructDefinition,
+  PyObject* Buffer, Py_ssize_t BlockRecords)
+{
+  StreamCodec Codec;
+  PyObject* Result = NULL;
+  Py_buffer View;
+  Py_ssize_t Size = StructDefinition->StructSize;
+  Py_ssize_t Records, Start, Length = 0, Capacity, BlockSize;
+  char* Zeros = NULL;
+
+  if (InitStreamCodec(&Codec, StructDefinition) != 0)
+    return NULL;
+
+  if (PyObject_GetBuffer(Buffer, &View, PyBUF_SIMPLE) != 0)
+  {
+    free(Codec.Fields);
+    return NULL;
+  }
+
+  if (View.len % Size != 0)
+  {
+    PyErr_SetString(StructError, 
+      "buffer size is not a multiple of the struct size");
+    goto fail;
+  }
+  Records = View.len / Size;
+
+  if (BlockRecords <= 0 || 
+      BlockRecords > 0x7fffffff / Codec.MaxRecordSize) /* payload size */
+  {
+    PyErr_SetString(StructError, "invalid number of records per block");
+    goto fail;
+  }
+
+  Zeros = calloc(1, Size);
+  Capacity = View.len / 2 + STREAM_HEADER_SIZE;
+  Result = PyBytes_FromStringAndSize(NULL, Capacity);
+  if (Zeros == NULL || Result == NULL)
+  {
+    if (Zeros == NULL)
+      PyErr_NoMemory();
+    goto fail;
+  }
+
+  for (Start = 0; Start < Records; Start += BlockRecords)
+  {
+    Py_ssize_t n = Records - Start < BlockRecords ? 
+      Records - Start : BlockRecords;
+    unsigned char* Header;
+    unsigned char* End;
+
+    BlockSize = STREAM_HEADER_SIZE + n * Codec.MaxRecordSize;
+    if (Length + BlockSize > Capacity)
+    {
+      while (Length + BlockSize > Capacity)
+      {
+        if (Capacity > PY_SSIZE_T_MAX / 2)
+        {
+          PyErr_NoMemory();
+          goto fail;
+        }
+        Capacity *= 2;
+      }
+      if (_PyBytes_Resize(&Result, Capacity) != 0)
+        goto fail;
+    }
+
+    Header = (unsigned char*) PyBytes_AS_STRING(Result) + Length;
+
+    Py_BEGIN_ALLOW_THREADS
+    End = EncodeRecords(&Codec, Zeros, (char*) View.buf + Start * Size, n,
+      Header + STREAM_HEADER_SIZE);
+    memcpy(Header, STREAM_MAGIC, 4);
+    PutUint32(Header + 4, (unsigned int) Size);
+    PutUint32(Header + 8, (unsigned int) n);
+    PutUint32(Header + 12, (unsigned int) 
+      (End - Header - STREAM_HEADER_SIZE));
+    PutUint32(Header + 16, StreamCrc(Header + STREAM_HEADER_SIZE, 
+      End - Header - STREAM_HEADER_SIZE));
+    Py_END_ALLOW_THREADS
+
+    Length = End - (unsigned char*) PyBytes_AS_STRING(Result);
+  }
+
+  if (_PyBytes_Resize(&Result, Length) != 0)
+    goto fail;
+
+  free(Zeros);
+  free(Codec.Fields);
+  PyBuffer_Release(&View);
+  return Result;
+
+fail:
+
+  if (Zeros != NULL)
+    free(Zeros);
+  free(Codec.Fields);
+  Py_XDECREF(Result);
+  PyBuffer_Release(&View);
+  return NULL;
+}
+
+/* Check the block header at Offset and return its record count, -1 with
+   an exception set when it is not valid */
+
+static Py_ssize_t CheckStreamBlock(const StreamCodec* Codec, 
+  const unsigned char* Data, Py_ssize_t Length, Py_ssize_t Offset)
+{
+  const unsigned char* Header = Data + Offset;
+  unsigned int Payload;
+
+  if (Length - Offset < STREAM_HEADER_SIZE || 
+      memcmp(Header, STREAM_MAGIC, 4) != 0)
+  {
+    PyErr_Format(StructError, "no stream block at offset %zd", Offset);
+    return -1;
+  }
+
+  if (GetUint32(Header + 4) != (unsigned int) Codec->StructSize)
+  {
+    PyErr_Format(StructError, 
+      "block at offset %zd: records of %u bytes, not %zd", Offset, 
+      GetUint32(Header + 4), Codec->StructSize);
+    return -1;
+  }
+
+  Payload = GetUint32(Header + 12);
+  if ((size_t) (Length - Offset - STREAM_HEADER_SIZE) < Payload)
+  {
+    PyErr_Format(StructError, "block at offset %zd is truncated", Offset);
+    return -1;
+  }
+
+  /* every record takes at least its bitmap, which bounds what a header
+     can make the decoder allocate */
+
+  if (GetUint32(Header + 8) > Payload / Codec->BitmapSize)
+  {
+    PyErr_Format(StructError, "block at offset %zd is corrupt", Offset);
+    return -1;
+  }
+
+  return (Py_ssize_t) GetUint32(Header + 8);
+}
+
+static PyObject* DecodeStream(PyStructDefinition* StructDefinition,
+  PyObject* Stream, Py_ssize_t Offset)
+{
+  StreamCodec Codec;
+  PyObject* Result = NULL;
+  Py_buffer View;
+  const unsigned char* Data;
+  Py_ssize_t Size = StructDefinition->StructSize;
+  Py_ssize_t Records = 0, Position, Record, Bad = -1, n;
+  int Status = 0;
+
+  if (InitStreamCodec(&Codec, StructDefinition) != 0)
+    return NULL;
+
+  if (PyObject_GetBuffer(Stream, &View, PyBUF_SIMPLE) != 0)
+  {
+    free(Codec.Fields);
+    return NULL;
+  }
+  Data = View.buf;
+
+  if (Offset < 0 || Offset > View.len)
+  {
+    PyErr_SetString(StructError, "offset out of range");
+    goto fail;
+  }
+
+  /* size the output from the block headers */
+
+  for (Position = Offset; Position < View.len; 
+       Position += STREAM_HEADER_SIZE + GetUint32(Data + Position + 12))
+  {
+    n = CheckStreamBlock(&Codec, Data, View.len, Position);
+    if (n < 0)
+      goto fail;
+    if (Records > PY_SSIZE_T_MAX / Size - n)
+    {
+      PyErr_NoMemory();
+      goto fail;
+    }
+    Records += n;
+  }
+
+  Result = PyBytes_FromStringAndSize(NULL, Records * Size);
+  if (Result == NULL)
+    goto fail;
+
+  Py_BEGIN_ALLOW_THREADS
+
+  for (Position = Offset, Record = 0; Status == 0 && Position < View.len;
+       Position += STREAM_HEADER_SIZE + GetUint32(Data + Position + 12))
+  {
+    const unsigned char* Payload = Data + Position + STREAM_HEADER_SIZE;
+    unsigned int PayloadSize = GetUint32(Data + Position + 12);
+
+    n = GetUint32(Data + Position + 8);
+    if (StreamCrc(Payload, PayloadSize) != GetUint32(Data + Position + 16))
+      Status = 1;
+    else if (n > 0 && DecodeRecords(&Codec, Payload, Payload + PayloadSize,
+        n, PyBytes_AS_STRING(Result) + Record * Size) != 0)
+      Status = 2;
+    else
+      Record += n;
+
+    if (Status != 0)
+      Bad = Position;
+  }
+
+  Py_END_ALLOW_THREADS
+
+  if (Status != 0)
+  {
+    PyErr_Format(StructError, Status == 1 ? 
+      "block at offset %zd: checksum does not match" : 
+      "block at offset %zd is corrupt", Bad);
+    Py_CLEAR(Result);
+  }
+
+fail:
+
+  free(Codec.Fields);
+  PyBuffer_Release(&View);
+  return Result;
+}
+
+/*------------------*/
+/* Varint wire form */
+/*------------------*/
+
+/*
+In struct objects and record buffers, varint fields ('v' and 'V') are
+held as 8-byte integers, so that attribute access, records, indexes and
+the rest work on a fixed layout. obj.encode() and structdef.decode()
+convert to and from the wire form: the struct bytes in order, with the
+slot of each varint element replaced by its LEB128 encoding.
+*/
+
+/* Set up Check for field i if it is a varint field, else return 0 */
+
+static int VarintCheck(FieldCheck* Check, PyStructDefinition* 
+  StructDefinition, Py_ssize_t i)
+{
+  PyStructField* Field = (PyStructField*) 
+    PyList_GET_ITEM(StructDefinition->FieldList, i);
+
+  if (Field->Format->format != 'v' && Field->Format->format != 'V')
+    return 0;
+
+  InitFieldCheck(Check, 0, Field, Field->Table);
+  return 1;
+}
+
+static PyObject* EncodeWire(PyStructDefinition* StructDefinition, 
+  const char* Data)
+{
+  Py_ssize_t FieldCount = PyList_GET_SIZE(StructDefinition->FieldList);
+  Py_ssize_t Size = StructDefinition->StructSize, i;
+  int Position = 0, e;
+  FieldCheck Check;
+  PyObject* Result;
+  unsigned char* Out;
+
+  /* a varint takes at most 2 bytes more than its slot */
+
+  for (i = 0; i < FieldCount; i++)
+    if (VarintCheck(&Check, StructDefinition, i))
+      Size += Check.Count * (VARINT_MAX_SIZE - 8);
+
+  Result = PyBytes_FromStringAndSize(NULL, Size);
+  if (Result == NULL)
+    return NULL;
+  Out = (unsigned char*) PyBytes_AS_STRING(Result);
+
+  for (i = 0; i < FieldCount; i++)
+  {
+    if (!VarintCheck(&Check, StructDefinition, i))
+      continue;
+
+    memcpy(Out, Data + Position, Check.Offset - Position);
+    Out += Check.Offset - Position;
+
+    for (e = 0; e < Check.Count; e++)
     {
-      return u_sstr(FieldData, Field->RepeatCount);
+      unsigned PY_LONG_LONG x = LoadElement(&Check, Data + Check.Offset + 
+        e * 8).u;
+
+      Out += EncodeVarint(Out, Check.Type == 'i' ? ZIGZAG(x) : x);
     }
-    case 'p':
-	  {
-	    return u_pstr(FieldData, Field->RepeatCount);
-	  }
-	  default:
-	  {
-	    if (Field->RepeatCount == 1)
-	    {
-	      return Field->Format->unpack(FieldData, Field->Format);
-	    }
-	    else
-	    {
-	      PyObject* ResultTuple;
-		    int i;
-		
-		    ResultTuple = PyTuple_New(Field->RepeatCount);
-	      if (ResultTuple == NULL)
-		      return NULL;
-	    
-	      i = 0;
-	  
-	      while (i < Field->RepeatCount)
-		    {
-		      PyObject* Element = Field->Format->unpack(FieldData, 
-            Field->Format);
-		      if (Element == NULL)
-		      {
-		        Py_DECREF(ResultTuple);
-			      return NULL;
-		      };
+    Position = Check.Offset + Check.Count * 8;
+  }
 
-		      PyTuple_SET_ITEM(ResultTuple, i, Element); 
-            /* steals the reference */
-		  
-		      FieldData += Field->Format->size;
+  memcpy(Out, Data + Position, StructDefinition->StructSize - Position);
+  Out += StructDefinition->StructSize - Position;
 
-		      i++;
-		    }
+  if (_PyBytes_Resize(&Result, (char*) Out - PyBytes_AS_STRING(Result)) 
+      != 0)
+    return NULL;
 
-		    return ResultTuple;
-	    }
-	  }
-  }
+  return Result;
 }
 
-static int SetFieldValue(PyStructField* Field, char* StructData, 
-  PyObject* Value)
+/* Decode the wire form at p into the struct at Data. Return the end of 
+   the wire form, or NULL if it is truncated or (with an exception set)
+   holds an invalid varint. */
+
+static const unsigned char* DecodeWire(PyStructDefinition* 
+  StructDefinition, const unsigned char* p, const unsigned char* End, 
+  char* Data)
 {
-  char* FieldData = StructData + Field->Offset;
+  Py_ssize_t FieldCount = PyList_GET_SIZE(StructDefinition->FieldList), i;
+  int Position = 0, e, n;
+  FieldCheck Check;
 
-  switch (Field->Format->format)
+  for (i = 0; i <= FieldCount; i++)
   {
-	  case 's': 
-	  {
-	    return p_sstr(FieldData, Value, Field->RepeatCount);
-	  }
-	  case 'p': 
-	  {
-	    return p_pstr(FieldData, Value, Field->RepeatCount);
-	  }
-	  default:
-	  {
-	    if (Field->RepeatCount == 1)
-	    {
-	      return Field->Format->pack(FieldData, Value, Field->Format);
-	    }
-	    else
-	    {
-	      int i;
+    int Offset = StructDefinition->StructSize;
 
-	      if (!PyTuple_Check(Value)) 
-	      {
-		      PyErr_SetString(StructError, "value for field must be a tuple");
-		      return -1;
-		    }
+    if (i < FieldCount)
+    {
+      if (!VarintCheck(&Check, StructDefinition, i))
+        continue;
+      Offset = Check.Offset;
+    }
 
-		    if (PyTuple_Size(Value) != Field->RepeatCount)
-		    {
-		      PyErr_SetString(StructError, "field element count mismatch");
-		      return -1;
-		    }
+    if (End - p < Offset - Position)
+      return NULL;
+    memcpy(Data + Position, p, Offset - Position);
+    p += Offset - Position;
 
-		    i = 0;
+    if (i == FieldCount)
+      break;
 
-		    while (i < Field->RepeatCount)
-		    {
-		      PyObject* Element = PyTuple_GET_ITEM(Value, i);
-		        /* borrowed reference ! */
+    for (e = 0; e < Check.Count; e++)
+    {
+      unsigned PY_LONG_LONG x;
 
-		      if (Field->Format->pack(FieldData, Element, Field->Format) < 0)
-		        return -1;
-		  
-		      FieldData += Field->Format->size;
+      n = DecodeVarint(p, End, &x);
+      if (n < 0)
+        PyErr_SetString(StructError, "invalid varint");
+      if (n <= 0)
+        return NULL;
+      p += n;
 
-		      i++;
-		    }
+      StoreElement(&Check, Data + Check.Offset + e * 8, 
+        Check.Type == 'i' ? UNZIGZAG(x) : x);
+    }
+    Position = Check.Offset + Check.Count * 8;
+  }
 
-		    return 0;
-	    }
-	  }
+  return p;
+}
+
+static PyObject* DecodeStruct(PyStructDefinition* StructDefinition,
+  PyObject* Buffer, Py_ssize_t Offset)
+{
+  PyObject* StructObject = NULL;
+  PyObject* Result = NULL;
+  Py_buffer View;
+  const unsigned char* Start;
+  const unsigned char* End;
+
+  if (PyObject_GetBuffer(Buffer, &View, PyBUF_SIMPLE) != 0)
+    return NULL;
+
+  if (Offset < 0 || Offset > View.len)
+  {
+    PyErr_SetString(StructError, "offset out of range");
+    goto fail;
+  }
+
+  StructObject = NewStructObject(StructDefinition, 
+    StructDefinition->InitialStructData, StructDefinition->StructSize);
+  if (StructObject == NULL)
+    goto fail;
+
+  Start = (const unsigned char*) View.buf;
+  End = DecodeWire(StructDefinition, Start + Offset, Start + View.len, 
+    StructObjectData(StructObject));
+  if (End == NULL)
+  {
+    if (!PyErr_Occurred())
+      PyErr_Format(StructError, 
+        "buffer does not hold a struct at offset %zd", Offset);
+    goto fail;
   }
+
+  if ((StructDefinition->ChecksumCount != 0 || 
+       StructDefinition->CheckCount != 0) && 
+      CheckStructData(StructDefinition, StructObjectData(StructObject), -1) 
+      != 0)
+    goto fail;
+
+  Result = Py_BuildValue("On", StructObject, (Py_ssize_t) (End - Start));
+
+fail:
+
+  Py_XDECREF(StructObject);
+  PyBuffer_Release(&View);
+  return Result;
 }
 
-/*--------------------*/
-/* PyStructDefinition */
-/*--------------------*/
+/*--------*/
+/* Unions */
+/*--------*/
+
+/*
+A union field overlays alternative layouts, its cases, on the same bytes.
+It is defined with the field type "union" and the options
+
+  {"discriminator": name, "cases": {value: structdef, ...}}
+
+where name is a single-element integer field and a case value of None 
+stands for all the others. The repeat count is the size of the field, 0
+for the size of the largest case.
+
+Which case is active is looked up in a dispatch table built with the 
+definition: directly indexed when the case values are less than 
+UNION_DIRECT_RANGE apart, a sorted array searched by bisection 
+otherwise. Reading the field returns a struct view of the active case
+over the memory of the struct itself, so nothing is copied, writes
+through it go to the struct and it is read-only if the struct is. The
+view holds the struct's buffer (through a one-record buffer, its Base),
+so the struct does not cache its hash meanwhile. In every other respect (bytes, hashing, 
+the array interface) a union field is a string field.
+*/
+
+#define UNION_DIRECT_RANGE 256
+
+/* signed discriminator values are mapped to keys that sort like them */
+
+#define UNION_KEY_SIGN ((unsigned PY_LONG_LONG) 1 << 63)
 
 typedef struct {
-  PyObject_HEAD
-  const formatdef* FormatTable;
-  PyObject* FieldList;
-  PyObject* FieldMap;
-  int StructSize;
-  char* InitialStructData;
-} PyStructDefinition;
+  unsigned PY_LONG_LONG Key;
+  PyStructDefinition* Case;
+} UnionCase;
+
+struct _UnionSpec {
+  FieldCheck Discriminator;
+  UnionCase* Cases; /* by key */
+  int CaseCount;
+  PyStructDefinition* Default; /* or NULL */
+  unsigned short* Direct; /* case number + 1 per key from the lowest, or
+                             NULL */
+  int DirectSize;
+};
 
-static void PyStructDefinition_dealloc(PyStructDefinition* self)
+static void FreeUnionSpecs(UnionSpec* Specs, int Count)
 {
-  if (self->InitialStructData != NULL)
-    free(self->InitialStructData);
+  int i, j;
 
-  if (self->FieldMap != NULL)
-    Py_DECREF(self->FieldMap);
-    
-  if (self->FieldList != NULL)
-    Py_DECREF(self->FieldList);
+  for (i = 0; i < Count; i++)
+  {
+    for (j = 0; j < Specs[i].CaseCount; j++)
+      Py_DECREF(Specs[i].Cases[j].Case);
+    Py_XDECREF(Specs[i].Default);
+    free(Specs[i].Cases);
+    free(Specs[i].Direct);
+  }
+
+  free(Specs);
+}
+
+/* The cases dictionary in the options of a union field (borrowed) */
+
+static PyObject* GetUnionCases(PyObject* Options)
+{
+  PyObject* Cases = NULL;
+
+  if (Options != NULL && PyDict_Check(Options))
+    Cases = PyDict_GetItemString(Options, "cases"); /* borrowed */
+
+  if (Cases == NULL || !PyDict_Check(Cases) || PyDict_Size(Cases) == 0)
+  {
+    PyErr_SetString(StructError, 
+      "union field needs a dictionary of cases in its options");
+    return NULL;
+  }
+
+  return Cases;
+}
+
+/* Check the cases of a union field and return the size of the largest */
+
+static int UnionCaseSize(PyObject* Options)
+{
+  PyObject* Cases = GetUnionCases(Options);
+  PyObject* Value;
+  PyObject* Case;
+  Py_ssize_t Position = 0;
+  int Size = 0;
+
+  if (Cases == NULL)
+    return -1;
+
+  while (PyDict_Next(Cases, &Position, &Value, &Case))
+  {
+    if (Value != Py_None && !PyLong_Check(Value))
+    {
+      PyErr_SetString(StructError, 
+        "union case values must be integers or None");
+      return -1;
+    }
+    if (!PyObject_TypeCheck(Case, &PyStructDefinition_Type))
+    {
+      PyErr_SetString(StructError, 
+        "union cases must be struct definitions");
+      return -1;
+    }
+    if (((PyStructDefinition*) Case)->StructSize > Size)
+      Size = ((PyStructDefinition*) Case)->StructSize;
+  }
+
+  return Size;
+}
+
+static int CompareUnionCases(const void* a, const void* b)
+{
+  const UnionCase* x = a;
+  const UnionCase* y = b;
+
+  return x->Key < y->Key ? -1 : x->Key > y->Key;
+}
+
+static int CompileUnion(PyStructDefinition* StructDefinition, 
+  PyStructField* Field, PyObject* Options)
+{
+  PyObject* Cases = GetUnionCases(Options);
+  PyObject* Name = PyDict_GetItemString(Options, "discriminator");
+  PyStructField* Discriminator = NULL;
+  PyObject* Value;
+  PyObject* Case;
+  Py_ssize_t Position = 0;
+  UnionSpec* Specs;
+  UnionSpec* Spec;
+  unsigned PY_LONG_LONG Bits;
+  int i;
+
+  if (Cases == NULL)
+    return -1;
+
+  if (Name != NULL && PyUnicode_Check(Name))
+  {
+    Discriminator = (PyStructField*) 
+      PyDict_GetItemWithError(StructDefinition->FieldMap, Name);
+    if (Discriminator == NULL && PyErr_Occurred())
+      return -1;
+  }
+
+  Specs = realloc(StructDefinition->Unions, 
+    (StructDefinition->UnionCount + 1) * sizeof(UnionSpec));
+  if (Specs == NULL)
+  {
+    PyErr_NoMemory();
+    return -1;
+  }
+  StructDefinition->Unions = Specs;
+
+  /* counted from now on, so that it is freed with the definition */
+
+  Spec = &Specs[StructDefinition->UnionCount++];
+  memset(Spec, 0, sizeof(UnionSpec));
+
+  if (Discriminator == NULL || Discriminator == Field || 
+      Discriminator->RepeatCount != 1 || 
+      strchr("bBhHiIlLvV", Discriminator->Format->format) == NULL)
+  {
+    PyErr_Format(StructError, "union field '%U': the discriminator must "
+      "be the name of a single integer field", Field->Name);
+    return -1;
+  }
+  InitFieldCheck(&Spec->Discriminator, 0, Discriminator, 
+    Discriminator->Table);
+
+  Spec->Cases = malloc(PyDict_Size(Cases) * sizeof(UnionCase));
+  if (Spec->Cases == NULL)
+  {
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  while (PyDict_Next(Cases, &Position, &Value, &Case))
+  {
+    UnionCase* Entry = &Spec->Cases[Spec->CaseCount];
+
+    Py_INCREF(Case);
+    if (Value == Py_None)
+    {
+      Spec->Default = (PyStructDefinition*) Case;
+      continue;
+    }
+
+    if (Spec->Discriminator.Type == 'i')
+    {
+      PY_LONG_LONG x = PyLong_AsLongLong(Value);
+      Entry->Key = (unsigned PY_LONG_LONG) x ^ UNION_KEY_SIGN;
+      Bits = x < 0 ? ~x : x; /* all but the sign bit must fit */
+      Bits <<= 1;
+    }
+    else
+      Bits = Entry->Key = PyLong_AsUnsignedLongLong(Value);
+
+    Entry->Case = (PyStructDefinition*) Case;
+    Spec->CaseCount++;
+
+    if (PyErr_Occurred() || (Spec->Discriminator.Size < 8 && 
+        Bits >> (8 * Spec->Discriminator.Size) != 0))
+    {
+      PyErr_Format(StructError, "union field '%U': case value %R out of "
+        "range", Field->Name, Value);
+      return -1;
+    }
+  }
+
+  qsort(Spec->Cases, Spec->CaseCount, sizeof(UnionCase), 
+    CompareUnionCases);
+
+  if (Spec->CaseCount > 0 && Spec->Cases[Spec->CaseCount - 1].Key - 
+      Spec->Cases[0].Key < UNION_DIRECT_RANGE)
+  {
+    Spec->DirectSize = (int) (Spec->Cases[Spec->CaseCount - 1].Key - 
+      Spec->Cases[0].Key + 1);
+    Spec->Direct = calloc(Spec->DirectSize, sizeof(unsigned short));
+    if (Spec->Direct == NULL)
+    {
+      PyErr_NoMemory();
+      return -1;
+    }
+
+    for (i = 0; i < Spec->CaseCount; i++)
+      Spec->Direct[Spec->Cases[i].Key - Spec->Cases[0].Key] = 
+        (unsigned short) (i + 1);
+  }
+
+  Field->Union = StructDefinition->UnionCount;
+  return 0;
+}
+
+/* The active case of the union Spec in the struct at StructData, or 
+   NULL if there is none */
+
+static PyStructDefinition* FindUnionCase(const UnionSpec* Spec, 
+  const char* StructData)
+{
+  unsigned PY_LONG_LONG Key = LoadElement(&Spec->Discriminator, 
+    StructData + Spec->Discriminator.Offset).u;
+  int Low = 0, High = Spec->CaseCount;
+
+  if (Spec->Discriminator.Type == 'i')
+    Key ^= UNION_KEY_SIGN;
+
+  if (Spec->Direct != NULL)
+  {
+    unsigned PY_LONG_LONG i = Key - Spec->Cases[0].Key;
+
+    if (i < (unsigned PY_LONG_LONG) Spec->DirectSize && Spec->Direct[i])
+      return Spec->Cases[Spec->Direct[i] - 1].Case;
+    return Spec->Default;
+  }
 
-  PyMem_DEL(self);
+  while (Low < High)
+  {
+    int Middle = (Low + High) / 2;
+
+    if (Spec->Cases[Middle].Key < Key)
+      Low = Middle + 1;
+    else
+      High = Middle;
+  }
+
+  if (Low < Spec->CaseCount && Spec->Cases[Low].Key == Key)
+    return Spec->Cases[Low].Case;
+  return Spec->Default;
 }
 
-static PyObject* PyStructDefinition_getattr(PyStructDefinition* self, 
-  char* name)
+static PyObject* GetUnionView(PyObject* Owner, 
+  PyStructDefinition* StructDefinition, const char* StructData, 
+  PyStructField* Field)
 {
-  if (strcmp(name, "size") == 0)
-    return PyInt_FromLong(self->StructSize);
+  const UnionSpec* Spec = &StructDefinition->Unions[Field->Union - 1];
+  PyStructDefinition* Case = FindUnionCase(Spec, StructData);
+  PyRecordBuffer* Records;
+  PyObject* Result;
 
-  PyErr_SetString(PyExc_AttributeError, name);
-  return NULL;
+  if (Case == NULL)
+  {
+    PyObject* Value = GetFieldValue(Spec->Discriminator.Field, 
+      (char*) StructData);
+
+    if (Value != NULL)
+    {
+      PyErr_Format(StructError, "union field '%U' has no case for %U %R",
+        Field->Name, Spec->Discriminator.Field->Name, Value);
+      Py_DECREF(Value);
+    }
+    return NULL;
+  }
+
+  Records = (PyRecordBuffer*) NewRecordSlice(Case, Owner, Field->Offset, 
+    1);
+  if (Records == NULL)
+    return NULL;
+
+  Result = NewStructView(Case, (PyObject*) Records, Records->View.buf, 
+    Records->View.readonly);
+  Py_DECREF(Records);
+  return Result;
 }
 
-/* forward declaration */
+/*----------*/
+/* Pickling */
+/*----------*/
 
-static PyObject* NewStructObject(PyStructDefinition* StructDefinition, 
-  char* data, int len);
+/*
+A struct definition pickles by its spec: the arguments of structdef() it
+was built from, or the format string of a compiled format. Unpickling 
+looks the spec up among the existing definitions before building one, so
+that unpickling many structs of a definition builds it once per process,
+and the process that defined it gets the original back (structs of
+different definitions never compare equal).
+
+The lookup key is the spec frozen into a hashable value: lists become
+tuples, dictionaries frozensets of their items, and other values are
+paired with their type, so that an initial value of 1 does not match one
+of 1.0. A spec that can not be frozen (with an unhashable initial value,
+say) is not interned. SpecDefinitions holds weak references, so that
+interning doesn't keep definitions alive, and the first definition of a
+spec is the one found. Compiled formats are interned by their cache.
+*/
 
-static PyObject* PyStructDefinition_call(PyStructDefinition* self, 
-  PyObject* args, PyObject* kwds)
+static PyObject* SpecDefinitions = NULL;
+
+/* Return a new reference to the frozen form of Spec */
+
+static PyObject* FreezeSpec(PyObject* Spec)
 {
-  char* data = NULL;
-  int len;
- 
-  if (!PyArg_ParseTuple(args, "|s#", &data, &len))
-    return NULL;
+  PyObject* Result;
+  Py_ssize_t i, Count;
 
-  if (data == NULL)
-	return NewStructObject(self, self->InitialStructData, 
-      self->StructSize);
-  else
-    return NewStructObject(self, data, len);
+  if (PyList_Check(Spec) || PyTuple_Check(Spec))
+  {
+    Count = PySequence_Fast_GET_SIZE(Spec);
+    Result = PyTuple_New(Count);
+    for (i = 0; Result != NULL && i < Count; i++)
+    {
+      PyObject* Item = FreezeSpec(PySequence_Fast_GET_ITEM(Spec, i));
+      if (Item == NULL)
+        Py_CLEAR(Result);
+      else
+        PyTuple_SET_ITEM(Result, i, Item);
+    }
+    return Result;
+  }
+
+  if (PyDict_Check(Spec))
+  {
+    PyObject* Items = PyList_New(0);
+    PyObject* Key;
+    PyObject* Value;
+
+    i = 0;
+    while (Items != NULL && PyDict_Next(Spec, &i, &Key, &Value))
+    {
+      PyObject* Item = Py_BuildValue("(ON)", Key, FreezeSpec(Value));
+      if (Item == NULL || PyList_Append(Items, Item) != 0)
+        Py_CLEAR(Items);
+      Py_XDECREF(Item);
+    }
+    if (Items == NULL)
+      return NULL;
+
+    Result = PyFrozenSet_New(Items);
+    Py_DECREF(Items);
+    return Result;
+  }
+
+  return PyTuple_Pack(2, (PyObject*) Py_TYPE(Spec), Spec);
 }
 
-PyTypeObject PyStructDefinition_Type = {
-	PyObject_HEAD_INIT(0) /* set in initxstruct() */
-	0,
-	"structdef",
-	sizeof(PyStructDefinition),
-	0,
-	(destructor)PyStructDefinition_dealloc, /*tp_dealloc*/
-	0,		/*tp_print*/
-	(getattrfunc)PyStructDefinition_getattr, /*tp_getattr*/
-	0,		/*tp_setattr*/
-	0,		/*tp_compare*/
-	0,		/*tp_repr*/
-	0,		/*tp_as_number*/
-	0,		/*tp_as_sequence*/
-	0,		/*tp_as_mapping*/
-	0,		/*tp_hash*/
-	(ternaryfunc)PyStructDefinition_call, /*tp_call*/
-	0,		/*tp_str*/
-	0,		/*tp_getattro*/
-	0,		/*tp_setattro*/
-	0,		/*tp_as_buffer*/
-	Py_TPFLAGS_DEFAULT,	/*tp_flags*/
-	0,		/*tp_doc*/
-};
+/* Return a new reference to the live definition interned under Key, or
+   NULL, with an exception set only on failure */
 
-PyStructDefinition* NewPyStructDefinition()
+static PyObject* LookupSpecDefinition(PyObject* Key)
 {
-  PyStructDefinition* StructDefinition = 
-    PyObject_NEW(PyStructDefinition, &PyStructDefinition_Type);
-  if (StructDefinition == NULL)
+  PyObject* Ref;
+  PyObject* StructDefinition;
+
+  if (SpecDefinitions == NULL)
     return NULL;
 
-  StructDefinition->FieldList = NULL;
-  StructDefinition->FieldMap = NULL;
-  StructDefinition->InitialStructData = NULL;
+  Ref = PyDict_GetItemWithError(SpecDefinitions, Key);
+    /* borrowed reference */
+  if (Ref == NULL)
+    return NULL;
+
+  StructDefinition = PyWeakref_GetObject(Ref); /* borrowed reference */
+  if (StructDefinition == Py_None)
+    return NULL;
 
+  Py_INCREF(StructDefinition);
   return StructDefinition;
 }
 
-static PyStructField* LookupFieldByName(PyStructDefinition* 
-  StructDefinition, char* Name)
+/* Record the spec of a new definition and intern it, unless a definition
+   of that spec exists */
+
+static int SetDefinitionSpec(PyStructDefinition* StructDefinition,
+  PyObject* Spec)
 {
-  PyStructField* Field = 
-    (PyStructField*) PyDict_GetItemString(StructDefinition->FieldMap, 
-      Name);
+  PyObject* Key;
+  PyObject* Existing;
+  PyObject* Ref;
+
+  StructDefinition->Spec = Spec;
+  Py_INCREF(Spec);
+
+  if (SpecDefinitions == NULL)
+  {
+    SpecDefinitions = PyDict_New();
+    if (SpecDefinitions == NULL)
+      return -1;
+  }
+
+  Key = FreezeSpec(Spec);
+  if (Key == NULL)
+    goto not_interned;
+
+  Existing = LookupSpecDefinition(Key);
+  if (Existing != NULL)
+  {
+    Py_DECREF(Existing);
+    Py_DECREF(Key);
+    return 0;
+  }
   if (PyErr_Occurred())
-    return NULL;
+  {
+    Py_DECREF(Key);
+    goto not_interned;
+  }
 
-  if (Field == NULL)
+  Ref = PyWeakref_NewRef((PyObject*) StructDefinition, NULL);
+  if (Ref == NULL || PyDict_SetItem(SpecDefinitions, Key, Ref) != 0)
   {
-    PyErr_SetString(PyExc_KeyError, Name);
-    return NULL;
+    Py_XDECREF(Ref);
+    Py_DECREF(Key);
+    return -1;
   }
+  Py_DECREF(Ref);
 
-  return Field;
+  StructDefinition->SpecKey = Key;
+  return 0;
+
+not_interned:
+
+  if (!PyErr_ExceptionMatches(PyExc_TypeError))
+    return -1;
+  PyErr_Clear(); /* unhashable */
+  return 0;
 }
 
-static PyObject* GetFieldValueByName(PyStructDefinition* StructDefinition, 
-  char* StructData, char* Name)
+/* Called on dealloc, after the weak references are cleared */
+
+static void ForgetDefinitionSpec(PyStructDefinition* StructDefinition)
 {
-  PyStructField* Field = LookupFieldByName(StructDefinition, Name);
-  if (Field == NULL)
-    return NULL;
+  PyObject *Type, *Value, *Traceback;
+  PyObject* Ref;
 
-  return GetFieldValue(Field, StructData);
+  PyErr_Fetch(&Type, &Value, &Traceback);
+
+  Ref = PyDict_GetItemWithError(SpecDefinitions, StructDefinition->SpecKey);
+    /* borrowed reference */
+  if (Ref != NULL && PyWeakref_GetObject(Ref) == Py_None)
+    PyDict_DelItem(SpecDefinitions, StructDefinition->SpecKey);
+  PyErr_Clear();
+
+  PyErr_Restore(Type, Value, Traceback);
+  Py_CLEAR(StructDefinition->SpecKey);
 }
 
-static int SetFieldValueByName(PyStructDefinition* StructDefinition,
-  char* StructData, char* Name, PyObject* Value)
+static PyObject* PyStructDefinition_reduce(PyStructDefinition* self, 
+  PyObject* Unused)
 {
-  PyStructField* Field = LookupFieldByName(StructDefinition, Name);
-  if (Field == NULL)
-    return -1;
+  PyObject* Module = PyImport_ImportModule("xstruct");
+  PyObject* FromSpec;
 
-  return SetFieldValue(Field, StructData, Value);
+  if (Module == NULL)
+    return NULL;
+
+  FromSpec = PyObject_GetAttrString(Module, "structdef_from_spec");
+  Py_DECREF(Module);
+  if (FromSpec == NULL)
+    return NULL;
+
+  return Py_BuildValue("N(O)", FromSpec, self->Spec);
 }
 
-static int SetChangeableFieldValueByName(PyStructDefinition* 
-  StructDefinition, char* StructData, char* Name, PyObject* Value)
+static char structdef_from_spec__doc__[] = "\
+structdef_from_spec(spec) -> structdef\n\
+Return the struct definition of a spec, as given by structdef.spec: a\n\
+format string or (layout, fields, key, pack, optimize). An existing\n\
+definition of the same spec is returned rather than built again.";
+
+static PyObject* struct_structdef_from_spec(PyObject* self, 
+  PyObject* args)
 {
-  PyStructField* Field = LookupFieldByName(StructDefinition, Name);
-  if (Field == NULL)
-    return -1;
+  PyObject* Spec;
+  PyObject* Key;
+  PyObject* Result;
 
-  if (Field->Changeable)
-    return SetFieldValue(Field, StructData, Value);
-  else
+  if (!PyArg_ParseTuple(args, "O", &Spec))
+    return NULL;
+
+  if (PyUnicode_Check(Spec) || PyBytes_Check(Spec))
+    return (PyObject*) GetCompiledFormat(Spec);
+
+  if (!PyTuple_Check(Spec) || PyTuple_GET_SIZE(Spec) != 5 ||
+      !PySequence_Check(PyTuple_GET_ITEM(Spec, 1)))
   {
-    PyErr_SetString(StructError, "field is not changeable");
-    return -1;
+    PyErr_SetString(StructError, "invalid structdef spec");
+    return NULL;
   }
-}
 
-static int PrintFields(PyStructDefinition* StructDefinition, 
-  char* StructData, FILE* fp, int flags)
-{
-  int i = 0;
-  while (i < PyList_Size(StructDefinition->FieldList))
+  Key = FreezeSpec(Spec);
+  Result = Key != NULL ? LookupSpecDefinition(Key) : NULL;
+  Py_XDECREF(Key);
+  if (Result != NULL)
+    return Result;
+  if (PyErr_Occurred())
   {
-	  PyStructField* Field = (PyStructField*)
-      PyList_GET_ITEM(StructDefinition->FieldList, i); /* borrowed ref */
-	  PyObject* Value = GetFieldValue(Field, StructData);
-	  if (Value == NULL)
-	    return -1;
-	  fprintf(fp, "%s: ", PyString_AS_STRING(Field->Name));
-    if (PyObject_Print(Value, fp, Py_PRINT_RAW) != 0)
-    {
-      Py_DECREF(Value);
-      return -1;
-    }
-	  fprintf(fp, "\n");
-	  Py_DECREF(Value);
-    i++;
+    if (!PyErr_ExceptionMatches(PyExc_TypeError))
+      return NULL;
+    PyErr_Clear(); /* unhashable, not interned */
   }
-  return 0;
+
+  args = Py_BuildValue("(ONOOO)", PyTuple_GET_ITEM(Spec, 0),
+    PySequence_List(PyTuple_GET_ITEM(Spec, 1)), PyTuple_GET_ITEM(Spec, 2),
+    PyTuple_GET_ITEM(Spec, 3), PyTuple_GET_ITEM(Spec, 4));
+  if (args == NULL)
+    return NULL;
+
+  Result = struct_structdef(self, args, NULL);
+  Py_DECREF(args);
+  return Result;
 }
 
-static PyObject* struct_structdef(PyObject* self, PyObject* args)
-{
-  char* LayoutSpecifier;
-  PyObject* FieldDefinitions;
-  PyObject* InitialValues;
+/*---------------*/
+/* Atomic fields */
+/*---------------*/
 
-  PyStructDefinition* StructDefinition;
-  int i;
+/*
+Records in memory shared between processes (an mmap) can hold counters
+and state words that the processes update concurrently. A field defined
+with the atomic flag is updated with the atomic instructions of the 
+processor by the record buffer methods atomic_load() (acquire), 
+atomic_store() (release), fetch_add(), exchange() and compare_exchange()
+(sequentially consistent). An atomic field must be a named single
+integer in the byte order of the machine, naturally aligned in every
+record, which is checked when the definition is built; the alignment of
+the buffer itself is checked on each call.
+*/
 
-  if (!PyArg_ParseTuple(args, "sO!", &LayoutSpecifier, &PyList_Type,
-      &FieldDefinitions))
-    return NULL;
+#define ATOMIC_LOAD 0
+#define ATOMIC_STORE 1
+#define ATOMIC_FETCH_ADD 2
+#define ATOMIC_EXCHANGE 3
+#define ATOMIC_COMPARE_EXCHANGE 4
+
+#if defined(__GNUC__)
+
+#define HAVE_ATOMIC_FIELDS
+
+#define ATOMIC_OPERATION(Type) \
+  { \
+    Type* p = (Type*) Address; \
+    Type v = (Type) *Value; \
+    switch (Op) \
+    { \
+      case ATOMIC_LOAD: \
+        v = __atomic_load_n(p, __ATOMIC_ACQUIRE); \
+        break; \
+      case ATOMIC_STORE: \
+        __atomic_store_n(p, v, __ATOMIC_RELEASE); \
+        break; \
+      case ATOMIC_FETCH_ADD: \
+        v = __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST); \
+        break; \
+      case ATOMIC_EXCHANGE: \
+        v = __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST); \
+        break; \
+      case ATOMIC_COMPARE_EXCHANGE: \
+        __atomic_compare_exchange_n(p, &v, (Type) Desired, 0, \
+          __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); \
+        break; \
+    } \
+    *Value = v; \
+  }
 
-  InitialValues = PyList_New(0);
-  if (InitialValues == NULL)
-    return NULL;
+/* Apply Op to the Size bytes at Address. *Value is the operand (the
+   expected value for compare-exchange) and receives the previous value,
+   zero-extended. */
 
-  StructDefinition = NewPyStructDefinition();
-  if (StructDefinition == NULL)
+static void AtomicOperation(int Op, void* Address, int Size, 
+  unsigned PY_LONG_LONG* Value, unsigned PY_LONG_LONG Desired)
+{
+  switch (Size)
   {
-    Py_DECREF(InitialValues);
-    return NULL;
+    case 1:
+      ATOMIC_OPERATION(unsigned char)
+      break;
+    case 2:
+      ATOMIC_OPERATION(unsigned short)
+      break;
+    case 4:
+      ATOMIC_OPERATION(unsigned int)
+      break;
+    case 8:
+      ATOMIC_OPERATION(unsigned PY_LONG_LONG)
+      break;
   }
+}
 
-  StructDefinition->FormatTable =	whichtable(&LayoutSpecifier);
-  if (StructDefinition->FormatTable == NULL)
-    goto fail;
+#endif
 
-  StructDefinition->FieldList = PyList_New(0);
-  if (StructDefinition->FieldList == NULL)
-    goto fail;
+static int CheckAtomicField(PyStructDefinition* StructDefinition, 
+  PyStructField* Field)
+{
+  int Size = Field->Format->size;
 
-  StructDefinition->FieldMap = PyDict_New();
-  if (StructDefinition->FieldMap == NULL)
-    goto fail;
+#ifndef HAVE_ATOMIC_FIELDS
+  PyErr_SetString(StructError, 
+    "atomic fields are not supported on this platform");
+  return -1;
+#endif
 
-  StructDefinition->StructSize = 0;
+  if (Field->Name == NULL)
+  {
+    PyErr_SetString(StructError, "atomic field must have a name");
+    return -1;
+  }
 
-  i = 0;
-  while (i < PyList_Size(FieldDefinitions))
+  if (strchr("bBhHiIlL", Field->Format->format) == NULL || 
+      Field->RepeatCount != 1 || Field->Union)
   {
-    char* FieldName;
-    char* FieldType;
-    int RepeatCount = 1;
-    PyObject* InitialValue = NULL;
-    int Flags = 0;
+    PyErr_Format(StructError, "atomic field '%U' is not a single integer",
+      Field->Name);
+    return -1;
+  }
 
-    char ch;
-    formatdef* Format;
+  if (NeedsByteSwap(Field->Table))
+  {
+    PyErr_Format(StructError, 
+      "atomic field '%U' is not in the byte order of the machine",
+      Field->Name);
+    return -1;
+  }
 
-    int x;
+  if ((Size & (Size - 1)) != 0 || Size > 8 || Field->Offset % Size != 0 || 
+      StructDefinition->StructSize % Size != 0)
+  {
+    PyErr_Format(StructError, 
+      "atomic field '%U' is not naturally aligned in every record",
+      Field->Name);
+    return -1;
+  }
 
-    PyObject* FieldDefinition = PyList_GET_ITEM(FieldDefinitions, i);
-      /* borrowed reference */
+  return 0;
+}
 
-    if (!PyArg_ParseTuple(FieldDefinition, "z(si)|Oi", &FieldName,
-        &FieldType, &RepeatCount, &InitialValue, &Flags))
-      goto fail;
+/* Convert an operand for Field: a value in its range or, for fetch_add,
+   a delta of at most its width in magnitude */
 
-    if (RepeatCount < 0)
-    {
-      PyErr_SetString(StructError, "invalid repeat count");
-      goto fail;
-    }
+static int AtomicOperand(PyStructField* Field, PyObject* Object, 
+  int Delta, unsigned PY_LONG_LONG* Value)
+{
+  int Bits = 8 * Field->Format->size;
+  int Signed = islower(Field->Format->format);
+  PY_LONG_LONG Limit = Bits < 64 ? (PY_LONG_LONG) 1 << (Bits - 1) : 0;
+  PY_LONG_LONG x;
+  int Overflow;
 
-    ch = FieldType[0];
-    Format = (formatdef*) getentry(ch, StructDefinition->FormatTable);
-    if (Format == NULL)
-      goto fail;
+  if (!PyLong_Check(Object))
+  {
+    PyErr_SetString(StructError, "required argument is not an integer");
+    return -1;
+  }
 
-    StructDefinition->StructSize = align(StructDefinition->StructSize, ch, Format);
+  x = PyLong_AsLongLongAndOverflow(Object, &Overflow);
+  if (x == -1 && PyErr_Occurred())
+    return -1;
 
-    if ((ch != 'x') && ((RepeatCount != 0) || (ch == 's'))) 
-    {
-      PyStructField* Field = NewPyStructField();
-      if (Field == NULL)
-        goto fail;
+  if (Overflow > 0 && Bits == 64 && (Delta || !Signed))
+  {
+    /* above the range of long long */
 
-      if (PyList_Append(StructDefinition->FieldList, (PyObject*) Field) != 0)
-      {
-        Py_DECREF(Field);
-        goto fail;
-      }
+    *Value = PyLong_AsUnsignedLongLong(Object);
+    if (*Value == (unsigned PY_LONG_LONG) -1 && PyErr_Occurred())
+      goto out_of_range;
+    return 0;
+  }
 
-      /* from now on, Field is owned by StructDefinition */
+  if (Overflow != 0)
+    goto out_of_range;
 
-      Py_DECREF(Field); 
+  if (Limit != 0)
+  {
+    PY_LONG_LONG Low = Signed && !Delta ? -Limit : Delta ? -2 * Limit : 0;
+    PY_LONG_LONG High = Signed && !Delta ? Limit : 2 * Limit;
 
-      if (FieldName != NULL) 
-      {
-        PyObject* CurrentField = PyDict_GetItemString(
-          StructDefinition->FieldMap, FieldName); /* borrowed ref */
-        if (PyErr_Occurred())
-          goto fail;
+    if (x < Low || x >= High)
+      goto out_of_range;
+  }
+  else if (!Signed && !Delta && x < 0)
+    goto out_of_range;
 
-        if (CurrentField != NULL)
-        {
-          PyErr_SetString(StructError, "duplicate field name");
-          goto fail;
-        }
+  *Value = (unsigned PY_LONG_LONG) x;
+  return 0;
 
-        Field->Name = PyString_FromString(FieldName);
-        if (Field->Name == NULL)
-          goto fail;
+out_of_range:
 
-        if (PyDict_SetItemString(StructDefinition->FieldMap, 
-            FieldName, (PyObject*) Field) != 0)
-          goto fail;
-      }
+  PyErr_Clear();
+  PyErr_Format(StructError, "value out of range for atomic field '%U'",
+    Field->Name);
+  return -1;
+}
 
-      Field->Changeable = !(Flags & FLAG_READONLY);
-      Field->RepeatCount = RepeatCount;
-      Field->Format = Format;
-      Field->Offset = StructDefinition->StructSize;
+static PyObject* AtomicFieldValue(PyStructField* Field, 
+  unsigned PY_LONG_LONG Value)
+{
+  int Shift = 64 - 8 * Field->Format->size;
 
-      if (InitialValue == NULL)
-        InitialValue = Py_None;
+  if (islower(Field->Format->format))
+    return PyLong_FromLongLong((PY_LONG_LONG) (Value << Shift) >> Shift);
 
-      if (PyList_Append(InitialValues, InitialValue) != 0)
-        goto fail;
-    }
-    else /* other combinations do not count as fields */
-    {
-      if (FieldName != NULL)
-      {
-        PyErr_SetString(StructError, "field name given to num/format "
-          "combination that does not count as a field");
-        goto fail;
-      }
-    }
+  return PyLong_FromUnsignedLongLong(Value);
+}
 
-    x = RepeatCount * Format->size;
-	  if (x/Format->size != RepeatCount)
-    {
-	    PyErr_SetString(StructError, "field size overflow");
-		  goto fail;
-	  }
+static PyObject* RecordAtomicOperation(PyRecordBuffer* self, 
+  PyObject* args, int Op)
+{
+  static const char* ArgumentFormats[] = { "nO:atomic_load", 
+    "nOO:atomic_store", "nOO:fetch_add", "nOO:exchange", 
+    "nOOO:compare_exchange" };
+  Py_ssize_t Record;
+  PyObject* Name;
+  PyObject* Operand = NULL;
+  PyObject* Desired = NULL;
+  PyStructField* Field;
+  unsigned PY_LONG_LONG Value = 0;
+  unsigned PY_LONG_LONG DesiredValue = 0;
+  char* Address;
+
+  if (!PyArg_ParseTuple(args, ArgumentFormats[Op], &Record, &Name, 
+      &Operand, &Desired))
+    return NULL;
 
-    StructDefinition->StructSize += x;
-    if (StructDefinition->StructSize < 0)
-    {
-	    PyErr_SetString(StructError, "struct size overflow");
-		  goto fail;
-	  }
+  Field = LookupFieldByName(self->StructDefinition, Name);
+  if (Field == NULL)
+    return NULL;
 
-    i++;
+  if (!Field->Atomic)
+  {
+    PyErr_Format(StructError, "field '%U' is not atomic", Field->Name);
+    return NULL;
   }
 
-  if (StructDefinition->StructSize == 0)
+  if (Record < 0 || Record >= self->Count)
   {
-    PyErr_SetString(StructError, "zero struct size");
-	  goto fail;
+    PyErr_SetString(PyExc_IndexError, "record index out of range");
+    return NULL;
   }
 
-  StructDefinition->InitialStructData = malloc(StructDefinition->StructSize);
-  if (StructDefinition->InitialStructData == NULL)
+  if (Op != ATOMIC_LOAD && (self->View.readonly || !Field->Changeable))
   {
-    PyErr_NoMemory();
-    goto fail;
+    PyErr_SetString(StructError, self->View.readonly ? 
+      "records are read-only" : "field is not changeable");
+    return NULL;
   }
 
-  memset(StructDefinition->InitialStructData, '\0', StructDefinition->StructSize);
-
-  i = 0;
-  while (i < PyList_Size(InitialValues))
+  Address = (char*) self->View.buf + Record * self->Stride + Field->Offset;
+  if ((Py_uintptr_t) Address % Field->Format->size != 0)
   {
-    PyObject* InitialValue = PyList_GetItem(InitialValues, i);
-      /* borrowed reference */
-    if (InitialValue == NULL)
-      goto fail;
+    PyErr_Format(StructError, 
+      "atomic field '%U' is not aligned in the buffer", Field->Name);
+    return NULL;
+  }
 
-    if (InitialValue != Py_None)
-    {
-      PyStructField* Field = 
-        (PyStructField*) PyList_GetItem(StructDefinition->FieldList, i);
-          /* borrowed reference */
+  if (Operand != NULL && AtomicOperand(Field, Operand, 
+      Op == ATOMIC_FETCH_ADD, &Value) != 0)
+    return NULL;
+  if (Desired != NULL && AtomicOperand(Field, Desired, 0, &DesiredValue) 
+      != 0)
+    return NULL;
 
-      if (Field == NULL)
-        goto fail;
+#ifdef HAVE_ATOMIC_FIELDS
+  AtomicOperation(Op, Address, Field->Format->size, &Value, DesiredValue);
+#endif
 
-      if (SetFieldValue(Field, StructDefinition->InitialStructData, 
-          InitialValue) != 0)
-        goto fail;
-    }
+  if (Op == ATOMIC_STORE)
+    Py_RETURN_NONE;
 
-    i++;
-  }
+  return AtomicFieldValue(Field, Value);
+}
 
-  return (PyObject*) StructDefinition;
+static PyObject* PyRecordBuffer_atomic_load(PyRecordBuffer* self, 
+  PyObject* args)
+{
+  return RecordAtomicOperation(self, args, ATOMIC_LOAD);
+}
 
-fail:
+static PyObject* PyRecordBuffer_atomic_store(PyRecordBuffer* self, 
+  PyObject* args)
+{
+  return RecordAtomicOperation(self, args, ATOMIC_STORE);
+}
 
-  Py_DECREF(StructDefinition);
-  Py_DECREF(InitialValues);
-  return NULL;
+static PyObject* PyRecordBuffer_fetch_add(PyRecordBuffer* self, 
+  PyObject* args)
+{
+  return RecordAtomicOperation(self, args, ATOMIC_FETCH_ADD);
 }
 
-/*----------------*/
-/* PyStructObject */
-/*----------------*/
+static PyObject* PyRecordBuffer_exchange(PyRecordBuffer* self, 
+  PyObject* args)
+{
+  return RecordAtomicOperation(self, args, ATOMIC_EXCHANGE);
+}
+
+static PyObject* PyRecordBuffer_compare_exchange(PyRecordBuffer* self, 
+  PyObject* args)
+{
+  return RecordAtomicOperation(self, args, ATOMIC_COMPARE_EXCHANGE);
+}
+
+/*--------------*/
+/* Record rings */
+/*--------------*/
+
+/*
+A record ring passes records between processes through a buffer they
+share (an mmap), without copies or system calls. The buffer starts with
+three 64-bit sequence numbers, each on a cache line of its own so that
+the producers and the consumer do not contend for one:
+
+  Tail     records published, written by the producers
+  Claimed  records claimed, written by the producers in multi-producer
+           mode only
+  Head     records consumed, written by the consumer
+
+The records follow, as many as fit; sequence number n is record
+n % Capacity. A zero-filled buffer (a new mmap) is an empty ring.
+
+A producer claims free records, fills them in place through the record
+buffer claim() returns (and its struct views) and publishes them, which
+computes their checksums; the consumer takes published records as a 
+read-only record buffer and releases them when done with them. Both
+work on batches of contiguous records, for one atomic operation on the
+shared sequence numbers per batch. A single producer claims by reading
+Head alone; several claim with a compare-and-exchange on Claimed and
+publish in the order they claimed, each waiting (without the GIL) for
+the claims before its own. A producer that dies between claim and 
+publish stalls the ones after it, so the wait checks for signals and 
+may be given a timeout. There is one consumer in either mode.
+*/
+
+#ifdef HAVE_SCHED_H
+#include <sched.h>
+#endif
+
+#define RING_CACHE_LINE 64
+#define RING_WAIT_ROUND 1024 /* yields between checks for signals */
+
+typedef struct {
+  unsigned PY_LONG_LONG Value;
+  char Padding[RING_CACHE_LINE - sizeof(unsigned PY_LONG_LONG)];
+} RingIndex;
+
+typedef struct {
+  RingIndex Tail;
+  RingIndex Claimed;
+  RingIndex Head;
+} RingHeader;
+
+#ifdef HAVE_ATOMIC_FIELDS
+#define RingLoad(Index) __atomic_load_n(&(Index).Value, __ATOMIC_ACQUIRE)
+#define RingStore(Index, x) \
+  __atomic_store_n(&(Index).Value, (x), __ATOMIC_RELEASE)
+#define RingClaim(Index, Expected, x) \
+  __atomic_compare_exchange_n(&(Index).Value, (Expected), (x), 0, \
+    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#else /* not reached: rings are not built without atomics */
+#define RingLoad(Index) ((Index).Value)
+#define RingStore(Index, x) ((Index).Value = (x))
+#define RingClaim(Index, Expected, x) ((Index).Value = (x), 1)
+#endif
 
 typedef struct {
   PyObject_HEAD
   PyStructDefinition* StructDefinition;
-  char* StructData;
-} PyStructObject;
+  Py_buffer View;
+  RingHeader* Header;
+  Py_ssize_t Capacity; /* records */
+  int MultiProducer;
+  unsigned PY_LONG_LONG ClaimStart; /* claimed, not yet published */
+  Py_ssize_t ClaimCount;
+  unsigned PY_LONG_LONG TakeStart; /* consumed, not yet released */
+  Py_ssize_t TakeCount;
+} PyRecordRing;
+
+static void PyRecordRing_dealloc(PyRecordRing* self)
+{
+  PyBuffer_Release(&self->View);
+  Py_DECREF(self->StructDefinition);
 
-static void PyStructObject_dealloc(PyStructObject* self)
+  PyObject_DEL(self);
+}
+
+/* The number of records, up to Count, that follow sequence number Start
+   contiguously among the Available ones */
+
+static Py_ssize_t RingBatch(PyRecordRing* self, unsigned PY_LONG_LONG Start,
+  unsigned PY_LONG_LONG Available, Py_ssize_t Count)
 {
-  if (self->StructData != NULL)
-    free(self->StructData);
+  unsigned PY_LONG_LONG Contiguous = 
+    self->Capacity - Start % self->Capacity;
 
-  if (self->StructDefinition != NULL)
-    Py_DECREF(self->StructDefinition);
+  if (Available > Contiguous)
+    Available = Contiguous;
 
-  PyMem_DEL(self);
+  return (unsigned PY_LONG_LONG) Count < Available ? 
+    Count : (Py_ssize_t) Available;
 }
 
-static int PyStructObject_print(PyStructObject* self, FILE* fp, int flags)
+static PyObject* RingRecords(PyRecordRing* self, 
+  unsigned PY_LONG_LONG Start, Py_ssize_t Count, int ReadOnly)
 {
-  return PrintFields(self->StructDefinition, self->StructData, fp, flags);
+  PyRecordBuffer* Records = (PyRecordBuffer*) NewRecordSlice(
+    self->StructDefinition, self->View.obj, sizeof(RingHeader) + 
+    (Start % self->Capacity) * self->StructDefinition->StructSize, Count);
+
+  if (Records != NULL && ReadOnly)
+    Records->View.readonly = 1;
+
+  return (PyObject*) Records;
 }
 
-static PyObject* PyStructObject_getattr(PyStructObject* self, char* name)
+static int GetBatchCount(PyObject* args, Py_ssize_t* Count)
 {
-  return GetFieldValueByName(self->StructDefinition, self->StructData, name);
+  if (!PyArg_ParseTuple(args, "|n", Count))
+    return -1;
+
+  if (*Count < 1)
+  {
+    PyErr_SetString(StructError, "count must be positive");
+    return -1;
+  }
+
+  return 0;
 }
 
-static int PyStructObject_setattr(PyStructObject* self, char* name, 
-  PyObject* value)
+static PyObject* PyRecordRing_claim(PyRecordRing* self, PyObject* args)
 {
-  if (value == NULL)
+  RingHeader* Header = self->Header;
+  Py_ssize_t Count = 1;
+  unsigned PY_LONG_LONG Start;
+
+  if (GetBatchCount(args, &Count) != 0)
+    return NULL;
+
+  if (self->ClaimCount != 0)
   {
-    PyErr_SetString(StructError, "attribute can not be deleted");
-	  return -1;
+    PyErr_SetString(StructError, "the previous claim is not published");
+    return NULL;
+  }
+
+  if (!self->MultiProducer)
+  {
+    Start = RingLoad(Header->Tail);
+    Count = RingBatch(self, Start, 
+      self->Capacity - (Start - RingLoad(Header->Head)), Count);
+    if (Count == 0)
+      Py_RETURN_NONE;
   }
   else
-    return SetChangeableFieldValueByName(self->StructDefinition,
-      self->StructData, name, value);
-}
+  {
+    Py_ssize_t Wanted = Count;
 
-PyObject* PyStructObject_str(PyStructObject* self)
-{
-  return PyString_FromStringAndSize(self->StructData, 
-    self->StructDefinition->StructSize);
-}
+    Start = RingLoad(Header->Claimed);
+    do
+    {
+      Count = RingBatch(self, Start, 
+        self->Capacity - (Start - RingLoad(Header->Head)), Wanted);
+      if (Count == 0)
+        Py_RETURN_NONE;
+    }
+    while (!RingClaim(Header->Claimed, &Start, Start + Count));
+  }
 
-/* Mapping methods */
+  /* claimed for good now: if the records can't be returned, they can 
+     still be published */
 
-static int PyStructObject_length(PyStructObject* self)
-{
-  return PyDict_Size(self->StructDefinition->FieldMap);
+  self->ClaimStart = Start;
+  self->ClaimCount = Count;
+
+  return RingRecords(self, Start, Count, 0);
 }
 
-static PyObject* PyStructObject_subscript(PyStructObject* self, 
-  PyObject* key)
+/* Seconds on a clock that only goes forward */
+
+static double RingClock(void)
 {
-  char* str = PyString_AsString(key);
-  if (str == NULL)
-    return NULL;
+#ifdef CLOCK_MONOTONIC
+  struct timespec Now;
 
-  return GetFieldValueByName(self->StructDefinition, self->StructData, 
-    str);
+  if (clock_gettime(CLOCK_MONOTONIC, &Now) == 0)
+    return Now.tv_sec + Now.tv_nsec * 1e-9;
+#endif
+  return (double) time(NULL);
 }
 
-static int PyStructObject_ass_sub(PyStructObject* self, PyObject* key, 
-  PyObject* value)
+static PyObject* PyRecordRing_publish(PyRecordRing* self, PyObject* args)
 {
-  if (value == NULL)
+  PyStructDefinition* StructDefinition = self->StructDefinition;
+  RingHeader* Header = self->Header;
+  Py_ssize_t Count = self->ClaimCount;
+  double Timeout = -1;
+  Py_ssize_t i;
+
+  if (!PyArg_ParseTuple(args, "|d", &Timeout))
+    return NULL;
+
+  if (Count == 0)
   {
-    PyErr_SetString(StructError, "key can not be deleted");
-	  return -1;
+    PyErr_SetString(StructError, "no records claimed");
+    return NULL;
   }
-  else
+
+  for (i = 0; StructDefinition->ChecksumCount != 0 && i < Count; i++)
+    SealChecksums(StructDefinition->Checksums, 
+      StructDefinition->ChecksumCount, (char*) Header + sizeof(RingHeader)
+      + ((self->ClaimStart + i) % self->Capacity) * 
+      StructDefinition->StructSize);
+
+  if (self->MultiProducer && RingLoad(Header->Tail) != self->ClaimStart)
   {
-    char* str = PyString_AsString(key);
-    if (str == NULL)
-      return -1;
+    double Deadline = Timeout >= 0 ? RingClock() + Timeout : -1;
+    int Waiting = 1;
 
-    return SetChangeableFieldValueByName(self->StructDefinition,
-      self->StructData, str, value);
+    /* the claim stays, so that publish() can be called again after an
+       error */
+
+    for (;;)
+    {
+      Py_BEGIN_ALLOW_THREADS
+      for (i = 0; i < RING_WAIT_ROUND && 
+          (Waiting = (RingLoad(Header->Tail) != self->ClaimStart)); i++)
+      {
+#ifdef HAVE_SCHED_H
+        sched_yield(); /* the producer before may not be running */
+#endif
+      }
+      Py_END_ALLOW_THREADS
+
+      if (!Waiting)
+        break;
+      if (PyErr_CheckSignals() != 0)
+        return NULL;
+      if (Deadline >= 0 && RingClock() >= Deadline)
+      {
+        PyErr_SetString(StructError, 
+          "timed out waiting for an earlier claim to be published");
+        return NULL;
+      }
+    }
   }
-}
 
-static PyMappingMethods PyStructObject_as_mapping = {
-	(inquiry)PyStructObject_length, /*mp_length*/
-	(binaryfunc)PyStructObject_subscript, /*mp_subscript*/
-	(objobjargproc)PyStructObject_ass_sub, /*mp_ass_subscript*/
-};
+  RingStore(Header->Tail, self->ClaimStart + Count);
+  self->ClaimCount = 0;
 
-/* Buffer methods */
+  return PyLong_FromSsize_t(Count);
+}
 
-static int PyStructObject_getreadbuf(PyStructObject* self, 
-  int idx, void** pp)
+static PyObject* PyRecordRing_consume(PyRecordRing* self, PyObject* args)
 {
-  if (idx != 0 ) 
+  RingHeader* Header = self->Header;
+  Py_ssize_t Count = PY_SSIZE_T_MAX;
+  unsigned PY_LONG_LONG Start;
+
+  if (GetBatchCount(args, &Count) != 0)
+    return NULL;
+
+  if (self->TakeCount != 0)
   {
-	  PyErr_SetString(PyExc_SystemError,
-	    "accessing non-existent buffer segment");
-	  return -1;
+    PyErr_SetString(StructError, 
+      "the previous records are not released");
+    return NULL;
   }
-  *pp = self->StructData;
-  return self->StructDefinition->StructSize;
-}
 
-static int PyStructObject_getwritebuf(PyStructObject* self, 
-  int idx, void** pp)
-{
-  return PyStructObject_getreadbuf(self, idx, pp);
+  Start = RingLoad(Header->Head);
+  Count = RingBatch(self, Start, RingLoad(Header->Tail) - Start, Count);
+  if (Count == 0)
+    Py_RETURN_NONE;
+
+  self->TakeStart = Start;
+  self->TakeCount = Count;
+
+  return RingRecords(self, Start, Count, 1);
 }
 
-static int PyStructObject_getsegcount(PyStructObject* self, 
-  int* lenp)
+static PyObject* PyRecordRing_release(PyRecordRing* self, PyObject* Unused)
 {
-  if (lenp)
-    *lenp = self->StructDefinition->StructSize; 
-  return 1; /* this is the segment count */
+  Py_ssize_t Count = self->TakeCount;
+
+  if (Count == 0)
+  {
+    PyErr_SetString(StructError, "no records consumed");
+    return NULL;
+  }
+
+  RingStore(self->Header->Head, self->TakeStart + Count);
+  self->TakeCount = 0;
+
+  return PyLong_FromSsize_t(Count);
 }
 
-static int PyStructObject_getcharbuf(PyStructObject* self, 
-  int idx, const char** pp)
+static Py_ssize_t PyRecordRing_length(PyRecordRing* self)
 {
-  return PyStructObject_getreadbuf(self, idx, (void**) pp);
+  unsigned PY_LONG_LONG Head = RingLoad(self->Header->Head);
+
+  return (Py_ssize_t) (RingLoad(self->Header->Tail) - Head);
 }
 
-static PyBufferProcs PyStructObject_as_buffer = {
-  (getreadbufferproc)PyStructObject_getreadbuf,
-  (getwritebufferproc)PyStructObject_getwritebuf,
-  (getsegcountproc)PyStructObject_getsegcount,
-  (getcharbufferproc)PyStructObject_getcharbuf,
+static PyMethodDef PyRecordRing_methods[] = {
+  {"claim", (PyCFunction)PyRecordRing_claim, METH_VARARGS,
+   "claim([count]) -> records\n"
+   "Claim up to count (1) free records, to fill in place and publish().\n"
+   "Returns None when the ring is full."},
+  {"publish", (PyCFunction)PyRecordRing_publish, METH_VARARGS,
+   "publish([timeout]) -> count\n"
+   "Pass the claimed records, checksums computed, to the consumer. With\n"
+   "several producers, wait for the earlier claims to be published first,\n"
+   "for at most timeout seconds (default: no limit)."},
+  {"consume", (PyCFunction)PyRecordRing_consume, METH_VARARGS,
+   "consume([count]) -> records\n"
+   "Return up to count published records, read-only, to release() when\n"
+   "done with them. Returns None when the ring is empty."},
+  {"release", (PyCFunction)PyRecordRing_release, METH_NOARGS,
+   "release() -> count\n"
+   "Give the consumed records back to the producers."},
+  {NULL, NULL}
 };
 
-PyTypeObject PyStructObject_Type = {
-    PyObject_HEAD_INIT(0)
-	0,
-	"structobject",
-	sizeof(PyStructObject),
+static PyMemberDef PyRecordRing_members[] = {
+  {"layout", T_OBJECT, offsetof(PyRecordRing, StructDefinition), READONLY,
+   "struct definition of the records"},
+  {"capacity", T_PYSSIZET, offsetof(PyRecordRing, Capacity), READONLY,
+   "number of records the ring holds"},
+  {NULL}
+};
+
+static PySequenceMethods PyRecordRing_as_sequence = {
+  (lenfunc)PyRecordRing_length, /*sq_length*/
+};
+
+PyTypeObject PyRecordRing_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0) /* type set in PyInit_xstruct() */
+	"xstruct.ring",
+	sizeof(PyRecordRing),
 	0,
-	(destructor)PyStructObject_dealloc,  /*tp_dealloc*/
-	(printfunc)PyStructObject_print,		/*tp_print*/
-	(getattrfunc)PyStructObject_getattr, /*tp_getattr*/
-	(setattrfunc)PyStructObject_setattr, /*tp_setattr*/
-	0,		/*tp_compare*/
+	(destructor)PyRecordRing_dealloc,  /*tp_dealloc*/
+	0,		/*tp_vectorcall_offset*/
+	0,		/*tp_getattr*/
+	0,		/*tp_setattr*/
+	0,		/*tp_as_async*/
 	0,		/*tp_repr*/
 	0,		/*tp_as_number*/
-	0,		/*tp_as_sequence*/
-	&PyStructObject_as_mapping,		/*tp_as_mapping*/
+	&PyRecordRing_as_sequence,		/*tp_as_sequence*/
+	0,		/*tp_as_mapping*/
 	0,		/*tp_hash*/
 	0,		/*tp_call*/
-	(reprfunc)PyStructObject_str,		/*tp_str*/
-	0,		/*tp_getattro*/
+	0,		/*tp_str*/
+	PyObject_GenericGetAttr, /*tp_getattro*/
 	0,		/*tp_setattro*/
-	&PyStructObject_as_buffer,		/*tp_as_buffer*/
+	0,		/*tp_as_buffer*/
 	Py_TPFLAGS_DEFAULT,	/*tp_flags*/
 	0,		/*tp_doc*/
+	0,		/*tp_traverse*/
+	0,		/*tp_clear*/
+	0,		/*tp_richcompare*/
+	0,		/*tp_weaklistoffset*/
+	0,		/*tp_iter*/
+	0,		/*tp_iternext*/
+	PyRecordRing_methods, /*tp_methods*/
+	PyRecordRing_members, /*tp_members*/
 };
 
-static PyObject* NewStructObject(PyStructDefinition* StructDefinition, 
-  char* data, int len)
+static PyObject* PyStructDefinition_ring(PyStructDefinition* self, 
+  PyObject* args)
 {
-  int gap;
+  PyObject* Buffer;
+  int MultiProducer = 0;
+  PyRecordRing* Ring;
 
-  PyStructObject* StructObject = 
-    PyObject_NEW(PyStructObject, &PyStructObject_Type);
-  if (StructObject == NULL)
+  if (!PyArg_ParseTuple(args, "O|p", &Buffer, &MultiProducer))
     return NULL;
 
-  StructObject->StructDefinition = StructDefinition;
-  Py_INCREF(StructDefinition);
+#ifndef HAVE_ATOMIC_FIELDS
+  PyErr_SetString(StructError, "rings are not supported on this platform");
+  return NULL;
+#endif
 
-  StructObject->StructData = malloc(StructDefinition->StructSize);
-  if (StructObject->StructData == NULL)
+  Ring = PyObject_NEW(PyRecordRing, &PyRecordRing_Type);
+  if (Ring == NULL)
+    return NULL;
+
+  if (PyObject_GetBuffer(Buffer, &Ring->View, PyBUF_WRITABLE) != 0)
   {
-    PyErr_NoMemory();
-	  goto fail;
+    PyObject_DEL(Ring);
+    return NULL;
   }
 
-  gap = StructDefinition->StructSize - len;
-  if (gap <= 0)
-    memcpy(StructObject->StructData, data, StructDefinition->StructSize);
-  else
+  Ring->StructDefinition = self;
+  Py_INCREF(self);
+  Ring->Header = (RingHeader*) Ring->View.buf;
+  Ring->Capacity = (Ring->View.len - (Py_ssize_t) sizeof(RingHeader)) / 
+    self->StructSize;
+  Ring->MultiProducer = MultiProducer;
+  Ring->ClaimCount = 0;
+  Ring->TakeCount = 0;
+
+  if ((Py_uintptr_t) Ring->View.buf % sizeof(unsigned PY_LONG_LONG) != 0)
   {
-    memcpy(StructObject->StructData, data, len);
-    memset(StructObject->StructData + len, 0, gap);
-  }  
+    PyErr_SetString(StructError, "ring buffer is not aligned");
+    goto fail;
+  }
 
-  return (PyObject*) StructObject;
+  if (Ring->Capacity < 1)
+  {
+    PyErr_SetString(StructError, "buffer is too small for a ring");
+    goto fail;
+  }
+
+  return (PyObject*) Ring;
 
 fail:
 
-  Py_DECREF(StructObject);
+  Py_DECREF(Ring);
   return NULL;
 }
 
@@ -2213,10 +11857,29 @@ fail:
 /* List of functions */
 
 static PyMethodDef struct_methods[] = {
-	{"calcsize",	struct_calcsize,	METH_VARARGS, calcsize__doc__},
-	{"pack",	struct_pack,		METH_VARARGS, pack__doc__},
-	{"unpack",	struct_unpack,		METH_VARARGS, unpack__doc__},
-	{"structdef",	struct_structdef,	METH_VARARGS },
+	{"calcsize",	(PyCFunction)(void(*)(void)) struct_calcsize,
+		METH_FASTCALL, calcsize__doc__},
+	{"pack",	(PyCFunction)(void(*)(void)) struct_pack,
+		METH_FASTCALL, pack__doc__},
+	{"unpack",	(PyCFunction)(void(*)(void)) struct_unpack,
+		METH_FASTCALL, unpack__doc__},
+	{"structdef",	(PyCFunction)(void(*)(void)) struct_structdef,
+		METH_VARARGS | METH_KEYWORDS },
+	{"enable_stats",	struct_enable_stats,	METH_VARARGS, 
+		enable_stats__doc__},
+	{"stats",	struct_stats,		METH_VARARGS, stats__doc__},
+	{"reset_stats",	struct_reset_stats,	METH_VARARGS, reset_stats__doc__},
+	{"decode_columns",	struct_decode_columns,	METH_VARARGS, 
+		decode_columns__doc__},
+	{"encode_columns",	struct_encode_columns,	METH_VARARGS, 
+		encode_columns__doc__},
+	{"pack_many",	struct_pack_many,	METH_VARARGS, pack_many__doc__},
+	{"enable_jit",	struct_enable_jit,	METH_VARARGS, enable_jit__doc__},
+	{"jit",	struct_jit,	METH_VARARGS, jit__doc__},
+	{"structdef_from_descr",	struct_structdef_from_descr,	METH_VARARGS, 
+		structdef_from_descr__doc__},
+	{"structdef_from_spec",	struct_structdef_from_spec,	METH_VARARGS, 
+		structdef_from_spec__doc__},
 	{NULL,		NULL}		/* sentinel */
 };
 
@@ -2250,12 +11913,25 @@ PyStringConstant StructStringConstants[] = {
   { "unsigned_int", "I" },
   { "long", "l" },
   { "unsigned_long", "L" },
+  { "varint", "V" },
+  { "signed_varint", "v" },
   { "float" , "f" },
   { "double", "d" },
   { "string", "s" },
   { "pascal_string", "p" },
   { "pointer", "P" },
 
+  /* checksum field type specifiers */
+
+  { "crc32", "crc32" },
+  { "crc32c", "crc32c" },
+  { "adler32", "adler32" },
+  { "internet_checksum", "inet" },
+
+  /* union field type specifier */
+
+  { "union", "union" },
+
   /* sentinel */
 
   { NULL, NULL }
@@ -2267,7 +11943,7 @@ static int InitializeStringConstants(PyObject* SymbolDictionary,
   PyStringConstant* StringConstant = StringConstants;
   while (StringConstant->Name != NULL)
   {
-    PyObject* StringObject = PyString_FromString(StringConstant->Value);
+    PyObject* StringObject = PyUnicode_FromString(StringConstant->Value);
     if (StringObject == NULL)
       return -1;
     if (PyDict_SetItemString(SymbolDictionary, StringConstant->Name,
@@ -2292,6 +11968,13 @@ PyIntegerConstant StructIntegerConstants[] = {
   /* flags */
 
   { "readonly", FLAG_READONLY },
+  { "raw", FLAG_RAW },
+  { "atomic", FLAG_ATOMIC },
+
+  /* statistics modes */
+
+  { "stats_counters", STATS_COUNTERS },
+  { "stats_timing", STATS_TIMING },
 
   /* sentinel */
 
@@ -2304,7 +11987,7 @@ static int InitializeIntegerConstants(PyObject* SymbolDictionary,
   PyIntegerConstant* IntegerConstant = IntegerConstants;
   while (IntegerConstant->Name != NULL)
   {
-    PyObject* IntegerObject = PyInt_FromLong((long) IntegerConstant->Value);
+    PyObject* IntegerObject = PyLong_FromLong((long) IntegerConstant->Value);
     if (IntegerObject == NULL)
       return -1;
     if (PyDict_SetItemString(SymbolDictionary, IntegerConstant->Name,
@@ -2319,26 +12002,66 @@ static int InitializeIntegerConstants(PyObject* SymbolDictionary,
   return 0;
 }
 
-DL_EXPORT(void)
-initxstruct()
+static struct PyModuleDef xstructmodule = {
+	PyModuleDef_HEAD_INIT,
+	"xstruct",
+	struct__doc__,
+	-1,
+	struct_methods
+};
+
+PyMODINIT_FUNC
+PyInit_xstruct(void)
 {
 	PyObject *m, *d;
 
-  PyStructField_Type.ob_type = &PyType_Type;
-  PyStructDefinition_Type.ob_type = &PyType_Type;
-  PyStructObject_Type.ob_type = &PyType_Type;
+  if (PyType_Ready(&PyStructField_Type) < 0 ||
+      PyType_Ready(&PyStructDefinition_Type) < 0 ||
+      PyType_Ready(&PyStructObject_Type) < 0 ||
+      PyType_Ready(&PyFieldBuffer_Type) < 0 ||
+      PyType_Ready(&PyFormatStatistics_Type) < 0 ||
+      PyType_Ready(&PyRecordBuffer_Type) < 0 ||
+      PyType_Ready(&PyRecordRing_Type) < 0 ||
+      PyType_Ready(&PyRecordIndex_Type) < 0 ||
+      PyType_Ready(&PyRecordFilter_Type) < 0)
+    return NULL;
 
 	/* Create the module and add the functions */
-	m = Py_InitModule4("xstruct", struct_methods, struct__doc__,
-    (PyObject*)NULL, PYTHON_API_VERSION);
+	m = PyModule_Create(&xstructmodule);
+	if (m == NULL)
+		return NULL;
 
 	/* Add some symbolic constants to the module */
 	d = PyModule_GetDict(m);
 	StructError = PyErr_NewException("xstruct.error", NULL, NULL);
 	if (StructError == NULL)
-		return;
-	PyDict_SetItemString(d, "error", StructError);
+		goto fail;
+	if (PyDict_SetItemString(d, "error", StructError) != 0)
+		goto fail;
+
+  InitializeChecksums();
+
+  if (PoolLock == NULL)
+  {
+    PoolLock = PyThread_allocate_lock();
+    if (PoolLock == NULL)
+    {
+      PyErr_NoMemory();
+      goto fail;
+    }
+#ifdef HAVE_POOL_ATFORK
+    pthread_atfork(NULL, NULL, ResetWorkersAfterFork);
+#endif
+  }
+
+  if (InitializeStringConstants(d, StructStringConstants) != 0 ||
+      InitializeIntegerConstants(d, StructIntegerConstants) != 0)
+    goto fail;
 
-  InitializeStringConstants(d, StructStringConstants);
-  InitializeIntegerConstants(d, StructIntegerConstants);
+	return m;
+
+fail:
+
+	Py_DECREF(m);
+	return NULL;
 }